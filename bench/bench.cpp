@@ -0,0 +1,424 @@
+// GPU-less benchmarks of the CPU side: projection, meshes, remap, incremental block diff,
+// pyramid downsampling and image I/O. Prints one JSON line per benchmark to stdout, e.g.
+//   {"name": "remap/stitch/4096x2048", "iterations": 1, "seconds": 0.0412, "items_per_second": 2.04e+08}
+// seconds is the median time of one iteration over the repetitions. Items are points, vertices or pixels.
+// Options:
+//   --filter=<text>          only the benchmarks whose name contains text
+//   --repetitions=<n>        5 by default
+//   --threads=<n>            threads of the pool, 0 (the default) for all hardware threads
+//   --remap-widths=<w>[,...] output widths of the remap benchmarks, 2048,4096,8192 by default
+//   --dir=<path>             where the I/O benchmarks write their files, the current directory by default
+//   --baseline=<file>        compare with the output of an earlier run, exit with 1 if a benchmark got slower
+//   --threshold=<ratio>      by more than this, 0.1 by default
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "codectools.h"
+#include "fishtools.h"
+#include "imgtools.h"
+#include "incrementaltools.h"
+#include "jobtools.h"
+#include "meshtools.h"
+#include "pyramidtools.h"
+#include "stitchtools.h"
+#include "threadtools.h"
+
+namespace {
+	typedef std::chrono::steady_clock Clock;
+
+	// Cheap benchmarks run several times per repetition, so the clock and the loop don't dominate
+	double const g_minRepetitionSeconds = 0.05;
+	size_t const g_projectionPointCount = 4096;
+	size_t const g_ioWidth = 4096;
+	size_t const g_ioHeight = 2048;
+
+	// Results go here, so the compiler can't drop the work
+	volatile float g_sink = 0.0f;
+
+	struct BenchSettings
+	{
+		std::string m_filter;
+		size_t m_repetitionCount = 5;
+		size_t m_threadCount = 0;
+		std::vector<size_t> m_remapWidths = {2048, 4096, 8192};
+		std::string m_dir = ".";
+		std::string m_baselinePath;
+		double m_threshold = 0.1;
+	};
+
+	struct BenchResult
+	{
+		std::string m_name;
+		size_t m_iterations;
+		double m_seconds;
+		double m_itemsPerSecond;
+	};
+
+	double SecondsSince(Clock::time_point start)
+	{
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	class BenchRunner
+	{
+	public:
+		explicit BenchRunner(BenchSettings const & settings)
+			: m_settings(settings)
+		{}
+
+		bool IsSelected(std::string const & name) const
+		{
+			return name.find(m_settings.m_filter) != std::string::npos;
+		}
+
+		// Times run(), which processes itemCount items per call. The first call warms up caches
+		// and allocations and tells how many calls make a repetition
+		void Run(std::string const & name, double itemCount, std::function<void()> const & run)
+		{
+			if (!IsSelected(name))
+				return;
+
+			Clock::time_point const warmUpStart = Clock::now();
+			run();
+			double const warmUpSeconds = SecondsSince(warmUpStart);
+			size_t const iterations = std::max<size_t>(1, size_t(std::ceil(g_minRepetitionSeconds / std::max(warmUpSeconds, 1e-9))));
+
+			std::vector<double> times;
+			for (size_t repetition = 0; repetition < m_settings.m_repetitionCount; ++repetition) {
+				Clock::time_point const start = Clock::now();
+				for (size_t i = 0; i < iterations; ++i)
+					run();
+				times.push_back(SecondsSince(start) / iterations);
+			}
+			std::sort(times.begin(), times.end());
+			double const seconds = times[times.size() / 2];
+
+			m_results.push_back({name, iterations, seconds, itemCount / seconds});
+			std::cerr << name << ": " << seconds * 1e3 << " ms" << std::endl;
+		}
+
+		std::vector<BenchResult> const & GetResults() const
+		{
+			return m_results;
+		}
+
+	private:
+		BenchSettings const & m_settings;
+		std::vector<BenchResult> m_results;
+	};
+
+	// Smooth gradients with some noise on top, so the codecs have realistic work
+	RawImage MakeTestImage(size_t width, size_t height)
+	{
+		RawImage image("rgb24", width, height);
+		uint32_t state = 12345;
+		for (size_t y = 0; y < height; ++y) {
+			uint8_t * row = reinterpret_cast<uint8_t *>(image.GetRow(y));
+			for (size_t x = 0; x < width; ++x) {
+				state = state * 1664525u + 1013904223u;
+				int const noise = int(state >> 28) - 8;
+				row[3 * x + 0] = uint8_t(std::min(255, std::max(0, int(x * 255 / width) + noise)));
+				row[3 * x + 1] = uint8_t(std::min(255, std::max(0, int(y * 255 / height) + noise)));
+				row[3 * x + 2] = uint8_t(std::min(255, std::max(0, int((x + y) % 256) + noise)));
+			}
+		}
+		return image;
+	}
+
+	void RunProjectionBenches(BenchRunner & runner, FishInfo const & fishInfo)
+	{
+		std::vector<float> xs(g_projectionPointCount);
+		std::vector<float> ys(g_projectionPointCount);
+		for (size_t i = 0; i < g_projectionPointCount; ++i) {
+			xs[i] = -1.0f + 2.0f * (i % 64 + 0.5f) / 64;
+			ys[i] = -1.0f + 2.0f * (i / 64 + 0.5f) / 64;
+		}
+
+		runner.Run("projection/sphere2fish", g_projectionPointCount, [&]() {
+			float sum = 0.0f;
+			for (size_t i = 0; i < g_projectionPointCount; ++i)
+				sum += sphere2fish(glm::vec2(xs[i], ys[i]), fishInfo).x;
+			g_sink = sum;
+		});
+		runner.Run("projection/sphere2fish2", g_projectionPointCount, [&]() {
+			float sum = 0.0f;
+			for (size_t i = 0; i < g_projectionPointCount; ++i)
+				sum += sphere2fish2(glm::vec2(xs[i], ys[i]), fishInfo).x;
+			g_sink = sum;
+		});
+
+		FishProjection const projection = MakeFishProjection(fishInfo);
+		std::vector<float> us(g_projectionPointCount);
+		std::vector<float> vs(g_projectionPointCount);
+		runner.Run("projection/sphere2fish2Batch", g_projectionPointCount, [&]() {
+			sphere2fish2Batch(projection, xs.data(), ys.data(), g_projectionPointCount, us.data(), vs.data());
+			g_sink = us[g_projectionPointCount / 2];
+		});
+	}
+
+	void RunMeshBenches(BenchRunner & runner, FishInfo const & fishInfo0, FishInfo const & fishInfo1, ThreadPool & pool)
+	{
+		struct MeshBench
+		{
+			char const * m_name;
+			size_t m_stepCount;
+			size_t m_maxDepth;
+		};
+		MeshBench const benches[] = {{"uniform/60", 60, 0}, {"uniform/120", 120, 0}, {"uniform/240", 240, 0},
+									 {"adaptive/32x4", 32, 4}};
+		for (MeshBench const & bench : benches) {
+			std::string const name = std::string("mesh/") + bench.m_name;
+			if (!runner.IsSelected(name))
+				continue;
+
+			MeshSettings settings;
+			settings.m_stepCount = bench.m_stepCount;
+			settings.m_maxDepth = bench.m_maxDepth;
+			size_t const vertexCount = GenerateDualFishMesh(fishInfo0, fishInfo1, settings, pool).m_vertices.size();
+			runner.Run(name, vertexCount, [&]() {
+				g_sink = GenerateDualFishMesh(fishInfo0, fishInfo1, settings, pool).m_uvs0.back().x;
+			});
+		}
+	}
+
+	// A dual fisheye frame the size of the output, as the example rig records it
+	void RunRemapBenches(BenchRunner & runner, BenchSettings const & settings, FishInfo const & fishInfo0,
+						 FishInfo const & fishInfo1, ThreadPool & pool)
+	{
+		for (size_t const width : settings.m_remapWidths) {
+			size_t const height = width / 2;
+			std::string const size = std::to_string(width) + "x" + std::to_string(height);
+			std::string const buildName = "remap/build/" + size;
+			std::string const stitchName = "remap/stitch/" + size;
+			if (!runner.IsSelected(buildName) && !runner.IsSelected(stitchName))
+				continue;
+
+			RawImage const src = MakeTestImage(width, height);
+			auto const buildTable = [&]() {
+				return BuildRemapTable(fishInfo0, fishInfo1, src.GetPixFmt(), width, height, src.GetStride(),
+									   width, height, BlendMode::Feather);
+			};
+			runner.Run(buildName, width * height, [&]() {
+				g_sink = buildTable().m_weights[0];
+			});
+
+			if (!runner.IsSelected(stitchName))
+				continue;
+			RemapTable const table = buildTable();
+			runner.Run(stitchName, width * height, [&]() {
+				g_sink = Stitch(table, src, pool).GetData()[0];
+			});
+		}
+	}
+
+	// Two identical I/O sized frames, every block is compared in full. Per SIMD level up to the detected one
+	void RunIncrementalBenches(BenchRunner & runner, ThreadPool & pool)
+	{
+		RawImage const image = MakeTestImage(g_ioWidth, g_ioHeight);
+		RawImage previous = image.Clone();
+		std::vector<uint8_t> changed;
+		for (SimdLevel const level : {SimdLevel::Scalar, SimdLevel::Sse41, SimdLevel::Avx2}) {
+			if (level > DetectSimdLevel())
+				continue;
+			runner.Run(std::string("incremental/diff/") + SimdLevelName(level), g_ioWidth * g_ioHeight, [&]() {
+				UpdateChangedBlocks(previous, image, IncrementalSettings().m_blockSize, changed, pool, level);
+				g_sink = changed[0];
+			});
+		}
+	}
+
+	// One level of the pyramid of an I/O sized image, per SIMD level up to the detected one
+	void RunPyramidBenches(BenchRunner & runner, ThreadPool & pool)
+	{
+		RawImage const image = MakeTestImage(g_ioWidth, g_ioHeight);
+		RawImage half("rgb24", g_ioWidth / 2, g_ioHeight / 2);
+		for (SimdLevel const level : {SimdLevel::Scalar, SimdLevel::Sse41}) {
+			if (level > DetectSimdLevel())
+				continue;
+			runner.Run(std::string("pyramid/downsample/") + SimdLevelName(level), g_ioWidth * g_ioHeight, [&]() {
+				pool.ParallelFor(half.GetHeight(), [&](size_t y) {
+					DownsampleRow(reinterpret_cast<uint8_t const *>(image.GetRow(2 * y)),
+								  reinterpret_cast<uint8_t const *>(image.GetRow(2 * y + 1)), g_ioWidth,
+								  reinterpret_cast<uint8_t *>(half.GetRow(y)), level);
+				});
+				g_sink = half.GetData()[0];
+			});
+		}
+	}
+
+	void RunImageIoBenches(BenchRunner & runner, BenchSettings const & settings)
+	{
+		RawImage const image = MakeTestImage(g_ioWidth, g_ioHeight);
+		for (char const * extension : {"bmp", "ppm", "jpg", "png"}) {
+			std::string const path = settings.m_dir + "/bench." + extension;
+			if (!HasNativeCodec(GetImageFormat(path))) {
+				std::cerr << extension << ": no native codec, skipped" << std::endl;
+				continue;
+			}
+
+			runner.Run(std::string("io/save/") + extension, g_ioWidth * g_ioHeight, [&]() {
+				image.SaveToFile(path);
+			});
+			if (runner.IsSelected(std::string("io/load/") + extension) && !runner.IsSelected(std::string("io/save/") + extension))
+				image.SaveToFile(path);
+			runner.Run(std::string("io/load/") + extension, g_ioWidth * g_ioHeight, [&]() {
+				g_sink = RawImage::LoadFromFile(path, g_ioWidth, g_ioHeight).GetData()[0];
+			});
+			remove(path.c_str());
+		}
+	}
+
+	void WriteJson(std::ostream & out, std::vector<BenchResult> const & results, size_t threadCount)
+	{
+		out << "{\n";
+		out << "  \"threads\": " << threadCount << ",\n";
+		out << "  \"simd\": \"" << SimdLevelName(DetectSimdLevel()) << "\",\n";
+		out << "  \"benchmarks\": [\n";
+		for (size_t i = 0; i < results.size(); ++i) {
+			BenchResult const & result = results[i];
+			out << "    {\"name\": \"" << result.m_name << "\", \"iterations\": " << result.m_iterations
+				<< ", \"seconds\": " << result.m_seconds << ", \"items_per_second\": " << result.m_itemsPerSecond << "}"
+				<< (i + 1 < results.size() ? "," : "") << "\n";
+		}
+		out << "  ]\n";
+		out << "}\n";
+	}
+
+	// Reads what WriteJson wrote: the seconds of every benchmark and the thread count, which is 0 if missing
+	std::map<std::string, double> ReadBaseline(std::string const & path, size_t & threadCount)
+	{
+		std::ifstream file(path);
+		if (!file)
+			throw std::runtime_error("Can't open file for reading: " + path);
+		std::stringstream stream;
+		stream << file.rdbuf();
+		std::string const json = stream.str();
+
+		std::string const threadsKey = "\"threads\": ";
+		size_t const threads = json.find(threadsKey);
+		threadCount = threads == std::string::npos ? 0 : strtoul(json.c_str() + threads + threadsKey.size(), nullptr, 10);
+
+		std::map<std::string, double> seconds;
+		std::string const nameKey = "\"name\": \"";
+		std::string const secondsKey = "\"seconds\": ";
+		for (size_t name = json.find(nameKey); name != std::string::npos; name = json.find(nameKey, name + 1)) {
+			size_t const nameStart = name + nameKey.size();
+			size_t const nameEnd = json.find('"', nameStart);
+			size_t const value = json.find(secondsKey, nameEnd);
+			if (nameEnd == std::string::npos || value == std::string::npos)
+				throw std::runtime_error("Not a benchmark result file: " + path);
+			seconds[json.substr(nameStart, nameEnd - nameStart)] = strtod(json.c_str() + value + secondsKey.size(), nullptr);
+		}
+		if (seconds.empty())
+			throw std::runtime_error("No benchmarks in " + path);
+		return seconds;
+	}
+
+	// Returns the number of benchmarks that got slower than the threshold allows
+	size_t CompareWithBaseline(std::vector<BenchResult> const & results, BenchSettings const & settings, size_t threadCount)
+	{
+		size_t baselineThreadCount = 0;
+		std::map<std::string, double> const baseline = ReadBaseline(settings.m_baselinePath, baselineThreadCount);
+		if (baselineThreadCount != threadCount)
+			std::cerr << "Warning: the baseline ran on " << baselineThreadCount << " threads, this run on " << threadCount << std::endl;
+
+		size_t regressionCount = 0;
+		for (BenchResult const & result : results) {
+			auto const base = baseline.find(result.m_name);
+			if (base == baseline.end()) {
+				std::cerr << result.m_name << ": not in the baseline" << std::endl;
+				continue;
+			}
+
+			double const ratio = result.m_seconds / base->second;
+			bool const regressed = ratio > 1.0 + settings.m_threshold;
+			regressionCount += regressed;
+			std::cerr << result.m_name << ": " << base->second * 1e3 << " ms -> " << result.m_seconds * 1e3 << " ms ("
+					  << (ratio - 1.0) * 100.0 << "%)" << (regressed ? " REGRESSION" : "") << std::endl;
+		}
+		return regressionCount;
+	}
+
+	std::vector<size_t> ParseWidths(std::string const & value)
+	{
+		std::vector<size_t> widths;
+		std::istringstream stream(value);
+		std::string width;
+		while (std::getline(stream, width, ',')) {
+			size_t const parsed = strtoul(width.c_str(), nullptr, 10);
+			if (parsed < 2 || parsed % 2 != 0)
+				throw std::runtime_error("Expected even widths like 2048,4096, not " + value);
+			widths.push_back(parsed);
+		}
+		return widths;
+	}
+
+	BenchSettings ParseCommandLine(int argc, char ** argv)
+	{
+		BenchSettings settings;
+		for (int i = 1; i < argc; ++i) {
+			std::string const arg = argv[i];
+			size_t const separator = arg.find('=');
+			std::string const key = arg.substr(0, separator);
+			std::string const value = separator == std::string::npos ? std::string() : arg.substr(separator + 1);
+			if (key == "--filter")
+				settings.m_filter = value;
+			else if (key == "--repetitions")
+				settings.m_repetitionCount = std::max<size_t>(1, strtoul(value.c_str(), nullptr, 10));
+			else if (key == "--threads")
+				settings.m_threadCount = strtoul(value.c_str(), nullptr, 10);
+			else if (key == "--remap-widths")
+				settings.m_remapWidths = ParseWidths(value);
+			else if (key == "--dir" && !value.empty())
+				settings.m_dir = value;
+			else if (key == "--baseline" && !value.empty())
+				settings.m_baselinePath = value;
+			else if (key == "--threshold" && !value.empty())
+				settings.m_threshold = strtod(value.c_str(), nullptr);
+			else
+				throw std::runtime_error("Unknown argument: " + arg);
+		}
+		return settings;
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	try {
+		BenchSettings const settings = ParseCommandLine(argc, argv);
+		ThreadPool pool(settings.m_threadCount);
+
+		// The built-in calibration of the example rig
+		StitchJob job;
+		ResolveJob(job);
+
+		BenchRunner runner(settings);
+		RunProjectionBenches(runner, job.m_fishInfo0);
+		RunMeshBenches(runner, job.m_fishInfo0, job.m_fishInfo1, pool);
+		RunRemapBenches(runner, settings, job.m_fishInfo0, job.m_fishInfo1, pool);
+		RunIncrementalBenches(runner, pool);
+		RunPyramidBenches(runner, pool);
+		RunImageIoBenches(runner, settings);
+
+		WriteJson(std::cout, runner.GetResults(), pool.GetThreadCount());
+		if (!settings.m_baselinePath.empty() && CompareWithBaseline(runner.GetResults(), settings, pool.GetThreadCount()) > 0)
+			return 1;
+	}
+	catch (std::exception const & e) {
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
+	return 0;
+}
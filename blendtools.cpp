@@ -0,0 +1,230 @@
+#include "blendtools.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+
+#include "projtools.h"
+
+namespace {
+	// Distance to the rim in units of sphere2fish2's r, which is 0.5 at the rim
+	float GetRimDistance(glm::vec2 const & uv, FishInfo const & fishInfo)
+	{
+		glm::vec2 const offset = (uv - fishInfo.m_center) / fishInfo.m_ratio;
+		return std::max(0.0f, 0.5f - std::sqrt(offset.x * offset.x + offset.y * offset.y));
+	}
+
+	// Binomial 1 4 6 4 1 filter, then every other pixel. Edges are clamped
+	void Reduce(std::vector<float> const & src, size_t width, size_t height, size_t channels,
+				std::vector<float> & dst, size_t dstWidth, size_t dstHeight, ThreadPool & pool)
+	{
+		float const kernel[] = {1.0f / 16, 4.0f / 16, 6.0f / 16, 4.0f / 16, 1.0f / 16};
+		std::vector<float> rows(dstWidth * height * channels);
+
+		ParallelRows(pool, height, [&](size_t y) {
+			float const * srcRow = &src[y * width * channels];
+			float * row = &rows[y * dstWidth * channels];
+			for (size_t x = 0; x < dstWidth; ++x)
+				for (size_t c = 0; c < channels; ++c) {
+					float sum = 0.0f;
+					for (int i = 0; i < 5; ++i) {
+						size_t const srcX = size_t(std::min(std::max(int(2 * x) + i - 2, 0), int(width) - 1));
+						sum += kernel[i] * srcRow[srcX * channels + c];
+					}
+					row[x * channels + c] = sum;
+				}
+		});
+
+		dst.resize(dstWidth * dstHeight * channels);
+		ParallelRows(pool, dstHeight, [&](size_t y) {
+			float * dstRow = &dst[y * dstWidth * channels];
+			std::fill(dstRow, dstRow + dstWidth * channels, 0.0f);
+			for (int i = 0; i < 5; ++i) {
+				size_t const srcY = size_t(std::min(std::max(int(2 * y) + i - 2, 0), int(height) - 1));
+				float const * row = &rows[srcY * dstWidth * channels];
+				for (size_t x = 0; x < dstWidth * channels; ++x)
+					dstRow[x] += kernel[i] * row[x];
+			}
+		});
+	}
+
+	// Coarse pixel x sits on fine pixel 2x, odd fine pixels are halfway between two coarse ones
+	float Expand(std::vector<float> const & coarse, size_t width, size_t height, size_t channels,
+				 size_t x, size_t y, size_t c)
+	{
+		size_t const x0 = x / 2;
+		size_t const y0 = y / 2;
+		size_t const x1 = std::min(x0 + (x & 1), width - 1);
+		size_t const y1 = std::min(y0 + (y & 1), height - 1);
+		return 0.25f * (coarse[(y0 * width + x0) * channels + c] + coarse[(y0 * width + x1) * channels + c] +
+						coarse[(y1 * width + x0) * channels + c] + coarse[(y1 * width + x1) * channels + c]);
+	}
+
+	void ToFloat(RawImage const & image, std::vector<float> & data)
+	{
+		size_t const rowSize = 3 * image.GetWidth();
+		data.resize(rowSize * image.GetHeight());
+		for (size_t y = 0; y < image.GetHeight(); ++y) {
+			uint8_t const * row = reinterpret_cast<uint8_t const *>(image.GetRow(y));
+			std::copy(row, row + rowSize, &data[y * rowSize]);
+		}
+	}
+}
+
+char const * BlendModeName(BlendMode mode)
+{
+	switch (mode) {
+	case BlendMode::Hard:
+		return "hard";
+	case BlendMode::Feather:
+		return "feather";
+	case BlendMode::MultiBand:
+		return "multiband";
+	case BlendMode::Lens0:
+		return "lens0";
+	default:
+		return "lens1";
+	}
+}
+
+BlendMode ParseBlendMode(std::string const & name)
+{
+	for (BlendMode const mode : {BlendMode::Hard, BlendMode::Feather, BlendMode::MultiBand})
+		if (name == BlendModeName(mode))
+			return mode;
+	throw std::runtime_error("Unknown blend mode: " + name);
+}
+
+bool HasLens0(glm::vec2 const & uv)
+{
+	return uv.x >= 0.0f && uv.x <= 0.5f && uv.y >= 0.0f && uv.y <= 1.0f;
+}
+
+bool HasLens1(glm::vec2 const & uv)
+{
+	return uv.x >= 0.5f && uv.x <= 1.0f && uv.y >= 0.0f && uv.y <= 1.0f;
+}
+
+uint32_t GetBlendWeights(glm::vec2 const & uv0, glm::vec2 const & uv1,
+						 FishInfo const & fishInfo0, FishInfo const & fishInfo1, BlendMode mode)
+{
+	bool const hasTex0 = HasLens0(uv0);
+	bool const hasTex1 = HasLens1(uv1);
+	if (!hasTex0 || !hasTex1)
+		return hasTex0 ? 256 : hasTex1 ? 256 << 16 : 0;
+
+	uint32_t w0 = 128;
+	switch (mode) {
+	case BlendMode::Feather:
+	case BlendMode::MultiBand: {
+		float const distance0 = GetRimDistance(uv0, fishInfo0);
+		float const distance1 = GetRimDistance(uv1, fishInfo1);
+		if (distance0 + distance1 > 0.0f)
+			w0 = uint32_t(256.0f * distance0 / (distance0 + distance1) + 0.5f);
+		break;
+	}
+	case BlendMode::Lens0:
+		w0 = 256;
+		break;
+	case BlendMode::Lens1:
+		w0 = 0;
+		break;
+	default:
+		break;
+	}
+	return w0 | (256 - w0) << 16;
+}
+
+std::vector<uint32_t> BuildBlendWeightMap(FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+										  size_t width, size_t height, BlendMode mode, ThreadPool & pool)
+{
+	ViewLayout const layout = MakeViewLayout(OutputProjection::Equirect, {}, width, height);
+	std::vector<uint32_t> weights(width * height);
+	MapViewPixels(fishInfo0, fishInfo1, layout, width, height, pool, [&](size_t index, glm::vec2 const & uv0, glm::vec2 const & uv1) {
+		weights[index] = GetBlendWeights(uv0, uv1, fishInfo0, fishInfo1, mode);
+	});
+	return weights;
+}
+
+MultiBandBlender::MultiBandBlender(std::vector<uint32_t> const & weights, size_t width, size_t height, size_t levelCount,
+								   ThreadPool & pool)
+{
+	if (weights.size() != width * height)
+		throw std::runtime_error("Weight map doesn't match the image size!");
+
+	Level base;
+	base.m_width = width;
+	base.m_height = height;
+	base.m_mask.resize(width * height);
+	for (size_t i = 0; i < weights.size(); ++i) {
+		uint32_t const w0 = weights[i] & 0xffff;
+		uint32_t const w1 = weights[i] >> 16;
+		// Neither lens: both images have the fill color there, any mask will do
+		base.m_mask[i] = w0 + w1 > 0 ? float(w0) / (w0 + w1) : 0.5f;
+	}
+	m_levels.push_back(std::move(base));
+
+	while (m_levels.size() < levelCount && m_levels.back().m_width > 2 && m_levels.back().m_height > 2) {
+		Level const & fine = m_levels.back();
+		Level level;
+		level.m_width = (fine.m_width + 1) / 2;
+		level.m_height = (fine.m_height + 1) / 2;
+		Reduce(fine.m_mask, fine.m_width, fine.m_height, 1, level.m_mask, level.m_width, level.m_height, pool);
+		m_levels.push_back(std::move(level));
+	}
+}
+
+void MultiBandBlender::Blend(RawImage const & image0, RawImage const & image1, RawImage & out, ThreadPool & pool)
+{
+	Level & base = m_levels.front();
+	if (image0.GetWidth() != base.m_width || image0.GetHeight() != base.m_height ||
+			image1.GetWidth() != base.m_width || image1.GetHeight() != base.m_height ||
+			out.GetWidth() != base.m_width || out.GetHeight() != base.m_height)
+		throw std::runtime_error("Images don't match the multi-band blender size!");
+
+	ToFloat(image0, base.m_image0);
+	ToFloat(image1, base.m_image1);
+	for (size_t l = 1; l < m_levels.size(); ++l) {
+		Level const & fine = m_levels[l - 1];
+		Level & level = m_levels[l];
+		Reduce(fine.m_image0, fine.m_width, fine.m_height, 3, level.m_image0, level.m_width, level.m_height, pool);
+		Reduce(fine.m_image1, fine.m_width, fine.m_height, 3, level.m_image1, level.m_width, level.m_height, pool);
+	}
+
+	// From the top down, every level adds its Laplacian bands of both images to the expanded result so far.
+	// The top level has no coarser one, its Gaussians are blended directly
+	std::vector<float> result;
+	std::vector<float> coarseResult;
+	for (size_t l = m_levels.size(); l-- > 0;) {
+		Level const & level = m_levels[l];
+		Level const * coarse = l + 1 < m_levels.size() ? &m_levels[l + 1] : nullptr;
+
+		result.resize(3 * level.m_width * level.m_height);
+		ParallelRows(pool, level.m_height, [&](size_t y) {
+			for (size_t x = 0; x < level.m_width; ++x) {
+				float const mask = level.m_mask[y * level.m_width + x];
+				for (size_t c = 0; c < 3; ++c) {
+					size_t const i = (y * level.m_width + x) * 3 + c;
+					float band0 = level.m_image0[i];
+					float band1 = level.m_image1[i];
+					float base = 0.0f;
+					if (coarse) {
+						band0 -= Expand(coarse->m_image0, coarse->m_width, coarse->m_height, 3, x, y, c);
+						band1 -= Expand(coarse->m_image1, coarse->m_width, coarse->m_height, 3, x, y, c);
+						base = Expand(coarseResult, coarse->m_width, coarse->m_height, 3, x, y, c);
+					}
+					result[i] = base + band1 + mask * (band0 - band1);
+				}
+			}
+		});
+		result.swap(coarseResult);
+	}
+
+	ParallelRows(pool, base.m_height, [&](size_t y) {
+		uint8_t * row = reinterpret_cast<uint8_t *>(out.GetRow(y));
+		float const * resultRow = &coarseResult[3 * y * base.m_width];
+		for (size_t x = 0; x < 3 * base.m_width; ++x)
+			row[x] = uint8_t(std::min(std::max(resultRow[x] + 0.5f, 0.0f), 255.0f));
+	});
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "fishtools.h"
+#include "imgtools.h"
+#include "threadtools.h"
+
+enum class BlendMode
+{
+	Hard,      // Both lenses 50/50 wherever they overlap
+	Feather,   // Each lens weighted by its distance to the rim, so the seam fades out
+	MultiBand, // Feather weights applied per frequency band of a Laplacian pyramid
+	Lens0,     // Lens 0 wherever it has the pixel, lens 1 elsewhere: the multi-band inputs
+	Lens1
+};
+
+char const * BlendModeName(BlendMode mode);
+// The modes a user picks: hard, feather and multiband
+BlendMode ParseBlendMode(std::string const & name);
+
+// Lens areas of the source: lens 0 is the left half, lens 1 the right one
+bool HasLens0(glm::vec2 const & uv);
+bool HasLens1(glm::vec2 const & uv);
+
+// Weights of both lenses (w0 | w1 << 16, in 1/256) for an output pixel that maps to uv0 and uv1.
+// w0 + w1 <= 256, the rest goes to the fill color. MultiBand gets the feather weights, they are its mask
+uint32_t GetBlendWeights(glm::vec2 const & uv0, glm::vec2 const & uv1,
+						 FishInfo const & fishInfo0, FishInfo const & fishInfo1, BlendMode mode);
+
+// GetBlendWeights for every pixel of a width x height output, row 0 at the bottom as in the remap table
+std::vector<uint32_t> BuildBlendWeightMap(FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+										  size_t width, size_t height, BlendMode mode, ThreadPool & pool);
+
+// Laplacian pyramid blend of two rgb24 images, rendered with the Lens0 and Lens1 weights. Every band
+// is mixed with the matching level of the mask pyramid, w0 / (w0 + w1) of the feather weights, so low
+// frequencies blend over a wide band and fine detail over a narrow one. The mask pyramid is built once
+class MultiBandBlender
+{
+public:
+	MultiBandBlender(std::vector<uint32_t> const & weights, size_t width, size_t height, size_t levelCount, ThreadPool & pool);
+
+	void Blend(RawImage const & image0, RawImage const & image1, RawImage & out, ThreadPool & pool);
+
+private:
+	struct Level
+	{
+		size_t m_width;
+		size_t m_height;
+		std::vector<float> m_mask;
+		std::vector<float> m_image0;
+		std::vector<float> m_image1;
+	};
+
+private:
+	std::vector<Level> m_levels;
+};
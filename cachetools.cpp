@@ -0,0 +1,199 @@
+#include "cachetools.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+	uint32_t const g_cacheVersion = 1;
+	size_t const g_sectionAlignment = 64;
+
+	struct CacheHeader
+	{
+		char m_magic[8];
+		uint32_t m_version;
+		uint32_t m_sectionCount;
+		uint64_t m_key;
+		uint64_t m_reserved;
+	};
+
+	struct CacheSectionInfo
+	{
+		uint64_t m_offset;
+		uint64_t m_size;
+	};
+
+	char const g_cacheMagic[8] = {'O', 'G', 'L', 'C', 'A', 'C', 'H', 'E'};
+
+	uint64_t AlignUp(uint64_t value)
+	{
+		return (value + g_sectionAlignment - 1) / g_sectionAlignment * g_sectionAlignment;
+	}
+}
+
+Hasher & Hasher::Add(void const * data, size_t size)
+{
+	unsigned char const * bytes = static_cast<unsigned char const *>(data);
+	for (size_t i = 0; i < size; ++i) {
+		m_hash ^= bytes[i];
+		m_hash *= 1099511628211ULL;
+	}
+	return *this;
+}
+
+uint64_t Hasher::Get() const
+{
+	return m_hash;
+}
+
+MappedFile::MappedFile(std::string const & path)
+{
+	int const fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("Can't open file for mapping: " + path);
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		close(fd);
+		throw std::runtime_error("Can't map empty file: " + path);
+	}
+
+	m_size = info.st_size;
+	m_data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (m_data == MAP_FAILED)
+		throw std::runtime_error("Can't map file: " + path);
+}
+
+MappedFile::~MappedFile()
+{
+	munmap(m_data, m_size);
+}
+
+char const * MappedFile::GetData() const
+{
+	return static_cast<char const *>(m_data);
+}
+
+size_t MappedFile::GetSize() const
+{
+	return m_size;
+}
+
+CacheFile::CacheFile(std::string const & path)
+	: m_file(path)
+{}
+
+std::shared_ptr<CacheFile const> CacheFile::Open(std::string const & path, uint64_t key)
+{
+	if (access(path.c_str(), R_OK) != 0)
+		return nullptr;
+
+	std::shared_ptr<CacheFile> cache;
+	try {
+		cache.reset(new CacheFile(path));
+	}
+	catch (std::runtime_error const &) {
+		return nullptr;
+	}
+
+	char const * data = cache->m_file.GetData();
+	size_t const size = cache->m_file.GetSize();
+	if (size < sizeof(CacheHeader))
+		return nullptr;
+
+	CacheHeader header;
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.m_magic, g_cacheMagic, sizeof(g_cacheMagic)) != 0 || header.m_version != g_cacheVersion ||
+			header.m_key != key)
+		return nullptr;
+
+	size_t const tableEnd = sizeof(CacheHeader) + header.m_sectionCount * sizeof(CacheSectionInfo);
+	if (tableEnd > size)
+		return nullptr;
+
+	for (size_t i = 0; i < header.m_sectionCount; ++i) {
+		CacheSectionInfo info;
+		memcpy(&info, data + sizeof(CacheHeader) + i * sizeof(CacheSectionInfo), sizeof(info));
+		if (info.m_offset > size || info.m_size > size - info.m_offset)
+			return nullptr;
+		cache->m_sections.emplace_back(data + info.m_offset, info.m_size);
+	}
+
+	return cache;
+}
+
+void CacheFile::Write(std::string const & path, uint64_t key, std::vector<Section> const & sections)
+{
+	CacheHeader header;
+	memcpy(header.m_magic, g_cacheMagic, sizeof(g_cacheMagic));
+	header.m_version = g_cacheVersion;
+	header.m_sectionCount = sections.size();
+	header.m_key = key;
+	header.m_reserved = 0;
+
+	std::vector<CacheSectionInfo> infos;
+	uint64_t offset = AlignUp(sizeof(CacheHeader) + sections.size() * sizeof(CacheSectionInfo));
+	for (auto const & section : sections) {
+		infos.push_back({offset, section.second});
+		offset = AlignUp(offset + section.second);
+	}
+
+	size_t const slash = path.rfind('/');
+	if (slash != std::string::npos && slash > 0)
+		mkdir(path.substr(0, slash).c_str(), 0755);
+
+	// Write to a temporary file first, so other processes never map a half-written cache.
+	// A failure leaves the old cache, if any, and no temporary file
+	std::string const tmpPath = path + ".tmp" + std::to_string(getpid());
+	try {
+		std::ofstream file(tmpPath, std::ios::binary);
+		if (!file)
+			throw std::runtime_error("Can't open file for writing: " + tmpPath);
+
+		file.write(reinterpret_cast<char const *>(&header), sizeof(header));
+		file.write(reinterpret_cast<char const *>(infos.data()), infos.size() * sizeof(CacheSectionInfo));
+
+		char const padding[g_sectionAlignment] = {};
+		for (size_t i = 0; i < sections.size(); ++i) {
+			file.write(padding, infos[i].m_offset - file.tellp());
+			file.write(static_cast<char const *>(sections[i].first), sections[i].second);
+		}
+
+		file.close();
+		if (!file)
+			throw std::runtime_error("Failed to write file: " + tmpPath);
+
+		if (rename(tmpPath.c_str(), path.c_str()) != 0)
+			throw std::runtime_error("Can't write file: " + path);
+	}
+	catch (...) {
+		remove(tmpPath.c_str());
+		throw;
+	}
+}
+
+std::string CacheFile::GetPath(std::string const & dir, std::string const & prefix, uint64_t key)
+{
+	std::ostringstream path;
+	path << dir << "/" << prefix << "_" << std::hex << key << ".bin";
+	return path.str();
+}
+
+size_t CacheFile::GetSectionCount() const
+{
+	return m_sections.size();
+}
+
+CacheFile::Section CacheFile::GetSection(size_t index) const
+{
+	return m_sections.at(index);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// FNV-1a hash for building cache keys
+class Hasher
+{
+public:
+	Hasher & Add(void const * data, size_t size);
+
+	template<typename T>
+	Hasher & Add(T const & value)
+	{
+		return Add(&value, sizeof(value));
+	}
+
+	uint64_t Get() const;
+
+private:
+	uint64_t m_hash = 14695981039346656037ULL;
+};
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+	explicit MappedFile(std::string const & path);
+	~MappedFile();
+
+	MappedFile(MappedFile const &) = delete;
+	MappedFile & operator=(MappedFile const &) = delete;
+
+	char const * GetData() const;
+	size_t GetSize() const;
+
+private:
+	void * m_data = nullptr;
+	size_t m_size = 0;
+};
+
+// Versioned binary file of 64-byte aligned sections, identified by a key.
+// Sections are used in place from the mapping, nothing is copied on load.
+class CacheFile
+{
+public:
+	typedef std::pair<void const *, size_t> Section;
+
+	// Returns nullptr if there is no such file or it was written for another key or format version
+	static std::shared_ptr<CacheFile const> Open(std::string const & path, uint64_t key);
+	static void Write(std::string const & path, uint64_t key, std::vector<Section> const & sections);
+
+	static std::string GetPath(std::string const & dir, std::string const & prefix, uint64_t key);
+
+	size_t GetSectionCount() const;
+	Section GetSection(size_t index) const;
+
+private:
+	explicit CacheFile(std::string const & path);
+
+private:
+	MappedFile m_file;
+	std::vector<Section> m_sections;
+};
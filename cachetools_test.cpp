@@ -0,0 +1,126 @@
+#include "cachetools.h"
+
+#include <dirent.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "testtools.h"
+
+namespace {
+	std::string const g_dir = "cachetools_test_files";
+
+	// Names of the files left in the test directory
+	std::vector<std::string> ListDir()
+	{
+		std::vector<std::string> names;
+		if (DIR * dir = opendir(g_dir.c_str())) {
+			while (dirent const * entry = readdir(dir))
+				if (entry->d_name[0] != '.')
+					names.push_back(entry->d_name);
+			closedir(dir);
+		}
+		return names;
+	}
+
+	// Creates the test directory or empties it
+	void ClearDir()
+	{
+		mkdir(g_dir.c_str(), 0755);
+		for (std::string const & name : ListDir())
+			remove((g_dir + "/" + name).c_str());
+	}
+
+	TEST(SectionsComeBackAlignedAndUnchanged)
+	{
+		ClearDir();
+		std::string const path = CacheFile::GetPath(g_dir, "sections", 0x1234);
+		CHECK(path == g_dir + "/sections_1234.bin");
+
+		std::vector<float> const floats = {1.0f, 2.5f, -3.0f};
+		std::string const text = "odd sized";
+		CacheFile::Write(path, 0x1234, {{floats.data(), floats.size() * sizeof(float)},
+										{text.data(), text.size()},
+										{nullptr, 0}});
+
+		std::shared_ptr<CacheFile const> const cache = CacheFile::Open(path, 0x1234);
+		CHECK(cache);
+		if (!cache)
+			return;
+		CHECK(cache->GetSectionCount() == 3);
+		for (size_t i = 0; i < cache->GetSectionCount(); ++i)
+			CHECK(reinterpret_cast<uintptr_t>(cache->GetSection(i).first) % 64 == 0);
+		CHECK(cache->GetSection(0).second == floats.size() * sizeof(float));
+		CHECK(memcmp(cache->GetSection(0).first, floats.data(), cache->GetSection(0).second) == 0);
+		CHECK(cache->GetSection(1).second == text.size());
+		CHECK(memcmp(cache->GetSection(1).first, text.data(), text.size()) == 0);
+		CHECK(cache->GetSection(2).second == 0);
+		CHECK(ListDir() == std::vector<std::string>{"sections_1234.bin"});
+	}
+
+	TEST(OpenRejectsOtherKeysAndBrokenFiles)
+	{
+		ClearDir();
+		std::string const path = g_dir + "/key.bin";
+		uint32_t const value = 7;
+		CacheFile::Write(path, 1, {{&value, sizeof(value)}});
+		CHECK(CacheFile::Open(path, 1));
+		CHECK(!CacheFile::Open(path, 2));
+		CHECK(!CacheFile::Open(g_dir + "/missing.bin", 1));
+
+		FILE * file = fopen(path.c_str(), "wb");
+		CHECK(file);
+		if (file) {
+			fputs("not a cache", file);
+			fclose(file);
+		}
+		CHECK(!CacheFile::Open(path, 1));
+	}
+
+	TEST(FailedWriteLeavesNoTemporaryFile)
+	{
+		ClearDir();
+		std::vector<char> const data(1 << 16);
+
+		// Writing past a file size limit fails with EFBIG
+		rlimit limit;
+		getrlimit(RLIMIT_FSIZE, &limit);
+		rlimit smallLimit = limit;
+		smallLimit.rlim_cur = 4096;
+		signal(SIGXFSZ, SIG_IGN);
+		setrlimit(RLIMIT_FSIZE, &smallLimit);
+		CHECK_THROWS(CacheFile::Write(g_dir + "/big.bin", 1, {{data.data(), data.size()}}));
+		setrlimit(RLIMIT_FSIZE, &limit);
+		CHECK(ListDir().empty());
+
+		// The temporary file can be written, but not renamed onto a directory
+		std::string const path = g_dir + "/taken";
+		mkdir(path.c_str(), 0755);
+		mkdir((path + "/sub").c_str(), 0755);
+		CHECK_THROWS(CacheFile::Write(path, 1, {{data.data(), data.size()}}));
+		CHECK(ListDir() == std::vector<std::string>{"taken"});
+		remove((path + "/sub").c_str());
+		remove(path.c_str());
+	}
+
+	TEST(HasherTellsInputsApart)
+	{
+		CHECK(Hasher().Add(1).Add(2.0f).Get() == Hasher().Add(1).Add(2.0f).Get());
+		CHECK(Hasher().Add(1).Add(2.0f).Get() != Hasher().Add(1).Add(2.5f).Get());
+		CHECK(Hasher().Add(1).Add(2).Get() != Hasher().Add(2).Add(1).Get());
+		CHECK(Hasher().Get() != Hasher().Add(0).Get());
+	}
+}
+
+int main()
+{
+	int const result = RunTests();
+	ClearDir();
+	rmdir(g_dir.c_str());
+	return result;
+}
@@ -0,0 +1,776 @@
+#include "calibtools.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "blendtools.h"
+
+namespace {
+	int const g_patchRadius = 5;
+	int const g_patchSize = 2 * g_patchRadius + 1;
+	// The structure tensor of a corner is summed over this radius
+	int const g_windowRadius = 2;
+	float const g_harrisK = 0.04f;
+	// At most one feature per cell, so they spread over the whole overlap
+	int const g_cellSize = 8;
+	float const g_minRelativeResponse = 1e-3f;
+	// The best match has to beat any other offset by this much, repeated texture is ambiguous
+	float const g_minScoreGap = 0.05f;
+
+	size_t const g_paramCount = 11;
+	size_t const g_minMatchCount = 20;
+	size_t const g_rejectRoundCount = 3;
+	// Matches further off than this many times the median error are dropped before solving again
+	double const g_outlierFactor = 4.0;
+	double const g_derivativeStep = 1e-6;
+	double const g_tolerance = 1e-10;
+
+	// Luma or an equirectangular view of one lens, with an integral image of the pixels that have data
+	struct GrayImage
+	{
+		size_t m_width = 0;
+		size_t m_height = 0;
+		std::vector<float> m_data;
+		std::vector<uint8_t> m_valid;
+		std::vector<uint32_t> m_validSums;
+
+		float At(int x, int y) const
+		{
+			return m_data[x + y * m_width];
+		}
+	};
+
+	struct Feature
+	{
+		int m_x;
+		int m_y;
+		float m_response;
+	};
+
+	struct Match
+	{
+		glm::vec2 m_uv0;
+		glm::vec2 m_uv1;
+	};
+
+	struct LensModel
+	{
+		double m_center[2];
+		double m_ratio[2];
+		double m_fov;
+		double m_rotation[3];
+	};
+
+	void AllocateGrayImage(GrayImage & image, size_t width, size_t height)
+	{
+		image.m_width = width;
+		image.m_height = height;
+		image.m_data.assign(width * height, 0.0f);
+		image.m_valid.assign(width * height, 0);
+	}
+
+	void SumValid(GrayImage & image)
+	{
+		size_t const sumWidth = image.m_width + 1;
+		image.m_validSums.assign(sumWidth * (image.m_height + 1), 0);
+		for (size_t y = 0; y < image.m_height; ++y) {
+			uint32_t rowSum = 0;
+			for (size_t x = 0; x < image.m_width; ++x) {
+				rowSum += image.m_valid[x + y * image.m_width];
+				image.m_validSums[x + 1 + (y + 1) * sumWidth] = image.m_validSums[x + 1 + y * sumWidth] + rowSum;
+			}
+		}
+	}
+
+	// Whether every pixel within radius of (x, y) has data
+	bool IsValid(GrayImage const & image, int x, int y, int radius)
+	{
+		if (x < radius || y < radius || x + radius >= int(image.m_width) || y + radius >= int(image.m_height))
+			return false;
+		size_t const sumWidth = image.m_width + 1;
+		size_t const x0 = x - radius;
+		size_t const y0 = y - radius;
+		size_t const x1 = x + radius + 1;
+		size_t const y1 = y + radius + 1;
+		uint32_t const sum = image.m_validSums[x1 + y1 * sumWidth] - image.m_validSums[x0 + y1 * sumWidth] -
+							 image.m_validSums[x1 + y0 * sumWidth] + image.m_validSums[x0 + y0 * sumWidth];
+		return sum == uint32_t((2 * radius + 1) * (2 * radius + 1));
+	}
+
+	GrayImage ToGray(RawImage const & image, ThreadPool & pool)
+	{
+		std::string const pixFmt = image.GetPixFmt();
+		bool const isRgb = pixFmt == "rgb24";
+		if (!isRgb && pixFmt != "gray" && image.GetPlaneCount() < 2)
+			throw std::runtime_error("Calibration needs an rgb24, gray or planar yuv image, not " + pixFmt);
+
+		// Planar formats keep the luma in plane 0, which is what GetRow returns
+		GrayImage gray;
+		AllocateGrayImage(gray, image.GetWidth(), image.GetHeight());
+		ParallelRows(pool, gray.m_height, [&](size_t y) {
+			uint8_t const * row = reinterpret_cast<uint8_t const *>(image.GetRow(y));
+			float * grayRow = &gray.m_data[y * gray.m_width];
+			for (size_t x = 0; x < gray.m_width; ++x)
+				grayRow[x] = isRgb ? 0.299f * row[3 * x] + 0.587f * row[3 * x + 1] + 0.114f * row[3 * x + 2] : row[x];
+		});
+		return gray;
+	}
+
+	float Sample(GrayImage const & image, glm::vec2 const & uv)
+	{
+		float const x = glm::clamp(uv.x * image.m_width - 0.5f, 0.0f, float(image.m_width - 1));
+		float const y = glm::clamp(uv.y * image.m_height - 0.5f, 0.0f, float(image.m_height - 1));
+		int const x0 = int(std::min(size_t(x), image.m_width - 2));
+		int const y0 = int(std::min(size_t(y), image.m_height - 2));
+		float const fx = x - x0;
+		float const fy = y - y0;
+		float const top = image.At(x0, y0) + fx * (image.At(x0 + 1, y0) - image.At(x0, y0));
+		float const bottom = image.At(x0, y0 + 1) + fx * (image.At(x0 + 1, y0 + 1) - image.At(x0, y0 + 1));
+		return top + fy * (bottom - top);
+	}
+
+	glm::vec2 GetSphereCoord(float x, float y, size_t width, size_t height)
+	{
+		return glm::vec2(-1.0f + (x + 0.5f) * 2.0f / width, -1.0f + (y + 0.5f) * 2.0f / height);
+	}
+
+	// Both lenses seen through the calibration so far, as width x height equirectangular images.
+	// Where the calibration is right, a feature is at the same pixel in both
+	void RenderLenses(GrayImage const & source, FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+					  size_t width, size_t height, GrayImage & image0, GrayImage & image1, ThreadPool & pool)
+	{
+		FishProjection const projection0 = MakeFishProjection(fishInfo0);
+		FishProjection const projection1 = MakeFishProjection(fishInfo1);
+		AllocateGrayImage(image0, width, height);
+		AllocateGrayImage(image1, width, height);
+
+		ParallelRows(pool, height, [&](size_t y) {
+			std::vector<float> xs(width);
+			std::vector<float> ys(width, GetSphereCoord(0.0f, float(y), width, height).y);
+			for (size_t x = 0; x < width; ++x)
+				xs[x] = GetSphereCoord(float(x), 0.0f, width, height).x;
+
+			std::vector<float> us0(width), vs0(width), us1(width), vs1(width);
+			sphere2fish2Batch(projection0, xs.data(), ys.data(), width, us0.data(), vs0.data());
+			sphere2fish2Batch(projection1, xs.data(), ys.data(), width, us1.data(), vs1.data());
+			for (size_t x = 0; x < width; ++x) {
+				size_t const i = x + y * width;
+				glm::vec2 const uv0(us0[x], vs0[x]);
+				glm::vec2 const uv1(us1[x], vs1[x]);
+				if (HasLens0(uv0)) {
+					image0.m_data[i] = Sample(source, uv0);
+					image0.m_valid[i] = 1;
+				}
+				if (HasLens1(uv1)) {
+					image1.m_data[i] = Sample(source, uv1);
+					image1.m_valid[i] = 1;
+				}
+			}
+		});
+		SumValid(image0);
+		SumValid(image1);
+	}
+
+	// Harris corners of image0 whose patch both lenses see, the strongest per cell
+	std::vector<Feature> DetectFeatures(GrayImage const & image0, GrayImage const & image1, size_t maxFeatures, ThreadPool & pool)
+	{
+		int const width = int(image0.m_width);
+		int const height = int(image0.m_height);
+
+		// Gradient products Ix^2, Iy^2 and IxIy, only read where the whole patch is valid
+		std::vector<float> products(3 * width * height, 0.0f);
+		ParallelRows(pool, height - 2, [&](size_t row) {
+			int const y = int(row) + 1;
+			for (int x = 1; x < width - 1; ++x) {
+				float const ix = 0.5f * (image0.At(x + 1, y) - image0.At(x - 1, y));
+				float const iy = 0.5f * (image0.At(x, y + 1) - image0.At(x, y - 1));
+				float * product = &products[3 * (x + y * width)];
+				product[0] = ix * ix;
+				product[1] = iy * iy;
+				product[2] = ix * iy;
+			}
+		});
+
+		int const cellColumns = (width + g_cellSize - 1) / g_cellSize;
+		int const cellRows = (height + g_cellSize - 1) / g_cellSize;
+		std::vector<Feature> cells(cellColumns * cellRows, Feature{0, 0, 0.0f});
+		pool.ParallelFor(cellRows, [&](size_t cellRow) {
+			for (int cellColumn = 0; cellColumn < cellColumns; ++cellColumn) {
+				Feature & best = cells[cellColumn + cellRow * cellColumns];
+				for (int y = int(cellRow) * g_cellSize; y < std::min(height, int(cellRow + 1) * g_cellSize); ++y)
+					for (int x = cellColumn * g_cellSize; x < std::min(width, (cellColumn + 1) * g_cellSize); ++x) {
+						if (!IsValid(image0, x, y, g_patchRadius) || !IsValid(image1, x, y, g_patchRadius))
+							continue;
+
+						float sxx = 0.0f, syy = 0.0f, sxy = 0.0f;
+						for (int dy = -g_windowRadius; dy <= g_windowRadius; ++dy)
+							for (int dx = -g_windowRadius; dx <= g_windowRadius; ++dx) {
+								float const * product = &products[3 * (x + dx + (y + dy) * width)];
+								sxx += product[0];
+								syy += product[1];
+								sxy += product[2];
+							}
+						float const response = sxx * syy - sxy * sxy - g_harrisK * (sxx + syy) * (sxx + syy);
+						if (response > best.m_response)
+							best = Feature{x, y, response};
+					}
+			}
+		});
+
+		std::vector<Feature> features;
+		for (Feature const & feature : cells)
+			if (feature.m_response > 0.0f)
+				features.push_back(feature);
+		std::sort(features.begin(), features.end(), [](Feature const & a, Feature const & b) {
+			return a.m_response > b.m_response;
+		});
+		if (features.size() > maxFeatures)
+			features.resize(maxFeatures);
+		while (!features.empty() && features.back().m_response < g_minRelativeResponse * features.front().m_response)
+			features.pop_back();
+		return features;
+	}
+
+	// Normalized cross-correlation with a zero mean, unit length patch of image0
+	float GetScore(float const * patch, GrayImage const & image1, int x, int y)
+	{
+		float sum = 0.0f;
+		float sumSq = 0.0f;
+		float cross = 0.0f;
+		for (int dy = -g_patchRadius; dy <= g_patchRadius; ++dy)
+			for (int dx = -g_patchRadius; dx <= g_patchRadius; ++dx) {
+				float const value = image1.At(x + dx, y + dy);
+				sum += value;
+				sumSq += value * value;
+				cross += *patch++ * value;
+			}
+		float const variance = sumSq - sum * sum / (g_patchSize * g_patchSize);
+		return variance > 1e-3f ? cross / std::sqrt(variance) : -1.0f;
+	}
+
+	float GetPeakOffset(float before, float peak, float after)
+	{
+		float const curvature = before - 2.0f * peak + after;
+		return curvature < 0.0f ? glm::clamp(0.5f * (before - after) / curvature, -0.5f, 0.5f) : 0.0f;
+	}
+
+	// Where the patch of image0 at the feature is in image1, as an offset with subpixel precision
+	bool MatchFeature(GrayImage const & image0, GrayImage const & image1, Feature const & feature,
+					  int searchRadius, float minScore, glm::vec2 & offset)
+	{
+		float patch[g_patchSize * g_patchSize];
+		float mean = 0.0f;
+		for (int dy = -g_patchRadius, i = 0; dy <= g_patchRadius; ++dy)
+			for (int dx = -g_patchRadius; dx <= g_patchRadius; ++dx, ++i) {
+				patch[i] = image0.At(feature.m_x + dx, feature.m_y + dy);
+				mean += patch[i];
+			}
+		mean /= g_patchSize * g_patchSize;
+		float norm = 0.0f;
+		for (float & value : patch) {
+			value -= mean;
+			norm += value * value;
+		}
+		if (norm <= 1e-3f)
+			return false;
+		for (float & value : patch)
+			value /= std::sqrt(norm);
+
+		int const searchSize = 2 * searchRadius + 1;
+		std::vector<float> scores(searchSize * searchSize, -1.0f);
+		int bestIndex = 0;
+		for (int dy = -searchRadius, i = 0; dy <= searchRadius; ++dy)
+			for (int dx = -searchRadius; dx <= searchRadius; ++dx, ++i) {
+				if (IsValid(image1, feature.m_x + dx, feature.m_y + dy, g_patchRadius))
+					scores[i] = GetScore(patch, image1, feature.m_x + dx, feature.m_y + dy);
+				if (scores[i] > scores[bestIndex])
+					bestIndex = i;
+			}
+
+		int const bestX = bestIndex % searchSize;
+		int const bestY = bestIndex / searchSize;
+		float const best = scores[bestIndex];
+		// On the border of the search window the real peak may well be outside it
+		if (best < minScore || bestX == 0 || bestY == 0 || bestX == searchSize - 1 || bestY == searchSize - 1)
+			return false;
+		for (int i = 0; i < searchSize * searchSize; ++i)
+			if (std::abs(i % searchSize - bestX) > 1 || std::abs(i / searchSize - bestY) > 1)
+				if (scores[i] > best - g_minScoreGap)
+					return false;
+
+		offset.x = bestX - searchRadius + GetPeakOffset(scores[bestIndex - 1], best, scores[bestIndex + 1]);
+		offset.y = bestY - searchRadius + GetPeakOffset(scores[bestIndex - searchSize], best, scores[bestIndex + searchSize]);
+		return true;
+	}
+
+	// Pairs of source UVs that show the same point, found in width x width / 2 renderings of both lenses
+	std::vector<Match> MatchLenses(GrayImage const & source, FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+								   size_t width, CalibrationSettings const & settings, ThreadPool & pool)
+	{
+		size_t const height = width / 2;
+		GrayImage image0;
+		GrayImage image1;
+		RenderLenses(source, fishInfo0, fishInfo1, width, height, image0, image1, pool);
+		std::vector<Feature> const features = DetectFeatures(image0, image1, settings.m_maxFeatures, pool);
+
+		std::vector<Match> matches(features.size());
+		std::vector<uint8_t> matched(features.size(), 0);
+		pool.ParallelFor(features.size(), [&](size_t i) {
+			Feature const & feature = features[i];
+			glm::vec2 offset;
+			if (!MatchFeature(image0, image1, feature, settings.m_searchRadius, settings.m_minScore, offset))
+				return;
+
+			Match & match = matches[i];
+			match.m_uv0 = sphere2fish2(GetSphereCoord(float(feature.m_x), float(feature.m_y), width, height), fishInfo0);
+			match.m_uv1 = sphere2fish2(GetSphereCoord(feature.m_x + offset.x, feature.m_y + offset.y, width, height), fishInfo1);
+			matched[i] = HasLens0(match.m_uv0) && HasLens1(match.m_uv1);
+		});
+
+		std::vector<Match> result;
+		for (size_t i = 0; i < matches.size(); ++i)
+			if (matched[i])
+				result.push_back(matches[i]);
+		return result;
+	}
+
+	LensModel ToLensModel(FishInfo const & fishInfo)
+	{
+		LensModel lens;
+		for (size_t i = 0; i < 2; ++i) {
+			lens.m_center[i] = fishInfo.m_center[i];
+			lens.m_ratio[i] = fishInfo.m_ratio[i];
+		}
+		lens.m_fov = fishInfo.m_fov;
+		for (size_t i = 0; i < 3; ++i)
+			lens.m_rotation[i] = fishInfo.m_rotation[i];
+		return lens;
+	}
+
+	void ToFishInfo(LensModel const & lens, FishInfo & fishInfo)
+	{
+		for (size_t i = 0; i < 2; ++i) {
+			fishInfo.m_center[i] = float(lens.m_center[i]);
+			fishInfo.m_ratio[i] = float(lens.m_ratio[i]);
+		}
+		fishInfo.m_fov = float(lens.m_fov);
+		for (size_t i = 0; i < 3; ++i)
+			fishInfo.m_rotation[i] = float(lens.m_rotation[i]);
+	}
+
+	// Inverse of sphere2fish2: the direction lens uv looks in, in the frame of the equirectangular output
+	void GetRay(LensModel const & lens, glm::vec2 const & uv, double * ray)
+	{
+		double const ox = (uv.x - lens.m_center[0]) / lens.m_ratio[0];
+		double const oy = (uv.y - lens.m_center[1]) / lens.m_ratio[1];
+		double const r = std::sqrt(ox * ox + oy * oy);
+		double const theta = r * lens.m_fov;
+		// sin(theta) / r tends to fov at the lens axis
+		double const k = r > 0.0 ? std::sin(theta) / r : lens.m_fov;
+		double const vx = k * ox;
+		double const vy = std::cos(theta);
+		double const vz = k * oy;
+
+		// sphere2fish2 rotates by Ry(rotation.y) Rx(rotation.x), the transposes undo it
+		double const cosX = std::cos(lens.m_rotation[0]);
+		double const sinX = std::sin(lens.m_rotation[0]);
+		double const cosY = std::cos(lens.m_rotation[1]);
+		double const sinY = std::sin(lens.m_rotation[1]);
+		double const ax = cosY * vx - sinY * vz;
+		double const az = sinY * vx + cosY * vz;
+		double const px = ax;
+		double const py = cosX * vy + sinX * az;
+		double const pz = cosX * az - sinX * vy;
+
+		// rotation.z is added to the longitude
+		double const cosZ = std::cos(lens.m_rotation[2]);
+		double const sinZ = std::sin(lens.m_rotation[2]);
+		ray[0] = cosZ * px - sinZ * py;
+		ray[1] = sinZ * px + cosZ * py;
+		ray[2] = pz;
+	}
+
+	// Free parameters: center, FOV and vertical ratio of both lenses, then the rotation of lens 1
+	class DualFishProblem
+	{
+	public:
+		DualFishProblem(FishInfo const & fishInfo0, FishInfo const & fishInfo1, std::vector<Match> const & matches)
+			: m_lens0(ToLensModel(fishInfo0))
+			, m_lens1(ToLensModel(fishInfo1))
+			, m_matches(matches)
+		{
+		}
+
+		size_t GetMatchCount() const
+		{
+			return m_matches.size();
+		}
+
+		void GetParams(double * params) const
+		{
+			LensModel const * lenses[] = {&m_lens0, &m_lens1};
+			for (LensModel const * lens : lenses) {
+				*params++ = lens->m_center[0];
+				*params++ = lens->m_center[1];
+				*params++ = lens->m_fov;
+				*params++ = lens->m_ratio[1];
+			}
+			std::copy(m_lens1.m_rotation, m_lens1.m_rotation + 3, params);
+		}
+
+		void GetFishInfos(double const * params, FishInfo & fishInfo0, FishInfo & fishInfo1) const
+		{
+			LensModel lens0;
+			LensModel lens1;
+			SetParams(params, lens0, lens1);
+			ToFishInfo(lens0, fishInfo0);
+			ToFishInfo(lens1, fishInfo1);
+		}
+
+		// Difference of the rays both lenses see the match in, about the angle between them for small errors
+		void GetResidual(double const * params, size_t match, double * residual) const
+		{
+			LensModel lens0;
+			LensModel lens1;
+			SetParams(params, lens0, lens1);
+			double ray0[3];
+			double ray1[3];
+			GetRay(lens0, m_matches[match].m_uv0, ray0);
+			GetRay(lens1, m_matches[match].m_uv1, ray1);
+			for (size_t i = 0; i < 3; ++i)
+				residual[i] = ray0[i] - ray1[i];
+		}
+
+	private:
+		void SetParams(double const * params, LensModel & lens0, LensModel & lens1) const
+		{
+			lens0 = m_lens0;
+			lens1 = m_lens1;
+			for (LensModel * lens : {&lens0, &lens1}) {
+				lens->m_center[0] = *params++;
+				lens->m_center[1] = *params++;
+				lens->m_fov = *params++;
+				lens->m_ratio[1] = *params++;
+			}
+			std::copy(params, params + 3, lens1.m_rotation);
+		}
+
+	private:
+		LensModel m_lens0;
+		LensModel m_lens1;
+		std::vector<Match> const & m_matches;
+	};
+
+	struct NormalEquations
+	{
+		double m_jtj[g_paramCount][g_paramCount];
+		double m_jtr[g_paramCount];
+		double m_cost;
+	};
+
+	size_t GetChunkCount(size_t count, ThreadPool & pool)
+	{
+		return std::max<size_t>(1, std::min(count, 4 * pool.GetThreadCount()));
+	}
+
+	double GetCost(DualFishProblem const & problem, double const * params, ThreadPool & pool)
+	{
+		size_t const count = problem.GetMatchCount();
+		std::vector<double> costs(GetChunkCount(count, pool), 0.0);
+		pool.ParallelFor(costs.size(), [&](size_t chunk) {
+			for (size_t i = chunk * count / costs.size(); i < (chunk + 1) * count / costs.size(); ++i) {
+				double residual[3];
+				problem.GetResidual(params, i, residual);
+				costs[chunk] += residual[0] * residual[0] + residual[1] * residual[1] + residual[2] * residual[2];
+			}
+		});
+		double cost = 0.0;
+		for (double const chunkCost : costs)
+			cost += chunkCost;
+		return cost;
+	}
+
+	// J^T J and J^T r of the residuals, with the Jacobian from central differences
+	NormalEquations GetNormalEquations(DualFishProblem const & problem, double const * params, ThreadPool & pool)
+	{
+		size_t const count = problem.GetMatchCount();
+		std::vector<NormalEquations> chunks(GetChunkCount(count, pool));
+		pool.ParallelFor(chunks.size(), [&](size_t chunk) {
+			NormalEquations & equations = chunks[chunk];
+			std::fill(&equations.m_jtj[0][0], &equations.m_jtj[0][0] + g_paramCount * g_paramCount, 0.0);
+			std::fill(equations.m_jtr, equations.m_jtr + g_paramCount, 0.0);
+			equations.m_cost = 0.0;
+
+			double shifted[g_paramCount];
+			std::copy(params, params + g_paramCount, shifted);
+			for (size_t i = chunk * count / chunks.size(); i < (chunk + 1) * count / chunks.size(); ++i) {
+				double residual[3];
+				problem.GetResidual(params, i, residual);
+
+				double jacobian[3][g_paramCount];
+				for (size_t p = 0; p < g_paramCount; ++p) {
+					double plus[3];
+					double minus[3];
+					shifted[p] = params[p] + g_derivativeStep;
+					problem.GetResidual(shifted, i, plus);
+					shifted[p] = params[p] - g_derivativeStep;
+					problem.GetResidual(shifted, i, minus);
+					shifted[p] = params[p];
+					for (size_t r = 0; r < 3; ++r)
+						jacobian[r][p] = (plus[r] - minus[r]) / (2.0 * g_derivativeStep);
+				}
+
+				for (size_t r = 0; r < 3; ++r) {
+					equations.m_cost += residual[r] * residual[r];
+					for (size_t p = 0; p < g_paramCount; ++p) {
+						equations.m_jtr[p] += jacobian[r][p] * residual[r];
+						for (size_t q = 0; q <= p; ++q)
+							equations.m_jtj[p][q] += jacobian[r][p] * jacobian[r][q];
+					}
+				}
+			}
+		});
+
+		NormalEquations result = chunks.front();
+		for (size_t chunk = 1; chunk < chunks.size(); ++chunk) {
+			for (size_t p = 0; p < g_paramCount; ++p) {
+				result.m_jtr[p] += chunks[chunk].m_jtr[p];
+				for (size_t q = 0; q <= p; ++q)
+					result.m_jtj[p][q] += chunks[chunk].m_jtj[p][q];
+			}
+			result.m_cost += chunks[chunk].m_cost;
+		}
+		for (size_t p = 0; p < g_paramCount; ++p)
+			for (size_t q = p + 1; q < g_paramCount; ++q)
+				result.m_jtj[p][q] = result.m_jtj[q][p];
+		return result;
+	}
+
+	// Solves a x = b in place of b, false if a isn't positive definite
+	bool SolveCholesky(double (&a)[g_paramCount][g_paramCount], double (&b)[g_paramCount])
+	{
+		for (size_t i = 0; i < g_paramCount; ++i)
+			for (size_t j = 0; j <= i; ++j) {
+				double sum = a[i][j];
+				for (size_t k = 0; k < j; ++k)
+					sum -= a[i][k] * a[j][k];
+				if (i != j)
+					a[i][j] = sum / a[j][j];
+				else if (sum > 0.0)
+					a[i][i] = std::sqrt(sum);
+				else
+					return false;
+			}
+
+		for (size_t i = 0; i < g_paramCount; ++i) {
+			for (size_t k = 0; k < i; ++k)
+				b[i] -= a[i][k] * b[k];
+			b[i] /= a[i][i];
+		}
+		for (size_t i = g_paramCount; i-- > 0;) {
+			for (size_t k = i + 1; k < g_paramCount; ++k)
+				b[i] -= a[k][i] * b[k];
+			b[i] /= a[i][i];
+		}
+		return true;
+	}
+
+	void SolveLevenbergMarquardt(DualFishProblem const & problem, double * params, size_t maxIterations, ThreadPool & pool)
+	{
+		NormalEquations equations = GetNormalEquations(problem, params, pool);
+		double lambda = 1e-3;
+		for (size_t iteration = 0; iteration < maxIterations && lambda < 1e12; ++iteration) {
+			// Marquardt's damping scales with the diagonal, parameters of different units are damped alike
+			double a[g_paramCount][g_paramCount];
+			double step[g_paramCount];
+			for (size_t p = 0; p < g_paramCount; ++p) {
+				std::copy(equations.m_jtj[p], equations.m_jtj[p] + g_paramCount, a[p]);
+				a[p][p] += lambda * std::max(equations.m_jtj[p][p], 1e-12);
+				step[p] = -equations.m_jtr[p];
+			}
+			if (!SolveCholesky(a, step)) {
+				lambda *= 10.0;
+				continue;
+			}
+
+			double candidate[g_paramCount];
+			for (size_t p = 0; p < g_paramCount; ++p)
+				candidate[p] = params[p] + step[p];
+			double const cost = GetCost(problem, candidate, pool);
+			if (cost >= equations.m_cost) {
+				lambda *= 10.0;
+				continue;
+			}
+
+			std::copy(candidate, candidate + g_paramCount, params);
+			if (equations.m_cost - cost <= g_tolerance * equations.m_cost)
+				break;
+			lambda = std::max(lambda * 0.1, 1e-12);
+			equations = GetNormalEquations(problem, params, pool);
+		}
+	}
+
+	std::vector<double> GetErrors(DualFishProblem const & problem, double const * params)
+	{
+		std::vector<double> errors(problem.GetMatchCount());
+		for (size_t i = 0; i < errors.size(); ++i) {
+			double residual[3];
+			problem.GetResidual(params, i, residual);
+			errors[i] = std::sqrt(residual[0] * residual[0] + residual[1] * residual[1] + residual[2] * residual[2]);
+		}
+		return errors;
+	}
+
+	void CheckMatchCount(size_t count)
+	{
+		if (count < g_minMatchCount)
+			throw std::runtime_error("Only " + std::to_string(count) + " features matched between the lenses, calibration needs " +
+									 std::to_string(g_minMatchCount) + ". Is the initial guess close enough?");
+	}
+
+	std::string GetLinePrefix(std::string const & path, size_t lineNumber)
+	{
+		return path + ":" + std::to_string(lineNumber) + ": ";
+	}
+}
+
+CalibrationResult CalibrateDualFish(RawImage const & image, FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+									CalibrationSettings const & settings, ThreadPool & pool)
+{
+	GrayImage const source = ToGray(image, pool);
+
+	CalibrationResult result = {fishInfo0, fishInfo1, 0, 0.0f};
+	for (size_t pass = 0; pass < settings.m_passCount; ++pass) {
+		size_t const width = settings.m_width >> (settings.m_passCount - 1 - pass);
+		std::vector<Match> matches = MatchLenses(source, result.m_fishInfo0, result.m_fishInfo1, width, settings, pool);
+		CheckMatchCount(matches.size());
+
+		// Solved again without the matches that don't fit, until all of them do
+		for (size_t round = 0; round < g_rejectRoundCount; ++round) {
+			DualFishProblem const problem(result.m_fishInfo0, result.m_fishInfo1, matches);
+			double params[g_paramCount];
+			problem.GetParams(params);
+			SolveLevenbergMarquardt(problem, params, settings.m_maxIterations, pool);
+			problem.GetFishInfos(params, result.m_fishInfo0, result.m_fishInfo1);
+			if (!(result.m_fishInfo0.m_fov > 0.0f && result.m_fishInfo1.m_fov > 0.0f))
+				throw std::runtime_error("Calibration diverged, the initial guess is too far off");
+
+			std::vector<double> const errors = GetErrors(problem, params);
+			std::vector<double> sorted = errors;
+			std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+			double const threshold = g_outlierFactor * sorted[sorted.size() / 2];
+
+			std::vector<Match> inliers;
+			double sumSq = 0.0;
+			for (size_t i = 0; i < matches.size(); ++i)
+				if (errors[i] <= threshold) {
+					inliers.push_back(matches[i]);
+					sumSq += errors[i] * errors[i];
+				}
+			result.m_matchCount = inliers.size();
+			result.m_rmsError = float(std::sqrt(sumSq / inliers.size()));
+			if (inliers.size() == matches.size())
+				break;
+			matches.swap(inliers);
+			CheckMatchCount(matches.size());
+		}
+	}
+	return result;
+}
+
+void SaveCalibration(std::string const & path, FishInfo const & fishInfo0, FishInfo const & fishInfo1)
+{
+	std::ofstream file(path);
+	if (!file)
+		throw std::runtime_error("Can't open file for writing: " + path);
+
+	file << std::setprecision(9) << "# Dual fisheye calibration: angles in degrees, centers and ratios relative to the frame size\n";
+	FishInfo const * fishInfos[] = {&fishInfo0, &fishInfo1};
+	for (size_t lens = 0; lens < 2; ++lens) {
+		FishInfo const & fishInfo = *fishInfos[lens];
+		PhotometricInfo const & photometric = fishInfo.m_photometric;
+		std::string const prefix = "lens" + std::to_string(lens) + ".";
+		file << prefix << "center " << fishInfo.m_center.x << " " << fishInfo.m_center.y << "\n"
+			 << prefix << "rotation " << glm::degrees(fishInfo.m_rotation.x) << " " << glm::degrees(fishInfo.m_rotation.y) << " "
+			 << glm::degrees(fishInfo.m_rotation.z) << "\n"
+			 << prefix << "fov " << glm::degrees(fishInfo.m_fov) << "\n"
+			 << prefix << "ratio " << fishInfo.m_ratio.x << " " << fishInfo.m_ratio.y << "\n"
+			 << prefix << "gain " << photometric.m_gain << "\n"
+			 << prefix << "whiteBalance " << photometric.m_whiteBalance.x << " " << photometric.m_whiteBalance.y << " "
+			 << photometric.m_whiteBalance.z << "\n"
+			 << prefix << "vignetting " << photometric.m_vignetting.x << " " << photometric.m_vignetting.y << " "
+			 << photometric.m_vignetting.z << "\n";
+	}
+	if (!file.flush())
+		throw std::runtime_error("Failed to write file: " + path);
+}
+
+std::pair<FishInfo, FishInfo> LoadCalibration(std::string const & path)
+{
+	std::ifstream file(path);
+	if (!file)
+		throw std::runtime_error("Can't open file for reading: " + path);
+
+	// The geometry has to be complete, bits 0 to 3 for center, rotation, fov and ratio
+	FishInfo fishInfos[2] = {};
+	unsigned geometryFields[2] = {};
+	std::string line;
+	for (size_t lineNumber = 1; std::getline(file, line); ++lineNumber) {
+		std::istringstream stream(line);
+		std::string key;
+		if (!(stream >> key) || key[0] == '#')
+			continue;
+		if (key.size() < 7 || key.compare(0, 4, "lens") != 0 || (key[4] != '0' && key[4] != '1') || key[5] != '.')
+			throw std::runtime_error(GetLinePrefix(path, lineNumber) + "unknown key " + key);
+
+		size_t const lens = key[4] - '0';
+		std::string const field = key.substr(6);
+		size_t const valueCount = field == "fov" || field == "gain" ? 1 : field == "center" || field == "ratio" ? 2 :
+								  field == "rotation" || field == "whiteBalance" || field == "vignetting" ? 3 : 0;
+		if (valueCount == 0)
+			throw std::runtime_error(GetLinePrefix(path, lineNumber) + "unknown key " + key);
+		float values[3];
+		for (size_t i = 0; i < valueCount; ++i)
+			if (!(stream >> values[i]))
+				throw std::runtime_error(GetLinePrefix(path, lineNumber) + key + " needs " + std::to_string(valueCount) + " numbers");
+		std::string rest;
+		if (stream >> rest)
+			throw std::runtime_error(GetLinePrefix(path, lineNumber) + "unexpected " + rest + " after " + key);
+
+		FishInfo & fishInfo = fishInfos[lens];
+		if (field == "center") {
+			fishInfo.m_center = glm::vec2(values[0], values[1]);
+			geometryFields[lens] |= 1;
+		}
+		else if (field == "rotation") {
+			fishInfo.m_rotation = glm::vec3(glm::radians(values[0]), glm::radians(values[1]), glm::radians(values[2]));
+			geometryFields[lens] |= 2;
+		}
+		else if (field == "fov") {
+			fishInfo.m_fov = glm::radians(values[0]);
+			geometryFields[lens] |= 4;
+		}
+		else if (field == "ratio") {
+			fishInfo.m_ratio = glm::vec2(values[0], values[1]);
+			geometryFields[lens] |= 8;
+		}
+		else if (field == "gain")
+			fishInfo.m_photometric.m_gain = values[0];
+		else if (field == "whiteBalance")
+			fishInfo.m_photometric.m_whiteBalance = glm::vec3(values[0], values[1], values[2]);
+		else
+			fishInfo.m_photometric.m_vignetting = glm::vec3(values[0], values[1], values[2]);
+	}
+
+	for (size_t lens = 0; lens < 2; ++lens)
+		if (geometryFields[lens] != 15)
+			throw std::runtime_error(path + ": lens" + std::to_string(lens) + " needs center, rotation, fov and ratio");
+	return {fishInfos[0], fishInfos[1]};
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <utility>
+
+#include "fishtools.h"
+#include "imgtools.h"
+#include "threadtools.h"
+
+struct CalibrationSettings
+{
+	// Matching runs coarse to fine. Pass k renders both lenses as equirectangular images of
+	// m_width >> (m_passCount - 1 - k) pixels and searches m_searchRadius pixels around where the
+	// calibration so far puts a feature, so every pass has to cope with half the error of the previous one
+	size_t m_width = 2048;
+	size_t m_passCount = 3;
+	int m_searchRadius = 12;
+	size_t m_maxFeatures = 1500;
+	float m_minScore = 0.85f; // Normalized cross-correlation a match needs
+	size_t m_maxIterations = 100;
+};
+
+struct CalibrationResult
+{
+	FishInfo m_fishInfo0;
+	FishInfo m_fishInfo1;
+	size_t m_matchCount;
+	float m_rmsError; // Angle between the rays of matched features, in radians
+};
+
+// Fits the geometry of both lenses to a dual fisheye frame. Corners found where the lenses overlap
+// are matched between them, then Levenberg-Marquardt fits the centers, FOVs and vertical ratios of both
+// lenses and the rotation of lens 1 so that matched features look in the same direction.
+// Lens 0 keeps its rotation, it orients the panorama. ratio.x is kept as well: the projection only
+// depends on ratio / fov, so the FOV takes up the scale. The photometric calibration is passed through.
+// fishInfo0 and fishInfo1 are the initial guess, it has to be within a few degrees.
+// image is rgb24, gray or planar yuv, of which only the luma is used
+CalibrationResult CalibrateDualFish(RawImage const & image, FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+									CalibrationSettings const & settings, ThreadPool & pool);
+
+// Text file with one "lens<index>.<field> <values>" line per FishInfo field. Angles are in degrees,
+// centers and ratios relative to the frame size. The photometric fields may be left out
+void SaveCalibration(std::string const & path, FishInfo const & fishInfo0, FishInfo const & fishInfo1);
+std::pair<FishInfo, FishInfo> LoadCalibration(std::string const & path);
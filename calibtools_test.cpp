@@ -0,0 +1,180 @@
+#include "calibtools.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include <glm/gtc/constants.hpp>
+
+#include "testtools.h"
+
+namespace {
+	size_t const g_width = 2148;
+	size_t const g_height = 1074;
+
+	// The built-in calibration of the example rig
+	FishInfo const g_guess0 = {glm::vec2(1024.0f / 4296.0f, 1024.0f / 2148.0f), glm::vec3(glm::radians(25.0f), 0.0f, 0.0f),
+							   glm::radians(210.0f), glm::vec2(2048.0f / 4296.0f, 2048.0f / 2148.0f), PhotometricInfo()};
+	FishInfo const g_guess1 = {glm::vec2(3272.0f / 4296.0f, 1124.0f / 2148.0f), glm::vec3(0.0f, glm::radians(-5.0f), glm::pi<float>()),
+							   glm::radians(210.0f), glm::vec2(2048.0f / 4296.0f, 2048.0f / 2148.0f), PhotometricInfo()};
+
+	double HashLattice(int x, int y, int z, int octave)
+	{
+		uint32_t hash = x * 73856093u ^ y * 19349663u ^ z * 83492791u ^ octave * 2654435761u;
+		hash ^= hash >> 13;
+		hash *= 0x5bd1e995;
+		hash ^= hash >> 15;
+		return (hash & 0xffff) / 65535.0;
+	}
+
+	// Trilinear value noise over the sphere, a few octaves of it have corners everywhere
+	double GetTexture(double const * direction)
+	{
+		double value = 0.0;
+		double scale = 12.5;
+		double amplitude = 1.0;
+		for (int octave = 0; octave < 3; ++octave, scale *= 2.5, amplitude *= 0.6) {
+			int corner[3];
+			double frac[3];
+			for (int axis = 0; axis < 3; ++axis) {
+				double const point = direction[axis] * scale;
+				corner[axis] = int(std::floor(point));
+				frac[axis] = point - corner[axis];
+			}
+			for (int c = 0; c < 8; ++c) {
+				int const dx = c & 1;
+				int const dy = c >> 1 & 1;
+				int const dz = c >> 2;
+				value += amplitude * HashLattice(corner[0] + dx, corner[1] + dy, corner[2] + dz, octave) *
+						 (dx ? frac[0] : 1 - frac[0]) * (dy ? frac[1] : 1 - frac[1]) * (dz ? frac[2] : 1 - frac[2]);
+			}
+		}
+		return value;
+	}
+
+	// The inverse of sphere2fish2, written out separately: the direction a lens sees at (u, v)
+	bool GetRay(FishInfo const & fishInfo, double u, double v, double * ray)
+	{
+		double const offsetX = (u - fishInfo.m_center.x) / fishInfo.m_ratio.x;
+		double const offsetY = (v - fishInfo.m_center.y) / fishInfo.m_ratio.y;
+		double const r = std::sqrt(offsetX * offsetX + offsetY * offsetY);
+		if (r > 0.5)
+			return false;
+
+		double const theta = r * fishInfo.m_fov;
+		double const scale = r > 0.0 ? std::sin(theta) / r : fishInfo.m_fov;
+		double const viewX = scale * offsetX;
+		double const viewY = std::cos(theta);
+		double const viewZ = scale * offsetY;
+
+		glm::vec3 const & rotation = fishInfo.m_rotation;
+		double const rolledX = std::cos(rotation.y) * viewX - std::sin(rotation.y) * viewZ;
+		double const rolledZ = std::sin(rotation.y) * viewX + std::cos(rotation.y) * viewZ;
+		double const pitchedY = std::cos(rotation.x) * viewY + std::sin(rotation.x) * rolledZ;
+		double const pitchedZ = std::cos(rotation.x) * rolledZ - std::sin(rotation.x) * viewY;
+		ray[0] = std::cos(rotation.z) * rolledX - std::sin(rotation.z) * pitchedY;
+		ray[1] = std::sin(rotation.z) * rolledX + std::cos(rotation.z) * pitchedY;
+		ray[2] = pitchedZ;
+		return true;
+	}
+
+	// A gray dual fisheye frame of the textured sphere as the lenses see it
+	RawImage RenderFrame(FishInfo const & fishInfo0, FishInfo const & fishInfo1, ThreadPool & pool)
+	{
+		RawImage image("gray", g_width, g_height);
+		ParallelRows(pool, g_height, [&](size_t y) {
+			uint8_t * row = reinterpret_cast<uint8_t *>(image.GetRow(y));
+			for (size_t x = 0; x < g_width; ++x) {
+				double ray[3];
+				bool const inLens = GetRay(x < g_width / 2 ? fishInfo0 : fishInfo1, (x + 0.5) / g_width, (y + 0.5) / g_height, ray);
+				row[x] = inLens ? uint8_t(std::min(255.0, std::max(0.0, (GetTexture(ray) - 0.5) * 200.0 + 128.0))) : 0;
+			}
+		});
+		return image;
+	}
+
+	TEST(InverseAgreesWithSphere2fish2)
+	{
+		float maxError = 0.0f;
+		for (int i = 0; i < 1000; ++i) {
+			FishInfo const & fishInfo = i % 2 ? g_guess1 : g_guess0;
+			glm::vec2 const uv((i % 2 ? 0.5f : 0.0f) + 0.5f * (i * 37 % 101) / 101.0f, (i * 53 % 97) / 97.0f);
+			double ray[3];
+			if (!GetRay(fishInfo, uv.x, uv.y, ray))
+				continue;
+			glm::vec2 const sphere(float(std::atan2(ray[0], ray[1]) / glm::pi<double>()),
+								   float(-std::asin(ray[2]) / glm::half_pi<double>()));
+			maxError = std::max(maxError, glm::length(sphere2fish2(sphere, fishInfo) - uv));
+		}
+		CHECK(maxError < 1e-5f);
+	}
+
+	TEST(LevenbergMarquardtFindsTheLenses)
+	{
+		// The truth is a few pixels and degrees away from the guess
+		FishInfo truth0 = g_guess0;
+		truth0.m_center += glm::vec2(4.0f / g_width, -3.0f / g_height);
+		truth0.m_fov = glm::radians(206.0f);
+		truth0.m_ratio.y *= 1.004f;
+		FishInfo truth1 = g_guess1;
+		truth1.m_center += glm::vec2(-5.0f / g_width, 3.0f / g_height);
+		truth1.m_fov = glm::radians(213.0f);
+		truth1.m_rotation += glm::vec3(glm::radians(1.5f), glm::radians(-2.0f), glm::radians(1.0f));
+
+		ThreadPool pool;
+		RawImage const image = RenderFrame(truth0, truth1, pool);
+		CalibrationSettings settings;
+		settings.m_width = 1024;
+		CalibrationResult const result = CalibrateDualFish(image, g_guess0, g_guess1, settings, pool);
+		fprintf(stderr, "%zu matches, %g degrees rms\n", result.m_matchCount, glm::degrees(result.m_rmsError));
+		CHECK(result.m_matchCount >= 100);
+		CHECK(glm::degrees(result.m_rmsError) < 0.1f);
+
+		FishInfo const * const truths[] = {&truth0, &truth1};
+		FishInfo const * const results[] = {&result.m_fishInfo0, &result.m_fishInfo1};
+		for (size_t lens = 0; lens < 2; ++lens) {
+			FishInfo const & truth = *truths[lens];
+			FishInfo const & fit = *results[lens];
+			CHECK(std::abs(fit.m_center.x - truth.m_center.x) * g_width < 1.0f);
+			CHECK(std::abs(fit.m_center.y - truth.m_center.y) * g_height < 1.0f);
+			CHECK(std::abs(glm::degrees(fit.m_fov - truth.m_fov)) < 0.3f);
+			CHECK(std::abs(fit.m_ratio.y / truth.m_ratio.y - 1.0f) < 0.002f);
+			for (int axis = 0; axis < 3; ++axis)
+				CHECK(std::abs(glm::degrees(fit.m_rotation[axis] - truth.m_rotation[axis])) < 0.2f);
+		}
+	}
+
+	TEST(CalibrationFilesRoundTrip)
+	{
+		FishInfo fishInfo1 = g_guess1;
+		fishInfo1.m_photometric.m_gain = 1.25f;
+		fishInfo1.m_photometric.m_whiteBalance = glm::vec3(0.9f, 1.0f, 1.1f);
+		fishInfo1.m_photometric.m_vignetting = glm::vec3(-0.1f, 0.02f, 0.0f);
+		std::string const path = "calibtools_test_calibration.txt";
+		SaveCalibration(path, g_guess0, fishInfo1);
+		std::pair<FishInfo, FishInfo> const loaded = LoadCalibration(path);
+		remove(path.c_str());
+
+		FishInfo const * const saved[] = {&g_guess0, &fishInfo1};
+		FishInfo const * const fishInfos[] = {&loaded.first, &loaded.second};
+		for (size_t lens = 0; lens < 2; ++lens) {
+			FishInfo const & expected = *saved[lens];
+			FishInfo const & fishInfo = *fishInfos[lens];
+			CHECK(glm::length(fishInfo.m_center - expected.m_center) < 1e-6f);
+			CHECK(glm::length(fishInfo.m_rotation - expected.m_rotation) < 1e-6f);
+			CHECK(std::abs(fishInfo.m_fov - expected.m_fov) < 1e-6f);
+			CHECK(glm::length(fishInfo.m_ratio - expected.m_ratio) < 1e-6f);
+			CHECK(std::abs(fishInfo.m_photometric.m_gain - expected.m_photometric.m_gain) < 1e-6f);
+			CHECK(glm::length(fishInfo.m_photometric.m_whiteBalance - expected.m_photometric.m_whiteBalance) < 1e-6f);
+			CHECK(glm::length(fishInfo.m_photometric.m_vignetting - expected.m_photometric.m_vignetting) < 1e-6f);
+		}
+		CHECK_THROWS(LoadCalibration("calibtools_test_missing.txt"));
+	}
+}
+
+int main()
+{
+	return RunTests();
+}
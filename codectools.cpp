@@ -0,0 +1,684 @@
+#include "codectools.h"
+
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#ifdef HAVE_LIBJPEG
+#include <jpeglib.h>
+#endif
+
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+
+namespace {
+	typedef std::unique_ptr<FILE, int (*)(FILE *)> FilePtr;
+
+	FilePtr OpenFile(std::string const & path, char const * mode)
+	{
+		FilePtr file(fopen(path.c_str(), mode), fclose);
+		if (!file)
+			throw std::runtime_error(std::string("Can't open file for ") + (mode[0] == 'r' ? "reading: " : "writing: ") + path);
+		return file;
+	}
+
+	void ReadExactly(FILE * file, void * data, size_t size, std::string const & path)
+	{
+		if (fread(data, 1, size, file) != size)
+			throw std::runtime_error("Unexpected end of file: " + path);
+	}
+
+	void WriteExactly(FILE * file, void const * data, size_t size, std::string const & path)
+	{
+		if (fwrite(data, 1, size, file) != size)
+			throw std::runtime_error("Failed to write file: " + path);
+	}
+
+	// The end of every encoder: what's still buffered only fails to reach the disk here
+	void CloseWrittenFile(FilePtr & file, std::string const & path)
+	{
+		FILE * const stream = file.release();
+		bool const failed = fflush(stream) != 0 || ferror(stream) != 0;
+		if (fclose(stream) != 0 || failed)
+			throw std::runtime_error("Failed to write file: " + path);
+	}
+
+	uint32_t ReadLE(uint8_t const * data, size_t size)
+	{
+		uint32_t value = 0;
+		for (size_t i = 0; i < size; ++i)
+			value |= uint32_t(data[i]) << (8 * i);
+		return value;
+	}
+
+	void WriteLE(uint8_t * data, uint32_t value, size_t size)
+	{
+		for (size_t i = 0; i < size; ++i)
+			data[i] = uint8_t(value >> (8 * i));
+	}
+
+	uint8_t Clip(int value)
+	{
+		return uint8_t(std::min(std::max(value, 0), 255));
+	}
+
+	// BMP
+
+	struct BmpInfo
+	{
+		size_t m_width;
+		size_t m_height;
+		size_t m_bitCount;
+		size_t m_dataOffset;
+		bool m_topDown;
+	};
+
+	BmpInfo ReadBmpHeader(FILE * file, std::string const & path)
+	{
+		uint8_t header[54];
+		ReadExactly(file, header, sizeof(header), path);
+		if (header[0] != 'B' || header[1] != 'M')
+			throw std::runtime_error("Not a BMP file: " + path);
+
+		int32_t const height = int32_t(ReadLE(header + 22, 4));
+		BmpInfo info;
+		info.m_width = ReadLE(header + 18, 4);
+		info.m_height = height < 0 ? -height : height;
+		info.m_bitCount = ReadLE(header + 28, 2);
+		info.m_dataOffset = ReadLE(header + 10, 4);
+		info.m_topDown = height < 0;
+
+		uint32_t const compression = ReadLE(header + 30, 4);
+		if ((info.m_bitCount != 24 && info.m_bitCount != 32) || compression != 0)
+			throw std::runtime_error("Only uncompressed 24 and 32 bit BMP files are supported: " + path);
+
+		return info;
+	}
+
+	RawImage DecodeBmp(std::string const & path)
+	{
+		FilePtr file = OpenFile(path, "rb");
+		BmpInfo const info = ReadBmpHeader(file.get(), path);
+		if (fseek(file.get(), info.m_dataOffset, SEEK_SET) != 0)
+			throw std::runtime_error("Broken BMP file: " + path);
+
+		RawImage image("rgb24", info.m_width, info.m_height);
+		size_t const pixelSize = info.m_bitCount / 8;
+		size_t const fileRowSize = (pixelSize * info.m_width + 3) / 4 * 4;
+		std::vector<uint8_t> padding(fileRowSize);
+
+		for (size_t fileRow = 0; fileRow < info.m_height; ++fileRow) {
+			size_t const y = info.m_topDown ? fileRow : info.m_height - 1 - fileRow;
+			uint8_t * row = reinterpret_cast<uint8_t *>(image.GetRow(y));
+
+			if (pixelSize == 3) {
+				// Straight into the image row, then BGR -> RGB in place
+				ReadExactly(file.get(), row, 3 * info.m_width, path);
+				ReadExactly(file.get(), padding.data(), fileRowSize - 3 * info.m_width, path);
+				for (size_t x = 0; x < info.m_width; ++x)
+					std::swap(row[3 * x], row[3 * x + 2]);
+			}
+			else {
+				ReadExactly(file.get(), padding.data(), fileRowSize, path);
+				for (size_t x = 0; x < info.m_width; ++x) {
+					row[3 * x] = padding[4 * x + 2];
+					row[3 * x + 1] = padding[4 * x + 1];
+					row[3 * x + 2] = padding[4 * x];
+				}
+			}
+		}
+
+		return image;
+	}
+
+	void EncodeBmp(RawImage const & image, std::string const & path)
+	{
+		if (image.GetPixFmt() != "rgb24")
+			throw std::runtime_error("BMP writer supports rgb24 only: " + path);
+
+		size_t const width = image.GetWidth();
+		size_t const height = image.GetHeight();
+		size_t const fileRowSize = (3 * width + 3) / 4 * 4;
+
+		uint8_t header[54] = {'B', 'M'};
+		WriteLE(header + 2, 54 + fileRowSize * height, 4);
+		WriteLE(header + 10, 54, 4);
+		WriteLE(header + 14, 40, 4);
+		WriteLE(header + 18, width, 4);
+		WriteLE(header + 22, height, 4);
+		WriteLE(header + 26, 1, 2);
+		WriteLE(header + 28, 24, 2);
+		WriteLE(header + 34, fileRowSize * height, 4);
+
+		FilePtr file = OpenFile(path, "wb");
+		WriteExactly(file.get(), header, sizeof(header), path);
+
+		std::vector<uint8_t> fileRow(fileRowSize);
+		for (size_t y = height; y-- > 0;) {
+			uint8_t const * row = reinterpret_cast<uint8_t const *>(image.GetRow(y));
+			for (size_t x = 0; x < width; ++x) {
+				fileRow[3 * x] = row[3 * x + 2];
+				fileRow[3 * x + 1] = row[3 * x + 1];
+				fileRow[3 * x + 2] = row[3 * x];
+			}
+			WriteExactly(file.get(), fileRow.data(), fileRowSize, path);
+		}
+		CloseWrittenFile(file, path);
+	}
+
+	// PPM/PGM
+
+	size_t ReadPnmNumber(FILE * file, std::string const & path)
+	{
+		int c = fgetc(file);
+		for (;;) {
+			if (c == '#')
+				while (c != '\n' && c != EOF)
+					c = fgetc(file);
+			else if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+				c = fgetc(file);
+			else
+				break;
+		}
+
+		if (c < '0' || c > '9')
+			throw std::runtime_error("Broken PNM header: " + path);
+
+		size_t value = 0;
+		while (c >= '0' && c <= '9') {
+			value = 10 * value + (c - '0');
+			c = fgetc(file);
+		}
+		// The single whitespace after the last number is eaten here, binary data starts next
+		return value;
+	}
+
+	void ReadPnmHeader(FILE * file, std::string const & path, char & type, size_t & width, size_t & height)
+	{
+		char magic[2];
+		ReadExactly(file, magic, sizeof(magic), path);
+		if (magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6'))
+			throw std::runtime_error("Only binary PPM/PGM files are supported: " + path);
+
+		type = magic[1];
+		width = ReadPnmNumber(file, path);
+		height = ReadPnmNumber(file, path);
+		if (ReadPnmNumber(file, path) != 255)
+			throw std::runtime_error("Only 8 bit PPM/PGM files are supported: " + path);
+	}
+
+	RawImage DecodePnm(std::string const & path)
+	{
+		FilePtr file = OpenFile(path, "rb");
+		char type = 0;
+		size_t width = 0;
+		size_t height = 0;
+		ReadPnmHeader(file.get(), path, type, width, height);
+
+		RawImage image(type == '6' ? "rgb24" : "gray", width, height);
+		for (size_t y = 0; y < height; ++y)
+			ReadExactly(file.get(), image.GetRow(y), image.GetRowSize(), path);
+
+		return image;
+	}
+
+	void EncodePnm(RawImage const & image, std::string const & path)
+	{
+		char const * magic = image.GetPixFmt() == "gray" ? "P5" : "P6";
+		if (image.GetPixFmt() != "gray" && image.GetPixFmt() != "rgb24")
+			throw std::runtime_error("PPM/PGM writer supports rgb24 and gray only: " + path);
+
+		FilePtr file = OpenFile(path, "wb");
+		std::string const header = std::string(magic) + "\n" + std::to_string(image.GetWidth()) + " " +
+				std::to_string(image.GetHeight()) + "\n255\n";
+		WriteExactly(file.get(), header.data(), header.size(), path);
+		for (size_t y = 0; y < image.GetHeight(); ++y)
+			WriteExactly(file.get(), image.GetRow(y), image.GetRowSize(), path);
+		CloseWrittenFile(file, path);
+	}
+
+	// Raw frames
+
+	RawImage DecodeRawRgb24(std::string const & path, size_t width, size_t height)
+	{
+		FilePtr file = OpenFile(path, "rb");
+		RawImage image("rgb24", width, height);
+		for (size_t y = 0; y < height; ++y)
+			ReadExactly(file.get(), image.GetRow(y), image.GetRowSize(), path);
+		return image;
+	}
+
+	void EncodeRawRgb24(RawImage const & image, std::string const & path)
+	{
+		if (image.GetPixFmt() != "rgb24")
+			throw std::runtime_error("rgb24 writer expects rgb24 input: " + path);
+
+		FilePtr file = OpenFile(path, "wb");
+		for (size_t y = 0; y < image.GetHeight(); ++y)
+			WriteExactly(file.get(), image.GetRow(y), image.GetRowSize(), path);
+		CloseWrittenFile(file, path);
+	}
+
+	// BT.601 limited range, the same as ffmpeg uses for yuv420p <-> rgb24 by default
+	RawImage DecodeRawYuv420p(std::string const & path, size_t width, size_t height)
+	{
+		size_t const chromaWidth = (width + 1) / 2;
+		size_t const chromaHeight = (height + 1) / 2;
+		std::vector<uint8_t> planes(width * height + 2 * chromaWidth * chromaHeight);
+		uint8_t const * yPlane = planes.data();
+		uint8_t const * uPlane = yPlane + width * height;
+		uint8_t const * vPlane = uPlane + chromaWidth * chromaHeight;
+
+		FilePtr file = OpenFile(path, "rb");
+		ReadExactly(file.get(), planes.data(), planes.size(), path);
+
+		RawImage image("rgb24", width, height);
+		for (size_t y = 0; y < height; ++y) {
+			uint8_t * row = reinterpret_cast<uint8_t *>(image.GetRow(y));
+			for (size_t x = 0; x < width; ++x) {
+				int const c = 298 * (yPlane[x + y * width] - 16);
+				int const d = uPlane[x / 2 + y / 2 * chromaWidth] - 128;
+				int const e = vPlane[x / 2 + y / 2 * chromaWidth] - 128;
+				row[3 * x] = Clip((c + 409 * e + 128) >> 8);
+				row[3 * x + 1] = Clip((c - 100 * d - 208 * e + 128) >> 8);
+				row[3 * x + 2] = Clip((c + 516 * d + 128) >> 8);
+			}
+		}
+
+		return image;
+	}
+
+	void EncodeRawYuv420p(RawImage const & image, std::string const & path)
+	{
+		if (image.GetPixFmt() != "rgb24")
+			throw std::runtime_error("yuv420p writer expects rgb24 input: " + path);
+
+		size_t const width = image.GetWidth();
+		size_t const height = image.GetHeight();
+		size_t const chromaWidth = (width + 1) / 2;
+		size_t const chromaHeight = (height + 1) / 2;
+		std::vector<uint8_t> planes(width * height + 2 * chromaWidth * chromaHeight);
+		uint8_t * yPlane = planes.data();
+		uint8_t * uPlane = yPlane + width * height;
+		uint8_t * vPlane = uPlane + chromaWidth * chromaHeight;
+
+		for (size_t y = 0; y < height; ++y) {
+			uint8_t const * row = reinterpret_cast<uint8_t const *>(image.GetRow(y));
+			for (size_t x = 0; x < width; ++x)
+				yPlane[x + y * width] = uint8_t(((66 * row[3 * x] + 129 * row[3 * x + 1] + 25 * row[3 * x + 2] + 128) >> 8) + 16);
+		}
+
+		for (size_t cy = 0; cy < chromaHeight; ++cy)
+			for (size_t cx = 0; cx < chromaWidth; ++cx) {
+				int r = 0;
+				int g = 0;
+				int b = 0;
+				int count = 0;
+				for (size_t y = 2 * cy; y < std::min(2 * cy + 2, height); ++y)
+					for (size_t x = 2 * cx; x < std::min(2 * cx + 2, width); ++x) {
+						uint8_t const * pixel = reinterpret_cast<uint8_t const *>(image.GetRow(y)) + 3 * x;
+						r += pixel[0];
+						g += pixel[1];
+						b += pixel[2];
+						++count;
+					}
+				r /= count;
+				g /= count;
+				b /= count;
+				uPlane[cx + cy * chromaWidth] = uint8_t(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+				vPlane[cx + cy * chromaWidth] = uint8_t(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+			}
+
+		FilePtr file = OpenFile(path, "wb");
+		WriteExactly(file.get(), planes.data(), planes.size(), path);
+		CloseWrittenFile(file, path);
+	}
+
+#ifdef HAVE_LIBJPEG
+	struct JpegError
+	{
+		jpeg_error_mgr m_manager;
+		jmp_buf m_jump;
+	};
+
+	void OnJpegError(j_common_ptr info)
+	{
+		longjmp(reinterpret_cast<JpegError *>(info->err)->m_jump, 1);
+	}
+
+	bool ReadJpegSize(std::string const & path, size_t & width, size_t & height)
+	{
+		FilePtr file = OpenFile(path, "rb");
+
+		jpeg_decompress_struct info;
+		JpegError error;
+		info.err = jpeg_std_error(&error.m_manager);
+		error.m_manager.error_exit = OnJpegError;
+		if (setjmp(error.m_jump)) {
+			jpeg_destroy_decompress(&info);
+			return false;
+		}
+
+		jpeg_create_decompress(&info);
+		jpeg_stdio_src(&info, file.get());
+		jpeg_read_header(&info, TRUE);
+		width = info.image_width;
+		height = info.image_height;
+		jpeg_destroy_decompress(&info);
+		return true;
+	}
+
+	RawImage DecodeJpeg(std::string const & path)
+	{
+		// The image is allocated before setjmp and never reassigned after it, so longjmp can't leave it broken
+		size_t width = 0;
+		size_t height = 0;
+		if (!ReadJpegSize(path, width, height))
+			throw std::runtime_error("Failed to decode JPEG file: " + path);
+		RawImage image("rgb24", width, height);
+
+		FilePtr file = OpenFile(path, "rb");
+
+		jpeg_decompress_struct info;
+		JpegError error;
+		info.err = jpeg_std_error(&error.m_manager);
+		error.m_manager.error_exit = OnJpegError;
+		if (setjmp(error.m_jump)) {
+			jpeg_destroy_decompress(&info);
+			throw std::runtime_error("Failed to decode JPEG file: " + path);
+		}
+
+		jpeg_create_decompress(&info);
+		jpeg_stdio_src(&info, file.get());
+		jpeg_read_header(&info, TRUE);
+		info.out_color_space = JCS_RGB;
+		jpeg_start_decompress(&info);
+		if (info.output_width != width || info.output_height != height) {
+			jpeg_destroy_decompress(&info);
+			throw std::runtime_error("Unexpected JPEG size: " + path);
+		}
+
+		while (info.output_scanline < info.output_height) {
+			JSAMPROW row = reinterpret_cast<JSAMPROW>(image.GetRow(info.output_scanline));
+			jpeg_read_scanlines(&info, &row, 1);
+		}
+
+		jpeg_finish_decompress(&info);
+		jpeg_destroy_decompress(&info);
+		return image;
+	}
+
+	void EncodeJpeg(RawImage const & image, std::string const & path)
+	{
+		if (image.GetPixFmt() != "rgb24" && image.GetPixFmt() != "gray")
+			throw std::runtime_error("JPEG writer supports rgb24 and gray only: " + path);
+
+		FilePtr file = OpenFile(path, "wb");
+
+		jpeg_compress_struct info;
+		JpegError error;
+		info.err = jpeg_std_error(&error.m_manager);
+		error.m_manager.error_exit = OnJpegError;
+		if (setjmp(error.m_jump)) {
+			jpeg_destroy_compress(&info);
+			throw std::runtime_error("Failed to encode JPEG file: " + path);
+		}
+
+		jpeg_create_compress(&info);
+		jpeg_stdio_dest(&info, file.get());
+		info.image_width = image.GetWidth();
+		info.image_height = image.GetHeight();
+		info.input_components = image.GetPixFmt() == "rgb24" ? 3 : 1;
+		info.in_color_space = image.GetPixFmt() == "rgb24" ? JCS_RGB : JCS_GRAYSCALE;
+		jpeg_set_defaults(&info);
+		jpeg_set_quality(&info, 90, TRUE);
+		jpeg_start_compress(&info, TRUE);
+
+		while (info.next_scanline < info.image_height) {
+			JSAMPROW row = reinterpret_cast<JSAMPROW>(const_cast<char *>(image.GetRow(info.next_scanline)));
+			jpeg_write_scanlines(&info, &row, 1);
+		}
+
+		jpeg_finish_compress(&info);
+		jpeg_destroy_compress(&info);
+		CloseWrittenFile(file, path);
+	}
+#endif
+
+#ifdef HAVE_LIBPNG
+	bool ReadPngHeader(std::string const & path, size_t & width, size_t & height, png_byte & colorType)
+	{
+		FilePtr file = OpenFile(path, "rb");
+		uint8_t header[26];
+		if (fread(header, 1, sizeof(header), file.get()) != sizeof(header) || png_sig_cmp(header, 0, 8) != 0)
+			return false;
+
+		// IHDR is always the first chunk: big-endian width and height, bit depth, color type
+		width = size_t(header[16]) << 24 | size_t(header[17]) << 16 | size_t(header[18]) << 8 | header[19];
+		height = size_t(header[20]) << 24 | size_t(header[21]) << 16 | size_t(header[22]) << 8 | header[23];
+		colorType = header[25];
+		return true;
+	}
+
+	RawImage DecodePng(std::string const & path)
+	{
+		// Everything is reduced to 8 bit rgb24 or gray. As for JPEG, all C++ objects are set up before setjmp
+		size_t width = 0;
+		size_t height = 0;
+		png_byte colorType = 0;
+		if (!ReadPngHeader(path, width, height, colorType))
+			throw std::runtime_error("Failed to decode PNG file: " + path);
+
+		bool const gray = (colorType & PNG_COLOR_MASK_COLOR) == 0;
+		RawImage image(gray ? "gray" : "rgb24", width, height);
+		std::vector<png_bytep> rows(height);
+		for (size_t y = 0; y < height; ++y)
+			rows[y] = reinterpret_cast<png_bytep>(image.GetRow(y));
+
+		FilePtr file = OpenFile(path, "rb");
+
+		png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+		png_infop info = png ? png_create_info_struct(png) : nullptr;
+		if (!info) {
+			png_destroy_read_struct(&png, nullptr, nullptr);
+			throw std::runtime_error("Failed to decode PNG file: " + path);
+		}
+
+		if (setjmp(png_jmpbuf(png))) {
+			png_destroy_read_struct(&png, &info, nullptr);
+			throw std::runtime_error("Failed to decode PNG file: " + path);
+		}
+
+		png_init_io(png, file.get());
+		png_read_info(png, info);
+
+		png_set_strip_16(png);
+		png_set_strip_alpha(png);
+		png_set_packing(png);
+		if (colorType == PNG_COLOR_TYPE_PALETTE)
+			png_set_palette_to_rgb(png);
+		if (gray && png_get_bit_depth(png, info) < 8)
+			png_set_expand_gray_1_2_4_to_8(png);
+		png_read_update_info(png, info);
+
+		png_read_image(png, rows.data());
+		png_read_end(png, nullptr);
+		png_destroy_read_struct(&png, &info, nullptr);
+		return image;
+	}
+
+	void EncodePng(RawImage const & image, std::string const & path)
+	{
+		if (image.GetPixFmt() != "rgb24" && image.GetPixFmt() != "gray")
+			throw std::runtime_error("PNG writer supports rgb24 and gray only: " + path);
+
+		FilePtr file = OpenFile(path, "wb");
+
+		png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+		png_infop info = png ? png_create_info_struct(png) : nullptr;
+		if (!info) {
+			png_destroy_write_struct(&png, nullptr);
+			throw std::runtime_error("Failed to encode PNG file: " + path);
+		}
+
+		std::vector<png_bytep> rows(image.GetHeight());
+		for (size_t y = 0; y < image.GetHeight(); ++y)
+			rows[y] = reinterpret_cast<png_bytep>(const_cast<char *>(image.GetRow(y)));
+
+		if (setjmp(png_jmpbuf(png))) {
+			png_destroy_write_struct(&png, &info);
+			throw std::runtime_error("Failed to encode PNG file: " + path);
+		}
+
+		png_init_io(png, file.get());
+		png_set_IHDR(png, info, image.GetWidth(), image.GetHeight(), 8,
+					 image.GetPixFmt() == "rgb24" ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_GRAY,
+					 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+		// Fast compression, the files are mostly intermediate results
+		png_set_compression_level(png, 1);
+		png_write_info(png, info);
+		png_write_image(png, rows.data());
+		png_write_end(png, nullptr);
+		png_destroy_write_struct(&png, &info);
+		CloseWrittenFile(file, path);
+	}
+#endif
+}
+
+ImageFormat GetImageFormat(std::string const & path)
+{
+	size_t const dot = path.rfind('.');
+	if (dot == std::string::npos)
+		return ImageFormat::Unknown;
+
+	std::string extension = path.substr(dot + 1);
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+	if (extension == "bmp")
+		return ImageFormat::Bmp;
+	if (extension == "ppm")
+		return ImageFormat::Ppm;
+	if (extension == "pgm")
+		return ImageFormat::Pgm;
+	if (extension == "rgb")
+		return ImageFormat::RawRgb24;
+	if (extension == "yuv")
+		return ImageFormat::RawYuv420p;
+	if (extension == "jpg" || extension == "jpeg")
+		return ImageFormat::Jpeg;
+	if (extension == "png")
+		return ImageFormat::Png;
+
+	return ImageFormat::Unknown;
+}
+
+bool HasNativeCodec(ImageFormat format)
+{
+	switch (format) {
+	case ImageFormat::Bmp:
+	case ImageFormat::Ppm:
+	case ImageFormat::Pgm:
+	case ImageFormat::RawRgb24:
+	case ImageFormat::RawYuv420p:
+		return true;
+#ifdef HAVE_LIBJPEG
+	case ImageFormat::Jpeg:
+		return true;
+#endif
+#ifdef HAVE_LIBPNG
+	case ImageFormat::Png:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+bool GetImageFileSize(std::string const & path, ImageFormat format, size_t & width, size_t & height)
+{
+	switch (format) {
+	case ImageFormat::Bmp: {
+		FilePtr file = OpenFile(path, "rb");
+		BmpInfo const info = ReadBmpHeader(file.get(), path);
+		width = info.m_width;
+		height = info.m_height;
+		return true;
+	}
+	case ImageFormat::Ppm:
+	case ImageFormat::Pgm: {
+		FilePtr file = OpenFile(path, "rb");
+		char type = 0;
+		ReadPnmHeader(file.get(), path, type, width, height);
+		return true;
+	}
+#ifdef HAVE_LIBJPEG
+	case ImageFormat::Jpeg:
+		return ReadJpegSize(path, width, height);
+#endif
+#ifdef HAVE_LIBPNG
+	case ImageFormat::Png: {
+		png_byte colorType = 0;
+		return ReadPngHeader(path, width, height, colorType);
+	}
+#endif
+	default:
+		return false;
+	}
+}
+
+RawImage DecodeImageFile(std::string const & path, ImageFormat format, size_t width, size_t height)
+{
+	switch (format) {
+	case ImageFormat::Bmp:
+		return DecodeBmp(path);
+	case ImageFormat::Ppm:
+	case ImageFormat::Pgm:
+		return DecodePnm(path);
+	case ImageFormat::RawRgb24:
+		return DecodeRawRgb24(path, width, height);
+	case ImageFormat::RawYuv420p:
+		return DecodeRawYuv420p(path, width, height);
+#ifdef HAVE_LIBJPEG
+	case ImageFormat::Jpeg:
+		return DecodeJpeg(path);
+#endif
+#ifdef HAVE_LIBPNG
+	case ImageFormat::Png:
+		return DecodePng(path);
+#endif
+	default:
+		throw std::runtime_error("No native decoder for: " + path);
+	}
+}
+
+void EncodeImageFile(RawImage const & image, std::string const & path, ImageFormat format)
+{
+	switch (format) {
+	case ImageFormat::Bmp:
+		return EncodeBmp(image, path);
+	case ImageFormat::Ppm:
+	case ImageFormat::Pgm:
+		return EncodePnm(image, path);
+	case ImageFormat::RawRgb24:
+		return EncodeRawRgb24(image, path);
+	case ImageFormat::RawYuv420p:
+		return EncodeRawYuv420p(image, path);
+#ifdef HAVE_LIBJPEG
+	case ImageFormat::Jpeg:
+		return EncodeJpeg(image, path);
+#endif
+#ifdef HAVE_LIBPNG
+	case ImageFormat::Png:
+		return EncodePng(image, path);
+#endif
+	default:
+		throw std::runtime_error("No native encoder for: " + path);
+	}
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+
+#include "imgtools.h"
+
+enum class ImageFormat
+{
+	Unknown,
+	Bmp,
+	Ppm,
+	Pgm,
+	RawRgb24,
+	RawYuv420p,
+	Jpeg,
+	Png
+};
+
+// Guesses the format from the file extension (.bmp, .ppm, .pgm, .rgb, .yuv, .jpg/.jpeg, .png)
+ImageFormat GetImageFormat(std::string const & path);
+// Jpeg and Png are only available when built with libjpeg/libpng
+bool HasNativeCodec(ImageFormat format);
+
+// Decodes the file in-process, straight into the image rows. Raw formats have no header,
+// so width and height are required for them; yuv420p is converted to rgb24 on the fly.
+RawImage DecodeImageFile(std::string const & path, ImageFormat format, size_t width = 0, size_t height = 0);
+void EncodeImageFile(RawImage const & image, std::string const & path, ImageFormat format);
+
+// Reads the size from the file header, returns false for raw formats
+bool GetImageFileSize(std::string const & path, ImageFormat format, size_t & width, size_t & height);
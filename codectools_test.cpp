@@ -0,0 +1,128 @@
+#include "codectools.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+
+#include "testtools.h"
+
+namespace {
+	size_t const g_width = 37; // Odd, so rows need padding and the chroma planes round up
+	size_t const g_height = 21;
+
+	// Smooth, so the lossy formats stay close to it
+	RawImage MakeGradient(std::string const & pixFmt)
+	{
+		RawImage image(pixFmt, g_width, g_height);
+		size_t const channels = pixFmt == "gray" ? 1 : 3;
+		for (size_t y = 0; y < g_height; ++y) {
+			uint8_t * row = reinterpret_cast<uint8_t *>(image.GetRow(y));
+			for (size_t x = 0; x < g_width; ++x)
+				for (size_t c = 0; c < channels; ++c)
+					row[channels * x + c] = uint8_t(40 + 4 * x + 3 * y + 20 * c);
+		}
+		return image;
+	}
+
+	double GetMeanDifference(RawImage const & a, RawImage const & b)
+	{
+		double sum = 0.0;
+		for (size_t y = 0; y < a.GetHeight(); ++y) {
+			uint8_t const * rowA = reinterpret_cast<uint8_t const *>(a.GetRow(y));
+			uint8_t const * rowB = reinterpret_cast<uint8_t const *>(b.GetRow(y));
+			for (size_t x = 0; x < a.GetRowSize(); ++x)
+				sum += abs(rowA[x] - rowB[x]);
+		}
+		return sum / (a.GetHeight() * a.GetRowSize());
+	}
+
+	// Encodes and decodes the image, the result has to be within maxDifference per byte on average
+	void CheckRoundTrip(RawImage const & image, std::string const & extension, std::string const & decodedPixFmt,
+						double maxDifference)
+	{
+		std::string const path = "codectools_test." + extension;
+		ImageFormat const format = GetImageFormat(path);
+		EncodeImageFile(image, path, format);
+
+		size_t width = 0;
+		size_t height = 0;
+		bool const hasSize = GetImageFileSize(path, format, width, height);
+		CHECK(hasSize == (format != ImageFormat::RawRgb24 && format != ImageFormat::RawYuv420p));
+		CHECK(!hasSize || (width == g_width && height == g_height));
+
+		RawImage const decoded = DecodeImageFile(path, format, g_width, g_height);
+		remove(path.c_str());
+		CHECK(decoded.GetPixFmt() == decodedPixFmt);
+		CHECK(decoded.GetWidth() == g_width && decoded.GetHeight() == g_height);
+		if (decoded.GetPixFmt() == decodedPixFmt)
+			CHECK(GetMeanDifference(image, decoded) <= maxDifference);
+	}
+
+	TEST(LosslessFormatsRoundTrip)
+	{
+		RawImage const rgb = MakeGradient("rgb24");
+		CheckRoundTrip(rgb, "bmp", "rgb24", 0.0);
+		CheckRoundTrip(rgb, "ppm", "rgb24", 0.0);
+		CheckRoundTrip(rgb, "rgb", "rgb24", 0.0);
+		CheckRoundTrip(MakeGradient("gray"), "pgm", "gray", 0.0);
+		if (HasNativeCodec(ImageFormat::Png)) {
+			CheckRoundTrip(rgb, "png", "rgb24", 0.0);
+			CheckRoundTrip(MakeGradient("gray"), "png", "gray", 0.0);
+		}
+	}
+
+	TEST(LossyFormatsRoundTrip)
+	{
+		RawImage const rgb = MakeGradient("rgb24");
+		// yuv420p halves the chroma resolution
+		CheckRoundTrip(rgb, "yuv", "rgb24", 3.0);
+		if (HasNativeCodec(ImageFormat::Jpeg))
+			CheckRoundTrip(rgb, "jpg", "rgb24", 3.0);
+	}
+
+	TEST(FormatsComeFromTheExtension)
+	{
+		CHECK(GetImageFormat("a.bmp") == ImageFormat::Bmp);
+		CHECK(GetImageFormat("dir.jpg/a.JPEG") == ImageFormat::Jpeg);
+		CHECK(GetImageFormat("a.yuv") == ImageFormat::RawYuv420p);
+		CHECK(GetImageFormat("a.mkv") == ImageFormat::Unknown);
+		CHECK(GetImageFormat("bmp") == ImageFormat::Unknown);
+	}
+
+	TEST(EncodersRejectWhatTheyCantWrite)
+	{
+		RawImage const gray = MakeGradient("gray");
+		CHECK_THROWS(EncodeImageFile(gray, "codectools_test.bmp", ImageFormat::Bmp));
+		CHECK_THROWS(EncodeImageFile(gray, "codectools_test.rgb", ImageFormat::RawRgb24));
+		CHECK_THROWS(EncodeImageFile(gray, "codectools_test.yuv", ImageFormat::RawYuv420p));
+		RawImage const rgb = MakeGradient("rgb24");
+		CHECK_THROWS(EncodeImageFile(rgb, "no/such/dir/codectools_test.ppm", ImageFormat::Ppm));
+
+		// The image fits in the stdio buffer, so the write only fails when the file is flushed
+		for (ImageFormat const format : {ImageFormat::Bmp, ImageFormat::Ppm, ImageFormat::RawRgb24, ImageFormat::RawYuv420p})
+			CHECK_THROWS(EncodeImageFile(rgb, "/dev/full", format));
+	}
+
+	TEST(DecodersRejectBrokenFiles)
+	{
+		CHECK_THROWS(DecodeImageFile("codectools_test_missing.bmp", ImageFormat::Bmp));
+
+		// A PPM cut off in the middle of the pixels
+		std::string const path = "codectools_test_cut.ppm";
+		FILE * file = fopen(path.c_str(), "wb");
+		CHECK(file);
+		if (file) {
+			fputs("P6\n4 4\n255\nabc", file);
+			fclose(file);
+		}
+		CHECK_THROWS(DecodeImageFile(path, ImageFormat::Ppm));
+		remove(path.c_str());
+	}
+}
+
+int main()
+{
+	return RunTests();
+}
@@ -0,0 +1,301 @@
+#include "contexttools.h"
+
+#include <string.h>
+
+#include <stdexcept>
+#include <vector>
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#ifdef HAVE_EGL
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#ifdef HAVE_OSMESA
+#include <GL/osmesa.h>
+#endif
+
+namespace {
+	class WindowContext : public GLContext
+	{
+	public:
+		WindowContext(size_t width, size_t height, std::string const & title)
+		{
+			if (!glfwInit())
+				throw std::runtime_error("Failed to initialize GLFW");
+
+			glfwWindowHint(GLFW_SAMPLES, 4); // 4x antialiasing
+			glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3); // We want OpenGL 3.3
+			glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+			glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // To make MacOS happy; should not be needed
+			glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE); // We don't want the old OpenGL
+#ifdef ENABLE_TRACING
+			glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GL_TRUE); // For the KHR_debug messages in the trace
+#endif
+
+			m_window = glfwCreateWindow(width, height, title.c_str(), nullptr, nullptr);
+			if (m_window == nullptr) {
+				glfwTerminate();
+				throw std::runtime_error("Failed to open GLFW window. If you have an Intel GPU, they are not 3.3 compatible. Try the 2.1 version of the tutorials.");
+			}
+
+			glfwMakeContextCurrent(m_window);
+			glewExperimental = true; // Needed in core profile
+			if (glewInit() != GLEW_OK) {
+				glfwTerminate();
+				throw std::runtime_error("Failed to initialize GLEW");
+			}
+
+			glfwSetInputMode(m_window, GLFW_STICKY_KEYS, GL_TRUE);
+		}
+
+		~WindowContext() override
+		{
+			glfwTerminate();
+		}
+
+		std::string GetBackendName() const override
+		{
+			return "glfw";
+		}
+
+		bool IsHeadless() const override
+		{
+			return false;
+		}
+
+		void SwapBuffers() override
+		{
+			glfwSwapBuffers(m_window);
+		}
+
+		bool ShouldClose() override
+		{
+			glfwPollEvents();
+			return glfwGetKey(m_window, GLFW_KEY_ESCAPE) == GLFW_PRESS || glfwWindowShouldClose(m_window) != 0;
+		}
+
+	private:
+		GLFWwindow * m_window = nullptr;
+	};
+
+#if defined(HAVE_EGL) || defined(HAVE_OSMESA)
+	// glewInit() also sets up GLX and fails without an X display, the GL entry points
+	// themselves only need a current context
+	void InitHeadlessGlew()
+	{
+		glewExperimental = true;
+		if (glewContextInit() != GLEW_OK)
+			throw std::runtime_error("Failed to initialize GLEW");
+	}
+#endif
+
+#ifdef HAVE_EGL
+	bool HasExtension(char const * extensions, char const * name)
+	{
+		if (!extensions)
+			return false;
+
+		size_t const length = strlen(name);
+		for (char const * pos = strstr(extensions, name); pos; pos = strstr(pos + length, name))
+			if ((pos == extensions || pos[-1] == ' ') && (pos[length] == ' ' || pos[length] == '\0'))
+				return true;
+		return false;
+	}
+
+	// Mesa's surfaceless platform first, then the first device (NVIDIA's headless path)
+	EGLDisplay GetHeadlessDisplay()
+	{
+		char const * extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+		auto getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+				eglGetProcAddress("eglGetPlatformDisplayEXT"));
+
+		if (getPlatformDisplay && HasExtension(extensions, "EGL_MESA_platform_surfaceless"))
+			return getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+
+		auto queryDevices = reinterpret_cast<PFNEGLQUERYDEVICESEXTPROC>(eglGetProcAddress("eglQueryDevicesEXT"));
+		if (getPlatformDisplay && queryDevices && HasExtension(extensions, "EGL_EXT_platform_device")) {
+			EGLDeviceEXT device = nullptr;
+			EGLint deviceCount = 0;
+			if (queryDevices(1, &device, &deviceCount) && deviceCount > 0)
+				return getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, device, nullptr);
+		}
+
+		return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+
+	class EglContext : public GLContext
+	{
+	public:
+		EglContext()
+		{
+			m_display = GetHeadlessDisplay();
+			if (m_display == EGL_NO_DISPLAY || !eglInitialize(m_display, nullptr, nullptr))
+				throw std::runtime_error("No EGL display");
+
+			try {
+				if (!HasExtension(eglQueryString(m_display, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context"))
+					throw std::runtime_error("EGL_KHR_surfaceless_context is not supported");
+				if (!eglBindAPI(EGL_OPENGL_API))
+					throw std::runtime_error("Desktop OpenGL is not supported by EGL");
+
+				EGLint const configAttribs[] = {
+					EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+					EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+					EGL_NONE};
+				EGLConfig config = nullptr;
+				EGLint configCount = 0;
+				if (!eglChooseConfig(m_display, configAttribs, &config, 1, &configCount) || configCount == 0)
+					config = EGL_NO_CONFIG_KHR;
+
+				EGLint const contextAttribs[] = {
+					EGL_CONTEXT_MAJOR_VERSION, 3,
+					EGL_CONTEXT_MINOR_VERSION, 3,
+					EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+#ifdef ENABLE_TRACING
+					EGL_CONTEXT_OPENGL_DEBUG, EGL_TRUE,
+#endif
+					EGL_NONE};
+				m_context = eglCreateContext(m_display, config, EGL_NO_CONTEXT, contextAttribs);
+				if (m_context == EGL_NO_CONTEXT)
+					throw std::runtime_error("Failed to create EGL context");
+				if (!eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, m_context))
+					throw std::runtime_error("Failed to make EGL context current");
+
+				InitHeadlessGlew();
+			}
+			catch (...) {
+				Release();
+				throw;
+			}
+		}
+
+		~EglContext() override
+		{
+			Release();
+		}
+
+		std::string GetBackendName() const override
+		{
+			return "egl";
+		}
+
+		bool IsHeadless() const override
+		{
+			return true;
+		}
+
+	private:
+		void Release()
+		{
+			eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+			if (m_context != EGL_NO_CONTEXT)
+				eglDestroyContext(m_display, m_context);
+			eglTerminate(m_display);
+		}
+
+	private:
+		EGLDisplay m_display = EGL_NO_DISPLAY;
+		EGLContext m_context = EGL_NO_CONTEXT;
+	};
+#endif
+
+#ifdef HAVE_OSMESA
+	// Everything is drawn into FBOs, the default framebuffer only has to exist
+	GLsizei const g_osMesaBufferSize = 16;
+
+	class OsMesaContext : public GLContext
+	{
+	public:
+		OsMesaContext()
+			: m_buffer(4 * g_osMesaBufferSize * g_osMesaBufferSize)
+		{
+			int const attribs[] = {
+				OSMESA_FORMAT, OSMESA_RGBA,
+				OSMESA_DEPTH_BITS, 24,
+				OSMESA_PROFILE, OSMESA_CORE_PROFILE,
+				OSMESA_CONTEXT_MAJOR_VERSION, 3,
+				OSMESA_CONTEXT_MINOR_VERSION, 3,
+				0};
+			m_context = OSMesaCreateContextAttribs(attribs, nullptr);
+			if (!m_context)
+				throw std::runtime_error("Failed to create OSMesa context");
+			if (!OSMesaMakeCurrent(m_context, m_buffer.data(), GL_UNSIGNED_BYTE, g_osMesaBufferSize, g_osMesaBufferSize)) {
+				OSMesaDestroyContext(m_context);
+				throw std::runtime_error("Failed to make OSMesa context current");
+			}
+
+			try {
+				InitHeadlessGlew();
+			}
+			catch (...) {
+				OSMesaDestroyContext(m_context);
+				throw;
+			}
+		}
+
+		~OsMesaContext() override
+		{
+			OSMesaDestroyContext(m_context);
+		}
+
+		std::string GetBackendName() const override
+		{
+			return "osmesa";
+		}
+
+		bool IsHeadless() const override
+		{
+			return true;
+		}
+
+	private:
+		std::vector<unsigned char> m_buffer;
+		OSMesaContext m_context = nullptr;
+	};
+#endif
+}
+
+GLContext::~GLContext()
+{}
+
+void GLContext::SwapBuffers()
+{}
+
+bool GLContext::ShouldClose()
+{
+	return false;
+}
+
+std::unique_ptr<GLContext> CreateWindowContext(size_t width, size_t height, std::string const & title)
+{
+	return std::unique_ptr<GLContext>(new WindowContext(width, height, title));
+}
+
+std::unique_ptr<GLContext> CreateHeadlessContext()
+{
+	std::string errors;
+
+#ifdef HAVE_EGL
+	try {
+		return std::unique_ptr<GLContext>(new EglContext());
+	}
+	catch (std::exception const & e) {
+		errors += std::string(" egl: ") + e.what() + ";";
+	}
+#endif
+
+#ifdef HAVE_OSMESA
+	try {
+		return std::unique_ptr<GLContext>(new OsMesaContext());
+	}
+	catch (std::exception const & e) {
+		errors += std::string(" osmesa: ") + e.what() + ";";
+	}
+#endif
+
+	throw std::runtime_error("No headless OpenGL backend available:" + (errors.empty() ? std::string(" built without EGL and OSMesa") : errors));
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+// OpenGL 3.3 core context with the GL entry points loaded through GLEW.
+// Windowed contexts come from GLFW. Headless ones need no display and can only render into
+// framebuffer objects: surfaceless EGL is tried first, then OSMesa (llvmpipe) if built with it.
+class GLContext
+{
+public:
+	virtual ~GLContext();
+
+	virtual std::string GetBackendName() const = 0;
+	virtual bool IsHeadless() const = 0;
+
+	// Both are no-ops for headless contexts, which never ask to be closed
+	virtual void SwapBuffers();
+	virtual bool ShouldClose();
+};
+
+std::unique_ptr<GLContext> CreateWindowContext(size_t width, size_t height, std::string const & title);
+std::unique_ptr<GLContext> CreateHeadlessContext();
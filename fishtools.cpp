@@ -0,0 +1,296 @@
+#include "fishtools.h"
+
+#include <algorithm>
+#include <cmath>
+
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/gtx/transform.hpp>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FISH_X86
+#define FISH_AVX2 __attribute__((target("avx2,fma")))
+#endif
+
+namespace {
+	float const g_pi = 3.14159265358979f;
+	float const g_twoOverPi = 0.636619772367581f;
+	// pi / 2 split so that j * hi and j * mid are exact for the small quadrant counts used here
+	float const g_piOver2Hi = 1.5703125f;
+	float const g_piOver2Mid = 4.837512969970703125e-4f;
+	float const g_piOver2Lo = 7.54978995489188216e-8f;
+	float const g_tanPiOver8 = 0.414213562373095f;
+	float const g_outsideLens = 2.0f;
+	float const g_maxRadius = 0.5001f;
+
+	// Cephes sinf/cosf: reduction to [-pi/4, pi/4] by quadrant, then minimax polynomials
+	void SinCosPoly(float x, float & s, float & c)
+	{
+		float const j = std::floor(x * g_twoOverPi + 0.5f);
+		float const r = ((x - j * g_piOver2Hi) - j * g_piOver2Mid) - j * g_piOver2Lo;
+		float const z = r * r;
+
+		float const sp = r + r * z * ((-1.9515295891e-4f * z + 8.3321608736e-3f) * z - 1.6666654611e-1f);
+		float const cp = 1.0f - 0.5f * z + z * z * ((2.443315711809948e-5f * z - 1.388731625493765e-3f) * z + 4.166664568298827e-2f);
+
+		int const q = int(j);
+		s = q & 1 ? cp : sp;
+		c = q & 1 ? sp : cp;
+		if (q & 2)
+			s = -s;
+		if ((q + 1) & 2)
+			c = -c;
+	}
+
+	// Cephes atanf after folding the ratio into [0, tan(pi/8)]. Only y >= 0 is needed: the result is in [0, pi]
+	float Atan2Poly(float y, float x)
+	{
+		float const ax = std::fabs(x);
+		float const a = std::min(y, ax) / std::max(std::max(y, ax), 1e-30f);
+
+		bool const folded = a > g_tanPiOver8;
+		float const t = folded ? (a - 1.0f) / (a + 1.0f) : a;
+		float const z = t * t;
+		float angle = (folded ? g_pi / 4 : 0.0f) +
+				t + t * z * (((8.05374449538e-2f * z - 1.38776856032e-1f) * z + 1.99777106478e-1f) * z - 3.33329491539e-1f);
+
+		if (y > ax)
+			angle = g_pi / 2 - angle;
+		if (x < 0.0f)
+			angle = g_pi - angle;
+		return angle;
+	}
+
+	void Sphere2Fish2Scalar(FishProjection const & projection, float const * xs, float const * ys, size_t count,
+							float * us, float * vs)
+	{
+		float const * m = projection.m_rotation;
+		for (size_t i = 0; i < count; ++i) {
+			float sinLon, cosLon, sinLat, cosLat;
+			SinCosPoly(g_pi * xs[i] + projection.m_longitudeOffset, sinLon, cosLon);
+			SinCosPoly(g_pi / -2 * ys[i], sinLat, cosLat);
+
+			float const px = cosLat * sinLon;
+			float const py = cosLat * cosLon;
+			float const pz = sinLat;
+			float const vx = m[0] * px + m[1] * py + m[2] * pz;
+			float const vy = m[3] * px + m[4] * py + m[5] * pz;
+			float const vz = m[6] * px + m[7] * py + m[8] * pz;
+
+			// r * cos(theta) and r * sin(theta) are r * vx / rho and r * vz / rho, no need for theta itself
+			float const rho = std::sqrt(vx * vx + vz * vz);
+			float const r = Atan2Poly(rho, vy) * projection.m_invFov;
+			if (r > g_maxRadius) {
+				us[i] = g_outsideLens;
+				vs[i] = g_outsideLens;
+				continue;
+			}
+
+			// phi / rho tends to 1 at the lens axis
+			float const k = rho > 0.0f ? r / rho : projection.m_invFov;
+			us[i] = k * vx * projection.m_ratio.x + projection.m_center.x;
+			vs[i] = k * vz * projection.m_ratio.y + projection.m_center.y;
+		}
+	}
+
+#ifdef FISH_X86
+	FISH_AVX2 void SinCosAvx(__m256 x, __m256 & s, __m256 & c)
+	{
+		__m256 const j = _mm256_floor_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(g_twoOverPi), _mm256_set1_ps(0.5f)));
+		__m256 r = _mm256_fnmadd_ps(j, _mm256_set1_ps(g_piOver2Hi), x);
+		r = _mm256_fnmadd_ps(j, _mm256_set1_ps(g_piOver2Mid), r);
+		r = _mm256_fnmadd_ps(j, _mm256_set1_ps(g_piOver2Lo), r);
+		__m256 const z = _mm256_mul_ps(r, r);
+
+		__m256 sp = _mm256_fmadd_ps(_mm256_set1_ps(-1.9515295891e-4f), z, _mm256_set1_ps(8.3321608736e-3f));
+		sp = _mm256_fmadd_ps(sp, z, _mm256_set1_ps(-1.6666654611e-1f));
+		sp = _mm256_fmadd_ps(_mm256_mul_ps(r, z), sp, r);
+
+		__m256 cp = _mm256_fmadd_ps(_mm256_set1_ps(2.443315711809948e-5f), z, _mm256_set1_ps(-1.388731625493765e-3f));
+		cp = _mm256_fmadd_ps(cp, z, _mm256_set1_ps(4.166664568298827e-2f));
+		cp = _mm256_fmadd_ps(_mm256_mul_ps(z, z), cp, _mm256_fnmadd_ps(_mm256_set1_ps(0.5f), z, _mm256_set1_ps(1.0f)));
+
+		__m256i const q = _mm256_cvtps_epi32(j);
+		__m256 const swap = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(q, _mm256_set1_epi32(1)), _mm256_set1_epi32(1)));
+		__m256 const sinSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(q, _mm256_set1_epi32(2)), 30));
+		__m256 const cosSign = _mm256_castsi256_ps(_mm256_slli_epi32(
+				_mm256_and_si256(_mm256_add_epi32(q, _mm256_set1_epi32(1)), _mm256_set1_epi32(2)), 30));
+
+		s = _mm256_xor_ps(_mm256_blendv_ps(sp, cp, swap), sinSign);
+		c = _mm256_xor_ps(_mm256_blendv_ps(cp, sp, swap), cosSign);
+	}
+
+	FISH_AVX2 __m256 Atan2Avx(__m256 y, __m256 x)
+	{
+		__m256 const ax = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), x);
+		__m256 const a = _mm256_div_ps(_mm256_min_ps(y, ax), _mm256_max_ps(_mm256_max_ps(y, ax), _mm256_set1_ps(1e-30f)));
+
+		__m256 const folded = _mm256_cmp_ps(a, _mm256_set1_ps(g_tanPiOver8), _CMP_GT_OQ);
+		__m256 const one = _mm256_set1_ps(1.0f);
+		__m256 const t = _mm256_blendv_ps(a, _mm256_div_ps(_mm256_sub_ps(a, one), _mm256_add_ps(a, one)), folded);
+		__m256 const z = _mm256_mul_ps(t, t);
+
+		__m256 p = _mm256_fmadd_ps(_mm256_set1_ps(8.05374449538e-2f), z, _mm256_set1_ps(-1.38776856032e-1f));
+		p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(1.99777106478e-1f));
+		p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(-3.33329491539e-1f));
+		p = _mm256_fmadd_ps(_mm256_mul_ps(t, z), p, t);
+		__m256 angle = _mm256_add_ps(_mm256_and_ps(folded, _mm256_set1_ps(g_pi / 4)), p);
+
+		angle = _mm256_blendv_ps(angle, _mm256_sub_ps(_mm256_set1_ps(g_pi / 2), angle), _mm256_cmp_ps(y, ax, _CMP_GT_OQ));
+		return _mm256_blendv_ps(angle, _mm256_sub_ps(_mm256_set1_ps(g_pi), angle), x);
+	}
+
+	FISH_AVX2 void Sphere2Fish2Avx2(FishProjection const & projection, float const * xs, float const * ys, size_t count,
+									float * us, float * vs)
+	{
+		__m256 m[9];
+		for (size_t i = 0; i < 9; ++i)
+			m[i] = _mm256_set1_ps(projection.m_rotation[i]);
+
+		__m256 const pi = _mm256_set1_ps(g_pi);
+		__m256 const minusHalfPi = _mm256_set1_ps(g_pi / -2);
+		__m256 const longitudeOffset = _mm256_set1_ps(projection.m_longitudeOffset);
+		__m256 const invFov = _mm256_set1_ps(projection.m_invFov);
+		__m256 const ratioX = _mm256_set1_ps(projection.m_ratio.x);
+		__m256 const ratioY = _mm256_set1_ps(projection.m_ratio.y);
+		__m256 const centerX = _mm256_set1_ps(projection.m_center.x);
+		__m256 const centerY = _mm256_set1_ps(projection.m_center.y);
+		__m256 const outsideLens = _mm256_set1_ps(g_outsideLens);
+		__m256 const maxRadius = _mm256_set1_ps(g_maxRadius);
+
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m256 sinLon, cosLon, sinLat, cosLat;
+			SinCosAvx(_mm256_fmadd_ps(pi, _mm256_loadu_ps(xs + i), longitudeOffset), sinLon, cosLon);
+			SinCosAvx(_mm256_mul_ps(minusHalfPi, _mm256_loadu_ps(ys + i)), sinLat, cosLat);
+
+			__m256 const px = _mm256_mul_ps(cosLat, sinLon);
+			__m256 const py = _mm256_mul_ps(cosLat, cosLon);
+			__m256 const pz = sinLat;
+			__m256 const vx = _mm256_fmadd_ps(m[0], px, _mm256_fmadd_ps(m[1], py, _mm256_mul_ps(m[2], pz)));
+			__m256 const vy = _mm256_fmadd_ps(m[3], px, _mm256_fmadd_ps(m[4], py, _mm256_mul_ps(m[5], pz)));
+			__m256 const vz = _mm256_fmadd_ps(m[6], px, _mm256_fmadd_ps(m[7], py, _mm256_mul_ps(m[8], pz)));
+
+			__m256 const rho = _mm256_sqrt_ps(_mm256_fmadd_ps(vx, vx, _mm256_mul_ps(vz, vz)));
+			__m256 const r = _mm256_mul_ps(Atan2Avx(rho, vy), invFov);
+			__m256 const k = _mm256_blendv_ps(invFov, _mm256_div_ps(r, rho),
+											  _mm256_cmp_ps(rho, _mm256_setzero_ps(), _CMP_GT_OQ));
+			__m256 const outside = _mm256_cmp_ps(r, maxRadius, _CMP_GT_OQ);
+
+			__m256 const u = _mm256_fmadd_ps(_mm256_mul_ps(k, vx), ratioX, centerX);
+			__m256 const v = _mm256_fmadd_ps(_mm256_mul_ps(k, vz), ratioY, centerY);
+			_mm256_storeu_ps(us + i, _mm256_blendv_ps(u, outsideLens, outside));
+			_mm256_storeu_ps(vs + i, _mm256_blendv_ps(v, outsideLens, outside));
+		}
+
+		Sphere2Fish2Scalar(projection, xs + i, ys + i, count - i, us + i, vs + i);
+	}
+#endif
+}
+
+glm::vec2 sphere2fish(glm::vec2 coord, FishInfo const & fishInfo)
+{
+	const float longitude = glm::two_pi<float>() * (coord.x / 2 - 0.5f);
+	const float latitude  = glm::pi<float>() * coord.y / 2;
+
+	const glm::vec3 vec3d = {
+		glm::cos(latitude) * glm::sin(longitude),
+		glm::cos(latitude) * glm::cos(longitude),
+		glm::sin(latitude)
+	};
+
+	const float theta = glm::atan(vec3d.z, vec3d.x);
+	const float phi = glm::atan(glm::sqrt(vec3d.x * vec3d.x + vec3d.z * vec3d.z), vec3d.y);
+	const float r = phi / fishInfo.m_fov;
+
+	if (r > 0.505f)
+		return glm::vec2(2.0f, 2.0f);
+
+	const glm::vec2 fishCoord {
+		r * glm::cos(theta) * fishInfo.m_ratio.x,
+		r * glm::sin(theta) * fishInfo.m_ratio.y
+	};
+
+	return fishCoord + fishInfo.m_center;
+}
+
+glm::vec2 sphere2fish2(glm::vec2 const & coord, FishInfo const & fishInfo)
+{
+	/*
+	 *
+	 * Z   Y
+	 * |  /
+	 * | /
+	 * |/
+	 * ------- X
+	 *
+	 */
+
+	const float longitude = glm::two_pi<float>() * coord.x / 2.0f + fishInfo.m_rotation.z;
+	const float latitude  = glm::pi<float>() * coord.y / -2.0f;
+
+	glm::mat4 rotateMat = glm::rotate(glm::mat4(1.0f), fishInfo.m_rotation.y, glm::vec3(0.0f, 1.0f, 0.0f));
+	rotateMat = glm::rotate(rotateMat, fishInfo.m_rotation.x, glm::vec3(1.0f, 0.0f, 0.0f));
+
+	const glm::vec3 vec3d = rotateMat * glm::vec4(
+		glm::cos(latitude) * glm::sin(longitude),
+		glm::cos(latitude) * glm::cos(longitude),
+		glm::sin(latitude),
+		1
+	);
+
+	const float theta = glm::atan(vec3d.z, vec3d.x);
+	const float phi = glm::atan(glm::sqrt(vec3d.x * vec3d.x + vec3d.z * vec3d.z), vec3d.y);
+	const float r = phi / fishInfo.m_fov;
+
+	if (r > 0.5001f)
+		return glm::vec2(2.0f, 2.0f);
+
+	const glm::vec2 fishCoord {
+		r * glm::cos(theta) * fishInfo.m_ratio.x,
+		r * glm::sin(theta) * fishInfo.m_ratio.y
+	};
+
+	return fishCoord + fishInfo.m_center;
+}
+
+FishProjection MakeFishProjection(FishInfo const & fishInfo)
+{
+	glm::mat4 rotateMat = glm::rotate(glm::mat4(1.0f), fishInfo.m_rotation.y, glm::vec3(0.0f, 1.0f, 0.0f));
+	rotateMat = glm::rotate(rotateMat, fishInfo.m_rotation.x, glm::vec3(1.0f, 0.0f, 0.0f));
+
+	FishProjection projection;
+	for (size_t row = 0; row < 3; ++row)
+		for (size_t column = 0; column < 3; ++column)
+			projection.m_rotation[3 * row + column] = rotateMat[column][row];
+	projection.m_longitudeOffset = fishInfo.m_rotation.z;
+	projection.m_invFov = 1.0f / fishInfo.m_fov;
+	projection.m_center = fishInfo.m_center;
+	projection.m_ratio = fishInfo.m_ratio;
+	return projection;
+}
+
+void sphere2fish2Batch(FishProjection const & projection, float const * xs, float const * ys, size_t count,
+					   float * us, float * vs)
+{
+#ifdef FISH_X86
+	static bool const hasAvx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	if (hasAvx2) {
+		Sphere2Fish2Avx2(projection, xs, ys, count, us, vs);
+		return;
+	}
+#endif
+	Sphere2Fish2Scalar(projection, xs, ys, count, us, vs);
+}
+
+void HashFishInfo(Hasher & hasher, FishInfo const & fishInfo)
+{
+	hasher.Add(fishInfo.m_center).Add(fishInfo.m_rotation).Add(fishInfo.m_fov).Add(fishInfo.m_ratio);
+}
+
+void HashPhotometricInfo(Hasher & hasher, PhotometricInfo const & photometricInfo)
+{
+	hasher.Add(photometricInfo.m_gain).Add(photometricInfo.m_whiteBalance).Add(photometricInfo.m_vignetting);
+}
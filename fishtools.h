@@ -0,0 +1,50 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include "cachetools.h"
+
+// Corrections of what a lens records, applied when stitching. A sample at normalized radius r
+// (0 in the center, 1 at the rim) is multiplied by m_gain * m_whiteBalance[c] / vignetting(r),
+// vignetting(r) = 1 + k1 r^2 + k2 r^4 + k3 r^6 with m_vignetting = (k1, k2, k3). The defaults change nothing
+struct PhotometricInfo
+{
+	float m_gain = 1.0f;
+	glm::vec3 m_whiteBalance = glm::vec3(1.0f);
+	glm::vec3 m_vignetting = glm::vec3(0.0f);
+};
+
+struct FishInfo
+{
+	glm::vec2 m_center;
+	glm::vec3 m_rotation;
+	float m_fov;
+	glm::vec2 m_ratio;
+	PhotometricInfo m_photometric;
+};
+
+glm::vec2 sphere2fish(glm::vec2 coord, FishInfo const & fishInfo);
+glm::vec2 sphere2fish2(glm::vec2 const & coord, FishInfo const & fishInfo);
+
+// Everything sphere2fish2 derives from FishInfo alone, computed once per lens
+struct FishProjection
+{
+	float m_rotation[9]; // Row-major 3x3, same rotation as sphere2fish2 builds
+	float m_longitudeOffset;
+	float m_invFov;
+	glm::vec2 m_center;
+	glm::vec2 m_ratio;
+};
+
+FishProjection MakeFishProjection(FishInfo const & fishInfo);
+
+// sphere2fish2 for count points at once, coordinates and results are separate x/y and u/v arrays.
+// sin, cos and atan2 are polynomial approximations, evaluated with AVX2 when the CPU has it.
+// UV error against a double precision evaluation is under 2e-7, the same as sphere2fish2's own rounding.
+// Points outside the lens get (2, 2) the same way, a point right at the lens edge may land on either side
+void sphere2fish2Batch(FishProjection const & projection, float const * xs, float const * ys, size_t count,
+					   float * us, float * vs);
+
+// Geometry only, whatever depends on the photometric calibration hashes it separately
+void HashFishInfo(Hasher & hasher, FishInfo const & fishInfo);
+void HashPhotometricInfo(Hasher & hasher, PhotometricInfo const & photometricInfo);
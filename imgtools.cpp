@@ -1,18 +1,182 @@
 #include "imgtools.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
 
 #include <fstream>
+#include <stdexcept>
+
+#include "codectools.h"
+#include "tracetools.h"
+
+namespace {
+	size_t const g_alignment = 64;
+
+	size_t GreatestCommonDivisor(size_t a, size_t b)
+	{
+		while (b != 0) {
+			size_t const rest = a % b;
+			a = b;
+			b = rest;
+		}
+		return a;
+	}
+
+	// Waits for ffmpeg, throws message with its exit code unless it succeeded
+	void CloseFfmpegPipe(FILE * pipe, std::string const & message)
+	{
+		int const status = pclose(pipe);
+		if (status == -1)
+			throw std::runtime_error(message + ", can't get the exit code of ffmpeg");
+		if (!WIFEXITED(status))
+			throw std::runtime_error(message + ", ffmpeg was terminated");
+		if (WEXITSTATUS(status) != 0)
+			throw std::runtime_error(message + ", ffmpeg exit code " + std::to_string(WEXITSTATUS(status)));
+	}
+
+	RawImage GrayToRgb(RawImage const & gray)
+	{
+		RawImage image("rgb24", gray.GetWidth(), gray.GetHeight());
+		for (size_t y = 0; y < gray.GetHeight(); ++y) {
+			char const * src = gray.GetRow(y);
+			char * dst = image.GetRow(y);
+			for (size_t x = 0; x < gray.GetWidth(); ++x)
+				dst[3 * x] = dst[3 * x + 1] = dst[3 * x + 2] = src[x];
+		}
+		return image;
+	}
+
+	std::shared_ptr<void> AllocateAligned(size_t size)
+	{
+		void * data = nullptr;
+		if (posix_memalign(&data, g_alignment, size > 0 ? size : g_alignment) != 0)
+			throw std::bad_alloc();
+		return std::shared_ptr<void>(data, free);
+	}
+}
+
+size_t GetPixelSize(std::string const & pixFmt)
+{
+	if (pixFmt == "rgb24")
+		return 3;
+	if (pixFmt == "gray")
+		return 1;
+
+	throw std::runtime_error("Unsupported pixel format: " + pixFmt);
+}
+
+size_t GetPlaneCount(std::string const & pixFmt)
+{
+	if (pixFmt == "yuv420p")
+		return 3;
+	if (pixFmt == "nv12")
+		return 2;
+
+	GetPixelSize(pixFmt);
+	return 1;
+}
+
+size_t GetPlaneSampleSize(std::string const & pixFmt, size_t plane)
+{
+	if (plane >= GetPlaneCount(pixFmt))
+		throw std::runtime_error("No plane " + std::to_string(plane) + " in " + pixFmt);
+	if (pixFmt == "nv12" && plane == 1)
+		return 2;
+	if (pixFmt == "yuv420p" || pixFmt == "nv12")
+		return 1;
+
+	return GetPixelSize(pixFmt);
+}
+
+size_t GetPlaneWidth(std::string const & pixFmt, size_t plane, size_t width)
+{
+	return plane > 0 && GetPlaneCount(pixFmt) > 1 ? (width + 1) / 2 : width;
+}
+
+size_t GetPlaneHeight(std::string const & pixFmt, size_t plane, size_t height)
+{
+	return plane > 0 && GetPlaneCount(pixFmt) > 1 ? (height + 1) / 2 : height;
+}
+
+size_t GetPlaneStride(std::string const & pixFmt, size_t plane, size_t stride)
+{
+	if (plane == 0)
+		return stride;
+	if (pixFmt == "yuv420p")
+		return (stride + 1) / 2;
+	return (stride + 1) / 2 * 2;
+}
+
+size_t GetImageDataSize(std::string const & pixFmt, size_t width, size_t height)
+{
+	size_t size = 0;
+	for (size_t plane = 0; plane < GetPlaneCount(pixFmt); ++plane)
+		size += GetPlaneSampleSize(pixFmt, plane) * GetPlaneWidth(pixFmt, plane, width) *
+				GetPlaneHeight(pixFmt, plane, height);
+	return size;
+}
+
+size_t GetPaddedStride(std::string const & pixFmt, size_t width)
+{
+	// Keeping the stride a whole number of pixels lets GL take it as GL_UNPACK_ROW_LENGTH.
+	// yuv420p chroma rows are half the luma ones, so the luma stride goes in steps of 128
+	size_t const pixelSize = GetPlaneSampleSize(pixFmt, 0);
+	size_t const alignment = pixFmt == "yuv420p" ? 2 * g_alignment : g_alignment;
+	size_t const step = pixelSize * alignment / GreatestCommonDivisor(pixelSize, alignment);
+	return (pixelSize * width + step - 1) / step * step;
+}
 
 RawImage::RawImage()
 {}
 
-RawImage::RawImage(const std::vector<char> & data, std::string const & pixFmt, size_t width, size_t height)
-	: m_data(data)
+RawImage::RawImage(std::string const & pixFmt, size_t width, size_t height)
+	: m_pixFmt(pixFmt)
+	, m_width(width)
+	, m_height(height)
+{
+	size_t const stride = GetPaddedStride(pixFmt, width);
+	size_t size = 0;
+	for (size_t plane = 0; plane < ::GetPlaneCount(pixFmt); ++plane)
+		size += ::GetPlaneStride(pixFmt, plane, stride) * ::GetPlaneHeight(pixFmt, plane, height);
+
+	m_storage = AllocateAligned(size);
+	memset(m_storage.get(), 0, size);
+	SetPlanes(static_cast<char *>(m_storage.get()), stride);
+}
+
+RawImage::RawImage(char * data, size_t stride, std::string const & pixFmt, size_t width, size_t height,
+				   std::shared_ptr<void> const & owner)
+	: m_storage(owner)
 	, m_pixFmt(pixFmt)
 	, m_width(width)
 	, m_height(height)
-{}
+	, m_isView(true)
+{
+	if (stride < GetRowSize())
+		throw std::runtime_error("Image stride is too small!");
+
+	SetPlanes(data, stride);
+}
+
+void RawImage::SetPlanes(char * data, size_t stride)
+{
+	for (size_t plane = 0; plane < GetPlaneCount(); ++plane) {
+		m_planes[plane] = data;
+		m_strides[plane] = ::GetPlaneStride(m_pixFmt, plane, stride);
+		data += m_strides[plane] * GetPlaneHeight(plane);
+	}
+}
+
+RawImage RawImage::Clone() const
+{
+	RawImage image(m_pixFmt, m_width, m_height);
+	for (size_t plane = 0; plane < GetPlaneCount(); ++plane)
+		for (size_t y = 0; y < GetPlaneHeight(plane); ++y)
+			memcpy(image.GetPlaneRow(plane, y), GetPlaneRow(plane, y), GetPlaneRowSize(plane));
+	return image;
+}
 
 size_t RawImage::GetWidth() const
 {
@@ -24,9 +188,42 @@ size_t RawImage::GetHeight() const
 	return m_height;
 }
 
+size_t RawImage::GetStride() const
+{
+	return m_strides[0];
+}
+
+size_t RawImage::GetRowSize() const
+{
+	return GetPlaneRowSize(0);
+}
+
 const char *RawImage::GetData() const
 {
-	return m_data.data();
+	return m_planes[0];
+}
+
+char * RawImage::GetData()
+{
+	return m_planes[0];
+}
+
+char const * RawImage::GetRow(size_t y) const
+{
+	return m_planes[0] + y * m_strides[0];
+}
+
+char * RawImage::GetRow(size_t y)
+{
+	return m_planes[0] + y * m_strides[0];
+}
+
+size_t RawImage::GetDataSize() const
+{
+	size_t size = 0;
+	for (size_t plane = 0; plane < GetPlaneCount(); ++plane)
+		size += m_strides[plane] * GetPlaneHeight(plane);
+	return size;
 }
 
 std::string RawImage::GetPixFmt() const
@@ -34,13 +231,72 @@ std::string RawImage::GetPixFmt() const
 	return m_pixFmt;
 }
 
+bool RawImage::IsView() const
+{
+	return m_isView;
+}
+
+size_t RawImage::GetPlaneCount() const
+{
+	return ::GetPlaneCount(m_pixFmt);
+}
+
+size_t RawImage::GetPlaneStride(size_t plane) const
+{
+	return m_strides[plane];
+}
+
+size_t RawImage::GetPlaneRowSize(size_t plane) const
+{
+	return GetPlaneSampleSize(m_pixFmt, plane) * GetPlaneWidth(m_pixFmt, plane, m_width);
+}
+
+size_t RawImage::GetPlaneHeight(size_t plane) const
+{
+	return ::GetPlaneHeight(m_pixFmt, plane, m_height);
+}
+
+char const * RawImage::GetPlane(size_t plane) const
+{
+	return m_planes[plane];
+}
+
+char * RawImage::GetPlane(size_t plane)
+{
+	return m_planes[plane];
+}
+
+char const * RawImage::GetPlaneRow(size_t plane, size_t y) const
+{
+	return m_planes[plane] + y * m_strides[plane];
+}
+
+char * RawImage::GetPlaneRow(size_t plane, size_t y)
+{
+	return m_planes[plane] + y * m_strides[plane];
+}
+
 RawImage RawImage::LoadFromFile(const std::string & path, size_t width, size_t height)
 {
-	RawImage image;
-	image.m_width = width;
-	image.m_height = height;
-	image.m_data.resize(3 * width * height);
-	image.m_pixFmt = "rgb24";
+	TRACE_SCOPE("load");
+	ImageFormat const format = GetImageFormat(path);
+	if (HasNativeCodec(format)) {
+		size_t fileWidth = width;
+		size_t fileHeight = height;
+		GetImageFileSize(path, format, fileWidth, fileHeight);
+		if (fileWidth == width && fileHeight == height) {
+			RawImage image = DecodeImageFile(path, format, width, height);
+			return image.GetPixFmt() == "gray" ? GrayToRgb(image) : std::move(image);
+		}
+	}
+
+	return LoadWithFfmpeg(path, width, height);
+}
+
+RawImage RawImage::LoadWithFfmpeg(const std::string & path, size_t width, size_t height, std::string const & pixFmt)
+{
+	TRACE_SCOPE("load ffmpeg");
+	RawImage image(pixFmt, width, height);
 
 	std::string const cmd = "ffmpeg -i " + path + " -s " + std::to_string(width) + "x" + std::to_string(height) +
 			" -pix_fmt " + image.m_pixFmt + " -f rawvideo -";
@@ -48,29 +304,55 @@ RawImage RawImage::LoadFromFile(const std::string & path, size_t width, size_t h
 	if (!pipe)
 		throw std::runtime_error("Can't open file for reading: " + path);
 
-	size_t retBytesCnt = 0;
-	size_t sumBytesCnt = 0;
-	while ((retBytesCnt = fread(&image.m_data[sumBytesCnt], 1, BUFSIZ, pipe)) > 0)
-		sumBytesCnt += retBytesCnt;
-
-	pclose(pipe);
+	// Rows are read one by one straight into the padded storage
+	for (size_t plane = 0; plane < image.GetPlaneCount(); ++plane) {
+		size_t const rowSize = image.GetPlaneRowSize(plane);
+		for (size_t y = 0; y < image.GetPlaneHeight(plane); ++y) {
+			size_t retBytesCnt = 0;
+			size_t sumBytesCnt = 0;
+			char * row = image.GetPlaneRow(plane, y);
+			while (sumBytesCnt < rowSize && (retBytesCnt = fread(row + sumBytesCnt, 1, rowSize - sumBytesCnt, pipe)) > 0)
+				sumBytesCnt += retBytesCnt;
+			if (sumBytesCnt < rowSize) {
+				CloseFfmpegPipe(pipe, "Failed to decode file: " + path);
+				throw std::runtime_error("Failed to decode file: " + path);
+			}
+		}
+	}
 
+	CloseFfmpegPipe(pipe, "Failed to decode file: " + path);
 	return image;
-
 }
 
 void RawImage::SaveToFile(std::string const & path) const
+{
+	TRACE_SCOPE("save");
+	ImageFormat const format = GetImageFormat(path);
+	if (GetPlaneCount() == 1 && HasNativeCodec(format))
+		EncodeImageFile(*this, path, format);
+	else
+		SaveWithFfmpeg(path);
+}
+
+void RawImage::SaveWithFfmpeg(std::string const & path) const
 {
 	std::string const cmd = "ffmpeg -pix_fmt " + m_pixFmt + " -s " + std::to_string(m_width) + "x" + std::to_string(m_height) +
 			" -f rawvideo -i pipe:0 -y " + path;
 	FILE * pipe = popen(cmd.c_str(), "w");
 	if (!pipe)
-		throw std::runtime_error("Can't open file for writng: " + path);
+		throw std::runtime_error("Can't open file for writing: " + path);
 
-	fwrite((void const *)m_data.data(), 1, m_data.size(), pipe);
+	bool written = true;
+	if (GetDataSize() == GetImageDataSize(m_pixFmt, m_width, m_height))
+		written = fwrite((void const *)GetData(), 1, GetDataSize(), pipe) == GetDataSize();
+	else
+		for (size_t plane = 0; plane < GetPlaneCount() && written; ++plane)
+			for (size_t y = 0; y < GetPlaneHeight(plane) && written; ++y)
+				written = fwrite((void const *)GetPlaneRow(plane, y), 1, GetPlaneRowSize(plane), pipe) == GetPlaneRowSize(plane);
 
-	pclose(pipe);
+	if (!written) {
+		pclose(pipe);
+		throw std::runtime_error("Failed to write file: " + path);
+	}
+	CloseFfmpegPipe(pipe, "Failed to encode file: " + path);
 }
-
-
-
@@ -1,27 +1,92 @@
 #pragma once
 
+#include <array>
+#include <memory>
 #include <string>
-#include <vector>
 
+// Packed formats only (rgb24, gray)
+size_t GetPixelSize(std::string const & pixFmt);
+
+// Planar formats (yuv420p, nv12) keep the full resolution luma in plane 0 and the 2x2 subsampled
+// chroma in the planes that follow it. Packed formats have a single plane
+size_t GetPlaneCount(std::string const & pixFmt);
+// Bytes per sample: 3 for rgb24, 2 for the interleaved nv12 chroma, 1 otherwise
+size_t GetPlaneSampleSize(std::string const & pixFmt, size_t plane);
+size_t GetPlaneWidth(std::string const & pixFmt, size_t plane, size_t width);
+size_t GetPlaneHeight(std::string const & pixFmt, size_t plane, size_t height);
+// Chroma strides follow from the luma one the same way ffmpeg derives them for tight frames
+size_t GetPlaneStride(std::string const & pixFmt, size_t plane, size_t stride);
+
+// Size of a tightly packed frame, as ffmpeg reads and writes it
+size_t GetImageDataSize(std::string const & pixFmt, size_t width, size_t height);
+// Row stride of images allocated by RawImage: a multiple of 64 bytes and of the pixel size.
+// For planar formats this is the luma stride and the chroma strides are 64-byte aligned as well
+size_t GetPaddedStride(std::string const & pixFmt, size_t width);
+
+// Image buffer that is either owned or a non-owning view of external memory.
+// Owned buffers are 64-byte aligned with padded rows, so SIMD code can use aligned loads
+// on every row. Images are move-only, use Clone() for a deep copy.
+// The planes of planar formats follow each other in the same buffer, GetData/GetRow/GetStride
+// refer to plane 0.
 class RawImage
 {
 public:
-	RawImage(std::vector<char> const & data, std::string const & pixFmt, size_t width, size_t height);
+	RawImage(std::string const & pixFmt, size_t width, size_t height);
+	// View of memory owned by someone else (mmap regions, pool slots, mapped PBOs).
+	// If owner is set it keeps that memory alive for the lifetime of the view.
+	// stride is the luma stride for planar formats
+	RawImage(char * data, size_t stride, std::string const & pixFmt, size_t width, size_t height,
+			 std::shared_ptr<void> const & owner = nullptr);
+
+	RawImage(RawImage &&) = default;
+	RawImage & operator=(RawImage &&) = default;
+	RawImage(RawImage const &) = delete;
+	RawImage & operator=(RawImage const &) = delete;
+
+	RawImage Clone() const;
 
 	size_t GetWidth() const;
 	size_t GetHeight() const;
+	size_t GetStride() const;
+	size_t GetRowSize() const;
 	char const * GetData() const;
+	char * GetData();
+	char const * GetRow(size_t y) const;
+	char * GetRow(size_t y);
+	// All planes including the padding
+	size_t GetDataSize() const;
 	std::string GetPixFmt() const;
+	bool IsView() const;
+
+	size_t GetPlaneCount() const;
+	size_t GetPlaneStride(size_t plane) const;
+	size_t GetPlaneRowSize(size_t plane) const;
+	size_t GetPlaneHeight(size_t plane) const;
+	char const * GetPlane(size_t plane) const;
+	char * GetPlane(size_t plane);
+	char const * GetPlaneRow(size_t plane, size_t y) const;
+	char * GetPlaneRow(size_t plane, size_t y);
 
+	// Native codecs are used when there is one for the file type and no scaling is needed,
+	// everything else goes through ffmpeg. The result is always rgb24
 	static RawImage LoadFromFile(std::string const & path, size_t width, size_t height);
 	void SaveToFile(std::string const & path) const;
 
+	static RawImage LoadWithFfmpeg(std::string const & path, size_t width, size_t height,
+								   std::string const & pixFmt = "rgb24");
+	void SaveWithFfmpeg(std::string const & path) const;
+
 private:
 	RawImage();
 
+	void SetPlanes(char * data, size_t stride);
+
 private:
-	std::vector<char> m_data;
+	std::shared_ptr<void> m_storage;
+	std::array<char *, 3> m_planes{};
+	std::array<size_t, 3> m_strides{};
 	std::string m_pixFmt;
-	size_t m_width;
-	size_t m_height;
+	size_t m_width = 0;
+	size_t m_height = 0;
+	bool m_isView = false;
 };
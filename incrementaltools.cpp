@@ -0,0 +1,373 @@
+#include "incrementaltools.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+#include "tracetools.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INCREMENTAL_X86
+#define INCREMENTAL_SSE41 __attribute__((target("sse4.1")))
+#define INCREMENTAL_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace {
+	typedef std::chrono::steady_clock Clock;
+
+	// The tiles of StitchTiled, about what a tile of the output samples fits in the cache
+	size_t const g_tileSize = 64;
+
+	size_t DivideRoundingUp(size_t value, size_t divisor)
+	{
+		return (value + divisor - 1) / divisor;
+	}
+
+	// A block of blockSize luma pixels covers this much of a plane
+	struct PlaneBlock
+	{
+		size_t m_rowSize; // Bytes
+		size_t m_height;
+		size_t m_sampleSize;
+		size_t m_width;
+	};
+
+	PlaneBlock GetPlaneBlock(std::string const & pixFmt, size_t plane, size_t blockSize)
+	{
+		size_t const sampleSize = GetPlaneSampleSize(pixFmt, plane);
+		size_t const width = GetPlaneWidth(pixFmt, plane, blockSize);
+		return {sampleSize * width, GetPlaneHeight(pixFmt, plane, blockSize), sampleSize, width};
+	}
+
+	bool SpansDifferScalar(uint8_t const * left, uint8_t const * right, size_t size)
+	{
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8) {
+			uint64_t leftWord;
+			uint64_t rightWord;
+			memcpy(&leftWord, left + i, 8);
+			memcpy(&rightWord, right + i, 8);
+			if (leftWord != rightWord)
+				return true;
+		}
+		for (; i < size; ++i)
+			if (left[i] != right[i])
+				return true;
+		return false;
+	}
+
+	// Marks the blocks of a row that differ. Marked blocks need no more comparing, all of them is copied anyway
+	void DiffRowScalar(uint8_t const * previous, uint8_t const * current, size_t rowSize, size_t blockRowSize, uint8_t * changed)
+	{
+		for (size_t x = 0, block = 0; x < rowSize; x += blockRowSize, ++block)
+			if (!changed[block] && SpansDifferScalar(previous + x, current + x, std::min(blockRowSize, rowSize - x)))
+				changed[block] = 1;
+	}
+
+#ifdef INCREMENTAL_X86
+	// Block rows are short, one test at the end beats a branch per vector
+	INCREMENTAL_SSE41 bool SpansDifferSse41(uint8_t const * left, uint8_t const * right, size_t size)
+	{
+		__m128i diff = _mm_setzero_si128();
+		size_t i = 0;
+		for (; i + 16 <= size; i += 16)
+			diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<__m128i const *>(left + i)),
+													_mm_loadu_si128(reinterpret_cast<__m128i const *>(right + i))));
+		return !_mm_testz_si128(diff, diff) || SpansDifferScalar(left + i, right + i, size - i);
+	}
+
+	INCREMENTAL_SSE41 void DiffRowSse41(uint8_t const * previous, uint8_t const * current, size_t rowSize, size_t blockRowSize,
+										uint8_t * changed)
+	{
+		for (size_t x = 0, block = 0; x < rowSize; x += blockRowSize, ++block)
+			if (!changed[block] && SpansDifferSse41(previous + x, current + x, std::min(blockRowSize, rowSize - x)))
+				changed[block] = 1;
+	}
+
+	// A 16 pixel rgb24 block row is one 32 and one 16 byte step. The short step stays in here, calling
+	// the SSE4.1 version would switch between VEX and legacy encoded code for every block
+	INCREMENTAL_AVX2 bool SpansDifferAvx2(uint8_t const * left, uint8_t const * right, size_t size)
+	{
+		__m256i diff = _mm256_setzero_si256();
+		size_t i = 0;
+		for (; i + 32 <= size; i += 32)
+			diff = _mm256_or_si256(diff, _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(left + i)),
+														  _mm256_loadu_si256(reinterpret_cast<__m256i const *>(right + i))));
+		__m128i halfDiff = _mm_or_si128(_mm256_castsi256_si128(diff), _mm256_extracti128_si256(diff, 1));
+		for (; i + 16 <= size; i += 16)
+			halfDiff = _mm_or_si128(halfDiff, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<__m128i const *>(left + i)),
+															 _mm_loadu_si128(reinterpret_cast<__m128i const *>(right + i))));
+		return !_mm_testz_si128(halfDiff, halfDiff) || SpansDifferScalar(left + i, right + i, size - i);
+	}
+
+	INCREMENTAL_AVX2 void DiffRowAvx2(uint8_t const * previous, uint8_t const * current, size_t rowSize, size_t blockRowSize,
+									  uint8_t * changed)
+	{
+		for (size_t x = 0, block = 0; x < rowSize; x += blockRowSize, ++block)
+			if (!changed[block] && SpansDifferAvx2(previous + x, current + x, std::min(blockRowSize, rowSize - x)))
+				changed[block] = 1;
+	}
+#endif
+
+	void DiffRow(uint8_t const * previous, uint8_t const * current, size_t rowSize, size_t blockRowSize, uint8_t * changed,
+				 SimdLevel level)
+	{
+		switch (level) {
+#ifdef INCREMENTAL_X86
+		case SimdLevel::Avx2:
+			return DiffRowAvx2(previous, current, rowSize, blockRowSize, changed);
+		case SimdLevel::Sse41:
+			return DiffRowSse41(previous, current, rowSize, blockRowSize, changed);
+#endif
+		default:
+			return DiffRowScalar(previous, current, rowSize, blockRowSize, changed);
+		}
+	}
+
+	void CopyPlanes(RawImage const & src, RawImage & dst)
+	{
+		for (size_t plane = 0; plane < src.GetPlaneCount(); ++plane)
+			for (size_t y = 0; y < src.GetPlaneHeight(plane); ++y)
+				memcpy(dst.GetPlaneRow(plane, y), src.GetPlaneRow(plane, y), src.GetPlaneRowSize(plane));
+	}
+
+	// The blocks one texel offset of the table and the texel to the right and below it fall into
+	void AddTexelBlocks(int32_t offset, size_t stride, PlaneBlock const & block, size_t xBlockCount,
+						std::vector<uint32_t> & blocks)
+	{
+		size_t const x = size_t(offset) % stride / block.m_sampleSize;
+		size_t const y = size_t(offset) / stride;
+		for (size_t by = y / block.m_height; by <= (y + 1) / block.m_height; ++by)
+			for (size_t bx = x / block.m_width; bx <= (x + 1) / block.m_width; ++bx) {
+				uint32_t const index = uint32_t(bx + by * xBlockCount);
+				// Neighbouring pixels mostly sample the same block
+				if (blocks.empty() || blocks.back() != index)
+					blocks.push_back(index);
+			}
+	}
+}
+
+std::ostream & operator<<(std::ostream & stream, IncrementalStats const & stats)
+{
+	size_t const frameCount = stats.m_frameCount > 0 ? stats.m_frameCount : 1;
+	stream << "Incremental: " << 100.0 * stats.m_skippedTiles / (frameCount * stats.m_tileCount) << "% of "
+		   << stats.m_tileCount << " tiles skipped per frame";
+	if (stats.m_frameCount > 1)
+		stream << " (min " << 100.0 * stats.m_minSkipped << "%, max " << 100.0 * stats.m_maxSkipped << "% after the first), "
+			   << 100.0 * stats.m_changedBlocks / ((stats.m_frameCount - 1) * stats.m_blockCount) << "% of "
+			   << stats.m_blockCount << " blocks changed";
+	stream << std::endl;
+
+	stream << "Per frame: diff " << stats.m_diffMs / frameCount << " ms, stitch " << stats.m_stitchMs / frameCount << " ms";
+	if (stats.m_verifiedFrameCount > 0)
+		stream << ", verify " << stats.m_verifyMs / frameCount << " ms, " << stats.m_verifiedFrameCount
+			   << " frames identical to a full stitch";
+	stream << std::endl;
+	return stream;
+}
+
+void CheckIncrementalSettings(IncrementalSettings const & settings)
+{
+	if (settings.m_blockSize < 2 || settings.m_blockSize % 2 != 0)
+		throw std::runtime_error("Blocks are even and at least 2 pixels wide, not " + std::to_string(settings.m_blockSize));
+}
+
+void UpdateChangedBlocks(RawImage & previous, RawImage const & current, size_t blockSize, std::vector<uint8_t> & changed,
+						 ThreadPool & pool, SimdLevel level)
+{
+	TRACE_SCOPE("diff");
+	if (previous.GetPixFmt() != current.GetPixFmt() || previous.GetWidth() != current.GetWidth() ||
+			previous.GetHeight() != current.GetHeight())
+		throw std::runtime_error("Can't compare frames of different formats or sizes");
+
+	std::string const pixFmt = current.GetPixFmt();
+	size_t const xBlockCount = DivideRoundingUp(current.GetWidth(), blockSize);
+	size_t const yBlockCount = DivideRoundingUp(current.GetHeight(), blockSize);
+	changed.assign(xBlockCount * yBlockCount, 0);
+
+	pool.ParallelFor(yBlockCount, [&](size_t by) {
+		uint8_t * const rowChanged = changed.data() + by * xBlockCount;
+		for (size_t plane = 0; plane < current.GetPlaneCount(); ++plane) {
+			PlaneBlock const block = GetPlaneBlock(pixFmt, plane, blockSize);
+			size_t const rowSize = current.GetPlaneRowSize(plane);
+			size_t const yEnd = std::min(current.GetPlaneHeight(plane), (by + 1) * block.m_height);
+			for (size_t y = by * block.m_height; y < yEnd; ++y)
+				DiffRow(reinterpret_cast<uint8_t const *>(previous.GetPlaneRow(plane, y)),
+						reinterpret_cast<uint8_t const *>(current.GetPlaneRow(plane, y)), rowSize, block.m_rowSize, rowChanged, level);
+		}
+
+		for (size_t plane = 0; plane < current.GetPlaneCount(); ++plane) {
+			PlaneBlock const block = GetPlaneBlock(pixFmt, plane, blockSize);
+			size_t const rowSize = current.GetPlaneRowSize(plane);
+			size_t const yEnd = std::min(current.GetPlaneHeight(plane), (by + 1) * block.m_height);
+			for (size_t y = by * block.m_height; y < yEnd; ++y)
+				for (size_t bx = 0; bx < xBlockCount; ++bx)
+					if (rowChanged[bx]) {
+						size_t const x = bx * block.m_rowSize;
+						memcpy(previous.GetPlaneRow(plane, y) + x, current.GetPlaneRow(plane, y) + x,
+							   std::min(block.m_rowSize, rowSize - x));
+					}
+		}
+	});
+}
+
+IncrementalStitcher::IncrementalStitcher(RemapTable const & table, IncrementalSettings const & settings, ThreadPool & pool,
+										 SimdLevel level)
+	: m_table(table)
+	, m_settings(settings)
+	, m_pool(pool)
+	, m_level(level)
+	, m_xBlockCount(DivideRoundingUp(table.m_srcWidth, settings.m_blockSize))
+	, m_yBlockCount(DivideRoundingUp(table.m_srcHeight, settings.m_blockSize))
+	, m_xTileCount(DivideRoundingUp(table.m_width, g_tileSize))
+	, m_yTileCount(DivideRoundingUp(table.m_height, g_tileSize))
+	, m_previous(table.m_srcPixFmt, table.m_srcWidth, table.m_srcHeight)
+	, m_output("rgb24", table.m_width, table.m_height)
+{
+	CheckIncrementalSettings(settings);
+	if (settings.m_verify)
+		m_reference.reset(new RawImage("rgb24", table.m_width, table.m_height));
+
+	BuildBlockTiles();
+	m_stats.m_tileCount = m_xTileCount * m_yTileCount;
+	m_stats.m_blockCount = m_xBlockCount * m_yBlockCount;
+}
+
+void IncrementalStitcher::Stitch(RawImage const & frame)
+{
+	TRACE_SCOPE("incremental stitch");
+	if (frame.GetPixFmt() != m_previous.GetPixFmt() || frame.GetWidth() != m_previous.GetWidth() ||
+			frame.GetHeight() != m_previous.GetHeight())
+		throw std::runtime_error("Input image doesn't match remap table!");
+
+	auto const diffStart = Clock::now();
+	m_stitchedTiles.clear();
+	if (m_stats.m_frameCount == 0) {
+		CopyPlanes(frame, m_previous);
+		for (size_t tile = 0; tile < m_xTileCount * m_yTileCount; ++tile)
+			m_stitchedTiles.push_back(uint32_t(tile));
+	}
+	else {
+		UpdateChangedBlocks(m_previous, frame, m_settings.m_blockSize, m_changedBlocks, m_pool, m_level);
+		m_changedTiles.assign(m_xTileCount * m_yTileCount, 0);
+		size_t changedBlockCount = 0;
+		for (size_t block = 0; block < m_changedBlocks.size(); ++block) {
+			if (!m_changedBlocks[block])
+				continue;
+			++changedBlockCount;
+			for (uint32_t i = m_blockTileStarts[block]; i < m_blockTileStarts[block + 1]; ++i)
+				m_changedTiles[m_blockTiles[i]] = 1;
+		}
+		for (size_t tile = 0; tile < m_changedTiles.size(); ++tile)
+			if (m_changedTiles[tile])
+				m_stitchedTiles.push_back(uint32_t(tile));
+
+		double const skipped = 1.0 - double(m_stitchedTiles.size()) / m_stats.m_tileCount;
+		m_stats.m_skippedTiles += m_stats.m_tileCount - m_stitchedTiles.size();
+		m_stats.m_changedBlocks += changedBlockCount;
+		m_stats.m_minSkipped = std::min(m_stats.m_minSkipped, skipped);
+		m_stats.m_maxSkipped = std::max(m_stats.m_maxSkipped, skipped);
+	}
+	m_stats.m_diffMs += MillisecondsSince(diffStart);
+
+	auto const stitchStart = Clock::now();
+	StitchTiles(m_table, frame, m_output.GetData(), m_output.GetStride(), m_stitchedTiles, m_pool, m_level, g_tileSize);
+	m_stats.m_stitchMs += MillisecondsSince(stitchStart);
+	++m_stats.m_frameCount;
+
+	if (m_reference)
+		Verify(frame);
+}
+
+RawImage const & IncrementalStitcher::GetOutput() const
+{
+	return m_output;
+}
+
+std::vector<uint32_t> const & IncrementalStitcher::GetStitchedTiles() const
+{
+	return m_stitchedTiles;
+}
+
+size_t IncrementalStitcher::GetTileSize() const
+{
+	return g_tileSize;
+}
+
+IncrementalStats const & IncrementalStitcher::GetStats() const
+{
+	return m_stats;
+}
+
+// Collects the blocks every tile samples on the pool, then turns that around
+void IncrementalStitcher::BuildBlockTiles()
+{
+	TRACE_SCOPE("block tiles");
+	if (!m_table.m_offsets0 || m_table.m_srcPixFmt.empty())
+		throw std::runtime_error("Incremental stitching needs a remap table");
+
+	std::string const & pixFmt = m_table.m_srcPixFmt;
+	bool const planar = GetPlaneCount(pixFmt) > 1;
+	PlaneBlock const lumaBlock = GetPlaneBlock(pixFmt, 0, m_settings.m_blockSize);
+	PlaneBlock const chromaBlock = planar ? GetPlaneBlock(pixFmt, 1, m_settings.m_blockSize) : lumaBlock;
+	size_t const chromaStride = planar ? GetPlaneStride(pixFmt, 1, m_table.m_srcStride) : 0;
+	int32_t const * const offsets[2] = {m_table.m_offsets0, m_table.m_offsets1};
+	int32_t const * const chromaOffsets[2] = {m_table.m_chromaOffsets0, m_table.m_chromaOffsets1};
+
+	std::vector<std::vector<uint32_t>> tileBlocks(m_xTileCount * m_yTileCount);
+	m_pool.ParallelFor(tileBlocks.size(), [&](size_t tile) {
+		std::vector<uint32_t> & blocks = tileBlocks[tile];
+		size_t const x = (tile % m_xTileCount) * g_tileSize;
+		size_t const y = (tile / m_xTileCount) * g_tileSize;
+		for (size_t row = y; row < std::min(m_table.m_height, y + g_tileSize); ++row)
+			for (size_t i = x + row * m_table.m_width; i < std::min(m_table.m_width, x + g_tileSize) + row * m_table.m_width; ++i)
+				for (size_t lens = 0; lens < 2; ++lens) {
+					// Whatever a lens without weight samples is multiplied by 0
+					if (((m_table.m_weights[i] >> (16 * lens)) & 0xFFFF) == 0)
+						continue;
+					AddTexelBlocks(offsets[lens][i], m_table.m_srcStride, lumaBlock, m_xBlockCount, blocks);
+					if (planar)
+						AddTexelBlocks(chromaOffsets[lens][i], chromaStride, chromaBlock, m_xBlockCount, blocks);
+				}
+		std::sort(blocks.begin(), blocks.end());
+		blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+	});
+
+	m_blockTileStarts.assign(m_xBlockCount * m_yBlockCount + 1, 0);
+	for (std::vector<uint32_t> const & blocks : tileBlocks)
+		for (uint32_t const block : blocks)
+			++m_blockTileStarts[block + 1];
+	for (size_t block = 0; block < m_xBlockCount * m_yBlockCount; ++block)
+		m_blockTileStarts[block + 1] += m_blockTileStarts[block];
+
+	m_blockTiles.resize(m_blockTileStarts.back());
+	std::vector<uint32_t> ends(m_blockTileStarts.begin(), m_blockTileStarts.end() - 1);
+	for (size_t tile = 0; tile < tileBlocks.size(); ++tile)
+		for (uint32_t const block : tileBlocks[tile])
+			m_blockTiles[ends[block]++] = uint32_t(tile);
+}
+
+void IncrementalStitcher::Verify(RawImage const & frame)
+{
+	TRACE_SCOPE("verify");
+	auto const start = Clock::now();
+	StitchTiled(m_table, frame, m_reference->GetData(), m_reference->GetStride(), m_pool, m_level, g_tileSize);
+	for (size_t y = 0; y < m_output.GetHeight(); ++y) {
+		char const * const row = m_output.GetRow(y);
+		char const * const referenceRow = m_reference->GetRow(y);
+		if (memcmp(row, referenceRow, m_output.GetRowSize()) == 0)
+			continue;
+
+		size_t x = 0;
+		while (row[x] == referenceRow[x])
+			++x;
+		throw std::runtime_error("Frame " + std::to_string(m_stats.m_frameCount - 1) + ": the incremental stitch differs from a full one at " +
+								 std::to_string(x / 3) + "," + std::to_string(y));
+	}
+	m_stats.m_verifyMs += MillisecondsSince(start);
+	++m_stats.m_verifiedFrameCount;
+}
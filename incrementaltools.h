@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <iosfwd>
+#include <memory>
+#include <vector>
+
+#include "imgtools.h"
+#include "stitchtools.h"
+#include "threadtools.h"
+
+// Re-stitching of only what changed, for fixed cameras where most of a frame is the frame before.
+// Frames are compared in blocks of blockSize x blockSize luma pixels, the chroma planes in the blocks
+// covering the same pixels. The remap table is inverted once up front: every block knows the output
+// tiles that sample it with a non-zero weight, so a changed block re-stitches exactly those tiles
+struct IncrementalSettings
+{
+	bool m_enabled = false;
+	size_t m_blockSize = 16; // Even, in luma pixels
+	bool m_verify = false;   // Stitch every frame in full as well, throw on the first difference
+};
+
+struct IncrementalStats
+{
+	size_t m_frameCount = 0;
+	size_t m_tileCount = 0;     // Of a frame
+	size_t m_blockCount = 0;    // Of a frame
+	size_t m_skippedTiles = 0;  // Over all frames, the first one skips nothing
+	size_t m_changedBlocks = 0; // Over all frames but the first
+	double m_minSkipped = 1.0;  // Fraction of the tiles a frame skipped, from the second frame on
+	double m_maxSkipped = 0.0;
+	double m_diffMs = 0.0;
+	double m_stitchMs = 0.0;
+	double m_verifyMs = 0.0;
+	size_t m_verifiedFrameCount = 0;
+};
+
+std::ostream & operator<<(std::ostream & stream, IncrementalStats const & stats);
+
+// Throws if the settings can't be used
+void CheckIncrementalSettings(IncrementalSettings const & settings);
+
+// Compares current with previous block by block, marks the blocks that differ in changed (one byte per block,
+// row-major) and copies them into previous. Both images have the same format and size, padding isn't compared.
+// Block rows are spread over the pool
+void UpdateChangedBlocks(RawImage & previous, RawImage const & current, size_t blockSize, std::vector<uint8_t> & changed,
+						 ThreadPool & pool, SimdLevel level);
+
+class IncrementalStitcher
+{
+public:
+	// The table can't be a multi-band one, that blend spreads every change over the whole output
+	IncrementalStitcher(RemapTable const & table, IncrementalSettings const & settings, ThreadPool & pool,
+						SimdLevel level = DetectSimdLevel());
+
+	// Stitches the frame into GetOutput(), only the tiles that sample a changed block.
+	// The first frame is stitched in full
+	void Stitch(RawImage const & frame);
+
+	RawImage const & GetOutput() const;
+	// The tiles the last Stitch wrote, numbered like those of StitchTiled, in a grid of GetTileSize()
+	std::vector<uint32_t> const & GetStitchedTiles() const;
+	size_t GetTileSize() const;
+	IncrementalStats const & GetStats() const;
+
+private:
+	void BuildBlockTiles();
+	void Verify(RawImage const & frame);
+
+private:
+	RemapTable const m_table;
+	IncrementalSettings const m_settings;
+	ThreadPool & m_pool;
+	SimdLevel const m_level;
+	size_t const m_xBlockCount;
+	size_t const m_yBlockCount;
+	size_t const m_xTileCount;
+	size_t const m_yTileCount;
+
+	// The tiles sampling block b are m_blockTiles[m_blockTileStarts[b]] up to the start of block b + 1
+	std::vector<uint32_t> m_blockTileStarts;
+	std::vector<uint32_t> m_blockTiles;
+
+	RawImage m_previous; // The input as of the last frame
+	RawImage m_output;
+	std::unique_ptr<RawImage> m_reference; // Only to verify
+	std::vector<uint8_t> m_changedBlocks;
+	std::vector<uint8_t> m_changedTiles;
+	std::vector<uint32_t> m_stitchedTiles;
+	IncrementalStats m_stats;
+};
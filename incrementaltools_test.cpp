@@ -0,0 +1,130 @@
+#include "incrementaltools.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <glm/gtc/constants.hpp>
+
+#include "testtools.h"
+
+namespace {
+	std::vector<SimdLevel> GetSimdLevels()
+	{
+		std::vector<SimdLevel> levels;
+		for (SimdLevel const level : {SimdLevel::Scalar, SimdLevel::Sse41, SimdLevel::Avx2})
+			if (level <= DetectSimdLevel())
+				levels.push_back(level);
+		return levels;
+	}
+
+	void Fill(RawImage & image, uint32_t seed)
+	{
+		for (size_t plane = 0; plane < image.GetPlaneCount(); ++plane)
+			for (size_t y = 0; y < image.GetPlaneHeight(plane); ++y) {
+				uint8_t * row = reinterpret_cast<uint8_t *>(image.GetPlaneRow(plane, y));
+				for (size_t x = 0; x < image.GetPlaneRowSize(plane); ++x)
+					row[x] = uint8_t((x * 7 + y * 13 + plane * 29) ^ seed);
+			}
+	}
+
+	bool HaveSamePixels(RawImage const & a, RawImage const & b)
+	{
+		for (size_t plane = 0; plane < a.GetPlaneCount(); ++plane)
+			for (size_t y = 0; y < a.GetPlaneHeight(plane); ++y)
+				if (memcmp(a.GetPlaneRow(plane, y), b.GetPlaneRow(plane, y), a.GetPlaneRowSize(plane)) != 0)
+					return false;
+		return true;
+	}
+
+	std::vector<size_t> GetChangedIndices(std::vector<uint8_t> const & changed)
+	{
+		std::vector<size_t> indices;
+		for (size_t i = 0; i < changed.size(); ++i)
+			if (changed[i])
+				indices.push_back(i);
+		return indices;
+	}
+
+	TEST(OnlyChangedBlocksAreMarkedAndCopied)
+	{
+		ThreadPool pool(2);
+		for (SimdLevel const level : GetSimdLevels()) {
+			// 64x48 luma in 16 pixel blocks is 4x3 of them
+			RawImage previous("yuv420p", 64, 48);
+			Fill(previous, 0);
+			RawImage current = previous.Clone();
+			std::vector<uint8_t> changed;
+			UpdateChangedBlocks(previous, current, 16, changed, pool, level);
+			CHECK(changed.size() == 12);
+			CHECK(GetChangedIndices(changed).empty());
+
+			// A luma pixel in block (2, 1) and a chroma one covering luma (10, 6) in block (0, 0)
+			current.GetPlaneRow(0, 20)[37] ^= 1;
+			current.GetPlaneRow(2, 3)[5] ^= 1;
+			UpdateChangedBlocks(previous, current, 16, changed, pool, level);
+			CHECK(GetChangedIndices(changed) == (std::vector<size_t>{0, 6}));
+			CHECK(HaveSamePixels(previous, current));
+
+			// A partial block at the right edge of an rgb24 frame
+			RawImage previousRgb("rgb24", 50, 20);
+			Fill(previousRgb, 0);
+			RawImage currentRgb = previousRgb.Clone();
+			currentRgb.GetRow(19)[3 * 49 + 2] ^= 1;
+			UpdateChangedBlocks(previousRgb, currentRgb, 16, changed, pool, level);
+			CHECK(GetChangedIndices(changed) == (std::vector<size_t>{7}));
+			CHECK(HaveSamePixels(previousRgb, currentRgb));
+		}
+	}
+
+	TEST(MismatchedFramesAreRejected)
+	{
+		ThreadPool pool(1);
+		RawImage previous("yuv420p", 64, 48);
+		std::vector<uint8_t> changed;
+		CHECK_THROWS(UpdateChangedBlocks(previous, RawImage("yuv420p", 64, 32), 16, changed, pool, SimdLevel::Scalar));
+		CHECK_THROWS(UpdateChangedBlocks(previous, RawImage("nv12", 64, 48), 16, changed, pool, SimdLevel::Scalar));
+
+		IncrementalSettings settings;
+		settings.m_blockSize = 15;
+		CHECK_THROWS(CheckIncrementalSettings(settings));
+	}
+
+	TEST(IncrementalOutputMatchesAFullStitch)
+	{
+		ThreadPool pool(2);
+		FishInfo const fishInfo0 = {glm::vec2(0.25f, 0.5f), glm::vec3(0.0f), glm::radians(200.0f), glm::vec2(0.5f, 1.0f),
+									PhotometricInfo()};
+		FishInfo const fishInfo1 = {glm::vec2(0.75f, 0.5f), glm::vec3(0.0f, 0.0f, glm::pi<float>()), glm::radians(200.0f),
+									glm::vec2(0.5f, 1.0f), PhotometricInfo()};
+		RawImage frame("yuv420p", 256, 128);
+		RemapTable const table = BuildRemapTable(fishInfo0, fishInfo1, frame.GetPixFmt(), frame.GetWidth(), frame.GetHeight(),
+												 frame.GetStride(), 512, 256, BlendMode::Feather);
+		IncrementalSettings settings;
+		settings.m_enabled = true;
+		IncrementalStitcher stitcher(table, settings, pool);
+		size_t const tileCount = (512 / stitcher.GetTileSize()) * (256 / stitcher.GetTileSize());
+
+		Fill(frame, 0);
+		stitcher.Stitch(frame);
+		CHECK(stitcher.GetStitchedTiles().size() == tileCount);
+		CHECK(HaveSamePixels(stitcher.GetOutput(), Stitch(table, frame, pool)));
+
+		// A small change in the middle of lens 0
+		for (size_t y = 60; y < 68; ++y)
+			for (size_t x = 60; x < 68; ++x)
+				frame.GetRow(y)[x] ^= 0x55;
+		stitcher.Stitch(frame);
+		CHECK(!stitcher.GetStitchedTiles().empty());
+		CHECK(stitcher.GetStitchedTiles().size() < tileCount);
+		CHECK(HaveSamePixels(stitcher.GetOutput(), Stitch(table, frame, pool)));
+
+		stitcher.Stitch(frame);
+		CHECK(stitcher.GetStitchedTiles().empty());
+		CHECK(stitcher.GetStats().m_frameCount == 3);
+	}
+}
+
+int main()
+{
+	return RunTests();
+}
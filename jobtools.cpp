@@ -0,0 +1,287 @@
+#include "jobtools.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <tuple>
+
+#include <glm/gtc/constants.hpp>
+
+#include "calibtools.h"
+
+namespace {
+	// Hand-tuned for the example rig: a 4296x2148 frame with a 210 degree lens in each half
+	std::pair<FishInfo, FishInfo> GetBuiltInDualFishInfos()
+	{
+//		Ideal lenses, e.g. /home/alex/360/dual.bmp at 8192x4096:
+//		FishInfo fishInfo0 = {glm::vec2(0.25f, 0.5f), glm::vec3(0.0f, 0.0f, 0.0f), glm::pi<float>(), glm::vec2(0.5f, 1.0f), PhotometricInfo()};
+//		FishInfo fishInfo1 = {glm::vec2(0.75f, 0.5f), glm::vec3(0.0f, 0.0f, glm::pi<float>()), glm::pi<float>(), glm::vec2(0.5f, 1.0f), PhotometricInfo()};
+		FishInfo const fishInfo0 = {
+			glm::vec2(1024.0f / 4296.0f, 1024.0f / 2148.0f),
+			glm::vec3(glm::radians(25.0f), 0.0f, 0.0f),
+			glm::radians(210.0f),
+			glm::vec2(2048.0f / 4296.0f, 2048.0f / 2148.0f),
+			PhotometricInfo()};
+		FishInfo const fishInfo1 = {
+			glm::vec2(3272.0f / 4296.0f, 1124.0f / 2148.0f),
+			glm::vec3(0.0f, glm::radians(-5.0f), glm::pi<float>()),
+			glm::radians(210.0f),
+			glm::vec2(2048.0f / 4296.0f, 2048.0f / 2148.0f),
+			PhotometricInfo()};
+		return {fishInfo0, fishInfo1};
+	}
+
+	// A 220 degree lens filling a square frame, e.g. /home/alex/360/fish2sphere220.jpg at 4096x4096
+	FishInfo GetBuiltInOneFishInfo()
+	{
+//		A 180 degree one, e.g. /home/alex/360/cube_orig.bmp:
+//		return {glm::vec2(0.5f, 0.5f), glm::vec3(0.0f), glm::pi<float>(), glm::vec2(1.0f, 1.0f), PhotometricInfo()};
+		return {glm::vec2(0.5f, 0.5f), glm::vec3(0.0f), 11.0f * glm::pi<float>() / 9.0f, glm::vec2(1.0f, 1.0f), PhotometricInfo()};
+	}
+
+	void ParseSize(std::string const & value, size_t & width, size_t & height)
+	{
+		std::istringstream stream(value);
+		size_t parsedWidth = 0;
+		size_t parsedHeight = 0;
+		char separator = 0;
+		std::string rest;
+		if (value.empty() || !isdigit(value[0]) || !(stream >> parsedWidth >> separator >> parsedHeight) || separator != 'x' ||
+				stream >> rest || parsedWidth == 0 || parsedHeight == 0)
+			throw std::runtime_error("Expected a size like 1200x600, not " + value);
+		width = parsedWidth;
+		height = parsedHeight;
+	}
+
+	size_t ParseCount(std::string const & key, std::string const & value)
+	{
+		std::istringstream stream(value);
+		size_t count = 0;
+		std::string rest;
+		if (!isdigit(value[0]) || !(stream >> count) || stream >> rest)
+			throw std::runtime_error(key + " is a number, not " + value);
+		return count;
+	}
+
+	std::vector<RectilinearView> ParseViews(std::string const & value)
+	{
+		std::vector<RectilinearView> views;
+		std::istringstream stream(value);
+		std::string viewValue;
+		while (std::getline(stream, viewValue, '/')) {
+			std::istringstream viewStream(viewValue);
+			float yaw = 0.0f;
+			float pitch = 0.0f;
+			float fov = 0.0f;
+			char separators[2] = {};
+			std::string rest;
+			if (!(viewStream >> yaw >> separators[0] >> pitch >> separators[1] >> fov) || separators[0] != ',' ||
+					separators[1] != ',' || viewStream >> rest)
+				throw std::runtime_error("Expected views like 0,0,90/90,-30,60, not " + value);
+			views.push_back({glm::radians(yaw), glm::radians(pitch), glm::radians(fov)});
+		}
+		return views;
+	}
+}
+
+char const * RunModeName(RunMode mode)
+{
+	switch (mode) {
+	case RunMode::GL:
+		return "gl";
+	case RunMode::GLVideo:
+		return "gl-video";
+	case RunMode::Cpu:
+		return "cpu";
+	case RunMode::Video:
+		return "video";
+	case RunMode::Pipeline:
+		return "pipeline";
+	case RunMode::BenchThreads:
+		return "bench-threads";
+	case RunMode::BenchIo:
+		return "bench-io";
+	case RunMode::BenchStitch:
+		return "bench-stitch";
+	default:
+		return "bench-blend";
+	}
+}
+
+RunMode ParseRunMode(std::string const & name)
+{
+	for (RunMode const mode : {RunMode::GL, RunMode::GLVideo, RunMode::Cpu, RunMode::Video, RunMode::Pipeline, RunMode::BenchThreads,
+							   RunMode::BenchIo, RunMode::BenchStitch, RunMode::BenchBlend})
+		if (name == RunModeName(mode))
+			return mode;
+	throw std::runtime_error("Unknown mode: " + name);
+}
+
+void SetJobOption(StitchJob & job, std::string const & option)
+{
+	size_t const separator = option.find('=');
+	std::string const key = option.substr(0, separator);
+	bool const hasValue = separator != std::string::npos;
+	std::string const value = hasValue ? option.substr(separator + 1) : std::string();
+
+	if (key == "procedural" || key == "estimate-gains" || key == "no-mipmaps" || key == "incremental" ||
+			key == "verify-incremental" || key == "yuv") {
+		if (hasValue)
+			throw std::runtime_error(key + " takes no value");
+		if (key == "no-mipmaps")
+			job.m_mipmaps = false;
+		else if (key == "yuv")
+			job.m_yuvInput = true;
+		else if (key == "incremental" || key == "verify-incremental") {
+			job.m_incremental.m_enabled = true;
+			job.m_incremental.m_verify = job.m_incremental.m_verify || key == "verify-incremental";
+		}
+		else
+			(key == "procedural" ? job.m_procedural : job.m_estimateGains) = true;
+		return;
+	}
+
+	char const * const valueKeys[] = {"mode", "in", "in-size", "lenses", "calibration", "out", "out-size", "projection", "views",
+									  "blend", "calibrate", "pyramid", "tile-size", "tile-format", "block-size", "threads"};
+	if (std::find(std::begin(valueKeys), std::end(valueKeys), key) == std::end(valueKeys))
+		throw std::runtime_error("Unknown option: " + key);
+	if (value.empty())
+		throw std::runtime_error(key + " needs a value");
+
+	if (key == "mode")
+		job.m_mode = ParseRunMode(value);
+	else if (key == "in")
+		job.m_inPath = value;
+	else if (key == "in-size")
+		ParseSize(value, job.m_inWidth, job.m_inHeight);
+	else if (key == "lenses") {
+		if (value != "1" && value != "2")
+			throw std::runtime_error("lenses is 1 or 2, not " + value);
+		job.m_dualFish = value == "2";
+	}
+	else if (key == "calibration")
+		job.m_calibrationPath = value;
+	else if (key == "out")
+		job.m_outPath = value;
+	else if (key == "out-size")
+		ParseSize(value, job.m_outWidth, job.m_outHeight);
+	else if (key == "projection")
+		job.m_projection = ParseProjection(value);
+	else if (key == "views")
+		job.m_views = ParseViews(value);
+	else if (key == "blend")
+		job.m_blendMode = ParseBlendMode(value);
+	else if (key == "pyramid")
+		job.m_pyramid.m_path = value;
+	else if (key == "tile-size")
+		job.m_pyramid.m_tileSize = ParseCount(key, value);
+	else if (key == "tile-format")
+		job.m_pyramid.m_format = value;
+	else if (key == "block-size")
+		job.m_incremental.m_blockSize = ParseCount(key, value);
+	else if (key == "threads")
+		job.m_threadCount = ParseCount(key, value);
+	else
+		job.m_calibrateOutPath = value;
+}
+
+void ResolveJob(StitchJob & job)
+{
+	if (job.m_projection != OutputProjection::Equirect) {
+		char const * const equirectOption = !job.m_dualFish ? "lenses=1" : job.m_procedural ? "procedural" :
+											job.m_blendMode == BlendMode::MultiBand ? "blend=multiband" : nullptr;
+		if (equirectOption)
+			throw std::runtime_error(std::string(equirectOption) + " is implemented for the equirect projection only");
+		// Throws for a size the tiles don't fit
+		MakeViewLayout(job.m_projection, job.m_views, job.m_outWidth, job.m_outHeight);
+	}
+	if (!job.m_views.empty() && job.m_projection != OutputProjection::Rectilinear)
+		throw std::runtime_error("views are for projection=rectilinear");
+	if (!job.m_pyramid.m_path.empty())
+		CheckPyramidSettings(job.m_pyramid);
+	if (job.m_incremental.m_enabled) {
+		CheckIncrementalSettings(job.m_incremental);
+		// Every change of the input would reach all of the output through the coarse levels
+		if (job.m_blendMode == BlendMode::MultiBand)
+			throw std::runtime_error("incremental can't be combined with blend=multiband");
+	}
+
+	if (job.m_dualFish) {
+		std::tie(job.m_fishInfo0, job.m_fishInfo1) = job.m_calibrationPath.empty() ?
+				GetBuiltInDualFishInfos() : LoadCalibration(job.m_calibrationPath);
+		return;
+	}
+
+	char const * const dualFishOption = job.m_procedural ? "procedural" :
+										job.m_blendMode == BlendMode::MultiBand ? "blend=multiband" :
+										job.m_estimateGains ? "estimate-gains" :
+										!job.m_calibrationPath.empty() ? "calibration" :
+										!job.m_calibrateOutPath.empty() ? "calibrate" : nullptr;
+	if (dualFishOption)
+		throw std::runtime_error(std::string(dualFishOption) + " is implemented for dual fisheye only");
+	job.m_fishInfo0 = GetBuiltInOneFishInfo();
+	job.m_fishInfo1 = job.m_fishInfo0;
+}
+
+std::vector<StitchJob> LoadJobFile(std::string const & path, StitchJob const & defaults)
+{
+	std::ifstream file(path);
+	if (!file)
+		throw std::runtime_error("Can't open file for reading: " + path);
+
+	std::vector<StitchJob> jobs;
+	std::string line;
+	for (size_t lineNumber = 1; std::getline(file, line); ++lineNumber) {
+		std::istringstream stream(line);
+		std::string option;
+		if (!(stream >> option) || option[0] == '#')
+			continue;
+
+		StitchJob job = defaults;
+		try {
+			do
+				SetJobOption(job, option);
+			while (stream >> option);
+			ResolveJob(job);
+		}
+		catch (std::exception const & e) {
+			throw std::runtime_error(path + ":" + std::to_string(lineNumber) + ": " + e.what());
+		}
+		jobs.push_back(job);
+	}
+	if (jobs.empty())
+		throw std::runtime_error("No jobs in " + path);
+	return jobs;
+}
+
+std::vector<StitchJob> ParseCommandLine(int argc, char const * const * argv, std::string & tracePath)
+{
+	StitchJob defaults;
+	std::vector<std::string> jobFiles;
+	for (int i = 1; i < argc; ++i) {
+		std::string const arg = argv[i];
+		if (arg.compare(0, 2, "--") != 0)
+			throw std::runtime_error("Unknown argument: " + arg);
+		if (arg.compare(0, 7, "--jobs=") == 0)
+			jobFiles.push_back(arg.substr(7));
+		else if (arg.compare(0, 8, "--trace=") == 0)
+			tracePath = arg.substr(8);
+		else
+			SetJobOption(defaults, arg.substr(2));
+	}
+
+	if (jobFiles.empty()) {
+		ResolveJob(defaults);
+		return {defaults};
+	}
+
+	std::vector<StitchJob> jobs;
+	for (std::string const & jobFile : jobFiles) {
+		std::vector<StitchJob> const fileJobs = LoadJobFile(jobFile, defaults);
+		jobs.insert(jobs.end(), fileJobs.begin(), fileJobs.end());
+	}
+	return jobs;
+}
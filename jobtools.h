@@ -0,0 +1,95 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "blendtools.h"
+#include "fishtools.h"
+#include "incrementaltools.h"
+#include "projtools.h"
+#include "pyramidtools.h"
+
+// What a job does with its input
+enum class RunMode
+{
+	GL,           // Stitch the image on the GPU, into a window or the out= file
+	GLVideo,      // Stitch every frame of the video on the GPU, decoded as yuv420p, and encode it
+	Cpu,          // Stitch the image with the CPU remap
+	Video,        // Stitch the video with the CPU remap, one frame after the other
+	Pipeline,     // The same with decoding, stitching and encoding overlapped
+	BenchThreads, // The CPU stitch with every thread count, then as Cpu
+	BenchIo,      // Save and load the image in every format, in-process and through ffmpeg
+	BenchStitch,  // Time mesh and procedural stitching on the GPU and compare both to the CPU stitch
+	BenchBlend    // Time every blend mode on the GPU and with the CPU remap, the outputs go to blend_<mode>.png
+};
+
+char const * RunModeName(RunMode mode);
+RunMode ParseRunMode(std::string const & name);
+
+// One input to stitch and what to make of it. Jobs are set up from "key=value" options:
+//   mode=<mode>            gl|gl-video|cpu|video|pipeline|bench-threads|bench-io|bench-stitch|bench-blend,
+//                          see RunMode. gl by default
+//   threads=<n>            worker threads, 0 for one per hardware thread, the default. The same for all jobs of a run
+//   in=<path>              input image, video for the video modes. Every job needs one
+//   in-size=<w>x<h>        size of the input, images are scaled to it
+//   lenses=1|2             single or dual fisheye input
+//   calibration=<file>     lens calibration as written by SaveCalibration, dual fisheye only.
+//                          Without one the built-in calibration of the example rig is used
+//   out=<path>             where the output goes. Without one, or a pyramid, it is shown in a window
+//   pyramid=<file>.dzi     also cut the output into a Deep Zoom tile pyramid, see WritePyramid
+//   tile-size=<n>          edge of the pyramid tiles, 512 by default
+//   tile-format=jpg|png|bmp|ppm
+//   out-size=<w>x<h>       size of the output, all tiles of it for the projections other than equirect
+//   projection=equirect|cubemap|eac|rectilinear
+//                          cubemap and eac need a 3:2 out-size, see MakeViewLayout
+//   views=<yaw>,<pitch>,<fov>[/...]
+//                          the rectilinear views in degrees, side by side in the output
+//   blend=hard|feather|multiband
+//   yuv                    load the image as yuv420p through ffmpeg and convert it to RGB in the shader, mode=gl only
+//   procedural             evaluate the projection per fragment instead of interpolating it over the mesh
+//   no-mipmaps             sample the input without mipmaps, saves regenerating them for every video frame
+//   incremental            re-stitch only the tiles of a video frame that sample changed blocks of the input,
+//                          for fixed cameras. A pyramid is kept up to date with the frames the same way
+//   block-size=<n>         edge of the compared blocks in input pixels, 16 by default
+//   verify-incremental     incremental, and check every frame against a full stitch
+//   estimate-gains         fit the exposure and white balance of the lenses to the rgb24 input first
+//   calibrate=<file>       fit the lens geometry to the input first and save it, gains included
+struct StitchJob
+{
+	RunMode m_mode = RunMode::GL;
+	size_t m_threadCount = 0;
+	std::string m_inPath;
+	size_t m_inWidth = 4296;
+	size_t m_inHeight = 2148;
+	bool m_dualFish = true;
+	std::string m_calibrationPath;
+	FishInfo m_fishInfo0; // Filled in from the calibration once all options are known
+	FishInfo m_fishInfo1;
+	std::string m_outPath;
+	size_t m_outWidth = 1200;
+	size_t m_outHeight = 600;
+	OutputProjection m_projection = OutputProjection::Equirect;
+	std::vector<RectilinearView> m_views;
+	PyramidSettings m_pyramid;
+	BlendMode m_blendMode = BlendMode::Feather;
+	bool m_procedural = false;
+	bool m_yuvInput = false;
+	bool m_mipmaps = true;
+	IncrementalSettings m_incremental;
+	bool m_estimateGains = false;
+	std::string m_calibrateOutPath;
+};
+
+// option is "key=value", or just "key" for the flags
+void SetJobOption(StitchJob & job, std::string const & option);
+// Loads the calibration, or picks the built-in one, and checks that the options go together
+void ResolveJob(StitchJob & job);
+
+// One job per line, as whitespace separated options applied on top of defaults.
+// Empty lines and lines starting with # are skipped. Errors name the line
+std::vector<StitchJob> LoadJobFile(std::string const & path, StitchJob const & defaults);
+
+// The options of a single job as --key=value arguments, or --jobs=<file> to run a job file. Job files
+// take the other options of the command line as defaults, wherever they are, and several may be given.
+// --trace=<file> is not a job option, it sets tracePath for the whole run
+std::vector<StitchJob> ParseCommandLine(int argc, char const * const * argv, std::string & tracePath);
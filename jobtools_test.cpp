@@ -0,0 +1,125 @@
+#include "jobtools.h"
+
+#include <stdio.h>
+
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#include "testtools.h"
+
+namespace {
+	std::string const g_jobFile = "jobtools_test_jobs.txt";
+
+	void WriteJobFile(std::string const & text)
+	{
+		std::ofstream file(g_jobFile);
+		file << text;
+	}
+
+	// The message LoadJobFile throws with, empty if it doesn't
+	std::string GetLoadError(std::string const & text)
+	{
+		WriteJobFile(text);
+		try {
+			LoadJobFile(g_jobFile, StitchJob());
+		}
+		catch (std::exception const & e) {
+			return e.what();
+		}
+		return std::string();
+	}
+
+	TEST(OptionsSetTheirFields)
+	{
+		StitchJob job;
+		for (char const * option : {"mode=pipeline", "threads=3", "in=a.yuv", "in-size=1074x538", "out=b.raw", "out-size=800x400",
+									"blend=hard", "incremental", "block-size=32", "no-mipmaps"})
+			SetJobOption(job, option);
+		CHECK(job.m_mode == RunMode::Pipeline);
+		CHECK(job.m_threadCount == 3);
+		CHECK(job.m_inPath == "a.yuv");
+		CHECK(job.m_inWidth == 1074 && job.m_inHeight == 538);
+		CHECK(job.m_outPath == "b.raw");
+		CHECK(job.m_outWidth == 800 && job.m_outHeight == 400);
+		CHECK(job.m_blendMode == BlendMode::Hard);
+		CHECK(job.m_incremental.m_enabled && !job.m_incremental.m_verify);
+		CHECK(job.m_incremental.m_blockSize == 32);
+		CHECK(!job.m_mipmaps);
+	}
+
+	TEST(EveryModeNameParses)
+	{
+		for (RunMode const mode : {RunMode::GL, RunMode::GLVideo, RunMode::Cpu, RunMode::Video, RunMode::Pipeline,
+								   RunMode::BenchThreads, RunMode::BenchIo, RunMode::BenchStitch, RunMode::BenchBlend})
+			CHECK(ParseRunMode(RunModeName(mode)) == mode);
+		CHECK_THROWS(ParseRunMode("gpu"));
+	}
+
+	TEST(BadOptionsAreRejected)
+	{
+		StitchJob job;
+		for (char const * option : {"colour=red", "mode=gpu", "threads=two", "threads=-1", "in-size=1074", "in-size=0x538",
+									"out-size=800x400x2", "lenses=3", "in=", "procedural=1", "blend=soft", "views=0,0"})
+			CHECK_THROWS(SetJobOption(job, option));
+	}
+
+	TEST(OptionsThatDontGoTogetherAreRejected)
+	{
+		std::vector<std::vector<char const *>> const badJobs = {
+			{"lenses=1", "blend=multiband"},
+			{"incremental", "blend=multiband"},
+			{"block-size=3", "incremental"},
+			{"projection=cubemap", "out-size=800x400"},
+			{"projection=cubemap", "out-size=768x512", "procedural"},
+			{"views=0,0,90"}};
+		for (std::vector<char const *> const & options : badJobs) {
+			StitchJob job;
+			for (char const * option : options)
+				SetJobOption(job, option);
+			CHECK_THROWS(ResolveJob(job));
+		}
+
+		StitchJob job;
+		SetJobOption(job, "projection=rectilinear");
+		SetJobOption(job, "views=0,0,90/90,-30,60");
+		SetJobOption(job, "out-size=1200x600");
+		ResolveJob(job);
+		CHECK(job.m_views.size() == 2);
+	}
+
+	TEST(JobFilesTakeTheCommandLineAsDefaults)
+	{
+		WriteJobFile("# comment\n"
+					 "in=a.jpg out=a.png\n"
+					 "\n"
+					 "  in=b.jpg out=b.png blend=hard threads=2\n");
+		char const * const argv[] = {"ogl", "--blend=multiband", "--jobs=jobtools_test_jobs.txt", "--trace=t.json"};
+		std::string tracePath;
+		std::vector<StitchJob> const jobs = ParseCommandLine(4, argv, tracePath);
+		remove(g_jobFile.c_str());
+		CHECK(tracePath == "t.json");
+		CHECK(jobs.size() == 2);
+		if (jobs.size() != 2)
+			return;
+		CHECK(jobs[0].m_inPath == "a.jpg" && jobs[0].m_blendMode == BlendMode::MultiBand && jobs[0].m_threadCount == 0);
+		CHECK(jobs[1].m_inPath == "b.jpg" && jobs[1].m_blendMode == BlendMode::Hard && jobs[1].m_threadCount == 2);
+	}
+
+	TEST(JobFileErrorsNameTheLine)
+	{
+		CHECK(GetLoadError("in=a.jpg\n\nin=b.jpg blend=soft\n").find(g_jobFile + ":3: ") == 0);
+		CHECK(GetLoadError("# nothing to do\n\n") == "No jobs in " + g_jobFile);
+		remove(g_jobFile.c_str());
+		CHECK_THROWS(LoadJobFile(g_jobFile, StitchJob()));
+
+		char const * const argv[] = {"ogl", "in=a.jpg"};
+		std::string tracePath;
+		CHECK_THROWS(ParseCommandLine(2, argv, tracePath));
+	}
+}
+
+int main()
+{
+	return RunTests();
+}
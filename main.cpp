@@ -1,15 +1,17 @@
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <map>
+#include <tuple>
 
 // Include standard headers
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Include GLEW. Always include it before gl.h and glfw.h, since it's a bit magic.
 #include <GL/glew.h>
 
-// Include GLFW
-#include <GLFW/glfw3.h>
-
 // Include GLM
 #include <glm/glm.hpp>
 
@@ -18,12 +20,26 @@
 
 #include <glm/gtc/matrix_transform.hpp>
 
+#include "blendtools.h"
+#include "cachetools.h"
+#include "calibtools.h"
+#include "codectools.h"
+#include "contexttools.h"
+#include "fishtools.h"
 #include "imgtools.h"
+#include "incrementaltools.h"
+#include "jobtools.h"
+#include "meshtools.h"
 #include "shaders.h"
 #include "ogltools.h"
-
-//#define ONE_FISH
-//#define SAVE_TO_FB
+#include "phototools.h"
+#include "pipelinetools.h"
+#include "projtools.h"
+#include "pyramidtools.h"
+#include "stitchtools.h"
+#include "threadtools.h"
+#include "tracetools.h"
+#include "videotools.h"
 
 namespace std {
 	bool operator<(const glm::vec2 & left, const glm::vec2 & right)
@@ -33,383 +49,1121 @@ namespace std {
 }
 
 namespace {
-	struct FishInfo
+	typedef std::chrono::steady_clock Clock;
+
+	std::string const g_cacheDir = "cache";
+	// A uniform 240x240 grid. With g_meshMaxDepth > 0 the grid is only the starting point:
+	// e.g. 32 and 4 refine up to the density of a 512x512 grid where the mapping needs it
+	size_t const g_meshStepCount = 240;
+	// Per tile of the cubemap and rectilinear outputs, about the density of the sphere mesh for a 90 degree face
+	size_t const g_viewMeshStepCount = 64;
+	size_t const g_meshMaxDepth = 0;
+	float const g_meshMaxError = 1e-4f;
+	size_t const g_decodeQueueDepth = 4;
+	size_t const g_encodeQueueDepth = 4;
+	size_t const g_benchFrameCount = 50;
+	// The coarsest level of 1200x600 is 38x19, wide enough for the low frequencies to blend smoothly
+	size_t const g_multiBandLevelCount = 6;
+	// Per GL stitcher, the least recently used go first. A rig's weights are 4 textures when every blend mode is run
+	size_t const g_maxCachedMeshes = 4;
+	size_t const g_maxCachedWeightTextures = 8;
+	// Videos are decoded in the camera's native 4:2:0 and converted to RGB by the remap itself,
+	// the yuv option does the same for the still image in the GL path
+	std::string const g_yuvPixFmt = "yuv420p";
+
+	// An entry of a cache bounded by EvictLeastRecentlyUsed, lastUse from a counter the owner bumps on every lookup
+	template <typename Value>
+	struct CacheEntry
 	{
-		glm::vec2 m_center;
-		glm::vec3 m_rotation;
-		float m_fov;
-		glm::vec2 m_ratio;
+		Value m_value;
+		size_t m_lastUse;
 	};
 
-	glm::vec2 sphere2fish(glm::vec2 coord, FishInfo const & fishInfo)
+	// Erases the least recently used entries, after release is called on their value, until there is room for one more
+	template <typename Value, typename Release>
+	void EvictLeastRecentlyUsed(std::map<uint64_t, CacheEntry<Value>> & cache, size_t maxCount, Release release)
 	{
-		const float longitude = glm::two_pi<float>() * (coord.x / 2 - 0.5f);
-		const float latitude  = glm::pi<float>() * coord.y / 2;
+		while (!cache.empty() && cache.size() >= maxCount) {
+			auto oldest = cache.begin();
+			for (auto it = cache.begin(); it != cache.end(); ++it)
+				if (it->second.m_lastUse < oldest->second.m_lastUse)
+					oldest = it;
+			release(oldest->second.m_value);
+			cache.erase(oldest);
+		}
+	}
 
-		const glm::vec3 vec3d = {
-			glm::cos(latitude) * glm::sin(longitude),
-			glm::cos(latitude) * glm::cos(longitude),
-			glm::sin(latitude)
-		};
+	// A stitching program with its uniform locations, looked up once
+	struct StitchProgram
+	{
+		GLuint m_id;
+		GLint m_mvpId;
+		GLint m_samplerId;
+		GLint m_ySamplerId;
+		GLint m_uSamplerId;
+		GLint m_vSamplerId;
+		GLint m_interleavedChromaId;
+		GLint m_weightSamplerId;
+		GLint m_whiteBalance0Id;
+		GLint m_whiteBalance1Id;
+	};
 
-		const float theta = glm::atan(vec3d.z, vec3d.x);
-		const float phi = glm::atan(glm::sqrt(vec3d.x * vec3d.x + vec3d.z * vec3d.z), vec3d.y);
-		const float r = phi / fishInfo.m_fov;
+	StitchProgram LoadStitchProgram(std::string const & vertexShaderCode, std::string const & fragmentShaderCode)
+	{
+		StitchProgram program;
+		program.m_id = LoadOrCompileProgram(g_cacheDir, vertexShaderCode, fragmentShaderCode);
+		program.m_mvpId = glGetUniformLocation(program.m_id, "MVP");
+		program.m_samplerId = glGetUniformLocation(program.m_id, "inSampler");
+		program.m_ySamplerId = glGetUniformLocation(program.m_id, "ySampler");
+		program.m_uSamplerId = glGetUniformLocation(program.m_id, "uSampler");
+		program.m_vSamplerId = glGetUniformLocation(program.m_id, "vSampler");
+		program.m_interleavedChromaId = glGetUniformLocation(program.m_id, "interleavedChroma");
+		program.m_weightSamplerId = glGetUniformLocation(program.m_id, "weightSampler");
+		program.m_whiteBalance0Id = glGetUniformLocation(program.m_id, "whiteBalance0");
+		program.m_whiteBalance1Id = glGetUniformLocation(program.m_id, "whiteBalance1");
+		return program;
+	}
 
-		if (r > 0.505f)
-			return glm::vec2(2.0f, 2.0f);
+	// Remap tables for a blend mode. Multi-band stitches each lens into its own image and blends those
+	struct CpuBlend
+	{
+		BlendMode m_mode;
+		std::vector<RemapTable> m_tables;
+		std::vector<RawImage> m_lensImages;
+		std::unique_ptr<MultiBandBlender> m_multiBand;
+	};
 
-		const glm::vec2 fishCoord {
-			r * glm::cos(theta) * fishInfo.m_ratio.x,
-			r * glm::sin(theta) * fishInfo.m_ratio.y
-		};
+	CpuBlend LoadCpuBlend(RawImage const & inTex, FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+						  size_t outWidth, size_t outHeight, BlendMode mode, ThreadPool & pool)
+	{
+		TRACE_SCOPE("remap tables");
+		CpuBlend blend;
+		blend.m_mode = mode;
+		std::vector<BlendMode> tableModes = {mode};
+		if (mode == BlendMode::MultiBand) {
+			tableModes = {BlendMode::Lens0, BlendMode::Lens1};
+			blend.m_multiBand.reset(new MultiBandBlender(BuildBlendWeightMap(fishInfo0, fishInfo1, outWidth, outHeight, mode, pool),
+														 outWidth, outHeight, g_multiBandLevelCount, pool));
+		}
+		for (BlendMode const tableMode : tableModes) {
+			blend.m_tables.push_back(LoadOrBuildRemapTable(g_cacheDir, fishInfo0, fishInfo1, inTex.GetPixFmt(), inTex.GetWidth(),
+														   inTex.GetHeight(), inTex.GetStride(), outWidth, outHeight, tableMode));
+			if (mode == BlendMode::MultiBand)
+				blend.m_lensImages.emplace_back("rgb24", outWidth, outHeight);
+		}
+		return blend;
+	}
 
-		return fishCoord + fishInfo.m_center;
+	void StitchBlended(CpuBlend & blend, RawImage const & inTex, RawImage & outTex, ThreadPool & pool, SimdLevel level)
+	{
+		TRACE_SCOPE("stitch");
+		if (!blend.m_multiBand) {
+			StitchTiled(blend.m_tables[0], inTex, outTex.GetData(), outTex.GetStride(), pool, level);
+			return;
+		}
+
+		for (size_t lens = 0; lens < 2; ++lens)
+			StitchTiled(blend.m_tables[lens], inTex, blend.m_lensImages[lens].GetData(), blend.m_lensImages[lens].GetStride(),
+						pool, level);
+		blend.m_multiBand->Blend(blend.m_lensImages[0], blend.m_lensImages[1], outTex, pool);
 	}
 
-	void GenerateOneFishBuffers(std::vector<glm::vec3> & vertexBufferData,
-								std::vector<glm::vec2> & uvBufferData,
-								std::vector<GLushort> & indexBufferData,
-								FishInfo const & fishInfo)
+	// Mean and largest absolute difference over all channels of two rgb24 images of the same size
+	std::pair<double, int> CompareImages(RawImage const & left, RawImage const & right)
 	{
-		vertexBufferData.clear();
-		uvBufferData.clear();
-		indexBufferData.clear();
+		uint64_t sum = 0;
+		int max = 0;
+		for (size_t y = 0; y < left.GetHeight(); ++y) {
+			uint8_t const * leftRow = reinterpret_cast<uint8_t const *>(left.GetRow(y));
+			uint8_t const * rightRow = reinterpret_cast<uint8_t const *>(right.GetRow(y));
+			for (size_t x = 0; x < 3 * left.GetWidth(); ++x) {
+				int const diff = std::abs(leftRow[x] - rightRow[x]);
+				sum += diff;
+				max = std::max(max, diff);
+			}
+		}
+		return {double(sum) / (3 * left.GetWidth() * left.GetHeight()), max};
+	}
 
-		const size_t xStepCount = 240;
-		const size_t yStepCount = 240;
+	double MeasureCpuStitch(CpuBlend & blend, RawImage const & inTex, RawImage & outTex,
+							ThreadPool & pool, SimdLevel level)
+	{
+		size_t const iterations = 10;
 
-		const float xvStep = 2.0f / xStepCount;
-		const float yvStep = 2.0f / yStepCount;
+		auto const stitchStart = Clock::now();
+		for (size_t i = 0; i < iterations; ++i)
+			StitchBlended(blend, inTex, outTex, pool, level);
+		auto const stitchEnd = Clock::now();
 
-		const float xuvStep = 1.0f / xStepCount;
-		const float yuvStep = 1.0f / yStepCount;
+		return iterations * outTex.GetWidth() * outTex.GetHeight() / MillisecondsBetween(stitchStart, stitchEnd) / 1e3;
+	}
 
-		for (size_t xIndex = 0; xIndex <= xStepCount; ++xIndex)
-			for (size_t yIndex = 0; yIndex <= yStepCount; ++yIndex)
-			{
-				const glm::vec2 sphereCoord{-1.0f + xIndex * xvStep, -1.0f + yIndex * yvStep};
-				const glm::vec2 fishCoord = sphere2fish(sphereCoord, fishInfo);
+	void RunCpuStitch(RawImage const & inTex, FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+					  size_t outWidth, size_t outHeight, BlendMode blendMode, std::string const & outPath,
+					  PyramidSettings const & pyramid, bool measureScaling, ThreadPool & pool)
+	{
+		auto const tableStart = Clock::now();
+		CpuBlend blend = LoadCpuBlend(inTex, fishInfo0, fishInfo1, outWidth, outHeight, blendMode, pool);
+		auto const tableEnd = Clock::now();
+		std::cerr << "Remap table ready in " << MillisecondsBetween(tableStart, tableEnd) << " ms" << std::endl;
+
+		SimdLevel const level = DetectSimdLevel();
+		RawImage outTex("rgb24", outWidth, outHeight);
+
+		// Pools of their own, the shared one waits meanwhile
+		double singleMpps = 0.0;
+		for (size_t count = 1; measureScaling && count <= ThreadPool::GetHardwareThreadCount(); ++count) {
+			ThreadPool countPool(count);
+			double const mpps = MeasureCpuStitch(blend, inTex, outTex, countPool, level);
+			if (count == 1)
+				singleMpps = mpps;
+			std::cerr << "Threads: " << count << ", " << mpps << " MP/s, speedup " << mpps / singleMpps
+					  << ", efficiency " << 100.0 * mpps / singleMpps / count << "%" << std::endl;
+		}
+
+		double const mpps = MeasureCpuStitch(blend, inTex, outTex, pool, level);
+		std::cerr << "CPU stitch (" << SimdLevelName(level) << ", " << BlendModeName(blendMode) << ", "
+				  << pool.GetThreadCount() << " threads): "
+				  << mpps << " MP/s" << std::endl;
+
+		outTex.SaveToFile(outPath);
+		if (!pyramid.m_path.empty())
+			std::cerr << "Pyramid of " << WritePyramid(outTex, pyramid, pool) << " tiles written to " << pyramid.m_path << std::endl;
+	}
 
-				vertexBufferData.push_back({sphereCoord.x, sphereCoord.y, 0.0f});
-				uvBufferData.push_back({fishCoord.x, fishCoord.y});
+	// The stitching of the CPU video modes: every tile of every frame, or with incremental only the tiles
+	// that changed, and the pyramid of the job kept up to date with the frames
+	class CpuVideoStitcher
+	{
+	public:
+		CpuVideoStitcher(RemapTable const & table, IncrementalSettings const & incremental, PyramidSettings const & pyramid,
+						 ThreadPool & pool)
+			: m_table(table)
+			, m_pool(pool)
+			, m_level(DetectSimdLevel())
+		{
+			if (incremental.m_enabled)
+				m_incremental.reset(new IncrementalStitcher(table, incremental, pool, m_level));
+			if (!pyramid.m_path.empty())
+				m_pyramid.reset(new LivePyramid(table.m_width, table.m_height, pyramid, pool, m_level));
+		}
+
+		// Returns outFrame, or the output of the incremental stitcher, which keeps the tiles of the frames before
+		RawImage const & Stitch(RawImage const & inFrame, RawImage & outFrame)
+		{
+			RawImage const * stitched = &outFrame;
+			if (m_incremental) {
+				m_incremental->Stitch(inFrame);
+				stitched = &m_incremental->GetOutput();
 			}
-
-		for (size_t xIndex = 0; xIndex < xStepCount; ++xIndex)
-			for (size_t yIndex = 0; yIndex < yStepCount; ++yIndex)
-			{
-				const GLushort tli = xIndex + yIndex * (xStepCount + 1);
-				const GLushort tri = tli + 1;
-				const GLushort bli = xIndex + (yIndex + 1) * (xStepCount + 1);
-				const GLushort bri = bli + 1;
-				indexBufferData.insert(indexBufferData.end(), {bli, tli, tri, bli, tri, bri});
+			else
+				StitchTiled(m_table, inFrame, outFrame.GetData(), outFrame.GetStride(), m_pool, m_level);
+
+			if (m_pyramid) {
+				auto const pyramidStart = Clock::now();
+				m_pyramidTileCount += m_incremental ?
+					m_pyramid->Update(*stitched, m_incremental->GetStitchedTiles(), m_incremental->GetTileSize()) :
+					m_pyramid->Update(*stitched);
+				m_pyramidMs += MillisecondsSince(pyramidStart);
 			}
+			++m_frameCount;
+			return *stitched;
+		}
+
+		void PrintStats() const
+		{
+			if (m_incremental)
+				std::cerr << m_incremental->GetStats();
+			if (m_pyramid && m_frameCount > 0)
+				std::cerr << "Pyramid: " << double(m_pyramidTileCount) / m_frameCount << " tiles and "
+						  << m_pyramidMs / m_frameCount << " ms per frame" << std::endl;
+		}
+
+	private:
+		RemapTable const & m_table;
+		ThreadPool & m_pool;
+		SimdLevel const m_level;
+		std::unique_ptr<IncrementalStitcher> m_incremental;
+		std::unique_ptr<LivePyramid> m_pyramid;
+		size_t m_frameCount = 0;
+		size_t m_pyramidTileCount = 0;
+		double m_pyramidMs = 0.0;
+	};
+
+	void RunVideoStitch(std::string const & inPath, std::string const & outPath, size_t inWidth, size_t inHeight,
+						FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+						size_t outWidth, size_t outHeight, BlendMode blendMode,
+						IncrementalSettings const & incremental, PyramidSettings const & pyramid, ThreadPool & pool)
+	{
+		RawImage inFrame(g_yuvPixFmt, inWidth, inHeight);
+		RawImage outFrame("rgb24", outWidth, outHeight);
+
+		RemapTable const table = LoadOrBuildRemapTable(g_cacheDir, fishInfo0, fishInfo1, g_yuvPixFmt,
+													   inWidth, inHeight, inFrame.GetStride(), outWidth, outHeight, blendMode);
+		CpuVideoStitcher stitcher(table, incremental, pyramid, pool);
+
+		VideoReader reader(inPath, inWidth, inHeight, g_yuvPixFmt);
+		VideoWriter writer(outPath, outWidth, outHeight);
+
+		// Decode and encode times are the time spent waiting on the ffmpeg pipes
+		double decodeMs = 0.0;
+		double stitchMs = 0.0;
+		double encodeMs = 0.0;
+		size_t frameCount = 0;
+
+		auto const start = Clock::now();
+		for (;;) {
+			auto const decodeStart = Clock::now();
+			if (!reader.ReadFrame(inFrame))
+				break;
+			auto const stitchStart = Clock::now();
+			RawImage const & stitched = stitcher.Stitch(inFrame, outFrame);
+			auto const encodeStart = Clock::now();
+			writer.WriteFrame(stitched);
+			auto const encodeEnd = Clock::now();
+
+			decodeMs += MillisecondsBetween(decodeStart, stitchStart);
+			stitchMs += MillisecondsBetween(stitchStart, encodeStart);
+			encodeMs += MillisecondsBetween(encodeStart, encodeEnd);
+			++frameCount;
+		}
+		writer.Close();
+		auto const end = Clock::now();
+
+		if (frameCount == 0)
+			throw std::runtime_error("No frames decoded from " + inPath);
+
+		std::cerr << "Frames: " << frameCount << ", " << frameCount * 1e3 / MillisecondsBetween(start, end) << " fps" << std::endl;
+		std::cerr << "Per frame: decode " << decodeMs / frameCount << " ms, stitch " << stitchMs / frameCount
+				  << " ms, encode " << encodeMs / frameCount << " ms" << std::endl;
+		stitcher.PrintStats();
 	}
 
-	glm::vec2 sphere2fish2(glm::vec2 const & coord, FishInfo const & fishInfo)
+	void RunVideoPipeline(std::string const & inPath, std::string const & outPath, size_t inWidth, size_t inHeight,
+						  FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+						  size_t outWidth, size_t outHeight, BlendMode blendMode,
+						  IncrementalSettings const & incremental, PyramidSettings const & pyramid, ThreadPool & pool)
 	{
-		/*
-		 *
-		 * Z   Y
-		 * |  /
-		 * | /
-		 * |/
-		 * ------- X
-		 *
-		 */
+		RemapTable const table = LoadOrBuildRemapTable(g_cacheDir, fishInfo0, fishInfo1, g_yuvPixFmt,
+													   inWidth, inHeight, GetPaddedStride(g_yuvPixFmt, inWidth), outWidth, outHeight,
+													   blendMode);
+		CpuVideoStitcher stitcher(table, incremental, pyramid, pool);
+
+		VideoReader reader(inPath, inWidth, inHeight, g_yuvPixFmt);
+		VideoWriter writer(outPath, outWidth, outHeight);
+
+		PipelineConfig config;
+		config.m_decodeQueueDepth = g_decodeQueueDepth;
+		config.m_encodeQueueDepth = g_encodeQueueDepth;
+		config.m_inPixFmt = g_yuvPixFmt;
+		config.m_inWidth = inWidth;
+		config.m_inHeight = inHeight;
+		config.m_outWidth = outWidth;
+		config.m_outHeight = outHeight;
+
+		PipelineStages stages;
+		stages.m_decode = [&](RawImage & frame) {
+			return reader.ReadFrame(frame);
+		};
+		// Frames come in order to the single process thread, the incremental output is copied into the pool's frame
+		stages.m_process = [&](RawImage const & inFrame, RawImage & outFrame) {
+			RawImage const & stitched = stitcher.Stitch(inFrame, outFrame);
+			if (&stitched != &outFrame)
+				memcpy(outFrame.GetData(), stitched.GetData(), stitched.GetDataSize());
+		};
+		stages.m_encode = [&](RawImage const & frame) {
+			writer.WriteFrame(frame);
+		};
 
-		const float longitude = glm::two_pi<float>() * coord.x / 2.0f + fishInfo.m_rotation.z;
-		const float latitude  = glm::pi<float>() * coord.y / -2.0f;
+		PipelineStats const stats = RunPipeline(config, stages);
+		writer.Close();
 
-		glm::mat4 rotateMat = glm::rotate(glm::mat4(1.0f), fishInfo.m_rotation.y, glm::vec3(0.0f, 1.0f, 0.0f));
-		rotateMat = glm::rotate(rotateMat, fishInfo.m_rotation.x, glm::vec3(1.0f, 0.0f, 0.0f));
+		if (stats.m_frameCount == 0)
+			throw std::runtime_error("No frames decoded from " + inPath);
 
-		const glm::vec3 vec3d = rotateMat * glm::vec4(
-			glm::cos(latitude) * glm::sin(longitude),
-			glm::cos(latitude) * glm::cos(longitude),
-			glm::sin(latitude),
-			1
-		);
+		std::cerr << stats;
+		stitcher.PrintStats();
+	}
 
-		const float theta = glm::atan(vec3d.z, vec3d.x);
-		const float phi = glm::atan(glm::sqrt(vec3d.x * vec3d.x + vec3d.z * vec3d.z), vec3d.y);
-		const float r = phi / fishInfo.m_fov;
+	// Saves and loads the image in every format both in-process and through ffmpeg
+	void RunImageIoBench(RawImage const & image)
+	{
+		char const * const extensions[] = {"bmp", "ppm", "jpg", "png"};
+		for (char const * extension : extensions) {
+			std::string const path = std::string("bench.") + extension;
+			if (!HasNativeCodec(GetImageFormat(path))) {
+				std::cerr << extension << ": no native codec" << std::endl;
+				continue;
+			}
 
-		if (r > 0.5001f)
-			return glm::vec2(2.0f, 2.0f);
+			Clock::time_point const start = Clock::now();
+			image.SaveToFile(path);
+			Clock::time_point const saved = Clock::now();
+			RawImage const native = RawImage::LoadFromFile(path, image.GetWidth(), image.GetHeight());
+			Clock::time_point const loaded = Clock::now();
+			image.SaveWithFfmpeg(path);
+			Clock::time_point const ffmpegSaved = Clock::now();
+			RawImage const ffmpeg = RawImage::LoadWithFfmpeg(path, image.GetWidth(), image.GetHeight());
+			Clock::time_point const ffmpegLoaded = Clock::now();
+
+			std::cerr << extension << ": native save " << MillisecondsBetween(start, saved)
+					  << " ms, load " << MillisecondsBetween(saved, loaded)
+					  << " ms; ffmpeg save " << MillisecondsBetween(loaded, ffmpegSaved)
+					  << " ms, load " << MillisecondsBetween(ffmpegSaved, ffmpegLoaded) << " ms" << std::endl;
+		}
+	}
+	// The other modes always write files, GL stitched images without an out= path are shown in a window
+	bool IsShownInWindow(StitchJob const & job)
+	{
+		return job.m_mode == RunMode::GL && job.m_outPath.empty() && job.m_pyramid.m_path.empty();
+	}
 
-		const glm::vec2 fishCoord {
-			r * glm::cos(theta) * fishInfo.m_ratio.x,
-			r * glm::sin(theta) * fishInfo.m_ratio.y
-		};
+	bool IsGLMode(RunMode mode)
+	{
+		return mode == RunMode::GL || mode == RunMode::GLVideo || mode == RunMode::BenchStitch || mode == RunMode::BenchBlend;
+	}
 
-		return fishCoord + fishInfo.m_center;
+	std::string GetOutPath(StitchJob const & job, std::string const & defaultPath)
+	{
+		return job.m_outPath.empty() ? defaultPath : job.m_outPath;
 	}
 
+	// The out= image and the pyramid, whichever the job asks for
+	void SaveOutput(StitchJob const & job, RawImage const & outTex, ThreadPool & pool)
+	{
+		if (!job.m_outPath.empty())
+			outTex.SaveToFile(job.m_outPath);
+		if (!job.m_pyramid.m_path.empty()) {
+			auto const start = Clock::now();
+			size_t const tileCount = WritePyramid(outTex, job.m_pyramid, pool);
+			std::cerr << "Pyramid of " << tileCount << " tiles written in " << MillisecondsSince(start)
+					  << " ms to " << job.m_pyramid.m_path << std::endl;
+		}
+	}
+
+	// Throws for a job without input, or with options its mode can't do
+	void CheckJob(StitchJob const & job)
+	{
+		if (job.m_inPath.empty())
+			throw std::runtime_error("The job has no input, give it an in= path");
+
+		RunMode const mode = job.m_mode;
+		bool const isVideo = mode == RunMode::GLVideo || mode == RunMode::Video || mode == RunMode::Pipeline;
+		// The benchmarks of the GL modes run the CPU remap as well
+		bool const usesCpuRemap = mode != RunMode::BenchIo &&
+				(!IsGLMode(mode) || mode == RunMode::BenchStitch || mode == RunMode::BenchBlend);
+		if (!job.m_dualFish && (usesCpuRemap || isVideo || job.m_yuvInput))
+			throw std::runtime_error("Single fisheye input is only stitched on the GPU from rgb24");
+		if (job.m_projection != OutputProjection::Equirect && usesCpuRemap)
+			throw std::runtime_error("Only the GPU renders projections other than equirect");
+		if (isVideo && (job.m_estimateGains || !job.m_calibrateOutPath.empty()))
+			throw std::runtime_error("Calibration needs a still image, the video modes can't calibrate");
+		if (job.m_incremental.m_enabled && mode != RunMode::Video && mode != RunMode::Pipeline)
+			throw std::runtime_error("incremental is implemented for the CPU video modes only");
+		if (!job.m_pyramid.m_path.empty() && mode != RunMode::GL && mode != RunMode::Cpu && mode != RunMode::BenchThreads &&
+				mode != RunMode::Video && mode != RunMode::Pipeline)
+			throw std::runtime_error(std::string("pyramid= isn't written by mode=") + RunModeName(mode));
+		if (job.m_yuvInput && mode != RunMode::GL)
+			throw std::runtime_error("yuv is for mode=gl, the video modes always decode yuv420p");
+	}
+
+	RawImage LoadInput(StitchJob const & job)
+	{
+		// Filled by the render loop
+		if (job.m_mode == RunMode::GLVideo)
+			return RawImage(g_yuvPixFmt, job.m_inWidth, job.m_inHeight);
+		if (job.m_yuvInput)
+			return RawImage::LoadWithFfmpeg(job.m_inPath, job.m_inWidth, job.m_inHeight, g_yuvPixFmt);
+		return RawImage::LoadFromFile(job.m_inPath, job.m_inWidth, job.m_inHeight);
+	}
+
+	// Fits whatever the job asks for to its input, before anything is built from the calibration
+	void CalibrateJob(StitchJob & job, RawImage const & inTex, ThreadPool & pool)
+	{
+		TRACE_SCOPE("calibrate");
+		if (!job.m_calibrateOutPath.empty()) {
+			Clock::time_point const start = Clock::now();
+			CalibrationResult const calibration = CalibrateDualFish(inTex, job.m_fishInfo0, job.m_fishInfo1, CalibrationSettings(), pool);
+			Clock::time_point const end = Clock::now();
+			job.m_fishInfo0 = calibration.m_fishInfo0;
+			job.m_fishInfo1 = calibration.m_fishInfo1;
+			std::cerr << "Calibrated in " << MillisecondsBetween(start, end) << " ms from " << calibration.m_matchCount
+					  << " matches, rms error " << glm::degrees(calibration.m_rmsError) << " degrees" << std::endl;
+		}
+
+		if (job.m_estimateGains) {
+			std::tie(job.m_fishInfo0.m_photometric, job.m_fishInfo1.m_photometric) =
+					EstimatePhotometric(inTex, job.m_fishInfo0, job.m_fishInfo1, job.m_outWidth, job.m_outHeight, pool);
+			for (PhotometricInfo const & photometric : {job.m_fishInfo0.m_photometric, job.m_fishInfo1.m_photometric})
+				std::cerr << "Lens gain " << photometric.m_gain << ", white balance " << photometric.m_whiteBalance.x << " "
+						  << photometric.m_whiteBalance.y << " " << photometric.m_whiteBalance.z << std::endl;
+		}
+
+		if (!job.m_calibrateOutPath.empty()) {
+			SaveCalibration(job.m_calibrateOutPath, job.m_fishInfo0, job.m_fishInfo1);
+			std::cerr << "Calibration saved to " << job.m_calibrateOutPath << std::endl;
+		}
+	}
 
-	void GenerateDualFishBuffers(std::vector<glm::vec3> & vertexBufferData,
-								 std::vector<glm::vec2> & uvBufferData0,
-								 std::vector<glm::vec2> & uvBufferData1,
-								 std::vector<GLushort> & indexBufferData,
-								 FishInfo const & fishInfo0,
-								 FishInfo const & fishInfo1)
+	// Runs the jobs one after the other, a failed job doesn't stop the rest. Returns the exit code
+	int RunJobs(std::vector<StitchJob> & jobs, std::function<void(StitchJob &)> const & run)
 	{
-		vertexBufferData.clear();
-		uvBufferData0.clear();
-		uvBufferData0.clear();
-		indexBufferData.clear();
+		int result = 0;
+		for (size_t i = 0; i < jobs.size(); ++i) {
+			if (jobs.size() > 1)
+				std::cerr << "Job " << i + 1 << "/" << jobs.size() << ": " << jobs[i].m_inPath << std::endl;
+
+			Clock::time_point const start = Clock::now();
+			try {
+				run(jobs[i]);
+			}
+			catch (std::exception const & e) {
+				std::cerr << e.what() << std::endl;
+				result = -1;
+				continue;
+			}
+			if (jobs.size() > 1)
+				std::cerr << "Job done in " << MillisecondsSince(start) << " ms" << std::endl;
+		}
+		return result;
+	}
 
-		const size_t xStepCount = 240;
-		const size_t yStepCount = 240;
+	enum class ProgramKind
+	{
+		OneFish,
+		Mesh,
+		Procedural
+	};
 
-		const float xvStep = 2.0f / xStepCount;
-		const float yvStep = 2.0f / yStepCount;
+	// yuv samples the planes of a yuv420p or nv12 input, single fisheye is rgb24 only
+	StitchProgram LoadStitchProgram(ProgramKind kind, bool yuv)
+	{
+		switch (kind) {
+		case ProgramKind::OneFish:
+			return LoadStitchProgram(g_vertexShaderCode360, g_fragmentShaderCode360FBCut);
+		case ProgramKind::Mesh:
+			return LoadStitchProgram(g_vertexShaderCode360DualFish,
+									 yuv ? g_fragmentShaderCode360FBCutDualFishYuv : g_fragmentShaderCode360FBCutDualFish);
+		default:
+			return LoadStitchProgram(g_vertexShaderCode360FullScreen,
+									 yuv ? g_fragmentShaderCode360ProceduralDualFishYuv : g_fragmentShaderCode360ProceduralDualFish);
+		}
+	}
 
-		const float xuvStep = 1.0f / xStepCount;
-		const float yuvStep = 1.0f / yStepCount;
+	// GL side of the stitch, kept from job to job in the same context. Programs are compiled when first
+	// needed, the last few meshes and weight textures are kept per calibration and output size, so jobs of the same rig
+	// only upload their input. The input textures and the framebuffer are reused and resized as needed
+	class GLStitcher
+	{
+	public:
+		explicit GLStitcher(ThreadPool & pool)
+			: m_pool(pool)
+			, m_mvp(CreateSimpleMPVMatrix())
+			, m_meshMvp(m_mvp * GLMesh::GetPositionDecodeMatrix())
+		{
+		}
+
+		~GLStitcher()
+		{
+			for (auto const & programs : m_programs)
+				for (StitchProgram const & program : programs)
+					if (program.m_id)
+						glDeleteProgram(program.m_id);
+			for (auto const & weightTexture : m_weightTextures)
+				glDeleteTextures(1, &weightTexture.second.m_value);
+			if (!m_inTextureIds.empty())
+				glDeleteTextures(m_inTextureIds.size(), m_inTextureIds.data());
+			if (m_frameBuffer.first)
+				DeleteFrameBuffer(m_frameBuffer);
+		}
+
+		GLStitcher(GLStitcher const &) = delete;
+		GLStitcher & operator=(GLStitcher const &) = delete;
+
+		void SetJob(StitchJob const & job, RawImage const & inTex)
+		{
+			m_job = job;
+			m_layout = MakeViewLayout(job.m_projection, job.m_views, job.m_outWidth, job.m_outHeight);
+			++m_jobIndex;
+			UpdateInput(inTex);
+			m_mesh = &GetMesh();
+			std::cerr << "Stitching: " << (job.m_procedural ? "procedural" : "mesh") << ", blending: "
+					  << BlendModeName(job.m_blendMode) << ", projection: " << ProjectionName(job.m_projection) << std::endl;
+		}
+
+		// Refills the input textures from client memory, they are only recreated when the format or size changes
+		void UpdateInput(RawImage const & inTex)
+		{
+			TRACE_GL_SCOPE("upload");
+			SetInputFormat(inTex.GetPixFmt(), inTex.GetWidth(), inTex.GetHeight());
+			for (size_t plane = 0; plane < m_inTextureIds.size(); ++plane)
+				UpdatePlaneTexture(m_inTextureIds[plane], inTex, plane);
+			GenerateInputMipmaps();
+		}
+
+		// Streaming input for video: the next frame goes into the returned image, which is mapped GPU
+		// memory in the format of the last UpdateInput(), then UploadInputFrame() queues its upload
+		RawImage AcquireInputFrame()
+		{
+			if (!m_uploadRing)
+				m_uploadRing.reset(new UploadRing(m_inPixFmt, m_inWidth, m_inHeight));
+			return m_uploadRing->Acquire();
+		}
+
+		void UploadInputFrame()
+		{
+			TRACE_GL_SCOPE("upload");
+			m_uploadRing->Upload(m_inTextureIds);
+			GenerateInputMipmaps();
+		}
+
+		double GetUploadStallMs() const
+		{
+			return m_uploadRing ? m_uploadRing->GetStallMs() : 0.0;
+		}
+
+		// The output sized framebuffer, bound and with the viewport set
+		GLuint BindFrameBuffer()
+		{
+			if (!m_frameBuffer.first || m_frameBufferWidth != m_job.m_outWidth || m_frameBufferHeight != m_job.m_outHeight) {
+				if (m_frameBuffer.first)
+					DeleteFrameBuffer(m_frameBuffer);
+				m_frameBuffer = CreateFrameBuffer(m_job.m_outWidth, m_job.m_outHeight);
+				m_frameBufferWidth = m_job.m_outWidth;
+				m_frameBufferHeight = m_job.m_outHeight;
+			}
+			glBindFramebuffer(GL_FRAMEBUFFER, m_frameBuffer.first);
+			glViewport(0, 0, m_job.m_outWidth, m_job.m_outHeight);
+			return m_frameBuffer.first;
+		}
+
+		// Leaves targetFrameBuffer bound with the output in it. Multi-band stitches the lenses with the
+		// Lens0 and Lens1 weights, then blends them
+		void Draw(bool procedural, BlendMode mode, GLuint targetFrameBuffer)
+		{
+			TRACE_GL_SCOPE("draw");
+			if (mode != BlendMode::MultiBand) {
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+				DrawStitch(procedural, GetWeightTexture(mode));
+				return;
+			}
 
-		for (size_t xIndex = 0; xIndex <= xStepCount; ++xIndex)
-			for (size_t yIndex = 0; yIndex <= yStepCount; ++yIndex)
-			{
-				const glm::vec2 sphereCoord{-1.0f + xIndex * xvStep, -1.0f + yIndex * yvStep};
-				const glm::vec2 fishCoord0 = sphere2fish2(sphereCoord, fishInfo0);
-				const glm::vec2 fishCoord1 = sphere2fish2(sphereCoord, fishInfo1);
+			GLMultiBandBlender & blender = GetMultiBandBlender();
+			for (BlendMode const lensMode : {BlendMode::Lens0, BlendMode::Lens1}) {
+				blender.BindLensTarget(lensMode == BlendMode::Lens0 ? 0 : 1);
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+				DrawStitch(procedural, GetWeightTexture(lensMode));
+			}
+			blender.Blend(targetFrameBuffer);
+		}
+
+	private:
+		// One immutable texture per plane, the shader samples them separately and converts YUV to RGB.
+		// nv12 chroma is a single two-channel texture bound to both chroma samplers
+		void SetInputFormat(std::string const & pixFmt, size_t width, size_t height)
+		{
+			if (!m_inTextureIds.empty() && pixFmt == m_inPixFmt && width == m_inWidth && height == m_inHeight &&
+					m_job.m_mipmaps == m_inMipmaps)
+				return;
+
+			if (!m_inTextureIds.empty())
+				glDeleteTextures(m_inTextureIds.size(), m_inTextureIds.data());
+			m_inTextureIds.clear();
+			m_uploadRing.reset();
+			// rgb24 keeps the wrapping it always had, the lenses touch the edges of the frame
+			for (size_t plane = 0; plane < GetPlaneCount(pixFmt); ++plane)
+				m_inTextureIds.push_back(CreatePlaneTexture(pixFmt, width, height, plane, m_job.m_mipmaps,
+															pixFmt == "rgb24" ? GL_REPEAT : GL_CLAMP_TO_EDGE));
+			m_inPixFmt = pixFmt;
+			m_inWidth = width;
+			m_inHeight = height;
+			m_inMipmaps = m_job.m_mipmaps;
+		}
+
+		bool IsYuvInput() const
+		{
+			return m_inPixFmt != "rgb24";
+		}
+
+		void GenerateInputMipmaps()
+		{
+			if (!m_inMipmaps)
+				return;
+			for (GLuint const textureId : m_inTextureIds) {
+				glBindTexture(GL_TEXTURE_2D, textureId);
+				glGenerateMipmap(GL_TEXTURE_2D);
+			}
+		}
+
+		// The program with the uniforms of the current job
+		StitchProgram const & GetProgram(bool procedural)
+		{
+			ProgramKind const kind = !m_job.m_dualFish ? ProgramKind::OneFish : procedural ? ProgramKind::Procedural : ProgramKind::Mesh;
+			bool const yuv = IsYuvInput();
+			StitchProgram & program = m_programs[yuv][size_t(kind)];
+			if (!program.m_id)
+				program = LoadStitchProgram(kind, yuv);
+			glUseProgram(program.m_id);
+
+			size_t & programJob = m_programJobs[yuv][size_t(kind)];
+			if (programJob != m_jobIndex) {
+				programJob = m_jobIndex;
+				if (kind == ProgramKind::Procedural) {
+					SetFishProjectionUniform(program.m_id, "fish0", MakeFishProjection(m_job.m_fishInfo0));
+					SetFishProjectionUniform(program.m_id, "fish1", MakeFishProjection(m_job.m_fishInfo1));
+				}
+				if (kind != ProgramKind::OneFish) {
+					glUniform3fv(program.m_whiteBalance0Id, 1, &m_job.m_fishInfo0.m_photometric.m_whiteBalance[0]);
+					glUniform3fv(program.m_whiteBalance1Id, 1, &m_job.m_fishInfo1.m_photometric.m_whiteBalance[0]);
+				}
+			}
+			return program;
+		}
+
+		GLMesh const & GetMesh()
+		{
+			MeshSettings meshSettings;
+			meshSettings.m_stepCount = g_meshStepCount;
+			meshSettings.m_maxDepth = g_meshMaxDepth;
+			meshSettings.m_maxError = g_meshMaxError;
+
+			Hasher hasher;
+			hasher.Add(m_job.m_dualFish);
+			HashFishInfo(hasher, m_job.m_fishInfo0);
+			if (m_job.m_dualFish)
+				HashFishInfo(hasher, m_job.m_fishInfo1);
+			HashViewLayout(hasher, m_layout);
+			uint64_t const key = hasher.Get();
+			auto const cached = m_meshes.find(key);
+			if (cached != m_meshes.end()) {
+				cached->second.m_lastUse = ++m_cacheUseCount;
+				return *cached->second.m_value;
+			}
 
-				vertexBufferData.push_back({sphereCoord.x, sphereCoord.y, 0.0f});
-				uvBufferData0.push_back(fishCoord0);
-				uvBufferData1.push_back(fishCoord1);
+			TRACE_SCOPE("mesh");
+			auto const meshStart = Clock::now();
+			// The tiles of the other projections go into the framebuffer as one mesh, drawn in one call
+			FishMesh const mesh = !m_job.m_dualFish ? GenerateOneFishMesh(m_job.m_fishInfo0, g_meshStepCount) :
+					m_job.m_projection == OutputProjection::Equirect ?
+					LoadOrGenerateDualFishMesh(g_cacheDir, m_job.m_fishInfo0, m_job.m_fishInfo1, meshSettings, m_pool) :
+					GenerateViewMesh(m_job.m_fishInfo0, m_job.m_fishInfo1, m_layout, g_viewMeshStepCount, m_pool);
+			auto const meshEnd = Clock::now();
+			std::cerr << "Mesh ready in " << MillisecondsBetween(meshStart, meshEnd) << " ms, "
+					  << mesh.m_vertices.size() << " vertices, " << mesh.m_indices.size() / 3 << " triangles" << std::endl;
+
+			// m_mesh is only replaced after this, the mesh it points to may be evicted
+			EvictLeastRecentlyUsed(m_meshes, g_maxCachedMeshes, [](std::unique_ptr<GLMesh> &) {});
+			CacheEntry<std::unique_ptr<GLMesh>> & entry = m_meshes[key];
+			entry.m_value.reset(new GLMesh(mesh));
+			entry.m_lastUse = ++m_cacheUseCount;
+			std::unique_ptr<GLMesh> const & glMesh = entry.m_value;
+			size_t const floatVertexSize = sizeof(glm::vec3) + sizeof(glm::vec2) * (mesh.m_uvs1.empty() ? 1 : 2);
+			std::cerr << "Vertex data: " << glMesh->GetVertexCount() * glMesh->GetVertexSize() / 1024 << " KB interleaved, "
+					  << glMesh->GetVertexCount() * floatVertexSize / 1024 << " KB as separate float buffers" << std::endl;
+			return *glMesh;
+		}
+
+		// Whatever the blend weights depend on: the calibration, photometric part included, the output size and layout
+		uint64_t GetWeightKey(BlendMode mode) const
+		{
+			Hasher hasher;
+			for (FishInfo const * fishInfo : {&m_job.m_fishInfo0, &m_job.m_fishInfo1}) {
+				HashFishInfo(hasher, *fishInfo);
+				HashPhotometricInfo(hasher, fishInfo->m_photometric);
+			}
+			hasher.Add(m_job.m_outWidth).Add(m_job.m_outHeight).Add(mode);
+			HashViewLayout(hasher, m_layout);
+			return hasher.Get();
+		}
+
+		GLuint GetWeightTexture(BlendMode mode)
+		{
+			// The single fisheye shader has no weights
+			if (!m_job.m_dualFish)
+				return 0;
+
+			uint64_t const key = GetWeightKey(mode);
+			auto const cached = m_weightTextures.find(key);
+			if (cached != m_weightTextures.end()) {
+				cached->second.m_lastUse = ++m_cacheUseCount;
+				return cached->second.m_value;
 			}
 
-		for (size_t xIndex = 0; xIndex < xStepCount; ++xIndex)
-			for (size_t yIndex = 0; yIndex < yStepCount; ++yIndex)
-			{
-				const GLushort tli = xIndex + yIndex * (xStepCount + 1);
-				const GLushort tri = tli + 1;
-				const GLushort bli = xIndex + (yIndex + 1) * (xStepCount + 1);
-				const GLushort bri = bli + 1;
-				indexBufferData.insert(indexBufferData.end(), {bli, tli, tri, bli, tri, bri});
+			TRACE_SCOPE("weights");
+			auto const weightStart = Clock::now();
+			FishInfo const & fishInfo0 = m_job.m_fishInfo0;
+			FishInfo const & fishInfo1 = m_job.m_fishInfo1;
+			size_t const width = m_job.m_outWidth;
+			size_t const height = m_job.m_outHeight;
+			bool const isEquirect = m_job.m_projection == OutputProjection::Equirect;
+			// The radial photometric gains go into the weight textures, the white balance into uniforms
+			std::vector<uint32_t> const gains = !HasPhotometricCorrection(fishInfo0, fishInfo1) ? std::vector<uint32_t>() :
+					isEquirect ? BuildGainMap(fishInfo0, fishInfo1, width, height, m_pool) :
+					BuildViewGainMap(fishInfo0, fishInfo1, m_layout, width, height, m_pool);
+			std::vector<uint32_t> const weights = isEquirect ? BuildBlendWeightMap(fishInfo0, fishInfo1, width, height, mode, m_pool) :
+					BuildViewWeightMap(fishInfo0, fishInfo1, m_layout, width, height, mode, m_pool);
+			GLuint const textureId = CreateWeightTexture(weights, gains, width, height);
+			// The textures already drawn with may go, GL keeps them until those draws are done
+			EvictLeastRecentlyUsed(m_weightTextures, g_maxCachedWeightTextures, [](GLuint id) { glDeleteTextures(1, &id); });
+			m_weightTextures[key] = {textureId, ++m_cacheUseCount};
+			std::cerr << BlendModeName(mode) << " weights ready in " << MillisecondsSince(weightStart) << " ms" << std::endl;
+			return textureId;
+		}
+
+		GLMultiBandBlender & GetMultiBandBlender()
+		{
+			if (!m_multiBandBlender)
+				m_multiBandBlender.reset(new GLMultiBandBlender(g_cacheDir, g_multiBandLevelCount));
+
+			uint64_t const key = GetWeightKey(BlendMode::MultiBand);
+			if (key != m_multiBandKey) {
+				m_multiBandBlender->SetWeights(BuildBlendWeightMap(m_job.m_fishInfo0, m_job.m_fishInfo1, m_job.m_outWidth, m_job.m_outHeight,
+																   BlendMode::MultiBand, m_pool),
+											   m_job.m_outWidth, m_job.m_outHeight);
+				m_multiBandKey = key;
+			}
+			return *m_multiBandBlender;
+		}
+
+		void DrawStitch(bool procedural, GLuint weightTextureId)
+		{
+			StitchProgram const & program = GetProgram(procedural);
+			glUniformMatrix4fv(program.m_mvpId, 1, GL_FALSE, procedural ? &m_mvp[0][0] : &m_meshMvp[0][0]);
+
+			// Don't forget to bind input texture back after working with fb
+			for (size_t plane = 0; plane < m_inTextureIds.size(); ++plane) {
+				glActiveTexture(GL_TEXTURE0 + plane);
+				glBindTexture(GL_TEXTURE_2D, m_inTextureIds[plane]);
+			}
+			if (IsYuvInput()) {
+				glUniform1i(program.m_ySamplerId, 0);
+				glUniform1i(program.m_uSamplerId, 1);
+				glUniform1i(program.m_vSamplerId, m_inTextureIds.size() > 2 ? 2 : 1);
+				glUniform1i(program.m_interleavedChromaId, m_inTextureIds.size() == 2);
 			}
+			else
+				glUniform1i(program.m_samplerId, 0);
+
+			// After the plane textures
+			glActiveTexture(GL_TEXTURE3);
+			glBindTexture(GL_TEXTURE_2D, weightTextureId);
+			glUniform1i(program.m_weightSamplerId, 3);
+			glActiveTexture(GL_TEXTURE0);
+
+			if (procedural) {
+				if (!m_fullScreenTriangle)
+					m_fullScreenTriangle.reset(new FullScreenTriangle);
+				m_fullScreenTriangle->Draw();
+				return;
+			}
+			m_mesh->Draw();
+		}
+
+	private:
+		ThreadPool & m_pool;
+		glm::mat4 const m_mvp;
+		glm::mat4 const m_meshMvp;
+
+		StitchJob m_job;
+		ViewLayout m_layout;
+		size_t m_jobIndex = 0;
+		GLMesh const * m_mesh = nullptr;
+
+		// Indexed by YUV input and ProgramKind, with the job their uniforms were last set for
+		StitchProgram m_programs[2][3] = {};
+		size_t m_programJobs[2][3] = {};
+		std::unique_ptr<FullScreenTriangle> m_fullScreenTriangle;
+
+		std::map<uint64_t, CacheEntry<std::unique_ptr<GLMesh>>> m_meshes;
+		std::map<uint64_t, CacheEntry<GLuint>> m_weightTextures;
+		size_t m_cacheUseCount = 0;
+		std::unique_ptr<GLMultiBandBlender> m_multiBandBlender;
+		uint64_t m_multiBandKey = 0;
+
+		std::vector<GLuint> m_inTextureIds;
+		std::string m_inPixFmt;
+		size_t m_inWidth = 0;
+		size_t m_inHeight = 0;
+		bool m_inMipmaps = false;
+		std::unique_ptr<UploadRing> m_uploadRing;
+
+		std::pair<GLuint, GLuint> m_frameBuffer = {};
+		size_t m_frameBufferWidth = 0;
+		size_t m_frameBufferHeight = 0;
+	};
+
+	// Times mesh and procedural stitching, the CPU stitch evaluates sphere2fish2 exactly for every pixel
+	void RunStitchModesBench(GLStitcher & stitcher, StitchJob const & job, RawImage const & inTex, ThreadPool & pool)
+	{
+		size_t const outWidth = job.m_outWidth;
+		size_t const outHeight = job.m_outHeight;
+		RawImage const reference = Stitch(BuildRemapTable(job.m_fishInfo0, job.m_fishInfo1, inTex.GetPixFmt(), inTex.GetWidth(),
+														  inTex.GetHeight(), inTex.GetStride(), outWidth, outHeight, job.m_blendMode),
+										  inTex, pool);
+
+		GLuint const frameBuffer = stitcher.BindFrameBuffer();
+		for (bool const useProcedural : {false, true}) {
+			// The first frame pays for shader and texture setup in the driver
+			stitcher.Draw(useProcedural, job.m_blendMode, frameBuffer);
+			glFinish();
+
+			auto const start = Clock::now();
+			for (size_t frame = 0; frame < g_benchFrameCount; ++frame)
+				stitcher.Draw(useProcedural, job.m_blendMode, frameBuffer);
+			glFinish();
+			auto const end = Clock::now();
+
+			std::pair<double, int> const error = CompareImages(GetFBTexture(outWidth, outHeight), reference);
+			std::cerr << (useProcedural ? "Procedural" : "Mesh") << ": " << MillisecondsBetween(start, end) / g_benchFrameCount
+					  << " ms per frame, difference to the CPU stitch: mean " << error.first << ", max " << error.second << std::endl;
+		}
+	}
+
+	void RunBlendModesBench(GLStitcher & stitcher, StitchJob const & job, RawImage const & inTex, ThreadPool & pool)
+	{
+		size_t const outWidth = job.m_outWidth;
+		size_t const outHeight = job.m_outHeight;
+		SimdLevel const level = DetectSimdLevel();
+		RawImage cpuOutTex("rgb24", outWidth, outHeight);
+
+		GLuint const frameBuffer = stitcher.BindFrameBuffer();
+		for (BlendMode const mode : {BlendMode::Hard, BlendMode::Feather, BlendMode::MultiBand}) {
+			stitcher.Draw(job.m_procedural, mode, frameBuffer);
+			glFinish();
+
+			auto const start = Clock::now();
+			for (size_t frame = 0; frame < g_benchFrameCount; ++frame)
+				stitcher.Draw(job.m_procedural, mode, frameBuffer);
+			glFinish();
+			auto const end = Clock::now();
+			GetFBTexture(outWidth, outHeight).SaveToFile(std::string("blend_") + BlendModeName(mode) + ".png");
+
+			CpuBlend cpuBlend = LoadCpuBlend(inTex, job.m_fishInfo0, job.m_fishInfo1, outWidth, outHeight, mode, pool);
+			StitchBlended(cpuBlend, inTex, cpuOutTex, pool, level);
+			auto const cpuStart = Clock::now();
+			for (size_t frame = 0; frame < g_benchFrameCount; ++frame)
+				StitchBlended(cpuBlend, inTex, cpuOutTex, pool, level);
+			auto const cpuEnd = Clock::now();
+
+			std::cerr << BlendModeName(mode) << ": GPU " << MillisecondsBetween(start, end) / g_benchFrameCount << " ms, CPU "
+					  << MillisecondsBetween(cpuStart, cpuEnd) / g_benchFrameCount << " ms per frame" << std::endl;
+		}
+	}
+
+	// Renders every frame of the input video into the framebuffer and encodes it
+	void RunGLVideo(GLStitcher & stitcher, StitchJob const & job, RawImage const & inTex)
+	{
+		size_t const outWidth = job.m_outWidth;
+		size_t const outHeight = job.m_outHeight;
+		VideoReader reader(job.m_inPath, inTex.GetWidth(), inTex.GetHeight(), g_yuvPixFmt);
+		VideoWriter writer(GetOutPath(job, "out.mp4"), outWidth, outHeight);
+		ReadbackRing readback(outWidth, outHeight);
+		auto const writeFrame = [&](RawImage const & frame) {
+			writer.WriteFrame(frame);
+		};
+
+		// CPU time spent issuing the GL calls of a frame, not waiting for the GPU
+		double submitMs = 0.0;
+		size_t frameCount = 0;
+		auto const videoStart = Clock::now();
+		for (;;) {
+			// Decoded straight into the upload buffer, while the GPU still renders the frame before
+			RawImage frame = stitcher.AcquireInputFrame();
+			if (!reader.ReadFrame(frame))
+				break;
+			stitcher.UploadInputFrame();
+			GLuint const frameBuffer = stitcher.BindFrameBuffer();
+
+			auto const submitStart = Clock::now();
+			stitcher.Draw(job.m_procedural, job.m_blendMode, frameBuffer);
+			submitMs += MillisecondsSince(submitStart);
+
+			// Frame N is copied while frame N + 1 renders, the mapped buffer goes straight to ffmpeg
+			readback.Read(writeFrame);
+			++frameCount;
+			CollectGLTimings();
+		}
+		readback.Drain(writeFrame);
+		writer.Close();
+		auto const videoEnd = Clock::now();
+
+		if (frameCount > 0)
+			std::cerr << "CPU time per frame: " << submitMs / frameCount << " ms" << std::endl;
+		std::cerr << "Frames: " << frameCount << ", " << frameCount * 1e3 / MillisecondsBetween(videoStart, videoEnd)
+				  << " fps, upload stalls " << stitcher.GetUploadStallMs() << " ms, readback stalls " << readback.GetStallMs()
+				  << " ms" << std::endl;
+	}
+
+	// Into the out= file and the pyramid, or into the window until it's closed
+	void RunGLStill(GLContext & context, GLStitcher & stitcher, StitchJob const & job, ThreadPool & pool)
+	{
+		size_t const outWidth = job.m_outWidth;
+		size_t const outHeight = job.m_outHeight;
+		if (!IsShownInWindow(job)) {
+			GLuint const frameBuffer = stitcher.BindFrameBuffer();
+			auto const submitStart = Clock::now();
+			stitcher.Draw(job.m_procedural, job.m_blendMode, frameBuffer);
+			std::cerr << "CPU time per frame: " << MillisecondsSince(submitStart) << " ms" << std::endl;
+			SaveOutput(job, GetFBTexture(outWidth, outHeight), pool);
+			return;
+		}
+
+		// CPU time spent issuing the GL calls of a frame, not waiting for the GPU
+		double submitMs = 0.0;
+		size_t renderedFrameCount = 0;
+		do {
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			glViewport(0, 0, outWidth, outHeight);
+
+			auto const submitStart = Clock::now();
+			stitcher.Draw(job.m_procedural, job.m_blendMode, 0);
+			submitMs += MillisecondsSince(submitStart);
+			++renderedFrameCount;
+
+			context.SwapBuffers();
+			CollectGLTimings();
+		}
+		while (!context.ShouldClose());
+
+		std::cerr << "CPU time per frame: " << submitMs / renderedFrameCount << " ms" << std::endl;
+	}
+
+	// The modes of IsGLMode
+	void RunGLJob(GLContext & context, GLStitcher & stitcher, StitchJob const & job, RawImage & inTex, ThreadPool & pool)
+	{
+		stitcher.SetJob(job, inTex);
+		switch (job.m_mode) {
+		case RunMode::BenchStitch:
+			RunStitchModesBench(stitcher, job, inTex, pool);
+			break;
+		case RunMode::BenchBlend:
+			RunBlendModesBench(stitcher, job, inTex, pool);
+			break;
+		case RunMode::GLVideo:
+			RunGLVideo(stitcher, job, inTex);
+			break;
+		default:
+			RunGLStill(context, stitcher, job, pool);
+			break;
+		}
+		CollectGLTimings();
+	}
+
+	// context and stitcher are null when no job of the run is in a GL mode
+	void RunJob(StitchJob & job, GLContext * context, GLStitcher * stitcher, ThreadPool & pool)
+	{
+		switch (job.m_mode) {
+		case RunMode::Video:
+			RunVideoStitch(job.m_inPath, GetOutPath(job, "out.mp4"), job.m_inWidth, job.m_inHeight, job.m_fishInfo0, job.m_fishInfo1,
+						   job.m_outWidth, job.m_outHeight, job.m_blendMode, job.m_incremental, job.m_pyramid, pool);
+			return;
+		case RunMode::Pipeline:
+			RunVideoPipeline(job.m_inPath, GetOutPath(job, "out.mp4"), job.m_inWidth, job.m_inHeight, job.m_fishInfo0, job.m_fishInfo1,
+							 job.m_outWidth, job.m_outHeight, job.m_blendMode, job.m_incremental, job.m_pyramid, pool);
+			return;
+		case RunMode::BenchIo:
+			RunImageIoBench(LoadInput(job));
+			return;
+		default:
+			break;
+		}
+
+		RawImage inTex = LoadInput(job);
+		CalibrateJob(job, inTex, pool);
+		if (IsGLMode(job.m_mode))
+			RunGLJob(*context, *stitcher, job, inTex, pool);
+		else
+			RunCpuStitch(inTex, job.m_fishInfo0, job.m_fishInfo1, job.m_outWidth, job.m_outHeight, job.m_blendMode,
+						 GetOutPath(job, "1.png"), job.m_pyramid, job.m_mode == RunMode::BenchThreads, pool);
+	}
+
+	// One context for all jobs, if any job is in a GL mode. It only needs a window if a job is shown in one,
+	// and falls back to a window when there is no headless backend
+	std::unique_ptr<GLContext> CreateJobContext(std::vector<StitchJob> const & jobs)
+	{
+		auto const glJob = std::find_if(jobs.begin(), jobs.end(), [](StitchJob const & job) { return IsGLMode(job.m_mode); });
+		if (glJob == jobs.end())
+			return nullptr;
+
+		auto const shownJob = std::find_if(jobs.begin(), jobs.end(), IsShownInWindow);
+		if (shownJob != jobs.end())
+			return CreateWindowContext(shownJob->m_outWidth, shownJob->m_outHeight, "Windows name");
+		try {
+			return CreateHeadlessContext();
+		}
+		catch (std::exception const & e) {
+			std::cerr << e.what() << ", rendering in a window instead" << std::endl;
+			return CreateWindowContext(glJob->m_outWidth, glJob->m_outHeight, "Windows name");
+		}
+	}
+
+	// Writes the trace if one was asked for, the result of the jobs stands either way
+	int FinishRun(int result, std::string const & tracePath)
+	{
+		if (tracePath.empty())
+			return result;
+
+		try {
+			FinishTracing(tracePath);
+		}
+		catch (std::exception const & e) {
+			std::cerr << e.what() << std::endl;
+		}
+		return result;
 	}
 }
 
-int main(int, char**)
+int main(int argc, char ** argv)
 {
-#ifdef ONE_FISH
-//	RawImage const inTex = RawImage::LoadFromFile("/home/alex/360/cube_orig.bmp", 4096, 4096, glm::pi<float>());
-//	FishInfo fishInfo0 = {glm::vec2(0.5f, 0.5f), glm::vec3(0.0f), glm::pi<float>(), glm::vec2(1.0f, 1.0f)};
-
-	RawImage const inTex = RawImage::LoadFromFile("/home/alex/360/fish2sphere220.jpg", 4096, 4096);
-	FishInfo fishInfo0 = {glm::vec2(0.5f, 0.5f), glm::vec3(0.0f), 11.0f * glm::pi<float>() / 9.0f, glm::vec2(1.0f, 1.0f)};
-#else
-//	RawImage const inTex = RawImage::LoadFromFile("/home/alex/360/dual.bmp", 8192, 4096);
-//	FishInfo fishInfo0 = {glm::vec2(0.25f, 0.5f), glm::vec3(0.0f, 0.0f, 0.0f), glm::pi<float>(), glm::vec2(0.5f, 1.0f)};
-//	FishInfo fishInfo1 = {glm::vec2(0.75f, 0.5f), glm::vec3(0.0f, 0.0f, glm::pi<float>()), glm::pi<float>(), glm::vec2(0.5f, 1.0f)};
-
-	RawImage const inTex = RawImage::LoadFromFile("/home/alex/360/example.jpg", 4296, 2148);
-	FishInfo fishInfo0 = {
-		glm::vec2(1024.0f / 4296.0f, 1024.0f / 2148.0f),
-		glm::vec3(glm::radians(25.0f), 0.0f, 0.0f),
-		glm::radians(210.0f),
-		glm::vec2(2048.0f / 4296.0f, 2048.0f / 2148.0f)};
-	FishInfo fishInfo1 = {
-		glm::vec2(3272.0f / 4296.0f, 1124.0f / 2148.0f),
-		glm::vec3(0.0f, glm::radians(-5.0f), glm::pi<float>()),
-		glm::radians(210.0f),
-		glm::vec2(2048.0f / 4296.0f, 2048.0f / 2148.0f)};
-
-#endif
-
-
-	// Initialise GLFW
-	if (!glfwInit()) {
-		std::cerr << "Failed to initialize GLFW" << std::endl;
+	std::vector<StitchJob> jobs;
+	std::string tracePath;
+	try {
+		jobs = ParseCommandLine(argc, argv, tracePath);
+		for (StitchJob const & job : jobs)
+			CheckJob(job);
+		if (std::count_if(jobs.begin(), jobs.end(), IsShownInWindow) > 1)
+			throw std::runtime_error("Only one job can be shown in a window, give the others an out= path");
+		size_t const threadCount = jobs.front().m_threadCount;
+		if (std::any_of(jobs.begin(), jobs.end(), [&](StitchJob const & job) { return job.m_threadCount != threadCount; }))
+			throw std::runtime_error("The jobs of a run share one thread pool, threads= can't differ between them");
+	}
+	catch (std::exception const & e) {
+		std::cerr << e.what() << std::endl;
 		return -1;
 	}
 
-	glfwWindowHint(GLFW_SAMPLES, 4); // 4x antialiasing
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3); // We want OpenGL 3.3
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // To make MacOS happy; should not be needed
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE); // We don't want the old OpenGL
+	if (!tracePath.empty() && !StartTracing()) {
+		std::cerr << "Built without ENABLE_TRACING, --trace is ignored" << std::endl;
+		tracePath.clear();
+	}
 
-	// Open a window and create its OpenGL context
-	GLFWwindow * window; // (In the accompanying source code, this variable is global for simplicity)
-	window = glfwCreateWindow(1200, 600, "Windows name", nullptr, nullptr);
-	if (window == nullptr) {
-		std::cerr << "Failed to open GLFW window. If you have an Intel GPU, they are not 3.3 compatible. Try the 2.1 version of the tutorials." << std::endl;
-		glfwTerminate();
-		return -1;
+	// One pool for the whole run, the parallel work of every job goes to it
+	ThreadPool pool(jobs.front().m_threadCount);
+
+	std::unique_ptr<GLContext> context;
+	try {
+		context = CreateJobContext(jobs);
 	}
-	glfwMakeContextCurrent(window); // Initialize GLEW
-	glewExperimental = true; // Needed in core profile
-	if (glewInit() != GLEW_OK) {
-		std::cerr << "Failed to initialize GLEW" << std::endl;
+	catch (std::exception const & e) {
+		std::cerr << e.what() << std::endl;
 		return -1;
 	}
+	if (context) {
+		std::cerr << "OpenGL context: " << context->GetBackendName() << std::endl;
+		if (!tracePath.empty())
+			EnableGLDebugOutput();
+	}
 
-	glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
-
-	GLuint vertexArrayId;
-	glGenVertexArrays(1, &vertexArrayId);
-	glBindVertexArray(vertexArrayId);
-
-#ifdef ONE_FISH
-	GLuint programId = LoadShaders(g_vertexShaderCode360, g_fragmentShaderCode360FBCut);
-#else
-	GLuint programId = LoadShaders(g_vertexShaderCode360DualFish, g_fragmentShaderCode360FBCutDualFish);
-#endif
-
-	std::vector<glm::vec3> vertexBufferData;
-	std::vector<glm::vec2> uvBufferData0;
-#ifndef ONE_FISH
-	std::vector<glm::vec2> uvBufferData1;
-#endif
-	std::vector<GLushort> indexBufferData;
-
-#ifdef ONE_FISH
-	GenerateOneFishBuffers(vertexBufferData, uvBufferData0, indexBufferData, fishInfo0);
-#else
-	GenerateDualFishBuffers(vertexBufferData, uvBufferData0, uvBufferData1, indexBufferData, fishInfo0, fishInfo1);
-#endif
-
-	GLuint vertexBuffer;
-	glGenBuffers(1, &vertexBuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-	glBufferData(GL_ARRAY_BUFFER, vertexBufferData.size() * sizeof(glm::vec3), vertexBufferData.data(), GL_STATIC_DRAW);
-
-	GLuint inTexbuffer0;
-	glGenBuffers(1, &inTexbuffer0);
-	glBindBuffer(GL_ARRAY_BUFFER, inTexbuffer0);
-	glBufferData(GL_ARRAY_BUFFER, uvBufferData0.size() * sizeof(glm::vec2), uvBufferData0.data(), GL_STATIC_DRAW);
-
-#ifndef ONE_FISH
-	GLuint inTexbuffer1;
-	glGenBuffers(1, &inTexbuffer1);
-	glBindBuffer(GL_ARRAY_BUFFER, inTexbuffer1);
-	glBufferData(GL_ARRAY_BUFFER, uvBufferData1.size() * sizeof(glm::vec2), uvBufferData1.data(), GL_STATIC_DRAW);
-#endif
-
-	GLuint indexBuffer;
-	glGenBuffers(1, &indexBuffer);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferData.size() * sizeof(GLushort), indexBufferData.data(), GL_STATIC_DRAW);
-
-	GLuint textureId;
-	glGenTextures(1, &textureId);
-	glBindTexture(GL_TEXTURE_2D, textureId);
-
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, inTex.GetWidth(), inTex.GetHeight(), 0, GL_RGB, GL_UNSIGNED_BYTE, inTex.GetData());
-
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glGenerateMipmap(GL_TEXTURE_2D);
-
-	GLuint samplerID = glGetUniformLocation(programId, "inSampler");
-
-	glm::mat4 const mvp = CreateSimpleMPVMatrix();
-	GLuint const mvpId = glGetUniformLocation(programId, "MVP");
-
-#ifdef SAVE_TO_FB
-	size_t const fbWidth = 1200;
-	size_t const fbHeight = 600;
-
-	auto const fbParams = CreateFrameBuffer(fbWidth, fbHeight);
-#endif
-
-	do {
-#ifdef SAVE_TO_FB
-		glBindFramebuffer(GL_FRAMEBUFFER, fbParams.first);
-		glViewport(0, 0, fbWidth, fbHeight);
-#endif
-
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-		glUseProgram(programId);
-
-		glUniformMatrix4fv(mvpId, 1, GL_FALSE, &mvp[0][0]);
-
-		// Don't forget to bind input texture back after working with fb
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, textureId);
-		glUniform1i(samplerID, 0);
-
-		glEnableVertexAttribArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-		glVertexAttribPointer(
-			0,                  // attribute 0. No particular reason for 0, but must match the layout in the shader.
-			3,                  // size
-			GL_FLOAT,           // type
-			GL_FALSE,           // normalized?
-			0,                  // stride
-			(void*)0            // array buffer offset
-		);
-
-		glEnableVertexAttribArray(1);
-		glBindBuffer(GL_ARRAY_BUFFER, inTexbuffer0);
-		glVertexAttribPointer(
-			1,                  // attribute 0. No particular reason for 0, but must match the layout in the shader.
-			2,                  // size
-			GL_FLOAT,           // type
-			GL_FALSE,           // normalized?
-			0,                  // stride
-			(void*)0            // array buffer offset
-		);
-
-#ifndef ONE_FISH
-		glEnableVertexAttribArray(2);
-		glBindBuffer(GL_ARRAY_BUFFER, inTexbuffer1);
-		glVertexAttribPointer(
-			2,                  // attribute 0. No particular reason for 0, but must match the layout in the shader.
-			2,                  // size
-			GL_FLOAT,           // type
-			GL_FALSE,           // normalized?
-			0,                  // stride
-			(void*)0            // array buffer offset
-		);
-#endif
-
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
-
-		glDrawElements(
-			GL_TRIANGLES,           // mode
-			indexBufferData.size(), // count
-			GL_UNSIGNED_SHORT,      // type
-			(void*)0                // element array buffer offset
-		);
-
-#ifdef SAVE_TO_FB
-		RawImage(GetFBTexture(fbWidth, fbHeight), "rgb24", fbWidth, fbHeight).SaveToFile("1.png");
-#endif
-
-		glDisableVertexAttribArray(0);
-		glDisableVertexAttribArray(1);
-#ifndef ONE_FISH
-		glDisableVertexAttribArray(2);
-#endif
-
-#ifdef SAVE_TO_FB
-		break;
-#endif
-
-		// Swap buffers
-		glfwSwapBuffers(window);
-		glfwPollEvents();
-
-	}
-	while (glfwGetKey(window, GLFW_KEY_ESCAPE) != GLFW_PRESS && glfwWindowShouldClose(window) == 0);
-
-	//TODO Delete fb stuff
-	glDeleteBuffers(1, &vertexBuffer);
-	glDeleteBuffers(1, &inTexbuffer0);
-#ifndef ONE_FISH
-	glDeleteBuffers(1, &inTexbuffer1);
-#endif
-	glDeleteBuffers(1, &indexBuffer);
-	glDeleteProgram(programId);
-	glDeleteTextures(1, &textureId);
-	glDeleteVertexArrays(1, &vertexArrayId);
-
-	glfwTerminate();
+	int result = 0;
+	{
+		// Released before the context goes away
+		std::unique_ptr<GLStitcher> stitcher(context ? new GLStitcher(pool) : nullptr);
+		result = RunJobs(jobs, [&](StitchJob & job) {
+			RunJob(job, context.get(), stitcher.get(), pool);
+		});
+	}
+	if (context)
+		FinishGLTimings();
+	context.reset();
+	return FinishRun(result, tracePath);
 }
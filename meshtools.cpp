@@ -0,0 +1,397 @@
+#include "meshtools.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "cachetools.h"
+
+namespace {
+	// Quads of the adaptive mesh on the lattice of the finest level
+	struct Quad
+	{
+		uint32_t m_x;
+		uint32_t m_y;
+		uint32_t m_size;
+	};
+
+	size_t const g_quadChunkSize = 256;
+	size_t const g_vertexChunkSize = 4096;
+	// Corners, edge midpoints and center of a quad, row by row
+	size_t const g_quadSampleCount = 9;
+
+	bool IsOutsideLens(float u)
+	{
+		return u > 1.5f;
+	}
+
+	float InterpolationError(float const * values)
+	{
+		float const corners[] = {values[0], values[2], values[6], values[8]};
+		float const center = (corners[0] + corners[1] + corners[2] + corners[3]) / 4;
+		float error = std::fabs(values[4] - center);
+		error = std::max(error, std::fabs(values[1] - (corners[0] + corners[1]) / 2));
+		error = std::max(error, std::fabs(values[3] - (corners[0] + corners[2]) / 2));
+		error = std::max(error, std::fabs(values[5] - (corners[1] + corners[3]) / 2));
+		error = std::max(error, std::fabs(values[7] - (corners[2] + corners[3]) / 2));
+		return error;
+	}
+
+	// A lens edge inside the quad is split further no matter what, interpolating towards (2, 2)
+	// would smear it over the whole quad
+	bool NeedsSplit(float const * us, float const * vs, float maxError)
+	{
+		size_t const outsideCount = std::count_if(us, us + g_quadSampleCount, IsOutsideLens);
+		if (outsideCount == g_quadSampleCount)
+			return false;
+		if (outsideCount != 0)
+			return true;
+		return InterpolationError(us) > maxError || InterpolationError(vs) > maxError;
+	}
+
+	// Evaluates both lenses at count points, in chunks spread over the pool
+	void MapPoints(FishProjection const & projection0, FishProjection const & projection1,
+				   std::vector<float> const & xs, std::vector<float> const & ys,
+				   std::vector<float> & us0, std::vector<float> & vs0, std::vector<float> & us1, std::vector<float> & vs1,
+				   ThreadPool & pool)
+	{
+		size_t const count = xs.size();
+		us0.resize(count);
+		vs0.resize(count);
+		us1.resize(count);
+		vs1.resize(count);
+
+		pool.ParallelFor((count + g_vertexChunkSize - 1) / g_vertexChunkSize, [&](size_t chunk) {
+			size_t const first = chunk * g_vertexChunkSize;
+			size_t const chunkCount = std::min(g_vertexChunkSize, count - first);
+			sphere2fish2Batch(projection0, &xs[first], &ys[first], chunkCount, &us0[first], &vs0[first]);
+			sphere2fish2Batch(projection1, &xs[first], &ys[first], chunkCount, &us1[first], &vs1[first]);
+		});
+	}
+
+	FishMesh GenerateUniformDualFishMesh(FishInfo const & fishInfo0, FishInfo const & fishInfo1, size_t stepCount,
+										 ThreadPool & pool)
+	{
+		size_t const columnSize = stepCount + 1;
+		float const step = 2.0f / stepCount;
+
+		std::vector<float> xs(columnSize * columnSize);
+		std::vector<float> ys(xs.size());
+		for (size_t xIndex = 0; xIndex <= stepCount; ++xIndex)
+			for (size_t yIndex = 0; yIndex <= stepCount; ++yIndex) {
+				xs[xIndex * columnSize + yIndex] = -1.0f + xIndex * step;
+				ys[xIndex * columnSize + yIndex] = -1.0f + yIndex * step;
+			}
+
+		std::vector<float> us0, vs0, us1, vs1;
+		MapPoints(MakeFishProjection(fishInfo0), MakeFishProjection(fishInfo1), xs, ys, us0, vs0, us1, vs1, pool);
+
+		FishMesh mesh;
+		mesh.m_vertices.resize(xs.size());
+		mesh.m_uvs0.resize(xs.size());
+		mesh.m_uvs1.resize(xs.size());
+		for (size_t i = 0; i < xs.size(); ++i) {
+			mesh.m_vertices[i] = {xs[i], ys[i], 0.0f};
+			mesh.m_uvs0[i] = {us0[i], vs0[i]};
+			mesh.m_uvs1[i] = {us1[i], vs1[i]};
+		}
+
+		// Vertices go column by column, x outer
+		mesh.m_indices.reserve(6 * stepCount * stepCount);
+		for (size_t xIndex = 0; xIndex < stepCount; ++xIndex)
+			for (size_t yIndex = 0; yIndex < stepCount; ++yIndex) {
+				uint32_t const tli = xIndex * columnSize + yIndex;
+				uint32_t const tri = tli + columnSize;
+				uint32_t const bli = tli + 1;
+				uint32_t const bri = tri + 1;
+				mesh.m_indices.insert(mesh.m_indices.end(), {bli, tli, tri, bli, tri, bri});
+			}
+
+		return mesh;
+	}
+
+	// Refines level by level: every quad of a level is sampled in one parallel pass, the split ones
+	// become the next level
+	std::vector<Quad> RefineQuads(FishProjection const & projection0, FishProjection const & projection1,
+								  MeshSettings const & settings, ThreadPool & pool)
+	{
+		uint32_t const baseSize = 1u << settings.m_maxDepth;
+		float const latticeStep = 2.0f / (settings.m_stepCount * baseSize);
+
+		std::vector<Quad> quads;
+		for (uint32_t x = 0; x < settings.m_stepCount; ++x)
+			for (uint32_t y = 0; y < settings.m_stepCount; ++y)
+				quads.push_back({x * baseSize, y * baseSize, baseSize});
+
+		std::vector<Quad> leaves;
+		for (size_t depth = 0; depth < settings.m_maxDepth && !quads.empty(); ++depth) {
+			std::vector<uint8_t> split(quads.size());
+			pool.ParallelFor((quads.size() + g_quadChunkSize - 1) / g_quadChunkSize, [&](size_t chunk) {
+				size_t const first = chunk * g_quadChunkSize;
+				size_t const count = std::min(g_quadChunkSize, quads.size() - first);
+
+				std::vector<float> samples(6 * g_quadSampleCount * count);
+				float * const xs = samples.data();
+				float * const ys = xs + g_quadSampleCount * count;
+				float * const us0 = ys + g_quadSampleCount * count;
+				float * const vs0 = us0 + g_quadSampleCount * count;
+				float * const us1 = vs0 + g_quadSampleCount * count;
+				float * const vs1 = us1 + g_quadSampleCount * count;
+
+				for (size_t i = 0; i < count; ++i) {
+					Quad const & quad = quads[first + i];
+					for (size_t sample = 0; sample < g_quadSampleCount; ++sample) {
+						xs[g_quadSampleCount * i + sample] = -1.0f + (quad.m_x + sample % 3 * quad.m_size / 2) * latticeStep;
+						ys[g_quadSampleCount * i + sample] = -1.0f + (quad.m_y + sample / 3 * quad.m_size / 2) * latticeStep;
+					}
+				}
+
+				sphere2fish2Batch(projection0, xs, ys, g_quadSampleCount * count, us0, vs0);
+				sphere2fish2Batch(projection1, xs, ys, g_quadSampleCount * count, us1, vs1);
+
+				for (size_t i = 0; i < count; ++i) {
+					size_t const offset = g_quadSampleCount * i;
+					split[first + i] = NeedsSplit(us0 + offset, vs0 + offset, settings.m_maxError) ||
+									   NeedsSplit(us1 + offset, vs1 + offset, settings.m_maxError);
+				}
+			});
+
+			std::vector<Quad> next;
+			for (size_t i = 0; i < quads.size(); ++i) {
+				Quad const & quad = quads[i];
+				if (!split[i]) {
+					leaves.push_back(quad);
+					continue;
+				}
+
+				uint32_t const half = quad.m_size / 2;
+				next.push_back({quad.m_x, quad.m_y, half});
+				next.push_back({quad.m_x + half, quad.m_y, half});
+				next.push_back({quad.m_x, quad.m_y + half, half});
+				next.push_back({quad.m_x + half, quad.m_y + half, half});
+			}
+			quads.swap(next);
+		}
+
+		leaves.insert(leaves.end(), quads.begin(), quads.end());
+		return leaves;
+	}
+
+	FishMesh GenerateAdaptiveDualFishMesh(FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+										  MeshSettings const & settings, ThreadPool & pool)
+	{
+		FishProjection const projection0 = MakeFishProjection(fishInfo0);
+		FishProjection const projection1 = MakeFishProjection(fishInfo1);
+		std::vector<Quad> const leaves = RefineQuads(projection0, projection1, settings, pool);
+
+		uint64_t const latticeSize = settings.m_stepCount << settings.m_maxDepth;
+		float const latticeStep = 2.0f / latticeSize;
+
+		std::vector<float> xs;
+		std::vector<float> ys;
+		auto const addVertex = [&](uint32_t x, uint32_t y) {
+			xs.push_back(-1.0f + x * latticeStep);
+			ys.push_back(-1.0f + y * latticeStep);
+			return uint32_t(xs.size() - 1);
+		};
+
+		// Only quad corners are shared, centers belong to a single quad
+		std::unordered_map<uint64_t, uint32_t> corners;
+		corners.reserve(2 * leaves.size());
+		auto const addCorner = [&](uint32_t x, uint32_t y) {
+			uint64_t const key = x * (latticeSize + 1) + y;
+			if (corners.find(key) == corners.end())
+				corners[key] = addVertex(x, y);
+		};
+		for (Quad const & quad : leaves) {
+			addCorner(quad.m_x, quad.m_y);
+			addCorner(quad.m_x + quad.m_size, quad.m_y);
+			addCorner(quad.m_x, quad.m_y + quad.m_size);
+			addCorner(quad.m_x + quad.m_size, quad.m_y + quad.m_size);
+		}
+
+		FishMesh mesh;
+		std::vector<uint32_t> outline;
+		for (Quad const & quad : leaves) {
+			// Clockwise from the top left corner, picking up the corners of finer neighbours on the way
+			outline.clear();
+			int const dx[] = {1, 0, -1, 0};
+			int const dy[] = {0, 1, 0, -1};
+			uint32_t x = quad.m_x;
+			uint32_t y = quad.m_y;
+			for (size_t side = 0; side < 4; ++side)
+				for (uint32_t step = 0; step < quad.m_size; ++step) {
+					auto const corner = corners.find(x * (latticeSize + 1) + y);
+					if (corner != corners.end())
+						outline.push_back(corner->second);
+					x += dx[side];
+					y += dy[side];
+				}
+
+			if (outline.size() == 4) {
+				uint32_t const tli = outline[0];
+				uint32_t const tri = outline[1];
+				uint32_t const bri = outline[2];
+				uint32_t const bli = outline[3];
+				mesh.m_indices.insert(mesh.m_indices.end(), {bli, tli, tri, bli, tri, bri});
+				continue;
+			}
+
+			uint32_t const center = addVertex(quad.m_x + quad.m_size / 2, quad.m_y + quad.m_size / 2);
+			for (size_t i = 0; i < outline.size(); ++i)
+				mesh.m_indices.insert(mesh.m_indices.end(), {center, outline[i], outline[(i + 1) % outline.size()]});
+		}
+
+		std::vector<float> us0, vs0, us1, vs1;
+		MapPoints(projection0, projection1, xs, ys, us0, vs0, us1, vs1, pool);
+
+		mesh.m_vertices.resize(xs.size());
+		mesh.m_uvs0.resize(xs.size());
+		mesh.m_uvs1.resize(xs.size());
+		for (size_t i = 0; i < xs.size(); ++i) {
+			mesh.m_vertices[i] = {xs[i], ys[i], 0.0f};
+			mesh.m_uvs0[i] = {us0[i], vs0[i]};
+			mesh.m_uvs1[i] = {us1[i], vs1[i]};
+		}
+
+		return mesh;
+	}
+
+	template<typename T>
+	void AssignSection(std::vector<T> & data, CacheFile::Section const & section)
+	{
+		T const * begin = static_cast<T const *>(section.first);
+		data.assign(begin, begin + section.second / sizeof(T));
+	}
+}
+
+FishMesh GenerateOneFishMesh(FishInfo const & fishInfo, size_t stepCount)
+{
+	size_t const columnSize = stepCount + 1;
+	float const step = 2.0f / stepCount;
+
+	FishMesh mesh;
+	mesh.m_vertices.reserve(columnSize * columnSize);
+	mesh.m_uvs0.reserve(columnSize * columnSize);
+	for (size_t xIndex = 0; xIndex <= stepCount; ++xIndex)
+		for (size_t yIndex = 0; yIndex <= stepCount; ++yIndex) {
+			glm::vec2 const sphereCoord{-1.0f + xIndex * step, -1.0f + yIndex * step};
+			mesh.m_vertices.push_back({sphereCoord.x, sphereCoord.y, 0.0f});
+			mesh.m_uvs0.push_back(sphere2fish(sphereCoord, fishInfo));
+		}
+
+	mesh.m_indices.reserve(6 * stepCount * stepCount);
+	for (size_t xIndex = 0; xIndex < stepCount; ++xIndex)
+		for (size_t yIndex = 0; yIndex < stepCount; ++yIndex) {
+			uint32_t const tli = xIndex * columnSize + yIndex;
+			uint32_t const tri = tli + columnSize;
+			uint32_t const bli = tli + 1;
+			uint32_t const bri = tri + 1;
+			mesh.m_indices.insert(mesh.m_indices.end(), {bli, tli, tri, bli, tri, bri});
+		}
+
+	return mesh;
+}
+
+FishMesh GenerateDualFishMesh(FishInfo const & fishInfo0, FishInfo const & fishInfo1, MeshSettings const & settings,
+							  ThreadPool & pool)
+{
+	if (settings.m_maxDepth == 0)
+		return GenerateUniformDualFishMesh(fishInfo0, fishInfo1, settings.m_stepCount, pool);
+	return GenerateAdaptiveDualFishMesh(fishInfo0, fishInfo1, settings, pool);
+}
+
+// The mesh is copied out of the mapping, it's small and goes through glBufferData anyway
+FishMesh LoadOrGenerateDualFishMesh(std::string const & cacheDir,
+									FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+									MeshSettings const & settings, ThreadPool & pool)
+{
+	Hasher hasher;
+	hasher.Add("mesh", 4).Add(uint64_t(settings.m_stepCount)).Add(uint64_t(settings.m_maxDepth)).Add(settings.m_maxError);
+	HashFishInfo(hasher, fishInfo0);
+	HashFishInfo(hasher, fishInfo1);
+	std::string const path = CacheFile::GetPath(cacheDir, "mesh", hasher.Get());
+
+	FishMesh mesh;
+	std::shared_ptr<CacheFile const> cache = CacheFile::Open(path, hasher.Get());
+	if (cache && cache->GetSectionCount() == 4) {
+		AssignSection(mesh.m_vertices, cache->GetSection(0));
+		AssignSection(mesh.m_uvs0, cache->GetSection(1));
+		AssignSection(mesh.m_uvs1, cache->GetSection(2));
+		AssignSection(mesh.m_indices, cache->GetSection(3));
+		return mesh;
+	}
+
+	mesh = GenerateDualFishMesh(fishInfo0, fishInfo1, settings, pool);
+	try {
+		CacheFile::Write(path, hasher.Get(), {
+			{mesh.m_vertices.data(), mesh.m_vertices.size() * sizeof(glm::vec3)},
+			{mesh.m_uvs0.data(), mesh.m_uvs0.size() * sizeof(glm::vec2)},
+			{mesh.m_uvs1.data(), mesh.m_uvs1.size() * sizeof(glm::vec2)},
+			{mesh.m_indices.data(), mesh.m_indices.size() * sizeof(uint32_t)}});
+	}
+	catch (std::runtime_error const & e) {
+		// The mesh is generated, only the next run has to generate it again
+		std::cerr << e.what() << std::endl;
+	}
+	return mesh;
+}
+
+FishMesh GenerateViewMesh(FishInfo const & fishInfo0, FishInfo const & fishInfo1, ViewLayout const & layout,
+						  size_t stepCount, ThreadPool & pool)
+{
+	size_t const columnSize = stepCount + 1;
+	size_t const faceVertexCount = columnSize * columnSize;
+	float const step = 2.0f / stepCount;
+
+	std::vector<float> as(faceVertexCount);
+	std::vector<float> bs(faceVertexCount);
+	for (size_t xIndex = 0; xIndex <= stepCount; ++xIndex)
+		for (size_t yIndex = 0; yIndex <= stepCount; ++yIndex) {
+			as[xIndex * columnSize + yIndex] = -1.0f + xIndex * step;
+			bs[xIndex * columnSize + yIndex] = -1.0f + yIndex * step;
+		}
+
+	// Tiles don't share vertices, neighbouring ones may not look in neighbouring directions
+	size_t const faceCount = layout.m_faces.size();
+	std::vector<float> xs(faceCount * faceVertexCount);
+	std::vector<float> ys(xs.size());
+	for (size_t face = 0; face < faceCount; ++face)
+		ViewToSphereBatch(layout, layout.m_faces[face], as.data(), bs.data(), faceVertexCount,
+						  &xs[face * faceVertexCount], &ys[face * faceVertexCount]);
+
+	std::vector<float> us0, vs0, us1, vs1;
+	MapPoints(MakeFishProjection(fishInfo0), MakeFishProjection(fishInfo1), xs, ys, us0, vs0, us1, vs1, pool);
+
+	FishMesh mesh;
+	mesh.m_vertices.resize(xs.size());
+	mesh.m_uvs0.resize(xs.size());
+	mesh.m_uvs1.resize(xs.size());
+	mesh.m_indices.reserve(6 * faceCount * stepCount * stepCount);
+	for (size_t face = 0; face < faceCount; ++face) {
+		size_t const column = face % layout.m_columnCount;
+		size_t const row = face / layout.m_columnCount;
+		for (size_t i = 0; i < faceVertexCount; ++i) {
+			size_t const vertex = face * faceVertexCount + i;
+			mesh.m_vertices[vertex] = {-1.0f + (2.0f * column + as[i] + 1.0f) / layout.m_columnCount,
+									   -1.0f + (2.0f * row + bs[i] + 1.0f) / layout.m_rowCount, 0.0f};
+			mesh.m_uvs0[vertex] = {us0[vertex], vs0[vertex]};
+			mesh.m_uvs1[vertex] = {us1[vertex], vs1[vertex]};
+		}
+
+		// Vertices go column by column, x outer, as in the sphere meshes
+		uint32_t const first = face * faceVertexCount;
+		for (size_t xIndex = 0; xIndex < stepCount; ++xIndex)
+			for (size_t yIndex = 0; yIndex < stepCount; ++yIndex) {
+				uint32_t const tli = first + xIndex * columnSize + yIndex;
+				uint32_t const tri = tli + columnSize;
+				uint32_t const bli = tli + 1;
+				uint32_t const bri = tri + 1;
+				mesh.m_indices.insert(mesh.m_indices.end(), {bli, tli, tri, bli, tri, bri});
+			}
+	}
+
+	return mesh;
+}
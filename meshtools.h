@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "fishtools.h"
+#include "projtools.h"
+#include "threadtools.h"
+
+// Triangles over the sphere rectangle [-1, 1]^2 with texture coordinates into one or both lenses.
+// Indices are 32-bit, the vertex count is not limited to 65536
+struct FishMesh
+{
+	std::vector<glm::vec3> m_vertices;
+	std::vector<glm::vec2> m_uvs0;
+	std::vector<glm::vec2> m_uvs1; // Empty for a single lens
+	std::vector<uint32_t> m_indices;
+};
+
+struct MeshSettings
+{
+	size_t m_stepCount = 240; // Quads per side of the grid, of the starting grid in adaptive mode
+	size_t m_maxDepth = 0;    // How many times a quad may be split in four, 0 keeps the grid uniform
+	float m_maxError = 1e-4f; // UV distance from the exact mapping a quad may have before it is split
+};
+
+FishMesh GenerateOneFishMesh(FishInfo const & fishInfo, size_t stepCount);
+
+// With m_maxDepth > 0 quads are split where interpolating across them misses the exact mapping by more
+// than m_maxError, or where they cross a lens edge, so the poles and the seam get the vertices.
+// A quad next to finer ones is fanned around its center through their vertices, leaving no T-junctions
+FishMesh GenerateDualFishMesh(FishInfo const & fishInfo0, FishInfo const & fishInfo1, MeshSettings const & settings,
+							  ThreadPool & pool);
+FishMesh LoadOrGenerateDualFishMesh(std::string const & cacheDir,
+									FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+									MeshSettings const & settings, ThreadPool & pool);
+
+// A stepCount x stepCount grid over every tile of the layout, for the tiles of a whole output at once.
+// Positions cover the output as [-1, 1]^2, the top row of the tiles at -1 as the weight maps have it
+FishMesh GenerateViewMesh(FishInfo const & fishInfo0, FishInfo const & fishInfo1, ViewLayout const & layout,
+						  size_t stepCount, ThreadPool & pool);
@@ -1,33 +1,264 @@
 #include "ogltools.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <iostream>
+#include <tuple>
+
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/gtx/transform.hpp>
+
+#include "cachetools.h"
+#include "shaders.h"
+
+namespace {
+	// Must match the decoding in the vertex shaders
+	float const g_uvPackMin = -0.5f;
+	float const g_uvPackRange = 3.0f;
+
+	uint16_t PackUnorm16(float value, float min, float range)
+	{
+		float const normalized = std::min(std::max((value - min) / range, 0.0f), 1.0f);
+		return uint16_t(std::lround(normalized * 65535.0f));
+	}
+
+	GLenum GetPlaneInternalFormat(size_t sampleSize)
+	{
+		return sampleSize == 3 ? GL_RGB8 : sampleSize == 2 ? GL_RG8 : GL_R8;
+	}
+
+	GLenum GetPlaneFormat(size_t sampleSize)
+	{
+		return sampleSize == 3 ? GL_RGB : sampleSize == 2 ? GL_RG : GL_RED;
+	}
+
+	// Returns the milliseconds spent waiting. The first wait flushes, so the fence is guaranteed to signal eventually
+	double WaitForFence(GLsync fence, std::string const & msg)
+	{
+		auto const waitStart = std::chrono::steady_clock::now();
+		GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+		for (;;) {
+			GLenum const status = glClientWaitSync(fence, flags, 100000000);
+			if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+				break;
+			if (status == GL_WAIT_FAILED)
+				throw std::runtime_error(msg);
+			flags = 0;
+		}
+		return MillisecondsSince(waitStart);
+	}
+
+	void GLAPIENTRY DebugMessageCallback(GLenum, GLenum type, GLuint, GLenum severity, GLsizei length,
+										 GLchar const * message, void const *)
+	{
+		// Notifications are mostly buffer placement chatter
+		if (severity == GL_DEBUG_SEVERITY_NOTIFICATION)
+			return;
+
+		std::string const text = length >= 0 ? std::string(message, length) : std::string(message);
+		std::cerr << (type == GL_DEBUG_TYPE_ERROR ? "GL error: " : "GL: ") << text << std::endl;
+#ifdef ENABLE_TRACING
+		if (Tracer::Get().IsEnabled())
+			Tracer::Get().AddMessage("gl debug", text);
+#endif
+	}
+
+#ifdef ENABLE_TRACING
+	struct PendingTimerQuery
+	{
+		GLuint m_query;
+		char const * m_name;
+		int64_t m_startNs;
+	};
+
+	// GL objects belong to the one thread with the context
+	bool g_timerQueryActive = false;
+	std::vector<PendingTimerQuery> g_pendingTimerQueries;
+	std::vector<GLuint> g_freeTimerQueries;
+
+	// Queries finish in order, so collecting stops at the first that isn't available unless wait is set
+	void CollectTimerQueries(bool wait)
+	{
+		size_t collected = 0;
+		for (; collected < g_pendingTimerQueries.size(); ++collected) {
+			PendingTimerQuery const & pending = g_pendingTimerQueries[collected];
+			GLint available = GL_FALSE;
+			if (!wait)
+				glGetQueryObjectiv(pending.m_query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!wait && available != GL_TRUE)
+				break;
+
+			GLuint64 elapsedNs = 0;
+			glGetQueryObjectui64v(pending.m_query, GL_QUERY_RESULT, &elapsedNs);
+			// The GPU can't have taken longer than the wall time since the query began. llvmpipe reports
+			// hours for the first queries of a context
+			if (int64_t(elapsedNs) <= Tracer::Now() - pending.m_startNs)
+				Tracer::Get().AddEvent(pending.m_name, "gpu", pending.m_startNs, int64_t(elapsedNs), g_traceGpuThreadId);
+			g_freeTimerQueries.push_back(pending.m_query);
+		}
+		g_pendingTimerQueries.erase(g_pendingTimerQueries.begin(), g_pendingTimerQueries.begin() + collected);
+	}
+#endif
+}
 
 void OGLCheck(std::string const & msg)
 {
-	GLenum const error = glGetError();
-	if (error != GL_NO_ERROR)
-		throw std::runtime_error(msg);
+	std::vector<GLenum> const errors = GetAllOGLErrors();
+	if (errors.empty())
+		return;
+
+	std::string message = msg + " (";
+	for (size_t i = 0; i < errors.size(); ++i)
+		message += (i > 0 ? ", " : "") + std::string(GetOGLErrorName(errors[i]));
+	throw std::runtime_error(message + ")");
 }
 
 std::vector<GLenum> GetAllOGLErrors()
 {
 	std::vector<GLenum> errors;
 	GLenum error = GL_NO_ERROR;
-	while ((error = glGetError()) != GL_NO_ERROR)
+	// A lost context keeps returning errors
+	while ((error = glGetError()) != GL_NO_ERROR && errors.size() < 16)
 		errors.push_back(error);
 	return errors;
 }
 
-std::vector<char> GetFBTexture(size_t width, size_t height)
+char const * GetOGLErrorName(GLenum error)
+{
+	switch (error) {
+	case GL_INVALID_ENUM:
+		return "GL_INVALID_ENUM";
+	case GL_INVALID_VALUE:
+		return "GL_INVALID_VALUE";
+	case GL_INVALID_OPERATION:
+		return "GL_INVALID_OPERATION";
+	case GL_INVALID_FRAMEBUFFER_OPERATION:
+		return "GL_INVALID_FRAMEBUFFER_OPERATION";
+	case GL_OUT_OF_MEMORY:
+		return "GL_OUT_OF_MEMORY";
+	case GL_STACK_UNDERFLOW:
+		return "GL_STACK_UNDERFLOW";
+	case GL_STACK_OVERFLOW:
+		return "GL_STACK_OVERFLOW";
+	default:
+		return "unknown GL error";
+	}
+}
+
+void EnableGLDebugOutput()
+{
+	if (!GLEW_KHR_debug)
+		return;
+
+	glEnable(GL_DEBUG_OUTPUT);
+	glDebugMessageCallback(DebugMessageCallback, nullptr);
+}
+
+#ifdef ENABLE_TRACING
+GLTraceScope::GLTraceScope(char const * name)
+	: m_cpuScope(name, "gl")
+	, m_name(name)
+{
+	if (!Tracer::Get().IsEnabled() || !GLEW_ARB_timer_query || g_timerQueryActive)
+		return;
+
+	if (g_freeTimerQueries.empty()) {
+		glGenQueries(1, &m_query);
+	}
+	else {
+		m_query = g_freeTimerQueries.back();
+		g_freeTimerQueries.pop_back();
+	}
+	glBeginQuery(GL_TIME_ELAPSED, m_query);
+	g_timerQueryActive = true;
+	m_startNs = Tracer::Now();
+}
+
+GLTraceScope::~GLTraceScope()
+{
+	if (m_query == 0)
+		return;
+
+	glEndQuery(GL_TIME_ELAPSED);
+	g_timerQueryActive = false;
+	g_pendingTimerQueries.push_back({m_query, m_name, m_startNs});
+}
+
+void CollectGLTimings()
 {
-	std::vector<char> tex(3 * width * height);
+	CollectTimerQueries(false);
+}
+
+void FinishGLTimings()
+{
+	CollectTimerQueries(true);
+	if (!g_freeTimerQueries.empty())
+		glDeleteQueries(GLsizei(g_freeTimerQueries.size()), g_freeTimerQueries.data());
+	g_freeTimerQueries.clear();
+}
+#endif
 
-	glReadPixels(0, 0, width, height, GL_RGB, GL_BYTE, tex.data());
+RawImage GetFBTexture(size_t width, size_t height)
+{
+	TRACE_GL_SCOPE("readback");
+	RawImage tex("rgb24", width, height);
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glPixelStorei(GL_PACK_ROW_LENGTH, tex.GetStride() / 3);
+	glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, tex.GetData());
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
 	OGLCheck("Failed to get texture!");
 
 	return tex;
 }
 
+GLuint CreatePlaneTexture(std::string const & pixFmt, size_t width, size_t height, size_t plane, bool mipmaps, GLenum wrap)
+{
+	size_t const sampleSize = GetPlaneSampleSize(pixFmt, plane);
+	GLsizei const planeWidth = GetPlaneWidth(pixFmt, plane, width);
+	GLsizei const planeHeight = GetPlaneHeight(pixFmt, plane, height);
+	GLenum const internalFormat = GetPlaneInternalFormat(sampleSize);
+	GLsizei levelCount = 1;
+	while (mipmaps && std::max(planeWidth, planeHeight) >> levelCount > 0)
+		++levelCount;
+
+	GLuint textureId;
+	glGenTextures(1, &textureId);
+	glBindTexture(GL_TEXTURE_2D, textureId);
+	if (GLEW_ARB_texture_storage)
+		glTexStorage2D(GL_TEXTURE_2D, levelCount, internalFormat, planeWidth, planeHeight);
+	else {
+		// Mutable, but never respecified either
+		for (GLsizei level = 0; level < levelCount; ++level)
+			glTexImage2D(GL_TEXTURE_2D, level, internalFormat, std::max(1, planeWidth >> level), std::max(1, planeHeight >> level),
+						 0, GetPlaneFormat(sampleSize), GL_UNSIGNED_BYTE, nullptr);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
+	}
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+	OGLCheck("Failed to create plane texture!");
+
+	return textureId;
+}
+
+void UpdatePlaneTexture(GLuint textureId, RawImage const & image, size_t plane)
+{
+	size_t const sampleSize = GetPlaneSampleSize(image.GetPixFmt(), plane);
+	GLenum const format = GetPlaneFormat(sampleSize);
+
+	glBindTexture(GL_TEXTURE_2D, textureId);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, image.GetPlaneStride(plane) / sampleSize);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image.GetPlaneRowSize(plane) / sampleSize, image.GetPlaneHeight(plane),
+					format, GL_UNSIGNED_BYTE, image.GetPlane(plane));
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	OGLCheck("Failed to update plane texture!");
+}
+
 GLuint CompileShader(std::string const & shaderCode, GLenum type, std::string const & name)
 {
 	GLuint shaderID = glCreateShader(type);
@@ -47,11 +278,17 @@ void CheckCompileStatus(GLuint shaderID)
 
 	glGetShaderiv(shaderID, GL_COMPILE_STATUS, &res);
 	glGetShaderiv(shaderID, GL_INFO_LOG_LENGTH, &infoLogLength);
+	std::string shaderErrorMessage;
 	if (infoLogLength > 0) {
-		std::string shaderErrorMessage(infoLogLength + 1, 0);
+		shaderErrorMessage.resize(infoLogLength);
 		glGetShaderInfoLog(shaderID, infoLogLength, nullptr, &shaderErrorMessage[0]);
+		shaderErrorMessage.resize(infoLogLength - 1);
 		std::cerr << shaderErrorMessage << std::endl;
 	}
+	if (res != GL_TRUE) {
+		glDeleteShader(shaderID);
+		throw std::runtime_error("Failed to compile shader: " + shaderErrorMessage);
+	}
 }
 
 GLuint LinkProgram(GLuint vertexShaderID, GLuint fragmentShaderID)
@@ -61,24 +298,33 @@ GLuint LinkProgram(GLuint vertexShaderID, GLuint fragmentShaderID)
 
 	std::cerr << "Linking program..." << std::endl;
 	GLuint programID = glCreateProgram();
+	// Lets LoadOrCompileProgram fetch the binary, otherwise the driver may not keep it
+	if (GLEW_ARB_get_program_binary)
+		glProgramParameteri(programID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glAttachShader(programID, vertexShaderID);
 	glAttachShader(programID, fragmentShaderID);
 	glLinkProgram(programID);
 
+	glDetachShader(programID, vertexShaderID);
+	glDetachShader(programID, fragmentShaderID);
+
+	glDeleteShader(vertexShaderID);
+	glDeleteShader(fragmentShaderID);
+
 	// Check the program
 	glGetProgramiv(programID, GL_LINK_STATUS, &res);
 	glGetProgramiv(programID, GL_INFO_LOG_LENGTH, &infoLogLength);
+	std::string programErrorMessage;
 	if (infoLogLength > 0) {
-		std::string programErrorMessage(infoLogLength + 1, 0);
+		programErrorMessage.resize(infoLogLength);
 		glGetProgramInfoLog(programID, infoLogLength, nullptr, &programErrorMessage[0]);
+		programErrorMessage.resize(infoLogLength - 1);
 		std::cerr << programErrorMessage << std::endl;
 	}
-
-	glDetachShader(programID, vertexShaderID);
-	glDetachShader(programID, fragmentShaderID);
-
-	glDeleteShader(vertexShaderID);
-	glDeleteShader(fragmentShaderID);
+	if (res != GL_TRUE) {
+		glDeleteProgram(programID);
+		throw std::runtime_error("Failed to link program: " + programErrorMessage);
+	}
 
 	return programID;
 }
@@ -89,11 +335,84 @@ GLuint LoadShaders(std::string const & vertexShaderCode, std::string const & fra
 	CheckCompileStatus(vertexShaderID);
 
 	GLuint fragmentShaderID = CompileShader(fragmentShaderCode, GL_FRAGMENT_SHADER, "fragment");
-	CheckCompileStatus(fragmentShaderID);
+	try {
+		CheckCompileStatus(fragmentShaderID);
+	}
+	catch (std::runtime_error const &) {
+		glDeleteShader(vertexShaderID);
+		throw;
+	}
 
 	return LinkProgram(vertexShaderID, fragmentShaderID);
 }
 
+GLuint LoadOrCompileProgram(std::string const & cacheDir, std::string const & vertexShaderCode, std::string const & fragmentShaderCode)
+{
+	TRACE_SCOPE("program");
+	auto const start = std::chrono::steady_clock::now();
+	auto const elapsedMs = [&start]() {
+		return MillisecondsSince(start);
+	};
+
+	GLint formatCount = 0;
+	if (GLEW_ARB_get_program_binary)
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+	if (formatCount == 0) {
+		GLuint const programId = LoadShaders(vertexShaderCode, fragmentShaderCode);
+		std::cerr << "Program compiled in " << elapsedMs() << " ms, the driver has no program binaries" << std::endl;
+		return programId;
+	}
+
+	// Binaries are only valid for the driver that made them, a driver update changes the version string
+	Hasher hasher;
+	for (GLenum const name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+		char const * const value = reinterpret_cast<char const *>(glGetString(name));
+		std::string const driverString = value ? value : "";
+		hasher.Add(driverString.data(), driverString.size()).Add(driverString.size());
+	}
+	hasher.Add(vertexShaderCode.data(), vertexShaderCode.size()).Add(vertexShaderCode.size());
+	hasher.Add(fragmentShaderCode.data(), fragmentShaderCode.size()).Add(fragmentShaderCode.size());
+	uint64_t const key = hasher.Get();
+	std::string const path = CacheFile::GetPath(cacheDir, "program", key);
+
+	if (std::shared_ptr<CacheFile const> const cache = CacheFile::Open(path, key)) {
+		CacheFile::Section const format = cache->GetSectionCount() == 2 ? cache->GetSection(0) : CacheFile::Section();
+		if (format.second == sizeof(GLenum)) {
+			CacheFile::Section const binary = cache->GetSection(1);
+			GLuint const programId = glCreateProgram();
+			glProgramBinary(programId, *static_cast<GLenum const *>(format.first), binary.first, binary.second);
+			GLint res = GL_FALSE;
+			glGetProgramiv(programId, GL_LINK_STATUS, &res);
+			if (res == GL_TRUE) {
+				std::cerr << "Program loaded from the cache in " << elapsedMs() << " ms" << std::endl;
+				return programId;
+			}
+			// The driver may reject its own binaries after all, e.g. for another GPU of the same driver
+			glDeleteProgram(programId);
+		}
+	}
+
+	GLuint const programId = LoadShaders(vertexShaderCode, fragmentShaderCode);
+	double const compileMs = elapsedMs();
+
+	GLint binarySize = 0;
+	glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &binarySize);
+	if (binarySize > 0) {
+		std::vector<char> binary(binarySize);
+		GLenum format = 0;
+		glGetProgramBinary(programId, binarySize, &binarySize, &format, binary.data());
+		try {
+			CacheFile::Write(path, key, {{&format, sizeof(format)}, {binary.data(), size_t(binarySize)}});
+		}
+		catch (std::runtime_error const & e) {
+			// Only the next start-up gets slower
+			std::cerr << e.what() << std::endl;
+		}
+	}
+	std::cerr << "Program compiled in " << compileMs << " ms" << std::endl;
+	return programId;
+}
+
 glm::mat4 CreateMPVMatrix()
 {
 	float const width = 600.;
@@ -156,3 +475,457 @@ std::pair<GLuint, GLuint> CreateFrameBuffer(size_t width, size_t height)
 	return std::make_pair(frameBufferId, textureId);
 }
 
+void DeleteFrameBuffer(std::pair<GLuint, GLuint> const & frameBuffer)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer.first);
+	GLint depthRenderBuffer = 0;
+	glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_FRAMEBUFFER_ATTACHMENT_OBJECT_NAME,
+										  &depthRenderBuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	GLuint const renderBufferId = GLuint(depthRenderBuffer);
+	glDeleteRenderbuffers(1, &renderBufferId);
+	glDeleteTextures(1, &frameBuffer.second);
+	glDeleteFramebuffers(1, &frameBuffer.first);
+}
+
+GLuint CreateWeightTexture(std::vector<uint32_t> const & weights, std::vector<uint32_t> const & gains,
+						   size_t width, size_t height)
+{
+	TRACE_GL_SCOPE("upload weights");
+	std::vector<float> data(3 * weights.size());
+	for (size_t i = 0; i < weights.size(); ++i) {
+		uint32_t const w0 = weights[i] & 0xffff;
+		uint32_t const w1 = weights[i] >> 16;
+		float const gain0 = gains.empty() ? 1.0f : (gains[i] & 0xffff) / 256.0f;
+		float const gain1 = gains.empty() ? 1.0f : (gains[i] >> 16) / 256.0f;
+		data[3 * i] = w0 / 256.0f * gain0;
+		data[3 * i + 1] = w1 / 256.0f * gain1;
+		data[3 * i + 2] = (256 - w0 - w1) / 256.0f;
+	}
+
+	GLuint textureId;
+	glGenTextures(1, &textureId);
+	glBindTexture(GL_TEXTURE_2D, textureId);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, width, height, 0, GL_RGB, GL_FLOAT, data.data());
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	OGLCheck("Failed to create weight texture!");
+
+	return textureId;
+}
+
+GLMesh::GLMesh(FishMesh const & mesh)
+	: m_vertexCount(mesh.m_vertices.size())
+	, m_indexCount(mesh.m_indices.size())
+{
+	TRACE_GL_SCOPE("upload mesh");
+	size_t const lensCount = mesh.m_uvs1.empty() ? 1 : 2;
+	size_t const componentCount = 2 + 2 * lensCount;
+	m_vertexSize = componentCount * sizeof(uint16_t);
+
+	std::vector<uint16_t> vertices(componentCount * m_vertexCount);
+	for (size_t i = 0; i < m_vertexCount; ++i) {
+		uint16_t * const vertex = &vertices[componentCount * i];
+		vertex[0] = PackUnorm16(mesh.m_vertices[i].x, -1.0f, 2.0f);
+		vertex[1] = PackUnorm16(mesh.m_vertices[i].y, -1.0f, 2.0f);
+		vertex[2] = PackUnorm16(mesh.m_uvs0[i].x, g_uvPackMin, g_uvPackRange);
+		vertex[3] = PackUnorm16(mesh.m_uvs0[i].y, g_uvPackMin, g_uvPackRange);
+		if (lensCount == 2) {
+			vertex[4] = PackUnorm16(mesh.m_uvs1[i].x, g_uvPackMin, g_uvPackRange);
+			vertex[5] = PackUnorm16(mesh.m_uvs1[i].y, g_uvPackMin, g_uvPackRange);
+		}
+	}
+
+	glGenVertexArrays(1, &m_vertexArray);
+	glBindVertexArray(m_vertexArray);
+
+	glGenBuffers(1, &m_vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(uint16_t), vertices.data(), GL_STATIC_DRAW);
+
+	// Attribute locations match the layout() qualifiers of the vertex shaders
+	for (GLuint attribute = 0; attribute < 1 + lensCount; ++attribute) {
+		glEnableVertexAttribArray(attribute);
+		glVertexAttribPointer(attribute, 2, GL_UNSIGNED_SHORT, GL_TRUE, m_vertexSize,
+							  reinterpret_cast<void *>(2 * attribute * sizeof(uint16_t)));
+	}
+
+	// The element buffer binding is part of the VAO state
+	glGenBuffers(1, &m_indexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_indexCount * sizeof(GLuint), mesh.m_indices.data(), GL_STATIC_DRAW);
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	OGLCheck("Failed to create mesh buffers!");
+}
+
+GLMesh::~GLMesh()
+{
+	glDeleteVertexArrays(1, &m_vertexArray);
+	glDeleteBuffers(1, &m_vertexBuffer);
+	glDeleteBuffers(1, &m_indexBuffer);
+}
+
+size_t GLMesh::GetVertexCount() const
+{
+	return m_vertexCount;
+}
+
+size_t GLMesh::GetVertexSize() const
+{
+	return m_vertexSize;
+}
+
+size_t GLMesh::GetIndexCount() const
+{
+	return m_indexCount;
+}
+
+void GLMesh::Draw() const
+{
+	glBindVertexArray(m_vertexArray);
+	glDrawElements(GL_TRIANGLES, m_indexCount, GL_UNSIGNED_INT, nullptr);
+}
+
+glm::mat4 GLMesh::GetPositionDecodeMatrix()
+{
+	return glm::translate(glm::vec3(-1.0f, -1.0f, 0.0f)) * glm::scale(glm::vec3(2.0f, 2.0f, 1.0f));
+}
+
+FullScreenTriangle::FullScreenTriangle()
+{
+	glGenVertexArrays(1, &m_vertexArray);
+}
+
+FullScreenTriangle::~FullScreenTriangle()
+{
+	glDeleteVertexArrays(1, &m_vertexArray);
+}
+
+void FullScreenTriangle::Draw() const
+{
+	glBindVertexArray(m_vertexArray);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+void SetFishProjectionUniform(GLuint programId, std::string const & name, FishProjection const & projection)
+{
+	// m_rotation is row-major
+	glUniformMatrix3fv(glGetUniformLocation(programId, (name + ".rotation").c_str()), 1, GL_TRUE, projection.m_rotation);
+	glUniform1f(glGetUniformLocation(programId, (name + ".longitudeOffset").c_str()), projection.m_longitudeOffset);
+	glUniform1f(glGetUniformLocation(programId, (name + ".invFov").c_str()), projection.m_invFov);
+	glUniform2f(glGetUniformLocation(programId, (name + ".center").c_str()), projection.m_center.x, projection.m_center.y);
+	glUniform2f(glGetUniformLocation(programId, (name + ".ratio").c_str()), projection.m_ratio.x, projection.m_ratio.y);
+	OGLCheck("Failed to set fish projection!");
+}
+
+UploadRing::UploadRing(std::string const & pixFmt, size_t width, size_t height, size_t depth)
+	: m_pixFmt(pixFmt)
+	, m_width(width)
+	, m_height(height)
+	, m_stride(GetPaddedStride(pixFmt, width))
+	, m_persistent(GLEW_ARB_buffer_storage)
+	, m_slots(depth)
+{
+	// Planes one after the other, the way a RawImage view of the buffer expects them
+	for (size_t plane = 0; plane < GetPlaneCount(pixFmt); ++plane)
+		m_size += GetPlaneStride(pixFmt, plane, m_stride) * GetPlaneHeight(pixFmt, plane, height);
+
+	GLbitfield const mapFlags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	for (Slot & slot : m_slots) {
+		glGenBuffers(1, &slot.m_buffer);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.m_buffer);
+		if (m_persistent) {
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, m_size, nullptr, mapFlags);
+			slot.m_data = static_cast<char *>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, m_size, mapFlags));
+			if (!slot.m_data) {
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+				throw std::runtime_error("Failed to map upload buffer!");
+			}
+		}
+		else
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, m_size, nullptr, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	OGLCheck("Failed to create upload buffers!");
+}
+
+UploadRing::~UploadRing()
+{
+	for (Slot & slot : m_slots) {
+		if (slot.m_fence)
+			glDeleteSync(slot.m_fence);
+		// Deleting a buffer unmaps it
+		glDeleteBuffers(1, &slot.m_buffer);
+	}
+}
+
+bool UploadRing::IsPersistent() const
+{
+	return m_persistent;
+}
+
+double UploadRing::GetStallMs() const
+{
+	return m_stallMs;
+}
+
+RawImage UploadRing::Acquire()
+{
+	Slot & slot = m_slots[m_head];
+	if (!m_acquired) {
+		if (slot.m_fence) {
+			TRACE_SCOPE("upload wait");
+			m_stallMs += WaitForFence(slot.m_fence, "Failed to wait for upload!");
+			glDeleteSync(slot.m_fence);
+			slot.m_fence = nullptr;
+		}
+		if (!m_persistent) {
+			// The fence already made sure the GPU is done with the old contents
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.m_buffer);
+			slot.m_data = static_cast<char *>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, m_size,
+															   GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			if (!slot.m_data)
+				throw std::runtime_error("Failed to map upload buffer!");
+		}
+		m_acquired = true;
+	}
+	return RawImage(slot.m_data, m_stride, m_pixFmt, m_width, m_height);
+}
+
+void UploadRing::Upload(std::vector<GLuint> const & textureIds)
+{
+	if (!m_acquired)
+		throw std::runtime_error("No frame to upload!");
+	if (textureIds.size() != GetPlaneCount(m_pixFmt))
+		throw std::runtime_error("Expected a texture per plane of " + m_pixFmt);
+
+	TRACE_GL_SCOPE("upload ring");
+	Slot & slot = m_slots[m_head];
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.m_buffer);
+	if (!m_persistent) {
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		slot.m_data = nullptr;
+	}
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	size_t offset = 0;
+	for (size_t plane = 0; plane < textureIds.size(); ++plane) {
+		size_t const sampleSize = GetPlaneSampleSize(m_pixFmt, plane);
+		size_t const planeStride = GetPlaneStride(m_pixFmt, plane, m_stride);
+		size_t const planeHeight = GetPlaneHeight(m_pixFmt, plane, m_height);
+		glBindTexture(GL_TEXTURE_2D, textureIds[plane]);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, planeStride / sampleSize);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, GetPlaneWidth(m_pixFmt, plane, m_width), planeHeight,
+						GetPlaneFormat(sampleSize), GL_UNSIGNED_BYTE, reinterpret_cast<void const *>(offset));
+		offset += planeStride * planeHeight;
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	slot.m_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	OGLCheck("Failed to upload frame!");
+
+	m_head = (m_head + 1) % m_slots.size();
+	m_acquired = false;
+}
+
+ReadbackRing::ReadbackRing(size_t width, size_t height, size_t depth)
+	: m_width(width)
+	, m_height(height)
+	, m_stride(GetPaddedStride("rgb24", width))
+	, m_slots(depth)
+{
+	for (Slot & slot : m_slots) {
+		glGenBuffers(1, &slot.m_buffer);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.m_buffer);
+		glBufferData(GL_PIXEL_PACK_BUFFER, m_stride * m_height, nullptr, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	OGLCheck("Failed to create readback buffers!");
+}
+
+ReadbackRing::~ReadbackRing()
+{
+	for (Slot & slot : m_slots) {
+		if (slot.m_fence)
+			glDeleteSync(slot.m_fence);
+		glDeleteBuffers(1, &slot.m_buffer);
+	}
+}
+
+size_t ReadbackRing::GetPendingCount() const
+{
+	return m_pending;
+}
+
+bool ReadbackRing::IsFull() const
+{
+	return m_pending == m_slots.size();
+}
+
+double ReadbackRing::GetStallMs() const
+{
+	return m_stallMs;
+}
+
+void ReadbackRing::Read(std::function<void(RawImage const &)> const & consumer)
+{
+	if (IsFull())
+		Consume(consumer);
+
+	TRACE_GL_SCOPE("readback");
+	Slot & slot = m_slots[m_head];
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.m_buffer);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glPixelStorei(GL_PACK_ROW_LENGTH, m_stride / 3);
+	glReadPixels(0, 0, m_width, m_height, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	slot.m_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	OGLCheck("Failed to start readback!");
+
+	m_head = (m_head + 1) % m_slots.size();
+	++m_pending;
+}
+
+void ReadbackRing::Consume(std::function<void(RawImage const &)> const & consumer)
+{
+	if (m_pending == 0)
+		throw std::runtime_error("No frames to consume!");
+
+	Slot & slot = m_slots[(m_head + m_slots.size() - m_pending) % m_slots.size()];
+
+	TRACE_SCOPE("readback consume");
+	m_stallMs += WaitForFence(slot.m_fence, "Failed to wait for readback!");
+	glDeleteSync(slot.m_fence);
+	slot.m_fence = nullptr;
+	--m_pending;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.m_buffer);
+	void * data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, m_stride * m_height, GL_MAP_READ_BIT);
+	if (!data)
+		throw std::runtime_error("Failed to map readback buffer!");
+
+	try {
+		consumer(RawImage(static_cast<char *>(data), m_stride, "rgb24", m_width, m_height));
+	}
+	catch (...) {
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		throw;
+	}
+
+	glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+void ReadbackRing::Drain(std::function<void(RawImage const &)> const & consumer)
+{
+	while (m_pending > 0)
+		Consume(consumer);
+}
+
+GLMultiBandBlender::GLMultiBandBlender(std::string const & cacheDir, size_t levelCount)
+	: m_maxLevelCount(std::max<size_t>(1, levelCount))
+{
+	m_programId = LoadOrCompileProgram(cacheDir, g_vertexShaderCode360FullScreen, g_fragmentShaderCode360MultiBand);
+	glUseProgram(m_programId);
+	glm::mat4 const mvp(1.0f);
+	glUniformMatrix4fv(glGetUniformLocation(m_programId, "MVP"), 1, GL_FALSE, &mvp[0][0]);
+	glUniform1i(glGetUniformLocation(m_programId, "image0Sampler"), 0);
+	glUniform1i(glGetUniformLocation(m_programId, "image1Sampler"), 1);
+	glUniform1i(glGetUniformLocation(m_programId, "maskSampler"), 2);
+	m_levelCountId = glGetUniformLocation(m_programId, "levelCount");
+}
+
+GLMultiBandBlender::~GLMultiBandBlender()
+{
+	glDeleteProgram(m_programId);
+	DeleteTargets();
+}
+
+void GLMultiBandBlender::SetWeights(std::vector<uint32_t> const & weights, size_t width, size_t height)
+{
+	if (weights.size() != width * height)
+		throw std::runtime_error("Weight map doesn't match the image size!");
+
+	if (width != m_width || height != m_height) {
+		DeleteTargets();
+		m_width = width;
+		m_height = height;
+		for (size_t lens = 0; lens < 2; ++lens) {
+			m_frameBuffers[lens] = CreateFrameBuffer(width, height);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		glGenTextures(1, &m_maskTexture);
+		glBindTexture(GL_TEXTURE_2D, m_maskTexture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+
+		size_t const levelCount = std::min(m_maxLevelCount, size_t(std::log2(std::max(width, height))) + 1);
+		glUseProgram(m_programId);
+		glUniform1i(m_levelCountId, GLint(levelCount));
+	}
+
+	// Lens 0 share of the pixel, pixels without either lens have the fill color in both images
+	std::vector<float> mask(weights.size());
+	for (size_t i = 0; i < weights.size(); ++i) {
+		uint32_t const w0 = weights[i] & 0xffff;
+		uint32_t const w1 = weights[i] >> 16;
+		mask[i] = w0 + w1 > 0 ? float(w0) / (w0 + w1) : 0.5f;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, m_maskTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, width, height, 0, GL_RED, GL_FLOAT, mask.data());
+	glGenerateMipmap(GL_TEXTURE_2D);
+	OGLCheck("Failed to create multi-band mask texture!");
+}
+
+void GLMultiBandBlender::DeleteTargets()
+{
+	for (std::pair<GLuint, GLuint> & frameBuffer : m_frameBuffers)
+		if (frameBuffer.first) {
+			DeleteFrameBuffer(frameBuffer);
+			frameBuffer = std::make_pair(0, 0);
+		}
+	if (m_maskTexture) {
+		glDeleteTextures(1, &m_maskTexture);
+		m_maskTexture = 0;
+	}
+}
+
+void GLMultiBandBlender::BindLensTarget(size_t lens) const
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, m_frameBuffers[lens].first);
+	glViewport(0, 0, m_width, m_height);
+}
+
+void GLMultiBandBlender::Blend(GLuint targetFrameBuffer) const
+{
+	for (size_t lens = 0; lens < 2; ++lens) {
+		glActiveTexture(GL_TEXTURE0 + lens);
+		glBindTexture(GL_TEXTURE_2D, m_frameBuffers[lens].second);
+		glGenerateMipmap(GL_TEXTURE_2D);
+	}
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, m_maskTexture);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, targetFrameBuffer);
+	glViewport(0, 0, m_width, m_height);
+	glUseProgram(m_programId);
+	m_triangle.Draw();
+	glActiveTexture(GL_TEXTURE0);
+}
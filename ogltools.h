@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <vector>
 #include <string>
 
@@ -7,16 +8,258 @@
 
 #include <glm/glm.hpp>
 
+#include "imgtools.h"
+#include "meshtools.h"
+#include "tracetools.h"
+
+// Throws with msg and the names of all pending errors, if there are any
 void OGLCheck(std::string const & msg = {});
+// Empties the error queue, glGetError() only returns one error per call
+std::vector<GLenum> GetAllOGLErrors();
+char const * GetOGLErrorName(GLenum error);
+
+// Logs KHR_debug messages of the driver to std::cerr and into the trace. Does nothing without the
+// extension, the context also has to be a debug context for most drivers to say anything
+void EnableGLDebugOutput();
+
+// TRACE_GL_SCOPE times its scope on the CPU like TRACE_SCOPE and on the GPU with a GL_TIME_ELAPSED
+// query. Queries can't nest, inner scopes only get the CPU side. The GPU times are collected without
+// stalling by CollectGLTimings() and go on the GPU row of the trace at the CPU start of their scope,
+// the GPU runs them somewhat later. FinishGLTimings() waits for the rest and must run before the
+// context goes away
+#ifdef ENABLE_TRACING
+#define TRACE_GL_SCOPE(name) GLTraceScope TRACE_CONCAT(glTraceScope, __LINE__)(name)
+
+class GLTraceScope
+{
+public:
+	explicit GLTraceScope(char const * name);
+	~GLTraceScope();
+
+	GLTraceScope(GLTraceScope const &) = delete;
+	GLTraceScope & operator=(GLTraceScope const &) = delete;
 
-std::vector<char> GetFBTexture(size_t width, size_t height);
+private:
+	TraceScope m_cpuScope;
+	char const * m_name;
+	GLuint m_query = 0;
+	int64_t m_startNs = 0;
+};
+
+void CollectGLTimings();
+void FinishGLTimings();
+#else
+#define TRACE_GL_SCOPE(name)
+
+inline void CollectGLTimings()
+{}
+
+inline void FinishGLTimings()
+{}
+#endif
+
+RawImage GetFBTexture(size_t width, size_t height);
+// Immutable storage (glTexStorage2D) for one plane of a pixFmt image: GL_R8, GL_RG8 for interleaved chroma
+// or GL_RGB8, with linear filtering. mipmaps allocates the whole chain and filters trilinearly, the levels
+// are only filled by glGenerateMipmap. The contents are undefined until the first upload
+GLuint CreatePlaneTexture(std::string const & pixFmt, size_t width, size_t height, size_t plane, bool mipmaps,
+						  GLenum wrap = GL_CLAMP_TO_EDGE);
+// Level 0 from client memory, glTexSubImage2D waits until it's copied
+void UpdatePlaneTexture(GLuint textureId, RawImage const & image, size_t plane);
 
 GLuint CompileShader(std::string const & shaderCode, GLenum type, std::string const & name);
+// Throw with the info log if compiling or linking failed. Both delete the failed object,
+// LinkProgram deletes the shaders either way
 void CheckCompileStatus(GLuint shaderID);
 GLuint LinkProgram(GLuint vertexShaderID, GLuint fragmentShaderID);
 GLuint LoadShaders(std::string const & vertexShaderCode, std::string const & fragmentShaderCode);
+// LoadShaders, but reloads the linked program from a binary in cacheDir when there is one for these sources
+// and this driver, and writes it there otherwise. Compiles from source if the driver has no program binary
+// formats or rejects the cached one. Prints how long loading took
+GLuint LoadOrCompileProgram(std::string const & cacheDir, std::string const & vertexShaderCode, std::string const & fragmentShaderCode);
 
 glm::mat4 CreateSimpleMPVMatrix();
 glm::mat4 CreateMPVMatrix();
 
 std::pair<GLuint, GLuint> CreateFrameBuffer(size_t width, size_t height);
+// Deletes a CreateFrameBuffer result along with its depth buffer
+void DeleteFrameBuffer(std::pair<GLuint, GLuint> const & frameBuffer);
+
+// Uploads a BuildBlendWeightMap result as a GL_RGB16F texture with nearest filtering, one texel per
+// output pixel: the lens weights multiplied by the BuildGainMap gains, if any, and the fill color weight
+GLuint CreateWeightTexture(std::vector<uint32_t> const & weights, std::vector<uint32_t> const & gains,
+						   size_t width, size_t height);
+
+// FishMesh uploaded as a single interleaved vertex buffer plus the index buffer, with the attribute
+// layout recorded once in its own vertex array object. Drawing binds the VAO and issues one draw call.
+// A vertex is the 2D position and the UVs of each lens as normalized 16-bit values: 12 bytes for
+// two lenses instead of 28 as separate float buffers. Half floats would be as small, but only have
+// a quarter texel of precision left at 4K. Positions come out of the attribute in [0, 1], multiply
+// the MVP by GetPositionDecodeMatrix(); UVs cover [-0.5, 2.5] and are decoded in the vertex shaders
+class GLMesh
+{
+public:
+	explicit GLMesh(FishMesh const & mesh);
+	~GLMesh();
+
+	GLMesh(GLMesh const &) = delete;
+	GLMesh & operator=(GLMesh const &) = delete;
+
+	size_t GetVertexCount() const;
+	size_t GetVertexSize() const;
+	size_t GetIndexCount() const;
+
+	void Draw() const;
+
+	static glm::mat4 GetPositionDecodeMatrix();
+
+private:
+	GLuint m_vertexArray = 0;
+	GLuint m_vertexBuffer = 0;
+	GLuint m_indexBuffer = 0;
+	size_t m_vertexCount;
+	size_t m_vertexSize;
+	size_t m_indexCount;
+};
+
+// Empty vertex array for g_vertexShaderCode360FullScreen, which makes its vertices from gl_VertexID
+class FullScreenTriangle
+{
+public:
+	FullScreenTriangle();
+	~FullScreenTriangle();
+
+	FullScreenTriangle(FullScreenTriangle const &) = delete;
+	FullScreenTriangle & operator=(FullScreenTriangle const &) = delete;
+
+	void Draw() const;
+
+private:
+	GLuint m_vertexArray = 0;
+};
+
+// Multi-band blending on the GPU. Both lenses are stitched into their own framebuffer, with Lens0 and
+// Lens1 weight textures, then Blend() mipmaps them and collapses the Laplacian pyramids in one
+// full-screen pass of g_fragmentShaderCode360MultiBand. The mask pyramid is mipmapped once here.
+// glGenerateMipmap filters with a box rather than a Gaussian, the bands are a little less clean
+// than MultiBandBlender's on the CPU. The program is loaded once through the program cache in cacheDir,
+// SetWeights() switches to another calibration or output size
+class GLMultiBandBlender
+{
+public:
+	GLMultiBandBlender(std::string const & cacheDir, size_t levelCount);
+	~GLMultiBandBlender();
+
+	GLMultiBandBlender(GLMultiBandBlender const &) = delete;
+	GLMultiBandBlender & operator=(GLMultiBandBlender const &) = delete;
+
+	// Uploads the mask of the Feather weights, the lens framebuffers follow the size
+	void SetWeights(std::vector<uint32_t> const & weights, size_t width, size_t height);
+
+	// Binds the framebuffer the lens should be stitched into and sets the viewport
+	void BindLensTarget(size_t lens) const;
+	// Leaves targetFrameBuffer bound
+	void Blend(GLuint targetFrameBuffer) const;
+
+private:
+	void DeleteTargets();
+
+private:
+	size_t m_width = 0;
+	size_t m_height = 0;
+	size_t m_maxLevelCount;
+	GLuint m_levelCountId = 0;
+	std::pair<GLuint, GLuint> m_frameBuffers[2] = {};
+	GLuint m_maskTexture = 0;
+	GLuint m_programId = 0;
+	FullScreenTriangle m_triangle;
+};
+
+// Sets the FishProjection uniform struct called name of the current program
+void SetFishProjectionUniform(GLuint programId, std::string const & name, FishProjection const & projection);
+
+// Ring of pixel unpack buffers for streaming frames into the textures of CreatePlaneTexture.
+// Acquire() hands the next buffer out as a RawImage view for the decoder to write straight into, Upload()
+// queues glTexSubImage2D of every plane from it and fences the buffer. Neither waits for the GPU, so
+// frame N + 1 is decoded and copied while frame N renders. A buffer is handed out again once its fence
+// signaled. With ARB_buffer_storage the buffers are mapped once, persistently and coherently, otherwise
+// each one is mapped unsynchronized when it is acquired and unmapped for the upload
+class UploadRing
+{
+public:
+	UploadRing(std::string const & pixFmt, size_t width, size_t height, size_t depth = 3);
+	~UploadRing();
+
+	UploadRing(UploadRing const &) = delete;
+	UploadRing & operator=(UploadRing const &) = delete;
+
+	bool IsPersistent() const;
+	// Time spent in Acquire() waiting for the GPU to finish with a buffer
+	double GetStallMs() const;
+
+	// Valid until Upload(). Acquiring again before that returns the same buffer
+	RawImage Acquire();
+	// The planes of the acquired frame into level 0 of the textures, one per plane
+	void Upload(std::vector<GLuint> const & textureIds);
+
+private:
+	struct Slot
+	{
+		GLuint m_buffer = 0;
+		char * m_data = nullptr;
+		GLsync m_fence = nullptr;
+	};
+
+private:
+	std::string m_pixFmt;
+	size_t m_width;
+	size_t m_height;
+	size_t m_stride;
+	size_t m_size = 0;
+	bool m_persistent;
+	std::vector<Slot> m_slots;
+	size_t m_head = 0;
+	bool m_acquired = false;
+	double m_stallMs = 0.0;
+};
+
+// Ring of pixel pack buffers for asynchronous rgb24 readback of the bound framebuffer.
+// Read() only queues glReadPixels into the next buffer and fences it, so the copy of frame N
+// overlaps the rendering of the following frames. Consume() waits for the oldest fence and
+// hands the mapped buffer over as a padded RawImage view, valid until the consumer returns.
+// Uses nothing beyond GL 3.2 (PBOs and sync objects), so llvmpipe runs it as well.
+class ReadbackRing
+{
+public:
+	ReadbackRing(size_t width, size_t height, size_t depth = 3);
+	~ReadbackRing();
+
+	ReadbackRing(ReadbackRing const &) = delete;
+	ReadbackRing & operator=(ReadbackRing const &) = delete;
+
+	size_t GetPendingCount() const;
+	bool IsFull() const;
+	// Time spent in Consume() waiting for the GPU, near zero when the ring is deep enough
+	double GetStallMs() const;
+
+	// Consumes the oldest frame first if the ring is full
+	void Read(std::function<void(RawImage const &)> const & consumer);
+	void Consume(std::function<void(RawImage const &)> const & consumer);
+	void Drain(std::function<void(RawImage const &)> const & consumer);
+
+private:
+	struct Slot
+	{
+		GLuint m_buffer = 0;
+		GLsync m_fence = nullptr;
+	};
+
+private:
+	size_t m_width;
+	size_t m_height;
+	size_t m_stride;
+	std::vector<Slot> m_slots;
+	size_t m_head = 0;
+	size_t m_pending = 0;
+	double m_stallMs = 0.0;
+};
@@ -0,0 +1,138 @@
+#include "phototools.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <stdexcept>
+
+#include "blendtools.h"
+#include "projtools.h"
+
+namespace {
+	float const g_maxGain = 4095.0f / 256.0f;
+	// Samples this dark or this bright say little about the exposure
+	float const g_minSample = 16.0f;
+	float const g_maxSample = 240.0f;
+
+	void SampleRgb(RawImage const & image, glm::vec2 const & uv, float * rgb)
+	{
+		size_t const width = image.GetWidth();
+		size_t const height = image.GetHeight();
+		float const x = glm::clamp(uv.x * width - 0.5f, 0.0f, float(width - 1));
+		float const y = glm::clamp(uv.y * height - 0.5f, 0.0f, float(height - 1));
+		size_t const x0 = std::min(size_t(x), width - 2);
+		size_t const y0 = std::min(size_t(y), height - 2);
+		float const fx = x - x0;
+		float const fy = y - y0;
+
+		uint8_t const * top = reinterpret_cast<uint8_t const *>(image.GetRow(y0)) + 3 * x0;
+		uint8_t const * bottom = reinterpret_cast<uint8_t const *>(image.GetRow(y0 + 1)) + 3 * x0;
+		for (size_t c = 0; c < 3; ++c) {
+			float const topValue = top[c] + fx * (top[c + 3] - top[c]);
+			float const bottomValue = bottom[c] + fx * (bottom[c + 3] - bottom[c]);
+			rgb[c] = topValue + fy * (bottomValue - topValue);
+		}
+	}
+}
+
+uint32_t EncodeGain(float gain)
+{
+	return uint32_t(std::min(std::max(gain, 0.0f), g_maxGain) * 256.0f + 0.5f);
+}
+
+bool IsIdentity(PhotometricInfo const & photometricInfo)
+{
+	return photometricInfo.m_gain == 1.0f && photometricInfo.m_whiteBalance == glm::vec3(1.0f) &&
+		   photometricInfo.m_vignetting == glm::vec3(0.0f);
+}
+
+bool HasPhotometricCorrection(FishInfo const & fishInfo0, FishInfo const & fishInfo1)
+{
+	return !IsIdentity(fishInfo0.m_photometric) || !IsIdentity(fishInfo1.m_photometric);
+}
+
+float GetRadialGain(glm::vec2 const & uv, FishInfo const & fishInfo)
+{
+	// sphere2fish2's radius is 0.5 at the rim
+	glm::vec2 const offset = 2.0f * (uv - fishInfo.m_center) / fishInfo.m_ratio;
+	float const r2 = offset.x * offset.x + offset.y * offset.y;
+	glm::vec3 const & k = fishInfo.m_photometric.m_vignetting;
+	float const vignetting = 1.0f + r2 * (k.x + r2 * (k.y + r2 * k.z));
+	return vignetting > 0.0f ? fishInfo.m_photometric.m_gain / vignetting : g_maxGain;
+}
+
+uint32_t GetLensGains(glm::vec2 const & uv0, glm::vec2 const & uv1,
+					  FishInfo const & fishInfo0, FishInfo const & fishInfo1)
+{
+	// Outside its lens the gain is never used
+	uint32_t const gain0 = HasLens0(uv0) ? EncodeGain(GetRadialGain(uv0, fishInfo0)) : 256;
+	uint32_t const gain1 = HasLens1(uv1) ? EncodeGain(GetRadialGain(uv1, fishInfo1)) : 256;
+	return gain0 | gain1 << 16;
+}
+
+std::vector<uint32_t> BuildGainMap(FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+								   size_t width, size_t height, ThreadPool & pool)
+{
+	ViewLayout const layout = MakeViewLayout(OutputProjection::Equirect, {}, width, height);
+	std::vector<uint32_t> gains(width * height);
+	MapViewPixels(fishInfo0, fishInfo1, layout, width, height, pool, [&](size_t index, glm::vec2 const & uv0, glm::vec2 const & uv1) {
+		gains[index] = GetLensGains(uv0, uv1, fishInfo0, fishInfo1);
+	});
+	return gains;
+}
+
+std::pair<PhotometricInfo, PhotometricInfo> EstimatePhotometric(RawImage const & image,
+																FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+																size_t width, size_t height, ThreadPool & pool)
+{
+	if (image.GetPixFmt() != "rgb24")
+		throw std::runtime_error("Photometric estimation needs an rgb24 image, not " + image.GetPixFmt());
+
+	// Per row: corrected channel sums of lens 0, then of lens 1. A row belongs to a single task
+	ViewLayout const layout = MakeViewLayout(OutputProjection::Equirect, {}, width, height);
+	std::vector<std::array<double, 6>> rowSums(height);
+	MapViewPixels(fishInfo0, fishInfo1, layout, width, height, pool, [&](size_t index, glm::vec2 const & uv0, glm::vec2 const & uv1) {
+		if (!HasLens0(uv0) || !HasLens1(uv1))
+			return;
+
+		float rgb0[3];
+		float rgb1[3];
+		SampleRgb(image, uv0, rgb0);
+		SampleRgb(image, uv1, rgb1);
+		bool usable = true;
+		for (size_t c = 0; c < 3; ++c)
+			usable = usable && std::min(rgb0[c], rgb1[c]) >= g_minSample && std::max(rgb0[c], rgb1[c]) <= g_maxSample;
+		if (!usable)
+			return;
+
+		float const gain0 = GetRadialGain(uv0, fishInfo0);
+		float const gain1 = GetRadialGain(uv1, fishInfo1);
+		std::array<double, 6> & sums = rowSums[index / width];
+		for (size_t c = 0; c < 3; ++c) {
+			sums[c] += rgb0[c] * gain0 * fishInfo0.m_photometric.m_whiteBalance[c];
+			sums[c + 3] += rgb1[c] * gain1 * fishInfo1.m_photometric.m_whiteBalance[c];
+		}
+	});
+
+	std::array<double, 6> sums = {};
+	for (std::array<double, 6> const & row : rowSums)
+		for (size_t i = 0; i < sums.size(); ++i)
+			sums[i] += row[i];
+	for (double const sum : sums)
+		if (sum <= 0.0)
+			throw std::runtime_error("No usable overlap to estimate the photometric calibration from!");
+
+	// Lens 0 channel c is multiplied by sqrt(sum1 / sum0), lens 1 by the inverse. Green goes
+	// to the gain, the white balance keeps the rest
+	glm::vec3 correction;
+	for (size_t c = 0; c < 3; ++c)
+		correction[c] = float(std::sqrt(sums[c + 3] / sums[c]));
+
+	PhotometricInfo photometric0 = fishInfo0.m_photometric;
+	PhotometricInfo photometric1 = fishInfo1.m_photometric;
+	photometric0.m_gain *= correction.y;
+	photometric0.m_whiteBalance *= correction / correction.y;
+	photometric1.m_gain /= correction.y;
+	photometric1.m_whiteBalance *= correction.y / correction;
+	return {photometric0, photometric1};
+}
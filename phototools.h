@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "fishtools.h"
+#include "imgtools.h"
+#include "threadtools.h"
+
+// Gains are 8.8 fixed point below 16, so the stitch kernels can multiply them in 16-bit lanes
+uint32_t EncodeGain(float gain);
+
+bool IsIdentity(PhotometricInfo const & photometricInfo);
+bool HasPhotometricCorrection(FishInfo const & fishInfo0, FishInfo const & fishInfo1);
+
+// m_gain / vignetting(r) at the lens UV, the white balance is applied separately per channel
+float GetRadialGain(glm::vec2 const & uv, FishInfo const & fishInfo);
+
+// Encoded radial gains of both lenses (g0 | g1 << 16) for an output pixel that maps to uv0 and uv1
+uint32_t GetLensGains(glm::vec2 const & uv0, glm::vec2 const & uv1,
+					  FishInfo const & fishInfo0, FishInfo const & fishInfo1);
+
+// GetLensGains for every pixel of a width x height output, laid out as BuildBlendWeightMap
+std::vector<uint32_t> BuildGainMap(FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+								   size_t width, size_t height, ThreadPool & pool);
+
+// Fits the gains and white balance of both lenses so that they agree where they overlap, from the
+// pixels of a width x height output that both lenses see. The current calibration, vignetting included,
+// is applied first and the fit is multiplied into it, so it can be refined frame after frame.
+// The correction is split evenly: per channel the product of both lens corrections stays 1.
+// image is the rgb24 dual fisheye frame, dark and clipped samples are left out
+std::pair<PhotometricInfo, PhotometricInfo> EstimatePhotometric(RawImage const & image,
+																FishInfo const & fishInfo0, FishInfo const & fishInfo1,
+																size_t width, size_t height, ThreadPool & pool);
@@ -0,0 +1,165 @@
+#include "pipelinetools.h"
+
+#include <exception>
+#include <mutex>
+#include <ostream>
+
+namespace {
+	typedef std::chrono::steady_clock Clock;
+
+	// Free frames travel back from the consumer stage to the producer stage through a queue as well
+	class FramePool
+	{
+	public:
+		FramePool(size_t count, std::string const & pixFmt, size_t width, size_t height)
+			: m_free(count)
+		{
+			for (size_t i = 0; i < count; ++i) {
+				m_frames.emplace_back(new RawImage(pixFmt, width, height));
+				m_free.TryPush(m_frames.back().get());
+			}
+		}
+
+		bool Acquire(RawImage * & frame, std::atomic<bool> const & abort)
+		{
+			return m_free.Pop(frame, abort);
+		}
+
+		void Release(RawImage * frame, std::atomic<bool> const & abort)
+		{
+			m_free.Push(frame, abort);
+		}
+
+	private:
+		std::vector<std::unique_ptr<RawImage>> m_frames;
+		SpscQueue<RawImage *> m_free;
+	};
+
+	class StageGuard
+	{
+	public:
+		StageGuard(std::atomic<bool> & abort, std::exception_ptr & error, std::mutex & mutex)
+			: m_abort(abort)
+			, m_error(error)
+			, m_mutex(mutex)
+		{}
+
+		template<typename F>
+		void Run(F const & stage)
+		{
+			try {
+				stage();
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (!m_error)
+					m_error = std::current_exception();
+				m_abort = true;
+			}
+		}
+
+	private:
+		std::atomic<bool> & m_abort;
+		std::exception_ptr & m_error;
+		std::mutex & m_mutex;
+	};
+}
+
+PipelineStats RunPipeline(PipelineConfig const & config, PipelineStages const & stages)
+{
+	FramePool inPool(config.m_decodeQueueDepth + 2, config.m_inPixFmt, config.m_inWidth, config.m_inHeight);
+	FramePool outPool(config.m_encodeQueueDepth + 2, config.m_outPixFmt, config.m_outWidth, config.m_outHeight);
+
+	// nullptr marks the end of the stream
+	SpscQueue<RawImage *> decoded(config.m_decodeQueueDepth);
+	SpscQueue<RawImage *> processed(config.m_encodeQueueDepth);
+
+	std::atomic<bool> abort(false);
+	std::exception_ptr error;
+	std::mutex errorMutex;
+	StageGuard guard(abort, error, errorMutex);
+
+	PipelineStats stats;
+	auto const start = Clock::now();
+
+	std::thread decodeThread([&]() {
+		guard.Run([&]() {
+			RawImage * frame = nullptr;
+			while (inPool.Acquire(frame, abort)) {
+				auto const decodeStart = Clock::now();
+				bool const hasFrame = stages.m_decode(*frame);
+				stats.m_decodeMs += MillisecondsSince(decodeStart);
+
+				if (!hasFrame) {
+					decoded.Push(nullptr, abort);
+					break;
+				}
+				if (!decoded.Push(frame, abort))
+					break;
+			}
+		});
+	});
+
+	std::thread encodeThread([&]() {
+		guard.Run([&]() {
+			RawImage * frame = nullptr;
+			while (processed.Pop(frame, abort) && frame) {
+				auto const encodeStart = Clock::now();
+				stages.m_encode(*frame);
+				stats.m_encodeMs += MillisecondsSince(encodeStart);
+				++stats.m_frameCount;
+
+				outPool.Release(frame, abort);
+			}
+		});
+	});
+
+	guard.Run([&]() {
+		RawImage * inFrame = nullptr;
+		RawImage * outFrame = nullptr;
+		while (decoded.Pop(inFrame, abort)) {
+			if (!inFrame) {
+				processed.Push(nullptr, abort);
+				break;
+			}
+			if (!outPool.Acquire(outFrame, abort))
+				break;
+
+			auto const processStart = Clock::now();
+			stages.m_process(*inFrame, *outFrame);
+			stats.m_processMs += MillisecondsSince(processStart);
+
+			inPool.Release(inFrame, abort);
+			if (!processed.Push(outFrame, abort))
+				break;
+		}
+	});
+
+	decodeThread.join();
+	encodeThread.join();
+
+	if (error)
+		std::rethrow_exception(error);
+
+	stats.m_totalMs = MillisecondsSince(start);
+	stats.m_decodeQueue = decoded.GetStats();
+	stats.m_encodeQueue = processed.GetStats();
+	return stats;
+}
+
+std::ostream & operator<<(std::ostream & stream, PipelineStats const & stats)
+{
+	size_t const frameCount = stats.m_frameCount > 0 ? stats.m_frameCount : 1;
+	stream << "Frames: " << stats.m_frameCount << ", " << stats.m_frameCount * 1e3 / stats.m_totalMs << " fps" << std::endl;
+	stream << "Per frame: decode " << stats.m_decodeMs / frameCount << " ms, process " << stats.m_processMs / frameCount
+		   << " ms, encode " << stats.m_encodeMs / frameCount << " ms" << std::endl;
+
+	auto const printQueue = [&](char const * name, QueueStats const & queue) {
+		stream << name << " queue: full " << queue.m_fullStalls << " times (" << queue.m_fullWaitMs << " ms), empty "
+			   << queue.m_emptyStalls << " times (" << queue.m_emptyWaitMs << " ms)" << std::endl;
+	};
+	printQueue("Decode", stats.m_decodeQueue);
+	printQueue("Encode", stats.m_encodeQueue);
+
+	return stream;
+}
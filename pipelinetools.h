@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "imgtools.h"
+#include "tracetools.h"
+
+struct QueueStats
+{
+	size_t m_fullStalls = 0;   // times the producer found the queue full (back-pressure)
+	size_t m_emptyStalls = 0;  // times the consumer found the queue empty (starvation)
+	double m_fullWaitMs = 0.0;
+	double m_emptyWaitMs = 0.0;
+};
+
+// Bounded lock-free single-producer single-consumer ring buffer
+template<typename T>
+class SpscQueue
+{
+public:
+	explicit SpscQueue(size_t capacity)
+		: m_items(capacity + 1)
+		, m_head(0)
+		, m_tail(0)
+	{}
+
+	size_t GetCapacity() const
+	{
+		return m_items.size() - 1;
+	}
+
+	bool TryPush(T const & value)
+	{
+		size_t const tail = m_tail.load(std::memory_order_relaxed);
+		size_t const next = (tail + 1) % m_items.size();
+		if (next == m_head.load(std::memory_order_acquire))
+			return false;
+
+		m_items[tail] = value;
+		m_tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	bool TryPop(T & value)
+	{
+		size_t const head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire))
+			return false;
+
+		value = m_items[head];
+		m_head.store((head + 1) % m_items.size(), std::memory_order_release);
+		return true;
+	}
+
+	// Blocking versions. They give up and return false once abort is set
+	bool Push(T const & value, std::atomic<bool> const & abort)
+	{
+		return Wait([&]() { return TryPush(value); }, abort, m_stats.m_fullStalls, m_stats.m_fullWaitMs);
+	}
+
+	bool Pop(T & value, std::atomic<bool> const & abort)
+	{
+		return Wait([&]() { return TryPop(value); }, abort, m_stats.m_emptyStalls, m_stats.m_emptyWaitMs);
+	}
+
+	// Only meaningful once both sides are done
+	QueueStats const & GetStats() const
+	{
+		return m_stats;
+	}
+
+private:
+	template<typename F>
+	bool Wait(F const & tryOnce, std::atomic<bool> const & abort, size_t & stalls, double & waitMs)
+	{
+		if (tryOnce())
+			return true;
+
+		++stalls;
+		auto const start = std::chrono::steady_clock::now();
+		for (size_t spin = 0; !tryOnce(); ++spin) {
+			if (abort)
+				return false;
+			if (spin < 64)
+				std::this_thread::yield();
+			else
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+		waitMs += MillisecondsSince(start);
+		return true;
+	}
+
+private:
+	std::vector<T> m_items;
+	alignas(64) std::atomic<size_t> m_head;
+	alignas(64) std::atomic<size_t> m_tail;
+	// Full stalls are only touched by the producer, empty stalls only by the consumer
+	alignas(64) QueueStats m_stats;
+};
+
+struct PipelineConfig
+{
+	size_t m_decodeQueueDepth = 4;
+	size_t m_encodeQueueDepth = 4;
+
+	std::string m_inPixFmt = "rgb24";
+	size_t m_inWidth = 0;
+	size_t m_inHeight = 0;
+
+	std::string m_outPixFmt = "rgb24";
+	size_t m_outWidth = 0;
+	size_t m_outHeight = 0;
+};
+
+struct PipelineStages
+{
+	std::function<bool(RawImage &)> m_decode; // returns false at the end of the stream
+	std::function<void(RawImage const &, RawImage &)> m_process;
+	std::function<void(RawImage const &)> m_encode;
+};
+
+struct PipelineStats
+{
+	size_t m_frameCount = 0;
+	double m_totalMs = 0.0;
+	double m_decodeMs = 0.0;
+	double m_processMs = 0.0;
+	double m_encodeMs = 0.0;
+	QueueStats m_decodeQueue;
+	QueueStats m_encodeQueue;
+};
+
+// Runs decode, process and encode on their own threads. Frames come from two preallocated pools
+// (queue depth + 2 frames each, so every stage can hold one) and are recycled, nothing is
+// allocated per frame. An exception in any stage stops the pipeline and is rethrown here.
+PipelineStats RunPipeline(PipelineConfig const & config, PipelineStages const & stages);
+
+std::ostream & operator<<(std::ostream & stream, PipelineStats const & stats);
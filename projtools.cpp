@@ -0,0 +1,165 @@
+#include "projtools.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+
+#include <glm/gtc/constants.hpp>
+
+#include "phototools.h"
+
+namespace {
+	// Cube faces as MakeViewLayout lays them out
+	ViewFace const g_cubeFaces[] = {
+		{glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f)},  // Left
+		{glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f)},   // Front
+		{glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f)},  // Right
+		{glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f)}, // Down
+		{glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(-1.0f, 0.0f, 0.0f)},  // Back
+		{glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f)}    // Up
+	};
+
+}
+
+char const * ProjectionName(OutputProjection projection)
+{
+	switch (projection) {
+	case OutputProjection::Equirect:
+		return "equirect";
+	case OutputProjection::Cubemap:
+		return "cubemap";
+	case OutputProjection::Eac:
+		return "eac";
+	default:
+		return "rectilinear";
+	}
+}
+
+OutputProjection ParseProjection(std::string const & name)
+{
+	for (OutputProjection const projection : {OutputProjection::Equirect, OutputProjection::Cubemap,
+											  OutputProjection::Eac, OutputProjection::Rectilinear})
+		if (name == ProjectionName(projection))
+			return projection;
+	throw std::runtime_error("Unknown projection: " + name);
+}
+
+ViewLayout MakeViewLayout(OutputProjection projection, std::vector<RectilinearView> const & views,
+						  size_t width, size_t height)
+{
+	ViewLayout layout = {projection, 1, 1, {}};
+	switch (projection) {
+	case OutputProjection::Equirect:
+		break;
+	case OutputProjection::Cubemap:
+	case OutputProjection::Eac:
+		if (width % 3 != 0 || height % 2 != 0 || width / 3 != height / 2)
+			throw std::runtime_error(std::string(ProjectionName(projection)) + " needs a 3:2 output of square faces, e.g. 1536x1024");
+		layout.m_columnCount = 3;
+		layout.m_rowCount = 2;
+		layout.m_faces.assign(std::begin(g_cubeFaces), std::end(g_cubeFaces));
+		break;
+	default:
+		if (views.empty())
+			throw std::runtime_error("Rectilinear output needs at least one view");
+		if (width % views.size() != 0)
+			throw std::runtime_error("Output width doesn't split into " + std::to_string(views.size()) + " views");
+		layout.m_columnCount = views.size();
+		for (RectilinearView const & view : views) {
+			if (!(view.m_fov > 0.0f && view.m_fov < glm::pi<float>()))
+				throw std::runtime_error("Rectilinear views need a FOV between 0 and 180 degrees");
+			float const halfWidth = std::tan(view.m_fov / 2);
+			float const halfHeight = halfWidth * height / (width / views.size());
+			float const cosYaw = std::cos(view.m_yaw);
+			float const sinYaw = std::sin(view.m_yaw);
+			float const cosPitch = std::cos(view.m_pitch);
+			float const sinPitch = std::sin(view.m_pitch);
+			layout.m_faces.push_back({glm::vec3(cosPitch * sinYaw, cosPitch * cosYaw, sinPitch),
+									  halfWidth * glm::vec3(cosYaw, -sinYaw, 0.0f),
+									  halfHeight * glm::vec3(sinPitch * sinYaw, sinPitch * cosYaw, -cosPitch)});
+		}
+		break;
+	}
+	return layout;
+}
+
+void ViewToSphereBatch(ViewLayout const & layout, ViewFace const & face, float const * as, float const * bs, size_t count,
+					   float * sphereXs, float * sphereYs)
+{
+	bool const equiAngular = layout.m_projection == OutputProjection::Eac;
+	for (size_t i = 0; i < count; ++i) {
+		float const a = equiAngular ? std::tan(as[i] * glm::pi<float>() / 4) : as[i];
+		float const b = equiAngular ? std::tan(bs[i] * glm::pi<float>() / 4) : bs[i];
+		glm::vec3 const direction = face.m_forward + a * face.m_right + b * face.m_down;
+		// The inverse of the longitude and latitude of sphere2fish2
+		sphereXs[i] = std::atan2(direction.x, direction.y) / glm::pi<float>();
+		sphereYs[i] = -std::atan2(direction.z, std::hypot(direction.x, direction.y)) / glm::half_pi<float>();
+	}
+}
+
+void MapViewPixels(FishInfo const & fishInfo0, FishInfo const & fishInfo1, ViewLayout const & layout,
+				   size_t width, size_t height, ThreadPool & pool,
+				   std::function<void(size_t, glm::vec2 const &, glm::vec2 const &)> const & pixel)
+{
+	if (width % layout.m_columnCount != 0 || height % layout.m_rowCount != 0)
+		throw std::runtime_error("Output size doesn't split into the tiles of the layout!");
+
+	FishProjection const projection0 = MakeFishProjection(fishInfo0);
+	FishProjection const projection1 = MakeFishProjection(fishInfo1);
+	size_t const tileWidth = width / layout.m_columnCount;
+	size_t const tileHeight = height / layout.m_rowCount;
+
+	std::vector<float> as(tileWidth);
+	for (size_t x = 0; x < tileWidth; ++x)
+		as[x] = -1.0f + (x + 0.5f) * 2.0f / tileWidth;
+
+	ParallelRows(pool, height, [&](size_t y) {
+		std::vector<float> const bs(tileWidth, -1.0f + (y % tileHeight + 0.5f) * 2.0f / tileHeight);
+		std::vector<float> xs(width), ys(width), us0(width), vs0(width), us1(width), vs1(width);
+		// An equirect tile position is the sphere position itself
+		float const * sphereXs = as.data();
+		float const * sphereYs = bs.data();
+		if (layout.m_projection != OutputProjection::Equirect) {
+			for (size_t column = 0; column < layout.m_columnCount; ++column) {
+				ViewFace const & face = layout.m_faces[y / tileHeight * layout.m_columnCount + column];
+				ViewToSphereBatch(layout, face, as.data(), bs.data(), tileWidth, &xs[column * tileWidth], &ys[column * tileWidth]);
+			}
+			sphereXs = xs.data();
+			sphereYs = ys.data();
+		}
+
+		sphere2fish2Batch(projection0, sphereXs, sphereYs, width, us0.data(), vs0.data());
+		sphere2fish2Batch(projection1, sphereXs, sphereYs, width, us1.data(), vs1.data());
+		for (size_t x = 0; x < width; ++x)
+			pixel(x + y * width, glm::vec2(us0[x], vs0[x]), glm::vec2(us1[x], vs1[x]));
+	});
+}
+
+void HashViewLayout(Hasher & hasher, ViewLayout const & layout)
+{
+	hasher.Add(layout.m_projection).Add(layout.m_columnCount).Add(layout.m_rowCount);
+	for (ViewFace const & face : layout.m_faces)
+		hasher.Add(face.m_forward).Add(face.m_right).Add(face.m_down);
+}
+
+std::vector<uint32_t> BuildViewWeightMap(FishInfo const & fishInfo0, FishInfo const & fishInfo1, ViewLayout const & layout,
+										 size_t width, size_t height, BlendMode mode, ThreadPool & pool)
+{
+	std::vector<uint32_t> weights(width * height);
+	MapViewPixels(fishInfo0, fishInfo1, layout, width, height, pool, [&](size_t index, glm::vec2 const & uv0, glm::vec2 const & uv1) {
+		weights[index] = GetBlendWeights(uv0, uv1, fishInfo0, fishInfo1, mode);
+	});
+	return weights;
+}
+
+std::vector<uint32_t> BuildViewGainMap(FishInfo const & fishInfo0, FishInfo const & fishInfo1, ViewLayout const & layout,
+									   size_t width, size_t height, ThreadPool & pool)
+{
+	std::vector<uint32_t> gains(width * height);
+	MapViewPixels(fishInfo0, fishInfo1, layout, width, height, pool, [&](size_t index, glm::vec2 const & uv0, glm::vec2 const & uv1) {
+		gains[index] = GetLensGains(uv0, uv1, fishInfo0, fishInfo1);
+	});
+	return gains;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "blendtools.h"
+#include "cachetools.h"
+#include "fishtools.h"
+#include "threadtools.h"
+
+enum class OutputProjection
+{
+	Equirect,   // The panorama itself
+	Cubemap,    // Six 90 degree faces in a 3x2 grid
+	Eac,        // Equi-angular cubemap: the cube faces with pixels evenly spaced in angle rather than on the face
+	Rectilinear // Perspective views side by side
+};
+
+char const * ProjectionName(OutputProjection projection);
+OutputProjection ParseProjection(std::string const & name);
+
+// Angles in radians. Positive yaw turns right, positive pitch looks up
+struct RectilinearView
+{
+	float m_yaw;
+	float m_pitch;
+	float m_fov; // Horizontal, the vertical one follows from the tile size
+};
+
+// One tile of the output. The pixel at tile position (a, b) in [-1, 1]^2, a to the right and b downwards,
+// looks along m_forward + f(a) * m_right + f(b) * m_down, f is tan(a * pi / 4) for EAC and a otherwise
+struct ViewFace
+{
+	glm::vec3 m_forward;
+	glm::vec3 m_right;
+	glm::vec3 m_down;
+};
+
+// An output image split in tiles. Directions are in the frame of sphere2fish2: +y is the center
+// of the panorama, +x is to its right and +z up
+struct ViewLayout
+{
+	OutputProjection m_projection;
+	size_t m_columnCount;
+	size_t m_rowCount;
+	std::vector<ViewFace> m_faces; // Row by row, the top row first
+};
+
+// The cube faces go left, front, right in the top row and down, back, up in the bottom row. The bottom
+// row is turned a quarter, so both rows are continuous strips and compress without seams in the middle.
+// Rectilinear views go side by side in one row. width x height is the whole output, throws if it doesn't
+// split into square cube faces or into the views. Equirect is a single tile without faces
+ViewLayout MakeViewLayout(OutputProjection projection, std::vector<RectilinearView> const & views,
+						  size_t width, size_t height);
+
+// Sphere positions, the [-1, 1]^2 input of sphere2fish2, seen at (a, b) of a tile
+void ViewToSphereBatch(ViewLayout const & layout, ViewFace const & face, float const * as, float const * bs, size_t count,
+					   float * sphereXs, float * sphereYs);
+
+void HashViewLayout(Hasher & hasher, ViewLayout const & layout);
+
+// Calls pixel(index, uv0, uv1) with the positions in both fisheyes of every pixel of a width x height output
+// in the layout. Rows are spread over the pool, the pixels of one row are visited in order by a single task
+void MapViewPixels(FishInfo const & fishInfo0, FishInfo const & fishInfo1, ViewLayout const & layout,
+				   size_t width, size_t height, ThreadPool & pool,
+				   std::function<void(size_t, glm::vec2 const &, glm::vec2 const &)> const & pixel);
+
+// BuildBlendWeightMap and BuildGainMap for the pixels of a width x height output in the layout.
+// Laid out the same way, row 0 holds the top of the tiles
+std::vector<uint32_t> BuildViewWeightMap(FishInfo const & fishInfo0, FishInfo const & fishInfo1, ViewLayout const & layout,
+										 size_t width, size_t height, BlendMode mode, ThreadPool & pool);
+std::vector<uint32_t> BuildViewGainMap(FishInfo const & fishInfo0, FishInfo const & fishInfo1, ViewLayout const & layout,
+									   size_t width, size_t height, ThreadPool & pool);
@@ -0,0 +1,387 @@
+#include "pyramidtools.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "codectools.h"
+#include "tracetools.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PYRAMID_X86
+#define PYRAMID_SSE41 __attribute__((target("sse4.1")))
+#endif
+
+namespace {
+	std::string const g_dziSuffix = ".dzi";
+
+	void MakeDir(std::string const & path)
+	{
+		if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+			throw std::runtime_error("Can't create directory: " + path);
+	}
+
+	// From the full image down to 1x1
+	std::vector<std::pair<size_t, size_t>> GetLevelSizes(size_t width, size_t height)
+	{
+		std::vector<std::pair<size_t, size_t>> sizes = {{width, height}};
+		while (sizes.back().first > 1 || sizes.back().second > 1)
+			sizes.emplace_back((sizes.back().first + 1) / 2, (sizes.back().second + 1) / 2);
+		return sizes;
+	}
+
+	// Creates the directories of the levels, the full image is the level with the highest number
+	std::vector<std::string> MakeLevelDirs(PyramidSettings const & settings, size_t levelCount)
+	{
+		std::string const filesDir = settings.m_path.substr(0, settings.m_path.size() - g_dziSuffix.size()) + "_files";
+		MakeDir(filesDir);
+		std::vector<std::string> dirs;
+		for (size_t index = 0; index < levelCount; ++index) {
+			dirs.push_back(filesDir + "/" + std::to_string(levelCount - 1 - index));
+			MakeDir(dirs.back());
+		}
+		return dirs;
+	}
+
+	std::string GetTilePath(std::string const & dir, size_t column, size_t row, PyramidSettings const & settings)
+	{
+		return dir + "/" + std::to_string(column) + "_" + std::to_string(row) + "." + settings.m_format;
+	}
+
+	// Tiles are views into the rows, the encoders only read them
+	void EncodeTile(uint8_t const * data, size_t stride, size_t width, size_t height, std::string const & path, ImageFormat format)
+	{
+		TRACE_SCOPE("pyramid tile");
+		RawImage const tile(const_cast<char *>(reinterpret_cast<char const *>(data)), stride, "rgb24", width, height);
+		EncodeImageFile(tile, path, format);
+	}
+
+	// Written last, viewers never see a pyramid with missing tiles
+	void WriteDzi(PyramidSettings const & settings, size_t width, size_t height)
+	{
+		std::ofstream file(settings.m_path);
+		file << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			 << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" TileSize=\"" << settings.m_tileSize
+			 << "\" Overlap=\"0\" Format=\"" << settings.m_format << "\">\n"
+			 << "  <Size Width=\"" << width << "\" Height=\"" << height << "\"/>\n"
+			 << "</Image>\n";
+		if (!file)
+			throw std::runtime_error("Failed to write file: " + settings.m_path);
+	}
+
+#ifdef PYRAMID_X86
+	PYRAMID_SSE41 __m128i LoadPairSse(uint8_t const * src)
+	{
+		// Each 16-bit lane holds a sample plus the same channel of the next pixel
+		return _mm_add_epi16(_mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(src))),
+							 _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(src + 3))));
+	}
+
+	// Four output pixels from eight input ones per step. Returns how many pixels are done, the loads
+	// reach three bytes past the eighth pixel, so the last steps are left to the scalar loop
+	PYRAMID_SSE41 size_t DownsampleRowSse41(uint8_t const * row0, uint8_t const * row1, size_t srcWidth, uint8_t * dst)
+	{
+		__m128i const rounding = _mm_set1_epi16(2);
+		__m128i const lowPick = _mm_setr_epi8(0, 1, 2, 6, 7, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1);
+		__m128i const highPick = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 3, 4, -1, -1, -1, -1);
+
+		size_t x = 0;
+		for (; 6 * x + 27 <= 3 * srcWidth; x += 4) {
+			__m128i sums[3];
+			for (size_t i = 0; i < 3; ++i) {
+				__m128i const sum = _mm_add_epi16(LoadPairSse(row0 + 6 * x + 8 * i), LoadPairSse(row1 + 6 * x + 8 * i));
+				sums[i] = _mm_srli_epi16(_mm_add_epi16(sum, rounding), 2);
+			}
+			// Lane 6k + c holds channel c of output pixel k
+			__m128i const low = _mm_packus_epi16(sums[0], sums[1]);
+			__m128i const high = _mm_packus_epi16(sums[2], sums[2]);
+			__m128i const pixels = _mm_or_si128(_mm_shuffle_epi8(low, lowPick), _mm_shuffle_epi8(high, highPick));
+			_mm_storel_epi64(reinterpret_cast<__m128i *>(dst + 3 * x), pixels);
+			uint32_t const last = uint32_t(_mm_extract_epi32(pixels, 2));
+			memcpy(dst + 3 * x + 8, &last, 4);
+		}
+		return x;
+	}
+#endif
+
+	// One level of the pyramid. Rows arrive from the level above in bands, which are written out
+	// once tileSize rows are in
+	struct PyramidLevel
+	{
+		size_t m_width;
+		size_t m_height;
+		std::string m_dir;
+		std::unique_ptr<RawImage> m_band; // Not for the full image, its bands are views of it
+		size_t m_bandRowCount = 0;
+		size_t m_tileRow = 0;
+	};
+
+	class PyramidWriter
+	{
+	public:
+		PyramidWriter(size_t width, size_t height, PyramidSettings const & settings, ThreadPool & pool, SimdLevel level)
+			: m_settings(settings)
+			, m_pool(pool)
+			, m_simdLevel(level)
+		{
+			std::vector<std::pair<size_t, size_t>> const sizes = GetLevelSizes(width, height);
+			std::vector<std::string> const dirs = MakeLevelDirs(m_settings, sizes.size());
+			for (size_t index = 0; index < sizes.size(); ++index) {
+				PyramidLevel level = {sizes[index].first, sizes[index].second, dirs[index], nullptr, 0, 0};
+				if (index > 0)
+					level.m_band.reset(new RawImage("rgb24", level.m_width, std::min(level.m_height, m_settings.m_tileSize)));
+				m_levels.push_back(std::move(level));
+			}
+		}
+
+		size_t Write(RawImage const & image)
+		{
+			for (size_t y = 0; y < image.GetHeight(); y += m_settings.m_tileSize)
+				WriteBand(0, reinterpret_cast<uint8_t const *>(image.GetRow(y)), image.GetStride(),
+						  std::min(m_settings.m_tileSize, image.GetHeight() - y));
+
+			// The bottom bands of the smaller levels aren't full
+			for (size_t index = 1; index < m_levels.size(); ++index) {
+				PyramidLevel & level = m_levels[index];
+				if (level.m_bandRowCount > 0)
+					WriteBand(index, reinterpret_cast<uint8_t const *>(level.m_band->GetData()), level.m_band->GetStride(),
+							  level.m_bandRowCount);
+			}
+			return m_tileCount;
+		}
+
+	private:
+		// Encodes the tiles of the band and downsamples it into the next level in the same parallel loop
+		void WriteBand(size_t index, uint8_t const * band, size_t stride, size_t rowCount)
+		{
+			PyramidLevel & level = m_levels[index];
+			size_t const tileSize = m_settings.m_tileSize;
+			size_t const columnCount = (level.m_width + tileSize - 1) / tileSize;
+			PyramidLevel * next = index + 1 < m_levels.size() ? &m_levels[index + 1] : nullptr;
+			size_t const nextRowCount = next ? (rowCount + 1) / 2 : 0;
+			size_t const chunkCount = GetRowChunkCount(nextRowCount);
+			ImageFormat const format = GetImageFormat("tile." + m_settings.m_format);
+
+			m_pool.ParallelFor(columnCount + chunkCount, [&](size_t task) {
+				if (task < columnCount) {
+					size_t const x = task * tileSize;
+					EncodeTile(band + 3 * x, stride, std::min(tileSize, level.m_width - x), rowCount,
+							   GetTilePath(level.m_dir, task, level.m_tileRow, m_settings), format);
+					return;
+				}
+
+				TRACE_SCOPE("pyramid downsample");
+				RunRowChunk(task - columnCount, nextRowCount, [&](size_t y) {
+					uint8_t const * row0 = band + 2 * y * stride;
+					uint8_t const * row1 = 2 * y + 1 < rowCount ? row0 + stride : row0;
+					DownsampleRow(row0, row1, level.m_width, reinterpret_cast<uint8_t *>(next->m_band->GetRow(next->m_bandRowCount + y)),
+								  m_simdLevel);
+				});
+			});
+
+			m_tileCount += columnCount;
+			++level.m_tileRow;
+			level.m_bandRowCount = 0;
+			if (!next)
+				return;
+
+			// Full bands give half a band, so the next level fills up every other band
+			next->m_bandRowCount += nextRowCount;
+			if (next->m_bandRowCount == tileSize)
+				WriteBand(index + 1, reinterpret_cast<uint8_t const *>(next->m_band->GetData()), next->m_band->GetStride(),
+						  next->m_bandRowCount);
+		}
+
+	private:
+		PyramidSettings const & m_settings;
+		ThreadPool & m_pool;
+		SimdLevel m_simdLevel;
+		std::vector<PyramidLevel> m_levels;
+		size_t m_tileCount = 0;
+	};
+}
+
+void CheckPyramidSettings(PyramidSettings const & settings)
+{
+	if (settings.m_path.size() <= g_dziSuffix.size() ||
+			settings.m_path.compare(settings.m_path.size() - g_dziSuffix.size(), g_dziSuffix.size(), g_dziSuffix) != 0)
+		throw std::runtime_error("The pyramid goes to a .dzi file, not " + settings.m_path);
+	if (settings.m_tileSize < 16 || settings.m_tileSize % 2 != 0)
+		throw std::runtime_error("Tiles are even and at least 16 pixels wide, not " + std::to_string(settings.m_tileSize));
+
+	ImageFormat const format = GetImageFormat("tile." + settings.m_format);
+	if (format != ImageFormat::Jpeg && format != ImageFormat::Png && format != ImageFormat::Bmp && format != ImageFormat::Ppm)
+		throw std::runtime_error("Tiles are jpg, png, bmp or ppm, not " + settings.m_format);
+	if (!HasNativeCodec(format))
+		throw std::runtime_error("Built without an encoder for " + settings.m_format + " tiles");
+}
+
+size_t WritePyramid(RawImage const & image, PyramidSettings const & settings, ThreadPool & pool, SimdLevel level)
+{
+	TRACE_SCOPE("pyramid");
+	if (image.GetPixFmt() != "rgb24")
+		throw std::runtime_error("Pyramids are made of rgb24 images, not " + image.GetPixFmt());
+	CheckPyramidSettings(settings);
+
+	size_t const tileCount = PyramidWriter(image.GetWidth(), image.GetHeight(), settings, pool, level).Write(image);
+	WriteDzi(settings, image.GetWidth(), image.GetHeight());
+	return tileCount;
+}
+
+LivePyramid::LivePyramid(size_t width, size_t height, PyramidSettings const & settings, ThreadPool & pool, SimdLevel level)
+	: m_settings(settings)
+	, m_pool(pool)
+	, m_simdLevel(level)
+	, m_width(width)
+	, m_height(height)
+{
+	CheckPyramidSettings(settings);
+
+	std::vector<std::pair<size_t, size_t>> const sizes = GetLevelSizes(width, height);
+	std::vector<std::string> const dirs = MakeLevelDirs(m_settings, sizes.size());
+	for (size_t index = 0; index < sizes.size(); ++index) {
+		Level level;
+		level.m_width = sizes[index].first;
+		level.m_height = sizes[index].second;
+		level.m_dir = dirs[index];
+		level.m_columnCount = (level.m_width + settings.m_tileSize - 1) / settings.m_tileSize;
+		level.m_rowCount = (level.m_height + settings.m_tileSize - 1) / settings.m_tileSize;
+		if (index > 0)
+			level.m_image.reset(new RawImage("rgb24", level.m_width, level.m_height));
+		m_levels.push_back(std::move(level));
+	}
+}
+
+size_t LivePyramid::Update(RawImage const & image)
+{
+	CheckImage(image);
+	Level & full = m_levels.front();
+	full.m_changedTiles.assign(full.m_columnCount * full.m_rowCount, 1);
+	return WriteChangedTiles(image);
+}
+
+size_t LivePyramid::Update(RawImage const & image, std::vector<uint32_t> const & changedCells, size_t cellSize)
+{
+	CheckImage(image);
+	Level & full = m_levels.front();
+	full.m_changedTiles.assign(full.m_columnCount * full.m_rowCount, m_written ? 0 : 1);
+
+	size_t const tileSize = m_settings.m_tileSize;
+	size_t const xCellCount = (m_width + cellSize - 1) / cellSize;
+	for (uint32_t const cell : changedCells) {
+		size_t const x = (cell % xCellCount) * cellSize;
+		size_t const y = (cell / xCellCount) * cellSize;
+		size_t const lastColumn = (std::min(m_width, x + cellSize) - 1) / tileSize;
+		size_t const lastRow = (std::min(m_height, y + cellSize) - 1) / tileSize;
+		for (size_t row = y / tileSize; row <= lastRow; ++row)
+			for (size_t column = x / tileSize; column <= lastColumn; ++column)
+				full.m_changedTiles[column + row * full.m_columnCount] = 1;
+	}
+	return WriteChangedTiles(image);
+}
+
+void LivePyramid::CheckImage(RawImage const & image) const
+{
+	if (image.GetPixFmt() != "rgb24" || image.GetWidth() != m_width || image.GetHeight() != m_height)
+		throw std::runtime_error("The image doesn't match the pyramid");
+}
+
+// Level by level, the tiles of a level are downsampled from the level above and encoded on the pool.
+// A tile of the next level changes with any of the four it is made of
+size_t LivePyramid::WriteChangedTiles(RawImage const & image)
+{
+	TRACE_SCOPE("pyramid update");
+	size_t const tileSize = m_settings.m_tileSize;
+	ImageFormat const format = GetImageFormat("tile." + m_settings.m_format);
+	size_t tileCount = 0;
+	for (size_t index = 0; index < m_levels.size(); ++index) {
+		Level & level = m_levels[index];
+		if (index > 0) {
+			Level const & above = m_levels[index - 1];
+			level.m_changedTiles.assign(level.m_columnCount * level.m_rowCount, 0);
+			for (size_t tile = 0; tile < above.m_changedTiles.size(); ++tile)
+				if (above.m_changedTiles[tile])
+					level.m_changedTiles[tile % above.m_columnCount / 2 + tile / above.m_columnCount / 2 * level.m_columnCount] = 1;
+		}
+
+		std::vector<size_t> tiles;
+		for (size_t tile = 0; tile < level.m_changedTiles.size(); ++tile)
+			if (level.m_changedTiles[tile])
+				tiles.push_back(tile);
+		if (tiles.empty())
+			break;
+
+		RawImage const & levelImage = index == 0 ? image : *level.m_image;
+		RawImage const * aboveImage = index == 0 ? nullptr : index == 1 ? &image : m_levels[index - 1].m_image.get();
+		m_pool.ParallelFor(tiles.size(), [&](size_t i) {
+			size_t const column = tiles[i] % level.m_columnCount;
+			size_t const row = tiles[i] / level.m_columnCount;
+			size_t const x = column * tileSize;
+			size_t const y = row * tileSize;
+			size_t const width = std::min(tileSize, level.m_width - x);
+			size_t const height = std::min(tileSize, level.m_height - y);
+
+			if (aboveImage) {
+				TRACE_SCOPE("pyramid downsample");
+				// The same rows and columns WritePyramid averages, odd edges included
+				size_t const aboveWidth = std::min(2 * tileSize, aboveImage->GetWidth() - 2 * x);
+				for (size_t dstY = y; dstY < y + height; ++dstY) {
+					uint8_t const * row0 = reinterpret_cast<uint8_t const *>(aboveImage->GetRow(2 * dstY)) + 3 * 2 * x;
+					uint8_t const * row1 = 2 * dstY + 1 < aboveImage->GetHeight() ?
+						reinterpret_cast<uint8_t const *>(aboveImage->GetRow(2 * dstY + 1)) + 3 * 2 * x : row0;
+					DownsampleRow(row0, row1, aboveWidth, reinterpret_cast<uint8_t *>(level.m_image->GetRow(dstY)) + 3 * x,
+								  m_simdLevel);
+				}
+			}
+
+			// Replaces the old tile in one step. A failure leaves the old tile and no temporary file,
+			// ParallelFor rethrows it once the other tiles are done
+			std::string const path = GetTilePath(level.m_dir, column, row, m_settings);
+			std::string const tempPath = path + ".tmp";
+			try {
+				EncodeTile(reinterpret_cast<uint8_t const *>(levelImage.GetRow(y)) + 3 * x, levelImage.GetStride(), width, height,
+						   tempPath, format);
+				if (rename(tempPath.c_str(), path.c_str()) != 0)
+					throw std::runtime_error("Can't replace tile: " + path);
+			}
+			catch (...) {
+				remove(tempPath.c_str());
+				throw;
+			}
+		});
+		tileCount += tiles.size();
+	}
+
+	if (!m_written) {
+		WriteDzi(m_settings, m_width, m_height);
+		m_written = true;
+	}
+	return tileCount;
+}
+
+void DownsampleRow(uint8_t const * row0, uint8_t const * row1, size_t srcWidth, uint8_t * dst, SimdLevel level)
+{
+	size_t x = 0;
+#ifdef PYRAMID_X86
+	// The shuffles need SSSE3 and the widening SSE4.1, AVX2 wouldn't gain much on 24-bit pixels
+	if (level != SimdLevel::Scalar)
+		x = DownsampleRowSse41(row0, row1, srcWidth, dst);
+#else
+	(void)level;
+#endif
+
+	for (size_t const dstWidth = (srcWidth + 1) / 2; x < dstWidth; ++x) {
+		size_t const x0 = 3 * (2 * x);
+		size_t const x1 = 3 * std::min(2 * x + 1, srcWidth - 1);
+		for (size_t c = 0; c < 3; ++c)
+			dst[3 * x + c] = uint8_t((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+	}
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "imgtools.h"
+#include "stitchtools.h"
+#include "threadtools.h"
+
+// A Deep Zoom image: <name>.dzi describes it, <name>_files/<level>/<column>_<row>.<format> are the tiles.
+// Level 0 is 1x1, every level doubles the size of the one before up to the full image. Web viewers
+// (OpenSeadragon, Marzipano's flat and equirect sources with a tile URL template) load it as is
+struct PyramidSettings
+{
+	std::string m_path;          // The .dzi file, empty for no pyramid
+	size_t m_tileSize = 512;     // Even, tiles don't overlap
+	std::string m_format = "jpg"; // jpg, png, bmp or ppm, only with a native encoder
+};
+
+// Throws if the settings can't be written
+void CheckPyramidSettings(PyramidSettings const & settings);
+
+// Writes the pyramid of an rgb24 image in a single pass over it. Every band of tileSize rows is encoded
+// as tiles while it is downsampled into the band of the next level, so each level is read once, right
+// after it was made. Tiles and rows of the downsampling are spread over the pool. Returns the tile count
+size_t WritePyramid(RawImage const & image, PyramidSettings const & settings, ThreadPool & pool,
+					SimdLevel level = DetectSimdLevel());
+
+// Keeps the pyramid of an image that changes a little between updates, e.g. the frames of a fixed camera,
+// in step with it. The levels below the full image are kept in memory, only the tiles over changed areas
+// are downsampled and encoded again, and each replaces the old one with a rename, so viewers never load
+// half a tile. The tiles come out the same as those of WritePyramid
+class LivePyramid
+{
+public:
+	LivePyramid(size_t width, size_t height, PyramidSettings const & settings, ThreadPool & pool,
+				SimdLevel level = DetectSimdLevel());
+
+	// All of the image changed. Both return the number of tiles written
+	size_t Update(RawImage const & image);
+	// changedCells are the changed cells of a grid of cellSize x cellSize pixels over the image, numbered row-major
+	// like the tiles of StitchTiled. The first update writes every tile and then the .dzi
+	size_t Update(RawImage const & image, std::vector<uint32_t> const & changedCells, size_t cellSize);
+
+private:
+	struct Level
+	{
+		size_t m_width;
+		size_t m_height;
+		std::string m_dir;
+		size_t m_columnCount;
+		size_t m_rowCount;
+		std::unique_ptr<RawImage> m_image; // Not for the full image, that one is given to Update
+		std::vector<uint8_t> m_changedTiles;
+	};
+
+	void CheckImage(RawImage const & image) const;
+	size_t WriteChangedTiles(RawImage const & image);
+
+private:
+	PyramidSettings const m_settings;
+	ThreadPool & m_pool;
+	SimdLevel const m_simdLevel;
+	size_t const m_width;
+	size_t const m_height;
+	std::vector<Level> m_levels;
+	bool m_written = false;
+};
+
+// 2x2 box filter with rounding. dst holds (srcWidth + 1) / 2 pixels, the last one of an odd row
+// averages the last column with itself. row1 is row0 again for the last row of an odd height
+void DownsampleRow(uint8_t const * row0, uint8_t const * row1, size_t srcWidth, uint8_t * dst, SimdLevel level);
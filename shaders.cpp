@@ -22,6 +22,7 @@ std::string const g_fragmentShaderCodeSimple = R"(
 		}
 	)";
 
+// The mesh vertex shaders expect GLMesh vertices: UVs are normalized 16-bit over [-0.5, 2.5]
 std::string const g_vertexShaderCode360 = R"(
 		#version 330 core
 
@@ -35,7 +36,7 @@ std::string const g_vertexShaderCode360 = R"(
 		void main()
 		{
 			gl_Position =  MVP * vec4(vertexPosition_modelspace,1);
-			UV = vertexUV;
+			UV = vertexUV * 3.0f - 0.5f;
 		}
 	)";
 
@@ -96,56 +97,172 @@ std::string const g_vertexShaderCode360DualFish = R"(
 
 		out vec2 UV0;
 		out vec2 UV1;
+		out vec2 weightUV;
 
 		uniform mat4 MVP;
 
 		void main()
 		{
 			gl_Position =  MVP * vec4(vertexPosition_modelspace,1);
-			UV0 = vertexUV0;
-			UV1 = vertexUV1;
+			UV0 = vertexUV0 * 3.0f - 0.5f;
+			UV1 = vertexUV1 * 3.0f - 0.5f;
+			weightUV = vertexPosition_modelspace.xy;
 		}
 	)";
 
-std::string const g_fragmentShaderCode360FBCutDualFish = R"(
+namespace {
+	std::string const g_fragmentHeaderDualFish = R"(
 		#version 330 core
 
+		layout(location = 0) out vec3 color;
+	)";
+
+	std::string const g_sampleRgb = R"(
+		uniform sampler2D inSampler;
+
+		vec3 sampleRgb(vec2 uv)
+		{
+			return texture(inSampler, uv).rgb;
+		}
+	)";
+
+	// Samples the Y, U and V planes of a yuv420p/nv12 frame and converts to RGB (BT.601 limited range) after sampling
+	std::string const g_sampleYuv = R"(
+		uniform sampler2D ySampler;
+		uniform sampler2D uSampler;
+		uniform sampler2D vSampler;
+		uniform bool interleavedChroma;
+
+		vec3 sampleRgb(vec2 uv)
+		{
+			float y = texture(ySampler, uv).r - 16.0f / 255.0f;
+			vec2 chroma = interleavedChroma ? texture(uSampler, uv).rg : vec2(texture(uSampler, uv).r, texture(vSampler, uv).r);
+			chroma -= vec2(128.0f / 255.0f);
+			return clamp(vec3(1.164f * y + 1.596f * chroma.y,
+							  1.164f * y - 0.391f * chroma.x - 0.813f * chroma.y,
+							  1.164f * y + 2.018f * chroma.x), 0.0f, 1.0f);
+		}
+	)";
+
+	// The lens weights of every output pixel come from a weight texture (see CreateWeightTexture), with the
+	// radial photometric gains already multiplied in, the third channel is the fill color weight.
+	// Both lenses are sampled unconditionally, no branches
+	std::string const g_blendDualFish = R"(
+		uniform sampler2D weightSampler;
+		uniform vec3 whiteBalance0;
+		uniform vec3 whiteBalance1;
+
+		vec3 blendDualFish(vec2 UV0, vec2 UV1, vec2 weightUV)
+		{
+			vec3 weights = texture(weightSampler, weightUV).rgb;
+			return weights.x * whiteBalance0 * sampleRgb(UV0) + weights.y * whiteBalance1 * sampleRgb(UV1) +
+				   weights.z * vec3(0.0f, 1.0f, 0.0f);
+		}
+	)";
+
+	std::string const g_mainMeshDualFish = R"(
 		in vec2 UV0;
 		in vec2 UV1;
+		in vec2 weightUV;
 
-		layout(location = 0) out vec3 color;
+		void main()
+		{
+			color = blendDualFish(UV0, UV1, weightUV);
+		}
+	)";
 
-		uniform sampler2D inSampler;
+	// sphere2fish2 with the FishProjection of each lens as uniforms, see fishtools.cpp
+	std::string const g_mainProceduralDualFish = R"(
+		struct FishProjection
+		{
+			mat3 rotation;
+			float longitudeOffset;
+			float invFov;
+			vec2 center;
+			vec2 ratio;
+		};
+
+		in vec2 spherePos;
+
+		uniform FishProjection fish0;
+		uniform FishProjection fish1;
+
+		vec2 sphere2fish2(vec2 coord, FishProjection fish)
+		{
+			float longitude = 3.14159265f * coord.x + fish.longitudeOffset;
+			float latitude = -1.57079633f * coord.y;
+			vec3 v = fish.rotation * vec3(cos(latitude) * sin(longitude), cos(latitude) * cos(longitude), sin(latitude));
+
+			float rho = length(v.xz);
+			float r = atan(rho, v.y) * fish.invFov;
+			if (r > 0.5001f)
+				return vec2(2.0f);
+			return fish.center + (rho > 0.0f ? r / rho : fish.invFov) * v.xz * fish.ratio;
+		}
 
 		void main()
 		{
-			bool hasTex0 = false;
-			bool hasTex1 = false;
-			if (all(lessThanEqual(UV0, vec2(0.5f, 1.0f))) && all(greaterThanEqual(UV0, vec2(0.0f))))
-				hasTex0 = true;
-			if (all(lessThanEqual(UV1, vec2(1.0f))) && all(greaterThanEqual(UV1, vec2(0.5f, 0.0f))))
-				hasTex1 = true;
-
-			if (hasTex0 && hasTex1) {
-				vec3 color0 = texture(inSampler, UV0).rgb;
-				vec3 color1 = texture(inSampler, UV1).rgb;
-				color = mix(color0, color1, 0.5f);
-			}
-			else if (hasTex0) {
-				color = texture(inSampler, UV0).rgb;
-			}
-			else if (hasTex1) {
-				color = texture(inSampler, UV1).rgb;
-			}
-			else {
-				color = vec3(0.0f, 1.0f, 0.0f);
-			}
+			color = blendDualFish(sphere2fish2(spherePos, fish0), sphere2fish2(spherePos, fish1), spherePos * 0.5f + 0.5f);
+		}
+	)";
+}
+
+std::string const g_fragmentShaderCode360FBCutDualFish =
+		g_fragmentHeaderDualFish + g_sampleRgb + g_blendDualFish + g_mainMeshDualFish;
+std::string const g_fragmentShaderCode360FBCutDualFishYuv =
+		g_fragmentHeaderDualFish + g_sampleYuv + g_blendDualFish + g_mainMeshDualFish;
+
+// One triangle covering the whole viewport, drawn with glDrawArrays(GL_TRIANGLES, 0, 3) and no attributes.
+// spherePos is interpolated exactly, so the mapping in the fragment shader is evaluated per pixel
+std::string const g_vertexShaderCode360FullScreen = R"(
+		#version 330 core
+
+		out vec2 spherePos;
+
+		uniform mat4 MVP;
 
-//			if (hasTex1)
-//				color = texture(inSampler, UV1).rgb;
-//			else
-//				color = vec3(0.0f, 0.0f, 1.0f);
+		void main()
+		{
+			spherePos = vec2(gl_VertexID == 1 ? 3.0f : -1.0f, gl_VertexID == 2 ? 3.0f : -1.0f);
+			gl_Position = MVP * vec4(spherePos, 0.0f, 1.0f);
 		}
+	)";
+
+std::string const g_fragmentShaderCode360ProceduralDualFish =
+		g_fragmentHeaderDualFish + g_sampleRgb + g_blendDualFish + g_mainProceduralDualFish;
+std::string const g_fragmentShaderCode360ProceduralDualFishYuv =
+		g_fragmentHeaderDualFish + g_sampleYuv + g_blendDualFish + g_mainProceduralDualFish;
+
+// Collapses the Laplacian pyramids of two stitched images, the mip chains of image0Sampler and
+// image1Sampler. Every band is mixed by the matching mip level of the lens 0 mask in maskSampler,
+// the top level blends the remaining low-pass images directly
+std::string const g_fragmentShaderCode360MultiBand = R"(
+		#version 330 core
 
+		in vec2 spherePos;
 
+		layout(location = 0) out vec3 color;
+
+		uniform sampler2D image0Sampler;
+		uniform sampler2D image1Sampler;
+		uniform sampler2D maskSampler;
+		uniform int levelCount;
+
+		void main()
+		{
+			vec2 uv = spherePos * 0.5f + 0.5f;
+			int top = levelCount - 1;
+
+			vec3 low0 = textureLod(image0Sampler, uv, float(top)).rgb;
+			vec3 low1 = textureLod(image1Sampler, uv, float(top)).rgb;
+			vec3 result = mix(low1, low0, textureLod(maskSampler, uv, float(top)).r);
+			for (int level = top - 1; level >= 0; --level) {
+				vec3 image0 = textureLod(image0Sampler, uv, float(level)).rgb;
+				vec3 image1 = textureLod(image1Sampler, uv, float(level)).rgb;
+				result += mix(image1 - low1, image0 - low0, textureLod(maskSampler, uv, float(level)).r);
+				low0 = image0;
+				low1 = image1;
+			}
+			color = result;
+		}
 	)";
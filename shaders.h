@@ -11,5 +11,16 @@ extern std::string const g_fragmentShaderCode360;
 extern std::string const g_fragmentShaderCode360FB;
 extern std::string const g_fragmentShaderCode360FBCut;
 
+// The dual fisheye fragment shaders blend both lenses with the weights in weightSampler,
+// the white balance of the lenses goes to whiteBalance0 and whiteBalance1
 extern std::string const g_vertexShaderCode360DualFish;
 extern std::string const g_fragmentShaderCode360FBCutDualFish;
+extern std::string const g_fragmentShaderCode360FBCutDualFishYuv;
+
+// No mesh: the lens UVs are computed per fragment from FishProjection uniforms fish0 and fish1
+extern std::string const g_vertexShaderCode360FullScreen;
+extern std::string const g_fragmentShaderCode360ProceduralDualFish;
+extern std::string const g_fragmentShaderCode360ProceduralDualFishYuv;
+
+// Drawn with g_vertexShaderCode360FullScreen, see GLMultiBandBlender
+extern std::string const g_fragmentShaderCode360MultiBand;
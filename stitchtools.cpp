@@ -0,0 +1,906 @@
+#include "stitchtools.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "phototools.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STITCH_X86
+#define STITCH_SSE41 __attribute__((target("sse4.1")))
+#define STITCH_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace {
+	void SetupTexel(glm::vec2 const & uv, size_t srcWidth, size_t srcHeight, size_t srcStride, size_t sampleSize,
+					int32_t & offset, uint32_t & frac)
+	{
+		// Texel centers are at half-integers, edges are clamped
+		float const x = glm::clamp(uv.x * srcWidth - 0.5f, 0.0f, float(srcWidth - 1));
+		float const y = glm::clamp(uv.y * srcHeight - 0.5f, 0.0f, float(srcHeight - 1));
+		size_t const x0 = std::min(size_t(x), srcWidth - 2);
+		size_t const y0 = std::min(size_t(y), srcHeight - 2);
+
+		uint32_t const fx = uint32_t((x - x0) * 256.0f + 0.5f);
+		uint32_t const fy = uint32_t((y - y0) * 256.0f + 0.5f);
+
+		offset = int32_t(sampleSize * x0 + y0 * srcStride);
+		frac = fx | fy << 16;
+	}
+
+	// Plane pointers resolved once per image. For nv12 U and V point into the same interleaved plane
+	struct SourcePlanes
+	{
+		uint8_t const * m_rgb = nullptr;
+		uint8_t const * m_y = nullptr;
+		uint8_t const * m_u = nullptr;
+		uint8_t const * m_v = nullptr;
+		size_t m_chromaStride = 0;
+		size_t m_chromaStep = 0;
+	};
+
+	SourcePlanes GetSourcePlanes(RawImage const & src)
+	{
+		SourcePlanes planes;
+		std::string const pixFmt = src.GetPixFmt();
+		if (pixFmt == "rgb24") {
+			planes.m_rgb = reinterpret_cast<uint8_t const *>(src.GetData());
+			return planes;
+		}
+
+		planes.m_y = reinterpret_cast<uint8_t const *>(src.GetPlane(0));
+		planes.m_u = reinterpret_cast<uint8_t const *>(src.GetPlane(1));
+		planes.m_chromaStride = src.GetPlaneStride(1);
+		if (pixFmt == "nv12") {
+			planes.m_v = planes.m_u + 1;
+			planes.m_chromaStep = 2;
+		}
+		else {
+			planes.m_v = reinterpret_cast<uint8_t const *>(src.GetPlane(2));
+			planes.m_chromaStep = 1;
+		}
+		return planes;
+	}
+
+	uint32_t Load24(uint8_t const * ptr)
+	{
+		return ptr[0] | ptr[1] << 8 | ptr[2] << 16;
+	}
+
+	uint32_t Lerp(uint32_t a, uint32_t b, uint32_t wa, uint32_t wb)
+	{
+		return (a * wa + b * wb + 128) >> 8;
+	}
+
+	// Bilinear sample of one channel. All kernels use exactly this integer math so they match bit for bit
+	uint32_t SampleChannel(uint8_t const * ptr, size_t stride, size_t step, uint32_t frac)
+	{
+		uint32_t const fx = frac & 0xFFFF;
+		uint32_t const fy = frac >> 16;
+		uint32_t const top = Lerp(ptr[0], ptr[step], 256 - fx, fx);
+		uint32_t const bottom = Lerp(ptr[stride], ptr[stride + step], 256 - fx, fx);
+		return Lerp(top, bottom, 256 - fy, fy);
+	}
+
+	// BT.601 limited range, the same conversion codectools uses for raw yuv420p files
+	int ClampByte(int value)
+	{
+		return std::min(std::max(value, 0), 255);
+	}
+
+	void YuvToRgb(int y, int u, int v, uint32_t * rgb)
+	{
+		int const c = 298 * (y - 16);
+		int const d = u - 128;
+		int const e = v - 128;
+		rgb[0] = ClampByte((c + 409 * e + 128) >> 8);
+		rgb[1] = ClampByte((c - 100 * d - 208 * e + 128) >> 8);
+		rgb[2] = ClampByte((c + 516 * d + 128) >> 8);
+	}
+
+	void SampleYuv(SourcePlanes const & src, size_t stride, int32_t offset, uint32_t frac,
+				   int32_t chromaOffset, uint32_t chromaFrac, uint32_t * rgb)
+	{
+		uint32_t const y = SampleChannel(src.m_y + offset, stride, 1, frac);
+		uint32_t const u = SampleChannel(src.m_u + chromaOffset, src.m_chromaStride, src.m_chromaStep, chromaFrac);
+		uint32_t const v = SampleChannel(src.m_v + chromaOffset, src.m_chromaStride, src.m_chromaStep, chromaFrac);
+		YuvToRgb(y, u, v, rgb);
+	}
+
+	// The SIMD kernels get the same result with 16-bit multiplies, hence gains below 16
+	uint32_t ApplyGain(uint32_t value, uint32_t gain, uint32_t whiteBalance)
+	{
+		return std::min<uint32_t>(255, value * (gain * whiteBalance >> 8) >> 8);
+	}
+
+	void ApplyGains(RemapTable const & table, size_t i, uint32_t * rgb0, uint32_t * rgb1)
+	{
+		for (size_t c = 0; c < 3; ++c) {
+			rgb0[c] = ApplyGain(rgb0[c], table.m_gains[i] & 0xFFFF, table.m_whiteBalance[0][c]);
+			rgb1[c] = ApplyGain(rgb1[c], table.m_gains[i] >> 16, table.m_whiteBalance[1][c]);
+		}
+	}
+
+	void StitchSpanScalar(RemapTable const & table, uint8_t const * src, uint8_t * dst, size_t first, size_t count)
+	{
+		size_t const stride = table.m_srcStride;
+		for (size_t i = first; i < first + count; ++i) {
+			uint32_t const w0 = table.m_weights[i] & 0xFFFF;
+			uint32_t const w1 = table.m_weights[i] >> 16;
+			uint32_t const wf = 256 - w0 - w1;
+			uint8_t const * ptr0 = src + table.m_offsets0[i];
+			uint8_t const * ptr1 = src + table.m_offsets1[i];
+			uint32_t rgb0[3];
+			uint32_t rgb1[3];
+			for (size_t c = 0; c < 3; ++c) {
+				rgb0[c] = SampleChannel(ptr0 + c, stride, 3, table.m_fracs0[i]);
+				rgb1[c] = SampleChannel(ptr1 + c, stride, 3, table.m_fracs1[i]);
+			}
+			if (table.m_gains)
+				ApplyGains(table, i, rgb0, rgb1);
+			for (size_t c = 0; c < 3; ++c)
+				dst[3 * (i - first) + c] = uint8_t((rgb0[c] * w0 + rgb1[c] * w1 + table.m_fillColor[c] * wf + 128) >> 8);
+		}
+	}
+
+	void StitchSpanYuvScalar(RemapTable const & table, SourcePlanes const & src, uint8_t * dst, size_t first, size_t count)
+	{
+		size_t const stride = table.m_srcStride;
+		for (size_t i = first; i < first + count; ++i) {
+			uint32_t const w0 = table.m_weights[i] & 0xFFFF;
+			uint32_t const w1 = table.m_weights[i] >> 16;
+			uint32_t const wf = 256 - w0 - w1;
+			uint32_t rgb0[3];
+			uint32_t rgb1[3];
+			SampleYuv(src, stride, table.m_offsets0[i], table.m_fracs0[i], table.m_chromaOffsets0[i], table.m_chromaFracs0[i], rgb0);
+			SampleYuv(src, stride, table.m_offsets1[i], table.m_fracs1[i], table.m_chromaOffsets1[i], table.m_chromaFracs1[i], rgb1);
+			if (table.m_gains)
+				ApplyGains(table, i, rgb0, rgb1);
+			for (size_t c = 0; c < 3; ++c)
+				dst[3 * (i - first) + c] = uint8_t((rgb0[c] * w0 + rgb1[c] * w1 + table.m_fillColor[c] * wf + 128) >> 8);
+		}
+	}
+
+#ifdef STITCH_X86
+	// Pixels are kept as 0x00BBGGRR in 32-bit lanes, math is done on 16-bit halves:
+	// (R, B) in one register and (G, junk) in another
+
+	STITCH_SSE41 __m128i LerpSse(__m128i a, __m128i b, __m128i wa, __m128i wb)
+	{
+		__m128i const sum = _mm_add_epi16(_mm_mullo_epi16(a, wa), _mm_mullo_epi16(b, wb));
+		return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(128)), 8);
+	}
+
+	STITCH_SSE41 __m128i Load4Sse(uint8_t const * base, int32_t const * offsets)
+	{
+		uint32_t values[4];
+		for (size_t i = 0; i < 4; ++i)
+			values[i] = Load24(base + offsets[i]);
+		return _mm_loadu_si128(reinterpret_cast<__m128i const *>(values));
+	}
+
+	STITCH_SSE41 void SampleSse(uint8_t const * src, size_t stride, int32_t const * offsets, uint32_t const * fracs,
+								__m128i & rb, __m128i & g)
+	{
+		__m128i const mask = _mm_set1_epi32(0x00FF00FF);
+		__m128i const frac = _mm_loadu_si128(reinterpret_cast<__m128i const *>(fracs));
+		__m128i const fx = _mm_shuffle_epi8(frac, _mm_setr_epi8(0, 1, 0, 1, 4, 5, 4, 5, 8, 9, 8, 9, 12, 13, 12, 13));
+		__m128i const fy = _mm_shuffle_epi8(frac, _mm_setr_epi8(2, 3, 2, 3, 6, 7, 6, 7, 10, 11, 10, 11, 14, 15, 14, 15));
+		__m128i const ifx = _mm_sub_epi16(_mm_set1_epi16(256), fx);
+		__m128i const ify = _mm_sub_epi16(_mm_set1_epi16(256), fy);
+
+		__m128i const tl = Load4Sse(src, offsets);
+		__m128i const tr = Load4Sse(src + 3, offsets);
+		__m128i const bl = Load4Sse(src + stride, offsets);
+		__m128i const br = Load4Sse(src + stride + 3, offsets);
+
+		__m128i const topRB = LerpSse(_mm_and_si128(tl, mask), _mm_and_si128(tr, mask), ifx, fx);
+		__m128i const topG = LerpSse(_mm_and_si128(_mm_srli_epi32(tl, 8), mask), _mm_and_si128(_mm_srli_epi32(tr, 8), mask), ifx, fx);
+		__m128i const bottomRB = LerpSse(_mm_and_si128(bl, mask), _mm_and_si128(br, mask), ifx, fx);
+		__m128i const bottomG = LerpSse(_mm_and_si128(_mm_srli_epi32(bl, 8), mask), _mm_and_si128(_mm_srli_epi32(br, 8), mask), ifx, fx);
+
+		rb = LerpSse(topRB, bottomRB, ify, fy);
+		g = LerpSse(topG, bottomG, ify, fy);
+	}
+
+	// White balance of both lenses for ApplyGainsSse, shifted left by 4 like the gains
+	struct WhiteBalanceSse
+	{
+		__m128i m_rb[2];
+		__m128i m_g[2];
+	};
+
+	STITCH_SSE41 WhiteBalanceSse MakeWhiteBalanceSse(RemapTable const & table)
+	{
+		WhiteBalanceSse whiteBalance;
+		for (size_t lens = 0; lens < 2; ++lens) {
+			uint16_t const * wb = table.m_whiteBalance[lens];
+			whiteBalance.m_rb[lens] = _mm_set1_epi32(int(wb[0] << 4 | uint32_t(wb[2]) << 20));
+			whiteBalance.m_g[lens] = _mm_set1_epi32(wb[1] << 4);
+		}
+		return whiteBalance;
+	}
+
+	// ApplyGain for 4 pixels of both lenses. mulhi of two values shifted left by 4 is their product >> 8,
+	// mulhi of a sample shifted left by 8 is sample * gain >> 8
+	STITCH_SSE41 void ApplyGainsSse(uint32_t const * gains, WhiteBalanceSse const & whiteBalance,
+									__m128i & rb0, __m128i & g0, __m128i & rb1, __m128i & g1)
+	{
+		__m128i const max = _mm_set1_epi16(255);
+		__m128i const gain = _mm_slli_epi16(_mm_loadu_si128(reinterpret_cast<__m128i const *>(gains)), 4);
+		__m128i const gain0 = _mm_shuffle_epi8(gain, _mm_setr_epi8(0, 1, 0, 1, 4, 5, 4, 5, 8, 9, 8, 9, 12, 13, 12, 13));
+		__m128i const gain1 = _mm_shuffle_epi8(gain, _mm_setr_epi8(2, 3, 2, 3, 6, 7, 6, 7, 10, 11, 10, 11, 14, 15, 14, 15));
+
+		rb0 = _mm_min_epu16(_mm_mulhi_epu16(_mm_slli_epi16(rb0, 8), _mm_mulhi_epu16(gain0, whiteBalance.m_rb[0])), max);
+		g0 = _mm_min_epu16(_mm_mulhi_epu16(_mm_slli_epi16(g0, 8), _mm_mulhi_epu16(gain0, whiteBalance.m_g[0])), max);
+		rb1 = _mm_min_epu16(_mm_mulhi_epu16(_mm_slli_epi16(rb1, 8), _mm_mulhi_epu16(gain1, whiteBalance.m_rb[1])), max);
+		g1 = _mm_min_epu16(_mm_mulhi_epu16(_mm_slli_epi16(g1, 8), _mm_mulhi_epu16(gain1, whiteBalance.m_g[1])), max);
+	}
+
+	// Mixes both lenses and the fill color and stores 4 rgb24 pixels
+	STITCH_SSE41 void BlendStoreSse(__m128i rb0, __m128i g0, __m128i rb1, __m128i g1, uint32_t const * weights,
+									uint8_t const * fillColor, uint8_t * out)
+	{
+		__m128i const fillRB = _mm_set1_epi32(fillColor[0] | fillColor[2] << 16);
+		__m128i const fillG = _mm_set1_epi32(fillColor[1]);
+		__m128i const full = _mm_set1_epi16(256);
+		__m128i const round = _mm_set1_epi16(128);
+		__m128i const pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+		__m128i const weight = _mm_loadu_si128(reinterpret_cast<__m128i const *>(weights));
+		__m128i const w0 = _mm_shuffle_epi8(weight, _mm_setr_epi8(0, 1, 0, 1, 4, 5, 4, 5, 8, 9, 8, 9, 12, 13, 12, 13));
+		__m128i const w1 = _mm_shuffle_epi8(weight, _mm_setr_epi8(2, 3, 2, 3, 6, 7, 6, 7, 10, 11, 10, 11, 14, 15, 14, 15));
+		__m128i const wf = _mm_sub_epi16(_mm_sub_epi16(full, w0), w1);
+
+		__m128i rb = _mm_add_epi16(_mm_mullo_epi16(rb0, w0), _mm_mullo_epi16(rb1, w1));
+		rb = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(rb, _mm_mullo_epi16(fillRB, wf)), round), 8);
+		__m128i g = _mm_add_epi16(_mm_mullo_epi16(g0, w0), _mm_mullo_epi16(g1, w1));
+		g = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(g, _mm_mullo_epi16(fillG, wf)), round), 8);
+
+		__m128i const pixels = _mm_or_si128(_mm_and_si128(rb, _mm_set1_epi32(0x00FF00FF)),
+											_mm_slli_epi32(_mm_and_si128(g, _mm_set1_epi32(0xFF)), 8));
+		__m128i const packed = _mm_shuffle_epi8(pixels, pack);
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(out), packed);
+		uint32_t const tail = _mm_extract_epi32(packed, 2);
+		memcpy(out + 8, &tail, 4);
+	}
+
+	STITCH_SSE41 void StitchSpanSse41(RemapTable const & table, uint8_t const * src, uint8_t * dst, size_t first, size_t count)
+	{
+		size_t const stride = table.m_srcStride;
+		WhiteBalanceSse const whiteBalance = MakeWhiteBalanceSse(table);
+
+		size_t i = first;
+		for (; i + 4 <= first + count; i += 4) {
+			__m128i rb0, g0, rb1, g1;
+			SampleSse(src, stride, &table.m_offsets0[i], &table.m_fracs0[i], rb0, g0);
+			SampleSse(src, stride, &table.m_offsets1[i], &table.m_fracs1[i], rb1, g1);
+			if (table.m_gains)
+				ApplyGainsSse(&table.m_gains[i], whiteBalance, rb0, g0, rb1, g1);
+			BlendStoreSse(rb0, g0, rb1, g1, &table.m_weights[i], table.m_fillColor, dst + 3 * (i - first));
+		}
+
+		StitchSpanScalar(table, src, dst + 3 * (i - first), i, first + count - i);
+	}
+
+	// Planar kernels keep one sample per 32-bit lane. Horizontally neighbouring texels are
+	// gathered as a pair of 16-bit halves, so a lerp is a single madd with (256 - f) | f << 16
+
+	STITCH_SSE41 __m128i Gather4Sse(uint8_t const * base, __m128i offsets)
+	{
+		int32_t offset[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(offset), offsets);
+		int32_t values[4];
+		for (size_t i = 0; i < 4; ++i)
+			memcpy(&values[i], base + offset[i], 4);
+		return _mm_loadu_si128(reinterpret_cast<__m128i const *>(values));
+	}
+
+	STITCH_SSE41 __m128i LerpPairSse(__m128i pair, __m128i weights)
+	{
+		return _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(pair, weights), _mm_set1_epi32(128)), 8);
+	}
+
+	// top and bottom hold the left texel in the byte selected by the first pattern and the right one
+	// in the byte selected by the second
+	STITCH_SSE41 __m128i BilinearSse(__m128i top, __m128i topPattern, __m128i bottom, __m128i bottomPattern,
+									 __m128i wx, __m128i wy)
+	{
+		__m128i const topValue = LerpPairSse(_mm_shuffle_epi8(top, topPattern), wx);
+		__m128i const bottomValue = LerpPairSse(_mm_shuffle_epi8(bottom, bottomPattern), wx);
+		return LerpPairSse(_mm_or_si128(topValue, _mm_slli_epi32(bottomValue, 16)), wy);
+	}
+
+	STITCH_SSE41 void LerpWeightsSse(__m128i frac, __m128i & wx, __m128i & wy)
+	{
+		__m128i const full = _mm_set1_epi32(256);
+		__m128i const fx = _mm_and_si128(frac, _mm_set1_epi32(0xFFFF));
+		__m128i const fy = _mm_srli_epi32(frac, 16);
+		wx = _mm_or_si128(_mm_sub_epi32(full, fx), _mm_slli_epi32(fx, 16));
+		wy = _mm_or_si128(_mm_sub_epi32(full, fy), _mm_slli_epi32(fy, 16));
+	}
+
+	STITCH_SSE41 __m128i ClampByteSse(__m128i value)
+	{
+		return _mm_min_epi32(_mm_max_epi32(_mm_srai_epi32(value, 8), _mm_setzero_si128()), _mm_set1_epi32(255));
+	}
+
+	STITCH_SSE41 void SampleYuvSse(SourcePlanes const & src, size_t stride, int32_t const * offsets, uint32_t const * fracs,
+								   int32_t const * chromaOffsets, uint32_t const * chromaFracs, __m128i & rb, __m128i & g)
+	{
+		// Bottom rows are gathered 2 bytes early and taken from the upper half of the lane,
+		// so no read goes past the last texel of the plane
+		__m128i const lowPair = _mm_setr_epi8(0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1);
+		__m128i const highPair = _mm_setr_epi8(2, -1, 3, -1, 6, -1, 7, -1, 10, -1, 11, -1, 14, -1, 15, -1);
+		__m128i const evenPair = _mm_setr_epi8(0, -1, 2, -1, 4, -1, 6, -1, 8, -1, 10, -1, 12, -1, 14, -1);
+		__m128i const oddPair = _mm_setr_epi8(1, -1, 3, -1, 5, -1, 7, -1, 9, -1, 11, -1, 13, -1, 15, -1);
+
+		__m128i wx, wy;
+		__m128i const off = _mm_loadu_si128(reinterpret_cast<__m128i const *>(offsets));
+		LerpWeightsSse(_mm_loadu_si128(reinterpret_cast<__m128i const *>(fracs)), wx, wy);
+		__m128i const y = BilinearSse(Gather4Sse(src.m_y, off), lowPair, Gather4Sse(src.m_y + stride - 2, off), highPair, wx, wy);
+
+		__m128i u, v;
+		__m128i const chromaOff = _mm_loadu_si128(reinterpret_cast<__m128i const *>(chromaOffsets));
+		LerpWeightsSse(_mm_loadu_si128(reinterpret_cast<__m128i const *>(chromaFracs)), wx, wy);
+		size_t const chromaStride = src.m_chromaStride;
+		if (src.m_chromaStep == 2) {
+			// U0 V0 U1 V1 in every lane
+			__m128i const top = Gather4Sse(src.m_u, chromaOff);
+			__m128i const bottom = Gather4Sse(src.m_u + chromaStride, chromaOff);
+			u = BilinearSse(top, evenPair, bottom, evenPair, wx, wy);
+			v = BilinearSse(top, oddPair, bottom, oddPair, wx, wy);
+		}
+		else {
+			u = BilinearSse(Gather4Sse(src.m_u, chromaOff), lowPair, Gather4Sse(src.m_u + chromaStride - 2, chromaOff), highPair, wx, wy);
+			v = BilinearSse(Gather4Sse(src.m_v, chromaOff), lowPair, Gather4Sse(src.m_v + chromaStride - 2, chromaOff), highPair, wx, wy);
+		}
+
+		__m128i const round = _mm_set1_epi32(128);
+		__m128i const c = _mm_add_epi32(_mm_mullo_epi32(_mm_sub_epi32(y, _mm_set1_epi32(16)), _mm_set1_epi32(298)), round);
+		__m128i const d = _mm_sub_epi32(u, round);
+		__m128i const e = _mm_sub_epi32(v, round);
+		__m128i const r = ClampByteSse(_mm_add_epi32(c, _mm_mullo_epi32(e, _mm_set1_epi32(409))));
+		__m128i const gg = ClampByteSse(_mm_sub_epi32(_mm_sub_epi32(c, _mm_mullo_epi32(d, _mm_set1_epi32(100))),
+													  _mm_mullo_epi32(e, _mm_set1_epi32(208))));
+		__m128i const b = ClampByteSse(_mm_add_epi32(c, _mm_mullo_epi32(d, _mm_set1_epi32(516))));
+
+		rb = _mm_or_si128(r, _mm_slli_epi32(b, 16));
+		g = gg;
+	}
+
+	STITCH_SSE41 void StitchSpanYuvSse41(RemapTable const & table, SourcePlanes const & src, uint8_t * dst, size_t first, size_t count)
+	{
+		size_t const stride = table.m_srcStride;
+		WhiteBalanceSse const whiteBalance = MakeWhiteBalanceSse(table);
+
+		size_t i = first;
+		for (; i + 4 <= first + count; i += 4) {
+			__m128i rb0, g0, rb1, g1;
+			SampleYuvSse(src, stride, &table.m_offsets0[i], &table.m_fracs0[i], &table.m_chromaOffsets0[i], &table.m_chromaFracs0[i], rb0, g0);
+			SampleYuvSse(src, stride, &table.m_offsets1[i], &table.m_fracs1[i], &table.m_chromaOffsets1[i], &table.m_chromaFracs1[i], rb1, g1);
+			if (table.m_gains)
+				ApplyGainsSse(&table.m_gains[i], whiteBalance, rb0, g0, rb1, g1);
+			BlendStoreSse(rb0, g0, rb1, g1, &table.m_weights[i], table.m_fillColor, dst + 3 * (i - first));
+		}
+
+		StitchSpanYuvScalar(table, src, dst + 3 * (i - first), i, first + count - i);
+	}
+
+	STITCH_AVX2 __m256i LerpAvx(__m256i a, __m256i b, __m256i wa, __m256i wb)
+	{
+		__m256i const sum = _mm256_add_epi16(_mm256_mullo_epi16(a, wa), _mm256_mullo_epi16(b, wb));
+		return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(128)), 8);
+	}
+
+	STITCH_AVX2 void SampleAvx(uint8_t const * src, size_t stride, int32_t const * offsets, uint32_t const * fracs,
+							   __m256i & rb, __m256i & g)
+	{
+		__m256i const mask = _mm256_set1_epi32(0x00FF00FF);
+		__m256i const fxPattern = _mm256_setr_epi8(0, 1, 0, 1, 4, 5, 4, 5, 8, 9, 8, 9, 12, 13, 12, 13,
+												   0, 1, 0, 1, 4, 5, 4, 5, 8, 9, 8, 9, 12, 13, 12, 13);
+		__m256i const fyPattern = _mm256_setr_epi8(2, 3, 2, 3, 6, 7, 6, 7, 10, 11, 10, 11, 14, 15, 14, 15,
+												   2, 3, 2, 3, 6, 7, 6, 7, 10, 11, 10, 11, 14, 15, 14, 15);
+		__m256i const off = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(offsets));
+		__m256i const frac = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(fracs));
+		__m256i const fx = _mm256_shuffle_epi8(frac, fxPattern);
+		__m256i const fy = _mm256_shuffle_epi8(frac, fyPattern);
+		__m256i const ifx = _mm256_sub_epi16(_mm256_set1_epi16(256), fx);
+		__m256i const ify = _mm256_sub_epi16(_mm256_set1_epi16(256), fy);
+
+		// The right texel is gathered from offset + 2 and shifted down, so no gather reads past
+		// the last byte of the right texel (the top-left offset never points to the last column)
+		int const * top = reinterpret_cast<int const *>(src);
+		int const * topRight = reinterpret_cast<int const *>(src + 2);
+		int const * bottom = reinterpret_cast<int const *>(src + stride);
+		int const * bottomRight = reinterpret_cast<int const *>(src + stride + 2);
+		__m256i const tl = _mm256_i32gather_epi32(top, off, 1);
+		__m256i const tr = _mm256_srli_epi32(_mm256_i32gather_epi32(topRight, off, 1), 8);
+		__m256i const bl = _mm256_i32gather_epi32(bottom, off, 1);
+		__m256i const br = _mm256_srli_epi32(_mm256_i32gather_epi32(bottomRight, off, 1), 8);
+
+		__m256i const topRB = LerpAvx(_mm256_and_si256(tl, mask), _mm256_and_si256(tr, mask), ifx, fx);
+		__m256i const topG = LerpAvx(_mm256_and_si256(_mm256_srli_epi32(tl, 8), mask), _mm256_and_si256(_mm256_srli_epi32(tr, 8), mask), ifx, fx);
+		__m256i const bottomRB = LerpAvx(_mm256_and_si256(bl, mask), _mm256_and_si256(br, mask), ifx, fx);
+		__m256i const bottomG = LerpAvx(_mm256_and_si256(_mm256_srli_epi32(bl, 8), mask), _mm256_and_si256(_mm256_srli_epi32(br, 8), mask), ifx, fx);
+
+		rb = LerpAvx(topRB, bottomRB, ify, fy);
+		g = LerpAvx(topG, bottomG, ify, fy);
+	}
+
+	struct WhiteBalanceAvx
+	{
+		__m256i m_rb[2];
+		__m256i m_g[2];
+	};
+
+	STITCH_AVX2 WhiteBalanceAvx MakeWhiteBalanceAvx(RemapTable const & table)
+	{
+		WhiteBalanceAvx whiteBalance;
+		for (size_t lens = 0; lens < 2; ++lens) {
+			uint16_t const * wb = table.m_whiteBalance[lens];
+			whiteBalance.m_rb[lens] = _mm256_set1_epi32(int(wb[0] << 4 | uint32_t(wb[2]) << 20));
+			whiteBalance.m_g[lens] = _mm256_set1_epi32(wb[1] << 4);
+		}
+		return whiteBalance;
+	}
+
+	STITCH_AVX2 void ApplyGainsAvx(uint32_t const * gains, WhiteBalanceAvx const & whiteBalance,
+								   __m256i & rb0, __m256i & g0, __m256i & rb1, __m256i & g1)
+	{
+		__m256i const max = _mm256_set1_epi16(255);
+		__m256i const gain0Pattern = _mm256_setr_epi8(0, 1, 0, 1, 4, 5, 4, 5, 8, 9, 8, 9, 12, 13, 12, 13,
+													  0, 1, 0, 1, 4, 5, 4, 5, 8, 9, 8, 9, 12, 13, 12, 13);
+		__m256i const gain1Pattern = _mm256_setr_epi8(2, 3, 2, 3, 6, 7, 6, 7, 10, 11, 10, 11, 14, 15, 14, 15,
+													  2, 3, 2, 3, 6, 7, 6, 7, 10, 11, 10, 11, 14, 15, 14, 15);
+		__m256i const gain = _mm256_slli_epi16(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(gains)), 4);
+		__m256i const gain0 = _mm256_shuffle_epi8(gain, gain0Pattern);
+		__m256i const gain1 = _mm256_shuffle_epi8(gain, gain1Pattern);
+
+		rb0 = _mm256_min_epu16(_mm256_mulhi_epu16(_mm256_slli_epi16(rb0, 8), _mm256_mulhi_epu16(gain0, whiteBalance.m_rb[0])), max);
+		g0 = _mm256_min_epu16(_mm256_mulhi_epu16(_mm256_slli_epi16(g0, 8), _mm256_mulhi_epu16(gain0, whiteBalance.m_g[0])), max);
+		rb1 = _mm256_min_epu16(_mm256_mulhi_epu16(_mm256_slli_epi16(rb1, 8), _mm256_mulhi_epu16(gain1, whiteBalance.m_rb[1])), max);
+		g1 = _mm256_min_epu16(_mm256_mulhi_epu16(_mm256_slli_epi16(g1, 8), _mm256_mulhi_epu16(gain1, whiteBalance.m_g[1])), max);
+	}
+
+	// Mixes both lenses and the fill color and stores 8 rgb24 pixels
+	STITCH_AVX2 void BlendStoreAvx(__m256i rb0, __m256i g0, __m256i rb1, __m256i g1, uint32_t const * weights,
+								   uint8_t const * fillColor, uint8_t * out)
+	{
+		__m256i const fillRB = _mm256_set1_epi32(fillColor[0] | fillColor[2] << 16);
+		__m256i const fillG = _mm256_set1_epi32(fillColor[1]);
+		__m256i const full = _mm256_set1_epi16(256);
+		__m256i const round = _mm256_set1_epi16(128);
+		__m256i const w0Pattern = _mm256_setr_epi8(0, 1, 0, 1, 4, 5, 4, 5, 8, 9, 8, 9, 12, 13, 12, 13,
+												   0, 1, 0, 1, 4, 5, 4, 5, 8, 9, 8, 9, 12, 13, 12, 13);
+		__m256i const w1Pattern = _mm256_setr_epi8(2, 3, 2, 3, 6, 7, 6, 7, 10, 11, 10, 11, 14, 15, 14, 15,
+												   2, 3, 2, 3, 6, 7, 6, 7, 10, 11, 10, 11, 14, 15, 14, 15);
+		__m256i const pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+											  0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+		__m256i const compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+		__m256i const weight = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(weights));
+		__m256i const w0 = _mm256_shuffle_epi8(weight, w0Pattern);
+		__m256i const w1 = _mm256_shuffle_epi8(weight, w1Pattern);
+		__m256i const wf = _mm256_sub_epi16(_mm256_sub_epi16(full, w0), w1);
+
+		__m256i rb = _mm256_add_epi16(_mm256_mullo_epi16(rb0, w0), _mm256_mullo_epi16(rb1, w1));
+		rb = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(rb, _mm256_mullo_epi16(fillRB, wf)), round), 8);
+		__m256i g = _mm256_add_epi16(_mm256_mullo_epi16(g0, w0), _mm256_mullo_epi16(g1, w1));
+		g = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(g, _mm256_mullo_epi16(fillG, wf)), round), 8);
+
+		__m256i const pixels = _mm256_or_si256(_mm256_and_si256(rb, _mm256_set1_epi32(0x00FF00FF)),
+											   _mm256_slli_epi32(_mm256_and_si256(g, _mm256_set1_epi32(0xFF)), 8));
+		__m256i const packed = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(pixels, pack), compact);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm256_castsi256_si128(packed));
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(out + 16), _mm256_extracti128_si256(packed, 1));
+	}
+
+	STITCH_AVX2 void StitchSpanAvx2(RemapTable const & table, uint8_t const * src, uint8_t * dst, size_t first, size_t count)
+	{
+		size_t const stride = table.m_srcStride;
+		WhiteBalanceAvx const whiteBalance = MakeWhiteBalanceAvx(table);
+
+		size_t i = first;
+		for (; i + 8 <= first + count; i += 8) {
+			__m256i rb0, g0, rb1, g1;
+			SampleAvx(src, stride, &table.m_offsets0[i], &table.m_fracs0[i], rb0, g0);
+			SampleAvx(src, stride, &table.m_offsets1[i], &table.m_fracs1[i], rb1, g1);
+			if (table.m_gains)
+				ApplyGainsAvx(&table.m_gains[i], whiteBalance, rb0, g0, rb1, g1);
+			BlendStoreAvx(rb0, g0, rb1, g1, &table.m_weights[i], table.m_fillColor, dst + 3 * (i - first));
+		}
+
+		StitchSpanScalar(table, src, dst + 3 * (i - first), i, first + count - i);
+	}
+
+	STITCH_AVX2 __m256i Gather8Avx(uint8_t const * base, __m256i offsets)
+	{
+		return _mm256_i32gather_epi32(reinterpret_cast<int const *>(base), offsets, 1);
+	}
+
+	STITCH_AVX2 __m256i LerpPairAvx(__m256i pair, __m256i weights)
+	{
+		return _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(pair, weights), _mm256_set1_epi32(128)), 8);
+	}
+
+	STITCH_AVX2 __m256i BilinearAvx(__m256i top, __m256i topPattern, __m256i bottom, __m256i bottomPattern,
+									__m256i wx, __m256i wy)
+	{
+		__m256i const topValue = LerpPairAvx(_mm256_shuffle_epi8(top, topPattern), wx);
+		__m256i const bottomValue = LerpPairAvx(_mm256_shuffle_epi8(bottom, bottomPattern), wx);
+		return LerpPairAvx(_mm256_or_si256(topValue, _mm256_slli_epi32(bottomValue, 16)), wy);
+	}
+
+	STITCH_AVX2 void LerpWeightsAvx(__m256i frac, __m256i & wx, __m256i & wy)
+	{
+		__m256i const full = _mm256_set1_epi32(256);
+		__m256i const fx = _mm256_and_si256(frac, _mm256_set1_epi32(0xFFFF));
+		__m256i const fy = _mm256_srli_epi32(frac, 16);
+		wx = _mm256_or_si256(_mm256_sub_epi32(full, fx), _mm256_slli_epi32(fx, 16));
+		wy = _mm256_or_si256(_mm256_sub_epi32(full, fy), _mm256_slli_epi32(fy, 16));
+	}
+
+	STITCH_AVX2 __m256i ClampByteAvx(__m256i value)
+	{
+		return _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(value, 8), _mm256_setzero_si256()), _mm256_set1_epi32(255));
+	}
+
+	STITCH_AVX2 void SampleYuvAvx(SourcePlanes const & src, size_t stride, int32_t const * offsets, uint32_t const * fracs,
+								  int32_t const * chromaOffsets, uint32_t const * chromaFracs, __m256i & rb, __m256i & g)
+	{
+		__m256i const lowPair = _mm256_setr_epi8(0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1,
+												 0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1);
+		__m256i const highPair = _mm256_setr_epi8(2, -1, 3, -1, 6, -1, 7, -1, 10, -1, 11, -1, 14, -1, 15, -1,
+												  2, -1, 3, -1, 6, -1, 7, -1, 10, -1, 11, -1, 14, -1, 15, -1);
+		__m256i const evenPair = _mm256_setr_epi8(0, -1, 2, -1, 4, -1, 6, -1, 8, -1, 10, -1, 12, -1, 14, -1,
+												  0, -1, 2, -1, 4, -1, 6, -1, 8, -1, 10, -1, 12, -1, 14, -1);
+		__m256i const oddPair = _mm256_setr_epi8(1, -1, 3, -1, 5, -1, 7, -1, 9, -1, 11, -1, 13, -1, 15, -1,
+												 1, -1, 3, -1, 5, -1, 7, -1, 9, -1, 11, -1, 13, -1, 15, -1);
+
+		__m256i wx, wy;
+		__m256i const off = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(offsets));
+		LerpWeightsAvx(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(fracs)), wx, wy);
+		__m256i const y = BilinearAvx(Gather8Avx(src.m_y, off), lowPair, Gather8Avx(src.m_y + stride - 2, off), highPair, wx, wy);
+
+		__m256i u, v;
+		__m256i const chromaOff = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(chromaOffsets));
+		LerpWeightsAvx(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(chromaFracs)), wx, wy);
+		size_t const chromaStride = src.m_chromaStride;
+		if (src.m_chromaStep == 2) {
+			__m256i const top = Gather8Avx(src.m_u, chromaOff);
+			__m256i const bottom = Gather8Avx(src.m_u + chromaStride, chromaOff);
+			u = BilinearAvx(top, evenPair, bottom, evenPair, wx, wy);
+			v = BilinearAvx(top, oddPair, bottom, oddPair, wx, wy);
+		}
+		else {
+			u = BilinearAvx(Gather8Avx(src.m_u, chromaOff), lowPair, Gather8Avx(src.m_u + chromaStride - 2, chromaOff), highPair, wx, wy);
+			v = BilinearAvx(Gather8Avx(src.m_v, chromaOff), lowPair, Gather8Avx(src.m_v + chromaStride - 2, chromaOff), highPair, wx, wy);
+		}
+
+		__m256i const round = _mm256_set1_epi32(128);
+		__m256i const c = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(y, _mm256_set1_epi32(16)), _mm256_set1_epi32(298)), round);
+		__m256i const d = _mm256_sub_epi32(u, round);
+		__m256i const e = _mm256_sub_epi32(v, round);
+		__m256i const r = ClampByteAvx(_mm256_add_epi32(c, _mm256_mullo_epi32(e, _mm256_set1_epi32(409))));
+		__m256i const gg = ClampByteAvx(_mm256_sub_epi32(_mm256_sub_epi32(c, _mm256_mullo_epi32(d, _mm256_set1_epi32(100))),
+														 _mm256_mullo_epi32(e, _mm256_set1_epi32(208))));
+		__m256i const b = ClampByteAvx(_mm256_add_epi32(c, _mm256_mullo_epi32(d, _mm256_set1_epi32(516))));
+
+		rb = _mm256_or_si256(r, _mm256_slli_epi32(b, 16));
+		g = gg;
+	}
+
+	STITCH_AVX2 void StitchSpanYuvAvx2(RemapTable const & table, SourcePlanes const & src, uint8_t * dst, size_t first, size_t count)
+	{
+		size_t const stride = table.m_srcStride;
+		WhiteBalanceAvx const whiteBalance = MakeWhiteBalanceAvx(table);
+
+		size_t i = first;
+		for (; i + 8 <= first + count; i += 8) {
+			__m256i rb0, g0, rb1, g1;
+			SampleYuvAvx(src, stride, &table.m_offsets0[i], &table.m_fracs0[i], &table.m_chromaOffsets0[i], &table.m_chromaFracs0[i], rb0, g0);
+			SampleYuvAvx(src, stride, &table.m_offsets1[i], &table.m_fracs1[i], &table.m_chromaOffsets1[i], &table.m_chromaFracs1[i], rb1, g1);
+			if (table.m_gains)
+				ApplyGainsAvx(&table.m_gains[i], whiteBalance, rb0, g0, rb1, g1);
+			BlendStoreAvx(rb0, g0, rb1, g1, &table.m_weights[i], table.m_fillColor, dst + 3 * (i - first));
+		}
+
+		StitchSpanYuvScalar(table, src, dst + 3 * (i - first), i, first + count - i);
+	}
+#endif
+
+	// Table arrays go one after another in a single block, planar sources add the chroma ones
+	// and a photometric calibration the gains
+	size_t GetTableArrayCount(std::string const & srcPixFmt, bool photometric)
+	{
+		return (srcPixFmt == "rgb24" ? 5 : 9) + (photometric ? 1 : 0);
+	}
+
+	struct RemapTableInfo
+	{
+		uint64_t m_width;
+		uint64_t m_height;
+		uint64_t m_srcWidth;
+		uint64_t m_srcHeight;
+		uint64_t m_srcStride;
+		uint8_t m_fillColor[8];
+		char m_srcPixFmt[16];
+		uint32_t m_blendMode;
+		uint32_t m_padding;
+	};
+
+	void SetTableArrays(RemapTable & table, uint32_t const * arrays, bool photometric)
+	{
+		size_t const size = table.m_width * table.m_height;
+		table.m_offsets0 = reinterpret_cast<int32_t const *>(arrays);
+		table.m_offsets1 = reinterpret_cast<int32_t const *>(arrays + size);
+		table.m_fracs0 = arrays + 2 * size;
+		table.m_fracs1 = arrays + 3 * size;
+		table.m_weights = arrays + 4 * size;
+		if (photometric)
+			table.m_gains = arrays + (GetTableArrayCount(table.m_srcPixFmt, true) - 1) * size;
+		if (table.m_srcPixFmt == "rgb24")
+			return;
+
+		table.m_chromaOffsets0 = reinterpret_cast<int32_t const *>(arrays + 5 * size);
+		table.m_chromaOffsets1 = reinterpret_cast<int32_t const *>(arrays + 6 * size);
+		table.m_chromaFracs0 = arrays + 7 * size;
+		table.m_chromaFracs1 = arrays + 8 * size;
+	}
+
+	void SetWhiteBalance(RemapTable & table, FishInfo const & fishInfo0, FishInfo const & fishInfo1)
+	{
+		for (size_t c = 0; c < 3; ++c) {
+			table.m_whiteBalance[0][c] = uint16_t(EncodeGain(fishInfo0.m_photometric.m_whiteBalance[c]));
+			table.m_whiteBalance[1][c] = uint16_t(EncodeGain(fishInfo1.m_photometric.m_whiteBalance[c]));
+		}
+	}
+
+	void CheckInput(RemapTable const & table, RawImage const & src)
+	{
+		if (src.GetPixFmt() != table.m_srcPixFmt || src.GetWidth() != table.m_srcWidth ||
+				src.GetHeight() != table.m_srcHeight || src.GetStride() != table.m_srcStride)
+			throw std::runtime_error("Input image doesn't match remap table!");
+	}
+
+	void StitchSpan(RemapTable const & table, SourcePlanes const & src, uint8_t * dst, size_t first, size_t count,
+					SimdLevel level)
+	{
+		if (!src.m_rgb) {
+			switch (level) {
+#ifdef STITCH_X86
+			case SimdLevel::Avx2:
+				return StitchSpanYuvAvx2(table, src, dst, first, count);
+			case SimdLevel::Sse41:
+				return StitchSpanYuvSse41(table, src, dst, first, count);
+#endif
+			default:
+				return StitchSpanYuvScalar(table, src, dst, first, count);
+			}
+		}
+
+		switch (level) {
+#ifdef STITCH_X86
+		case SimdLevel::Avx2:
+			return StitchSpanAvx2(table, src.m_rgb, dst, first, count);
+		case SimdLevel::Sse41:
+			return StitchSpanSse41(table, src.m_rgb, dst, first, count);
+#endif
+		default:
+			return StitchSpanScalar(table, src.m_rgb, dst, first, count);
+		}
+	}
+
+	// Tiles are numbered row-major
+	void StitchTile(RemapTable const & table, SourcePlanes const & src, char * dst, size_t dstStride, size_t tile,
+					SimdLevel level, size_t tileSize)
+	{
+		size_t const xTileCount = (table.m_width + tileSize - 1) / tileSize;
+		size_t const x = (tile % xTileCount) * tileSize;
+		size_t const y = (tile / xTileCount) * tileSize;
+		size_t const width = std::min(tileSize, table.m_width - x);
+		size_t const height = std::min(tileSize, table.m_height - y);
+
+		for (size_t row = y; row < y + height; ++row)
+			StitchSpan(table, src, reinterpret_cast<uint8_t *>(dst + row * dstStride + 3 * x),
+					   x + row * table.m_width, width, level);
+	}
+}
+
+SimdLevel DetectSimdLevel()
+{
+#ifdef STITCH_X86
+	if (__builtin_cpu_supports("avx2"))
+		return SimdLevel::Avx2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return SimdLevel::Sse41;
+#endif
+	return SimdLevel::Scalar;
+}
+
+char const * SimdLevelName(SimdLevel level)
+{
+	switch (level) {
+	case SimdLevel::Avx2:
+		return "avx2";
+	case SimdLevel::Sse41:
+		return "sse4.1";
+	default:
+		return "scalar";
+	}
+}
+
+RemapTable BuildRemapTable(FishInfo const & fishInfo0, FishInfo const & fishInfo1, std::string const & srcPixFmt,
+						   size_t srcWidth, size_t srcHeight, size_t srcStride, size_t width, size_t height,
+						   BlendMode blendMode)
+{
+	if (srcPixFmt != "rgb24" && srcPixFmt != "yuv420p" && srcPixFmt != "nv12")
+		throw std::runtime_error("Unsupported source format for remap table: " + srcPixFmt);
+	if (srcWidth < 4 || srcHeight < 4 || srcStride < GetPlaneSampleSize(srcPixFmt, 0) * srcWidth ||
+			srcStride * srcHeight > size_t(INT32_MAX))
+		throw std::runtime_error("Unsupported source size for remap table!");
+
+	bool const planar = GetPlaneCount(srcPixFmt) > 1;
+	size_t const sampleSize = GetPlaneSampleSize(srcPixFmt, 0);
+	size_t const chromaWidth = planar ? GetPlaneWidth(srcPixFmt, 1, srcWidth) : 0;
+	size_t const chromaHeight = planar ? GetPlaneHeight(srcPixFmt, 1, srcHeight) : 0;
+	size_t const chromaStride = planar ? GetPlaneStride(srcPixFmt, 1, srcStride) : 0;
+	size_t const chromaSampleSize = planar ? GetPlaneSampleSize(srcPixFmt, 1) : 0;
+
+	bool const photometric = HasPhotometricCorrection(fishInfo0, fishInfo1);
+	size_t const size = width * height;
+	auto storage = std::make_shared<std::vector<uint32_t>>(GetTableArrayCount(srcPixFmt, photometric) * size);
+
+	int32_t * offsets0 = reinterpret_cast<int32_t *>(storage->data());
+	int32_t * offsets1 = reinterpret_cast<int32_t *>(storage->data() + size);
+	uint32_t * fracs0 = storage->data() + 2 * size;
+	uint32_t * fracs1 = storage->data() + 3 * size;
+	uint32_t * weights = storage->data() + 4 * size;
+	int32_t * chromaOffsets0 = planar ? reinterpret_cast<int32_t *>(storage->data() + 5 * size) : nullptr;
+	int32_t * chromaOffsets1 = planar ? reinterpret_cast<int32_t *>(storage->data() + 6 * size) : nullptr;
+	uint32_t * chromaFracs0 = planar ? storage->data() + 7 * size : nullptr;
+	uint32_t * chromaFracs1 = planar ? storage->data() + 8 * size : nullptr;
+	uint32_t * gains = photometric ? storage->data() + (GetTableArrayCount(srcPixFmt, true) - 1) * size : nullptr;
+
+	for (size_t y = 0; y < height; ++y)
+		for (size_t x = 0; x < width; ++x)
+		{
+			// Output row 0 is what glReadPixels returns first, i.e. the bottom of the clip space
+			const glm::vec2 sphereCoord{-1.0f + (x + 0.5f) * 2.0f / width, -1.0f + (y + 0.5f) * 2.0f / height};
+			const glm::vec2 fishCoord0 = sphere2fish2(sphereCoord, fishInfo0);
+			const glm::vec2 fishCoord1 = sphere2fish2(sphereCoord, fishInfo1);
+
+			const bool hasTex0 = HasLens0(fishCoord0);
+			const bool hasTex1 = HasLens1(fishCoord1);
+
+			size_t const i = x + y * width;
+			if (hasTex0) {
+				SetupTexel(fishCoord0, srcWidth, srcHeight, srcStride, sampleSize, offsets0[i], fracs0[i]);
+				if (planar)
+					SetupTexel(fishCoord0, chromaWidth, chromaHeight, chromaStride, chromaSampleSize, chromaOffsets0[i], chromaFracs0[i]);
+			}
+			if (hasTex1) {
+				SetupTexel(fishCoord1, srcWidth, srcHeight, srcStride, sampleSize, offsets1[i], fracs1[i]);
+				if (planar)
+					SetupTexel(fishCoord1, chromaWidth, chromaHeight, chromaStride, chromaSampleSize, chromaOffsets1[i], chromaFracs1[i]);
+			}
+
+			weights[i] = GetBlendWeights(fishCoord0, fishCoord1, fishInfo0, fishInfo1, blendMode);
+			if (photometric)
+				gains[i] = GetLensGains(fishCoord0, fishCoord1, fishInfo0, fishInfo1);
+		}
+
+	RemapTable table;
+	table.m_width = width;
+	table.m_height = height;
+	table.m_srcWidth = srcWidth;
+	table.m_srcHeight = srcHeight;
+	table.m_srcStride = srcStride;
+	table.m_srcPixFmt = srcPixFmt;
+	SetTableArrays(table, storage->data(), photometric);
+	SetWhiteBalance(table, fishInfo0, fishInfo1);
+	table.m_storage = storage;
+	return table;
+}
+
+RemapTable LoadOrBuildRemapTable(std::string const & cacheDir,
+								 FishInfo const & fishInfo0, FishInfo const & fishInfo1, std::string const & srcPixFmt,
+								 size_t srcWidth, size_t srcHeight, size_t srcStride, size_t width, size_t height,
+								 BlendMode blendMode)
+{
+	RemapTableInfo info = {width, height, srcWidth, srcHeight, srcStride, {0, 255, 0}, {}, uint32_t(blendMode), 0};
+	strncpy(info.m_srcPixFmt, srcPixFmt.c_str(), sizeof(info.m_srcPixFmt) - 1);
+
+	Hasher hasher;
+	hasher.Add("remap", 5).Add(info);
+	HashFishInfo(hasher, fishInfo0);
+	HashFishInfo(hasher, fishInfo1);
+	HashPhotometricInfo(hasher, fishInfo0.m_photometric);
+	HashPhotometricInfo(hasher, fishInfo1.m_photometric);
+	std::string const path = CacheFile::GetPath(cacheDir, "remap", hasher.Get());
+
+	bool const photometric = HasPhotometricCorrection(fishInfo0, fishInfo1);
+	size_t const arraysSize = GetTableArrayCount(srcPixFmt, photometric) * sizeof(uint32_t) * width * height;
+	std::shared_ptr<CacheFile const> cache = CacheFile::Open(path, hasher.Get());
+	if (cache && cache->GetSectionCount() == 2 && cache->GetSection(0).second == sizeof(info) &&
+			memcmp(cache->GetSection(0).first, &info, sizeof(info)) == 0 && cache->GetSection(1).second == arraysSize) {
+		RemapTable table;
+		table.m_width = width;
+		table.m_height = height;
+		table.m_srcWidth = srcWidth;
+		table.m_srcHeight = srcHeight;
+		table.m_srcStride = srcStride;
+		table.m_srcPixFmt = srcPixFmt;
+		SetTableArrays(table, static_cast<uint32_t const *>(cache->GetSection(1).first), photometric);
+		SetWhiteBalance(table, fishInfo0, fishInfo1);
+		table.m_storage = cache;
+		return table;
+	}
+
+	RemapTable table = BuildRemapTable(fishInfo0, fishInfo1, srcPixFmt, srcWidth, srcHeight, srcStride, width, height,
+									   blendMode);
+	try {
+		CacheFile::Write(path, hasher.Get(), {{&info, sizeof(info)}, {table.m_offsets0, arraysSize}});
+	}
+	catch (std::runtime_error const & e) {
+		// The table is built, only the next run has to build it again
+		std::cerr << e.what() << std::endl;
+	}
+	return table;
+}
+
+void StitchSpan(RemapTable const & table, RawImage const & src, char * dst, size_t first, size_t count,
+				SimdLevel level)
+{
+	StitchSpan(table, GetSourcePlanes(src), reinterpret_cast<uint8_t *>(dst), first, count, level);
+}
+
+void StitchTiled(RemapTable const & table, RawImage const & src, char * dst, size_t dstStride, ThreadPool & pool,
+				 SimdLevel level, size_t tileSize)
+{
+	CheckInput(table, src);
+
+	SourcePlanes const planes = GetSourcePlanes(src);
+	size_t const xTileCount = (table.m_width + tileSize - 1) / tileSize;
+	size_t const yTileCount = (table.m_height + tileSize - 1) / tileSize;
+
+	pool.ParallelFor(xTileCount * yTileCount, [&](size_t tile) {
+		StitchTile(table, planes, dst, dstStride, tile, level, tileSize);
+	});
+}
+
+void StitchTiles(RemapTable const & table, RawImage const & src, char * dst, size_t dstStride,
+				 std::vector<uint32_t> const & tiles, ThreadPool & pool, SimdLevel level, size_t tileSize)
+{
+	CheckInput(table, src);
+
+	SourcePlanes const planes = GetSourcePlanes(src);
+	pool.ParallelFor(tiles.size(), [&](size_t index) {
+		StitchTile(table, planes, dst, dstStride, tiles[index], level, tileSize);
+	});
+}
+
+RawImage Stitch(RemapTable const & table, RawImage const & src, SimdLevel level)
+{
+	CheckInput(table, src);
+
+	SourcePlanes const planes = GetSourcePlanes(src);
+	RawImage dst("rgb24", table.m_width, table.m_height);
+	for (size_t y = 0; y < table.m_height; ++y)
+		StitchSpan(table, planes, reinterpret_cast<uint8_t *>(dst.GetRow(y)), y * table.m_width, table.m_width, level);
+
+	return dst;
+}
+
+RawImage Stitch(RemapTable const & table, RawImage const & src, ThreadPool & pool, SimdLevel level)
+{
+	RawImage dst("rgb24", table.m_width, table.m_height);
+	StitchTiled(table, src, dst.GetData(), dst.GetStride(), pool, level);
+
+	return dst;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "blendtools.h"
+#include "fishtools.h"
+#include "imgtools.h"
+#include "threadtools.h"
+
+// Per-output-pixel lookup table for the dual fisheye remap.
+// For every output pixel and every lens it keeps the byte offset of the top-left
+// source texel and the bilinear fractions (fx | fy << 16, both in 0..256), plus the
+// blend weights of both lenses (w0 | w1 << 16). Whatever is left of 256 goes to the fill color.
+// Planar YUV sources (yuv420p, nv12) get the same offsets and fractions for the chroma planes,
+// the luma ones go to m_offsets/m_fracs and the kernels convert to RGB right after sampling.
+// With a photometric calibration m_gains holds the radial gains of both lenses (g0 | g1 << 16, 8.8)
+// and m_whiteBalance the per-channel ones. A sample becomes min(255, value * (g * wb >> 8) >> 8)
+// before blending, in the same pass.
+// The arrays live in m_storage, which is either heap memory or a mapped cache file.
+struct RemapTable
+{
+	size_t m_width = 0;
+	size_t m_height = 0;
+	size_t m_srcWidth = 0;
+	size_t m_srcHeight = 0;
+	size_t m_srcStride = 0;
+	std::string m_srcPixFmt = "rgb24";
+
+	int32_t const * m_offsets0 = nullptr;
+	int32_t const * m_offsets1 = nullptr;
+	uint32_t const * m_fracs0 = nullptr;
+	uint32_t const * m_fracs1 = nullptr;
+	uint32_t const * m_weights = nullptr;
+	uint32_t const * m_gains = nullptr; // Only with a photometric calibration
+	uint16_t m_whiteBalance[2][3] = {{256, 256, 256}, {256, 256, 256}};
+
+	// Planar sources only
+	int32_t const * m_chromaOffsets0 = nullptr;
+	int32_t const * m_chromaOffsets1 = nullptr;
+	uint32_t const * m_chromaFracs0 = nullptr;
+	uint32_t const * m_chromaFracs1 = nullptr;
+
+	uint8_t m_fillColor[3] = {0, 255, 0};
+
+	std::shared_ptr<void const> m_storage;
+};
+
+enum class SimdLevel
+{
+	Scalar,
+	Sse41,
+	Avx2
+};
+
+SimdLevel DetectSimdLevel();
+char const * SimdLevelName(SimdLevel level);
+
+// srcPixFmt and srcStride (the luma stride for planar formats) are those of the images
+// the table will be applied to: rgb24, yuv420p or nv12. The blend weights come from GetBlendWeights,
+// so feathering costs nothing per frame. MultiBand tables feather, blend Lens0 and Lens1 ones instead
+RemapTable BuildRemapTable(FishInfo const & fishInfo0, FishInfo const & fishInfo1, std::string const & srcPixFmt,
+						   size_t srcWidth, size_t srcHeight, size_t srcStride, size_t width, size_t height,
+						   BlendMode blendMode = BlendMode::Hard);
+
+// Maps the table from cacheDir if it was built before for the same parameters,
+// otherwise builds it and stores it there
+RemapTable LoadOrBuildRemapTable(std::string const & cacheDir,
+								 FishInfo const & fishInfo0, FishInfo const & fishInfo1, std::string const & srcPixFmt,
+								 size_t srcWidth, size_t srcHeight, size_t srcStride, size_t width, size_t height,
+								 BlendMode blendMode = BlendMode::Hard);
+
+// Remaps count output pixels starting from the first one (row-major index), dst points to the first one.
+// src has to match the table, only Stitch and StitchTiled check that
+void StitchSpan(RemapTable const & table, RawImage const & src, char * dst, size_t first, size_t count,
+				SimdLevel level);
+
+RawImage Stitch(RemapTable const & table, RawImage const & src, SimdLevel level = DetectSimdLevel());
+
+// Splits the output into tileSize x tileSize tiles and remaps them on the pool.
+// A tile covers a small area of the source, so its reads stay in cache
+void StitchTiled(RemapTable const & table, RawImage const & src, char * dst, size_t dstStride, ThreadPool & pool,
+				 SimdLevel level, size_t tileSize = 64);
+
+// Remaps only the given tiles of StitchTiled, numbered row-major. The rest of dst is left as it is
+void StitchTiles(RemapTable const & table, RawImage const & src, char * dst, size_t dstStride,
+				 std::vector<uint32_t> const & tiles, ThreadPool & pool, SimdLevel level, size_t tileSize = 64);
+
+RawImage Stitch(RemapTable const & table, RawImage const & src, ThreadPool & pool, SimdLevel level = DetectSimdLevel());
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <exception>
+#include <vector>
+
+// Just enough to write the unit tests, each <module>_test.cpp is an executable of its own that ctest runs.
+// TEST(name) defines a test, CHECK records a failure and carries on with the test, an exception ends it.
+// RunTests runs them all in the order of definition and returns the exit code
+struct TestCase
+{
+	char const * m_name;
+	void (*m_function)();
+};
+
+inline std::vector<TestCase> & GetTestCases()
+{
+	static std::vector<TestCase> testCases;
+	return testCases;
+}
+
+inline size_t & GetTestFailureCount()
+{
+	static size_t failureCount = 0;
+	return failureCount;
+}
+
+inline void ReportTestFailure(char const * file, int line, char const * what)
+{
+	fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+	++GetTestFailureCount();
+}
+
+struct TestRegistration
+{
+	TestRegistration(char const * name, void (*function)())
+	{
+		GetTestCases().push_back({name, function});
+	}
+};
+
+#define TEST(name) \
+	void name(); \
+	TestRegistration const name##Registration(#name, name); \
+	void name()
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) \
+			ReportTestFailure(__FILE__, __LINE__, #condition); \
+	} while (false)
+
+#define CHECK_THROWS(statement) \
+	do { \
+		bool thrown = false; \
+		try { \
+			statement; \
+		} \
+		catch (std::exception const &) { \
+			thrown = true; \
+		} \
+		if (!thrown) \
+			ReportTestFailure(__FILE__, __LINE__, "throws: " #statement); \
+	} while (false)
+
+inline int RunTests()
+{
+	size_t failedTestCount = 0;
+	for (TestCase const & testCase : GetTestCases()) {
+		size_t const failureCount = GetTestFailureCount();
+		try {
+			testCase.m_function();
+		}
+		catch (std::exception const & e) {
+			fprintf(stderr, "%s: exception: %s\n", testCase.m_name, e.what());
+			++GetTestFailureCount();
+		}
+		bool const failed = GetTestFailureCount() != failureCount;
+		failedTestCount += failed;
+		fprintf(stderr, "%s: %s\n", testCase.m_name, failed ? "FAILED" : "ok");
+	}
+	fprintf(stderr, "%zu of %zu tests failed\n", failedTestCount, GetTestCases().size());
+	return failedTestCount == 0 ? 0 : 1;
+}
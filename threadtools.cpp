@@ -0,0 +1,163 @@
+#include "threadtools.h"
+
+#include <algorithm>
+
+namespace {
+	size_t const g_rowChunkSize = 16;
+}
+
+ThreadPool::ThreadPool(size_t threadCount)
+	: m_pending(0)
+{
+	if (threadCount == 0)
+		threadCount = GetHardwareThreadCount();
+
+	for (size_t i = 0; i < threadCount; ++i)
+		m_queues.emplace_back(new TaskQueue);
+
+	for (size_t i = 1; i < threadCount; ++i)
+		m_threads.emplace_back(&ThreadPool::WorkerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wakeUp.notify_all();
+
+	for (auto & thread : m_threads)
+		thread.join();
+}
+
+size_t ThreadPool::GetThreadCount() const
+{
+	return m_queues.size();
+}
+
+size_t ThreadPool::GetHardwareThreadCount()
+{
+	size_t const count = std::thread::hardware_concurrency();
+	return count > 0 ? count : 1;
+}
+
+void ThreadPool::ParallelFor(size_t count, std::function<void(size_t)> const & task)
+{
+	if (count == 0)
+		return;
+
+	size_t const queueCount = m_queues.size();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_task = &task;
+		m_pending = count;
+
+		// Contiguous chunks per worker keep neighbouring tasks together
+		for (size_t i = 0; i < queueCount; ++i) {
+			std::lock_guard<std::mutex> queueLock(m_queues[i]->m_mutex);
+			for (size_t j = i * count / queueCount; j < (i + 1) * count / queueCount; ++j)
+				m_queues[i]->m_tasks.push_back(j);
+		}
+
+		++m_generation;
+	}
+	m_wakeUp.notify_all();
+
+	RunTasks(0);
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_done.wait(lock, [this]() { return m_pending == 0; });
+	m_task = nullptr;
+	m_failed = false;
+	if (m_error) {
+		std::exception_ptr error;
+		std::swap(error, m_error);
+		std::rethrow_exception(error);
+	}
+}
+
+void ThreadPool::WorkerLoop(size_t index)
+{
+	size_t generation = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wakeUp.wait(lock, [&]() { return m_stop || m_generation != generation; });
+			if (m_stop)
+				return;
+			generation = m_generation;
+		}
+
+		RunTasks(index);
+	}
+}
+
+void ThreadPool::RunTasks(size_t index)
+{
+	size_t task = 0;
+	while (PopTask(index, task) || StealTask(index, task)) {
+		// m_task is published before the tasks are queued, so it's safe to read it after a pop.
+		// Exceptions can't leave a worker, the first one is kept for ParallelFor
+		if (!m_failed) {
+			try {
+				(*m_task)(task);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (!m_error)
+					m_error = std::current_exception();
+				m_failed = true;
+			}
+		}
+
+		if (--m_pending == 0) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_done.notify_all();
+		}
+	}
+}
+
+bool ThreadPool::PopTask(size_t index, size_t & task)
+{
+	TaskQueue & queue = *m_queues[index];
+	std::lock_guard<std::mutex> lock(queue.m_mutex);
+	if (queue.m_tasks.empty())
+		return false;
+
+	task = queue.m_tasks.front();
+	queue.m_tasks.pop_front();
+	return true;
+}
+
+bool ThreadPool::StealTask(size_t index, size_t & task)
+{
+	size_t const queueCount = m_queues.size();
+	for (size_t i = 1; i < queueCount; ++i) {
+		TaskQueue & queue = *m_queues[(index + i) % queueCount];
+		std::lock_guard<std::mutex> lock(queue.m_mutex);
+		if (queue.m_tasks.empty())
+			continue;
+
+		task = queue.m_tasks.back();
+		queue.m_tasks.pop_back();
+		return true;
+	}
+	return false;
+}
+
+size_t GetRowChunkCount(size_t rowCount)
+{
+	return (rowCount + g_rowChunkSize - 1) / g_rowChunkSize;
+}
+
+void RunRowChunk(size_t chunk, size_t rowCount, std::function<void(size_t)> const & row)
+{
+	for (size_t y = chunk * g_rowChunkSize; y < std::min(rowCount, (chunk + 1) * g_rowChunkSize); ++y)
+		row(y);
+}
+
+void ParallelRows(ThreadPool & pool, size_t rowCount, std::function<void(size_t)> const & row)
+{
+	pool.ParallelFor(GetRowChunkCount(rowCount), [&](size_t chunk) { RunRowChunk(chunk, rowCount, row); });
+}
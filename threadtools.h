@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of workers with per-worker task queues. Idle workers steal from the back
+// of the other queues, so neighbouring tasks tend to stay on the same core.
+// The calling thread takes part in the work as worker 0.
+class ThreadPool
+{
+public:
+	explicit ThreadPool(size_t threadCount = 0);
+	~ThreadPool();
+
+	ThreadPool(ThreadPool const &) = delete;
+	ThreadPool & operator=(ThreadPool const &) = delete;
+
+	size_t GetThreadCount() const;
+
+	// Runs task(0) ... task(count - 1) and waits for all of them. If a task throws, the tasks not started yet
+	// are skipped and the first exception is rethrown here once the others are done
+	void ParallelFor(size_t count, std::function<void(size_t)> const & task);
+
+	static size_t GetHardwareThreadCount();
+
+private:
+	struct TaskQueue
+	{
+		std::mutex m_mutex;
+		std::deque<size_t> m_tasks;
+	};
+
+	void WorkerLoop(size_t index);
+	void RunTasks(size_t index);
+	bool PopTask(size_t index, size_t & task);
+	bool StealTask(size_t index, size_t & task);
+
+private:
+	std::vector<std::unique_ptr<TaskQueue>> m_queues;
+	std::vector<std::thread> m_threads;
+
+	std::mutex m_mutex;
+	std::condition_variable m_wakeUp;
+	std::condition_variable m_done;
+	std::function<void(size_t)> const * m_task = nullptr;
+	std::atomic<size_t> m_pending;
+	std::atomic<bool> m_failed{false};
+	std::exception_ptr m_error; // Guarded by m_mutex
+	size_t m_generation = 0;
+	bool m_stop = false;
+};
+
+// Image rows go to the pool in chunks of neighbouring rows, so a task is worth queueing and
+// the rows it touches stay on one core. Chunk c of rowCount rows calls row(y) for each of its rows
+size_t GetRowChunkCount(size_t rowCount);
+void RunRowChunk(size_t chunk, size_t rowCount, std::function<void(size_t)> const & row);
+
+// Calls row(0) ... row(rowCount - 1) chunk by chunk over the pool and waits for all of them
+void ParallelRows(ThreadPool & pool, size_t rowCount, std::function<void(size_t)> const & row);
@@ -0,0 +1,85 @@
+#include "threadtools.h"
+
+#include <chrono>
+#include <set>
+#include <stdexcept>
+
+#include "testtools.h"
+
+namespace {
+	TEST(ParallelForRunsEveryTaskOnce)
+	{
+		for (size_t threadCount : {1, 4}) {
+			ThreadPool pool(threadCount);
+			CHECK(pool.GetThreadCount() == threadCount);
+			for (size_t count : {0, 1, 3, 1000}) {
+				std::vector<std::atomic<int>> runs(count);
+				pool.ParallelFor(count, [&](size_t task) { ++runs[task]; });
+				for (std::atomic<int> const & run : runs)
+					CHECK(run == 1);
+			}
+		}
+	}
+
+	TEST(ParallelForStealsFromBusyWorkers)
+	{
+		// The first quarter of the tasks is queued on the calling thread and is the only slow part,
+		// the other workers run out of work and have to take some of it
+		size_t const count = 32;
+		ThreadPool pool(4);
+		std::mutex mutex;
+		std::set<std::thread::id> slowThreads;
+		pool.ParallelFor(count, [&](size_t task) {
+			if (task >= count / 4)
+				return;
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			std::lock_guard<std::mutex> lock(mutex);
+			slowThreads.insert(std::this_thread::get_id());
+		});
+		CHECK(slowThreads.size() > 1);
+	}
+
+	TEST(ParallelForRethrowsTheFirstException)
+	{
+		ThreadPool pool(4);
+		bool caught = false;
+		try {
+			pool.ParallelFor(100, [&](size_t task) {
+				if (task == 17)
+					throw std::runtime_error("task 17");
+			});
+		}
+		catch (std::runtime_error const & e) {
+			caught = std::string(e.what()) == "task 17";
+		}
+		CHECK(caught);
+
+		// The pool is usable again afterwards
+		std::vector<std::atomic<int>> runs(100);
+		pool.ParallelFor(runs.size(), [&](size_t task) { ++runs[task]; });
+		for (std::atomic<int> const & run : runs)
+			CHECK(run == 1);
+	}
+
+	TEST(ParallelRowsRunsEveryRowOnce)
+	{
+		ThreadPool pool(3);
+		for (size_t rowCount : {0, 1, 15, 16, 17, 100}) {
+			std::vector<std::atomic<int>> runs(rowCount);
+			ParallelRows(pool, rowCount, [&](size_t y) { ++runs[y]; });
+			for (std::atomic<int> const & run : runs)
+				CHECK(run == 1);
+
+			// The chunks cover the rows in order, without gaps
+			size_t nextRow = 0;
+			for (size_t chunk = 0; chunk < GetRowChunkCount(rowCount); ++chunk)
+				RunRowChunk(chunk, rowCount, [&](size_t y) { CHECK(y == nextRow++); });
+			CHECK(nextRow == rowCount);
+		}
+	}
+}
+
+int main()
+{
+	return RunTests();
+}
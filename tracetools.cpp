@@ -0,0 +1,194 @@
+#include "tracetools.h"
+
+#include <iostream>
+
+#ifdef ENABLE_TRACING
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+	std::chrono::steady_clock::time_point const g_traceEpoch = std::chrono::steady_clock::now();
+
+	void WriteJsonString(std::ostream & out, std::string const & text)
+	{
+		out << '"';
+		for (char const c : text) {
+			if (c == '"' || c == '\\')
+				out << '\\' << c;
+			else if (c == '\n')
+				out << "\\n";
+			else if (static_cast<unsigned char>(c) >= 0x20)
+				out << c;
+		}
+		out << '"';
+	}
+
+	struct StageSummary
+	{
+		size_t m_count = 0;
+		int64_t m_totalNs = 0;
+		int64_t m_maxNs = 0;
+	};
+}
+
+Tracer & Tracer::Get()
+{
+	static Tracer tracer;
+	return tracer;
+}
+
+void Tracer::Start()
+{
+	m_enabled.store(true, std::memory_order_relaxed);
+}
+
+int64_t Tracer::Now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - g_traceEpoch).count();
+}
+
+Tracer::ThreadBuffer & Tracer::GetThreadBuffer()
+{
+	// Buffers belong to the tracer and outlive their threads, the pool's workers come and go with the pool
+	thread_local ThreadBuffer * buffer = nullptr;
+	if (!buffer) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_buffers.emplace_back(new ThreadBuffer);
+		buffer = m_buffers.back().get();
+		buffer->m_threadId = uint32_t(m_buffers.size());
+	}
+	return *buffer;
+}
+
+void Tracer::AddEvent(char const * name, char const * category, int64_t startNs, int64_t durationNs)
+{
+	ThreadBuffer & buffer = GetThreadBuffer();
+	std::lock_guard<std::mutex> lock(buffer.m_mutex);
+	buffer.m_events.push_back({name, category, startNs, durationNs, buffer.m_threadId});
+}
+
+void Tracer::AddEvent(char const * name, char const * category, int64_t startNs, int64_t durationNs, uint32_t threadId)
+{
+	ThreadBuffer & buffer = GetThreadBuffer();
+	std::lock_guard<std::mutex> lock(buffer.m_mutex);
+	buffer.m_events.push_back({name, category, startNs, durationNs, threadId});
+}
+
+void Tracer::AddMessage(char const * category, std::string const & message)
+{
+	uint32_t const threadId = GetThreadBuffer().m_threadId;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_messages.push_back({category, Now(), threadId, message});
+}
+
+std::vector<TraceEvent> Tracer::GetEvents() const
+{
+	std::vector<TraceEvent> events;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (std::unique_ptr<ThreadBuffer> const & buffer : m_buffers) {
+		std::lock_guard<std::mutex> bufferLock(buffer->m_mutex);
+		events.insert(events.end(), buffer->m_events.begin(), buffer->m_events.end());
+	}
+	return events;
+}
+
+// Complete events ("ph": "X") in microseconds, the messages as instant events
+void Tracer::WriteChromeTrace(std::string const & path) const
+{
+	std::ofstream file(path);
+	if (!file)
+		throw std::runtime_error("Can't open file for writing: " + path);
+
+	// Nanosecond resolution, whatever the length of the run
+	file << std::fixed << std::setprecision(3);
+	std::vector<TraceEvent> const events = GetEvents();
+	file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+	file << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << g_traceGpuThreadId
+		 << ", \"args\": {\"name\": \"GPU\"}}";
+	for (TraceEvent const & event : events) {
+		file << ",\n{\"name\": ";
+		WriteJsonString(file, event.m_name);
+		file << ", \"cat\": ";
+		WriteJsonString(file, event.m_category);
+		file << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.m_threadId << ", \"ts\": " << event.m_startNs / 1e3
+			 << ", \"dur\": " << event.m_durationNs / 1e3 << "}";
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (Message const & message : m_messages) {
+		file << ",\n{\"name\": ";
+		WriteJsonString(file, message.m_category);
+		file << ", \"cat\": ";
+		WriteJsonString(file, message.m_category);
+		file << ", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": " << message.m_threadId << ", \"ts\": "
+			 << message.m_timeNs / 1e3 << ", \"args\": {\"message\": ";
+		WriteJsonString(file, message.m_text);
+		file << "}}";
+	}
+	file << "\n]}\n";
+
+	if (!file)
+		throw std::runtime_error("Failed to write file: " + path);
+}
+
+// One line per stage and category, the most expensive first
+void Tracer::PrintSummary(std::ostream & out) const
+{
+	std::map<std::pair<std::string, std::string>, StageSummary> stages;
+	for (TraceEvent const & event : GetEvents()) {
+		StageSummary & stage = stages[std::make_pair(std::string(event.m_category), std::string(event.m_name))];
+		++stage.m_count;
+		stage.m_totalNs += event.m_durationNs;
+		stage.m_maxNs = std::max(stage.m_maxNs, event.m_durationNs);
+	}
+
+	std::vector<std::pair<std::pair<std::string, std::string>, StageSummary>> sorted(stages.begin(), stages.end());
+	std::sort(sorted.begin(), sorted.end(), [](decltype(sorted)::value_type const & left, decltype(sorted)::value_type const & right) {
+		return left.second.m_totalNs > right.second.m_totalNs;
+	});
+	for (auto const & stage : sorted)
+		out << stage.first.first << " " << stage.first.second << ": " << stage.second.m_count << " x "
+			<< stage.second.m_totalNs / 1e6 / stage.second.m_count << " ms, total " << stage.second.m_totalNs / 1e6
+			<< " ms, max " << stage.second.m_maxNs / 1e6 << " ms" << std::endl;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_messages.empty())
+		out << m_messages.size() << " messages, see the trace" << std::endl;
+}
+
+bool StartTracing()
+{
+	Tracer::Get().Start();
+	return true;
+}
+
+void FinishTracing(std::string const & path)
+{
+	Tracer::Get().WriteChromeTrace(path);
+	std::cerr << "Trace written to " << path << std::endl;
+	Tracer::Get().PrintSummary(std::cerr);
+}
+#else
+bool StartTracing()
+{
+	return false;
+}
+
+void FinishTracing(std::string const &)
+{
+}
+#endif
+
+double MillisecondsBetween(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+double MillisecondsSince(std::chrono::steady_clock::time_point start)
+{
+	return MillisecondsBetween(start, std::chrono::steady_clock::now());
+}
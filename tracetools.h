@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Scoped timers for the hot paths, exported as a Chrome trace (chrome://tracing, ui.perfetto.dev) and
+// as a per-stage summary. Built with ENABLE_TRACING the TRACE_ macros time their scope once StartTracing()
+// was called and cost an atomic load before. Without it they expand to nothing and the functions are empty.
+// Names and categories are string literals, events only keep the pointers
+#ifdef ENABLE_TRACING
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name, "cpu")
+#define TRACE_SCOPE_CATEGORY(name, category) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name, category)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_SCOPE_CATEGORY(name, category)
+#endif
+
+// Events from the GPU go on their own row of the trace
+uint32_t const g_traceGpuThreadId = 0;
+
+#ifdef ENABLE_TRACING
+struct TraceEvent
+{
+	char const * m_name;
+	char const * m_category;
+	int64_t m_startNs; // Since the process started
+	int64_t m_durationNs;
+	uint32_t m_threadId;
+};
+
+class Tracer
+{
+public:
+	static Tracer & Get();
+
+	void Start();
+	bool IsEnabled() const
+	{
+		return m_enabled.load(std::memory_order_relaxed);
+	}
+
+	// Nanoseconds since the process started
+	static int64_t Now();
+
+	void AddEvent(char const * name, char const * category, int64_t startNs, int64_t durationNs);
+	// For events measured elsewhere, e.g. on the GPU
+	void AddEvent(char const * name, char const * category, int64_t startNs, int64_t durationNs, uint32_t threadId);
+	void AddMessage(char const * category, std::string const & message);
+
+	// Only while no traced code runs
+	void WriteChromeTrace(std::string const & path) const;
+	void PrintSummary(std::ostream & out) const;
+
+private:
+	// One per thread, so threads only ever wait for the exporter
+	struct ThreadBuffer
+	{
+		std::mutex m_mutex;
+		uint32_t m_threadId;
+		std::vector<TraceEvent> m_events;
+	};
+
+	struct Message
+	{
+		char const * m_category;
+		int64_t m_timeNs;
+		uint32_t m_threadId;
+		std::string m_text;
+	};
+
+	Tracer() = default;
+	ThreadBuffer & GetThreadBuffer();
+	std::vector<TraceEvent> GetEvents() const;
+
+private:
+	std::atomic<bool> m_enabled{false};
+	mutable std::mutex m_mutex;
+	std::vector<std::unique_ptr<ThreadBuffer>> m_buffers;
+	std::vector<Message> m_messages;
+};
+
+class TraceScope
+{
+public:
+	TraceScope(char const * name, char const * category)
+		: m_name(name)
+		, m_category(category)
+		, m_startNs(Tracer::Get().IsEnabled() ? Tracer::Now() : -1)
+	{}
+
+	~TraceScope()
+	{
+		if (m_startNs >= 0)
+			Tracer::Get().AddEvent(m_name, m_category, m_startNs, Tracer::Now() - m_startNs);
+	}
+
+	TraceScope(TraceScope const &) = delete;
+	TraceScope & operator=(TraceScope const &) = delete;
+
+private:
+	char const * m_name;
+	char const * m_category;
+	int64_t m_startNs;
+};
+#endif
+
+// Starts recording if tracing is built in, returns false otherwise
+bool StartTracing();
+// Writes the Chrome trace and prints the per-stage summary to std::cerr
+void FinishTracing(std::string const & path);
+
+// Wall time for the timings the tools print, whether tracing is built in or not
+double MillisecondsBetween(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+double MillisecondsSince(std::chrono::steady_clock::time_point start);
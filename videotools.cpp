@@ -0,0 +1,121 @@
+#include "videotools.h"
+
+#include <stdexcept>
+
+VideoReader::VideoReader(std::string const & path, size_t width, size_t height, std::string const & pixFmt)
+	: m_frameSize(GetImageDataSize(pixFmt, width, height))
+{
+	std::string const cmd = "ffmpeg -v error -i " + path + " -s " + std::to_string(width) + "x" + std::to_string(height) +
+			" -pix_fmt " + pixFmt + " -f rawvideo -";
+	m_pipe = popen(cmd.c_str(), "r");
+	if (!m_pipe)
+		throw std::runtime_error("Can't open file for reading: " + path);
+}
+
+VideoReader::~VideoReader()
+{
+	pclose(m_pipe);
+}
+
+size_t VideoReader::GetFrameSize() const
+{
+	return m_frameSize;
+}
+
+size_t VideoReader::Read(char * data, size_t size)
+{
+	size_t sumBytesCnt = 0;
+	while (sumBytesCnt < size) {
+		size_t const retBytesCnt = fread(data + sumBytesCnt, 1, size - sumBytesCnt, m_pipe);
+		if (retBytesCnt == 0)
+			break;
+		sumBytesCnt += retBytesCnt;
+	}
+	return sumBytesCnt;
+}
+
+bool VideoReader::ReadFrame(char * data)
+{
+	size_t const sumBytesCnt = Read(data, m_frameSize);
+	if (sumBytesCnt == 0)
+		return false;
+	if (sumBytesCnt != m_frameSize)
+		throw std::runtime_error("Truncated video frame!");
+
+	return true;
+}
+
+bool VideoReader::ReadFrame(RawImage & frame)
+{
+	if (GetImageDataSize(frame.GetPixFmt(), frame.GetWidth(), frame.GetHeight()) != m_frameSize)
+		throw std::runtime_error("Frame doesn't match video size!");
+	if (frame.GetDataSize() == m_frameSize)
+		return ReadFrame(frame.GetData());
+
+	for (size_t plane = 0; plane < frame.GetPlaneCount(); ++plane) {
+		size_t const rowSize = frame.GetPlaneRowSize(plane);
+		for (size_t y = 0; y < frame.GetPlaneHeight(plane); ++y) {
+			size_t const sumBytesCnt = Read(frame.GetPlaneRow(plane, y), rowSize);
+			if (sumBytesCnt == 0 && plane == 0 && y == 0)
+				return false;
+			if (sumBytesCnt != rowSize)
+				throw std::runtime_error("Truncated video frame!");
+		}
+	}
+
+	return true;
+}
+
+VideoWriter::VideoWriter(std::string const & path, size_t width, size_t height, std::string const & pixFmt,
+						 double frameRate)
+	: m_frameSize(GetImageDataSize(pixFmt, width, height))
+{
+	std::string const cmd = "ffmpeg -v error -f rawvideo -pix_fmt " + pixFmt + " -s " + std::to_string(width) + "x" +
+			std::to_string(height) + " -r " + std::to_string(frameRate) + " -i pipe:0 -y " + path;
+	m_pipe = popen(cmd.c_str(), "w");
+	if (!m_pipe)
+		throw std::runtime_error("Can't open file for writng: " + path);
+}
+
+VideoWriter::~VideoWriter()
+{
+	if (m_pipe)
+		pclose(m_pipe);
+}
+
+size_t VideoWriter::GetFrameSize() const
+{
+	return m_frameSize;
+}
+
+void VideoWriter::WriteFrame(char const * data)
+{
+	if (fwrite(data, 1, m_frameSize, m_pipe) != m_frameSize)
+		throw std::runtime_error("Failed to write video frame!");
+}
+
+void VideoWriter::WriteFrame(RawImage const & frame)
+{
+	if (GetImageDataSize(frame.GetPixFmt(), frame.GetWidth(), frame.GetHeight()) != m_frameSize)
+		throw std::runtime_error("Frame doesn't match video size!");
+	if (frame.GetDataSize() == m_frameSize)
+		return WriteFrame(frame.GetData());
+
+	for (size_t plane = 0; plane < frame.GetPlaneCount(); ++plane) {
+		size_t const rowSize = frame.GetPlaneRowSize(plane);
+		for (size_t y = 0; y < frame.GetPlaneHeight(plane); ++y)
+			if (fwrite(frame.GetPlaneRow(plane, y), 1, rowSize, m_pipe) != rowSize)
+				throw std::runtime_error("Failed to write video frame!");
+	}
+}
+
+void VideoWriter::Close()
+{
+	if (!m_pipe)
+		return;
+
+	int const status = pclose(m_pipe);
+	m_pipe = nullptr;
+	if (status != 0)
+		throw std::runtime_error("ffmpeg failed to encode video!");
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <string>
+
+#include "imgtools.h"
+
+// Keeps one ffmpeg process decoding the whole file into fixed-size rawvideo frames
+class VideoReader
+{
+public:
+	VideoReader(std::string const & path, size_t width, size_t height, std::string const & pixFmt = "rgb24");
+	~VideoReader();
+
+	VideoReader(VideoReader const &) = delete;
+	VideoReader & operator=(VideoReader const &) = delete;
+
+	size_t GetFrameSize() const;
+
+	// Returns false at the end of the stream
+	bool ReadFrame(char * data);
+	// Reads rows straight into the image planes, padded rows are fine
+	bool ReadFrame(RawImage & frame);
+
+private:
+	size_t Read(char * data, size_t size);
+
+private:
+	FILE * m_pipe = nullptr;
+	size_t m_frameSize = 0;
+};
+
+// Keeps one ffmpeg process encoding rawvideo frames into a file
+class VideoWriter
+{
+public:
+	VideoWriter(std::string const & path, size_t width, size_t height, std::string const & pixFmt = "rgb24",
+				double frameRate = 30.0);
+	~VideoWriter();
+
+	VideoWriter(VideoWriter const &) = delete;
+	VideoWriter & operator=(VideoWriter const &) = delete;
+
+	size_t GetFrameSize() const;
+
+	void WriteFrame(char const * data);
+	void WriteFrame(RawImage const & frame);
+
+	// Flushes the pipe and waits for ffmpeg to finish the file
+	void Close();
+
+private:
+	FILE * m_pipe = nullptr;
+	size_t m_frameSize = 0;
+};